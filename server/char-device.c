@@ -53,6 +53,9 @@ struct RedCharDeviceClient {
     int do_flow_control;
     uint64_t num_client_tokens;
     uint64_t num_client_tokens_free; /* client messages that were consumed by the device */
+    /* tokens held by the client beyond the window, after a migration from a
+     * server with a bigger window. They are not returned once consumed */
+    uint64_t num_client_tokens_excess;
     uint64_t num_send_tokens; /* send to client */
     SpiceTimer *wait_for_tokens_timer;
     int wait_for_tokens_started;
@@ -445,6 +448,12 @@ static void red_char_device_client_tokens_add(RedCharDevice *dev,
     if (num_tokens > 1) {
         spice_debug("#tokens > 1 (=%u)", num_tokens);
     }
+    if (dev_client->num_client_tokens_excess) {
+        uint32_t excess = MIN(num_tokens, dev_client->num_client_tokens_excess);
+
+        dev_client->num_client_tokens_excess -= excess;
+        num_tokens -= excess;
+    }
     dev_client->num_client_tokens_free += num_tokens;
     if (dev_client->num_client_tokens_free >= dev->priv->client_tokens_interval) {
         uint32_t tokens = dev_client->num_client_tokens_free;
@@ -942,6 +951,7 @@ bool red_char_device_restore(RedCharDevice *dev,
 {
     RedCharDeviceClient *dev_client;
     uint32_t client_tokens_window;
+    uint64_t client_tokens_used;
 
     spice_assert(g_list_length(dev->priv->clients) == 1 &&
                  dev->priv->wait_for_migrate_data);
@@ -957,10 +967,19 @@ bool red_char_device_restore(RedCharDevice *dev,
 
     client_tokens_window = dev_client->num_client_tokens; /* initial state of tokens */
     dev_client->num_client_tokens = mig_data->num_client_tokens;
-    /* assumption: client_tokens_window stays the same across severs */
-    dev_client->num_client_tokens_free = client_tokens_window -
-                                           mig_data->num_client_tokens -
-                                           mig_data->write_num_client_tokens;
+    /* The window of the source server can differ from ours. With a smaller
+     * one the free tokens are returned to the client, which then gets our
+     * window. With a bigger one, the tokens above our window are not
+     * returned to the client once consumed. */
+    client_tokens_used = (uint64_t)mig_data->num_client_tokens +
+                         mig_data->write_num_client_tokens;
+    if (client_tokens_used <= client_tokens_window) {
+        dev_client->num_client_tokens_free = client_tokens_window - client_tokens_used;
+        dev_client->num_client_tokens_excess = 0;
+    } else {
+        dev_client->num_client_tokens_free = 0;
+        dev_client->num_client_tokens_excess = client_tokens_used - client_tokens_window;
+    }
     dev_client->num_send_tokens = mig_data->num_send_tokens;
 
     if (mig_data->write_size > 0) {
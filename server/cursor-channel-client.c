@@ -27,7 +27,10 @@
 #include "cursor-channel.h"
 #include "cursor-channel-client.h"
 
-#define CLIENT_CURSOR_CACHE_SIZE 256
+/* bytes of cursor shape data the client is asked to keep, the least
+ * recently used shapes are evicted first. Enough for a few animated
+ * 256x256 ARGB cursors */
+#define CLIENT_CURSOR_CACHE_SIZE (8 * 1024 * 1024)
 
 #define CURSOR_CACHE_HASH_SHIFT 8
 #define CURSOR_CACHE_HASH_SIZE (1 << CURSOR_CACHE_HASH_SHIFT)
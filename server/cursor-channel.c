@@ -30,6 +30,7 @@
 typedef struct RedCursorPipeItem {
     RedPipeItem base;
     RedCursorCmd *red_cursor;
+    uint64_t shape_id; /* hash of the shape content, 0 if there's no shape to cache */
 } RedCursorPipeItem;
 
 struct CursorChannel
@@ -53,6 +54,39 @@ G_DEFINE_TYPE(CursorChannel, cursor_channel, TYPE_COMMON_GRAPHICS_CHANNEL)
 
 static void cursor_pipe_item_free(RedPipeItem *pipe_item);
 
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+
+    while (size--) {
+        hash = (hash ^ *p++) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/* Identify cursor shapes by their content rather than by the unique id
+ * given by the guest. Animated cursors get a new id for each frame even
+ * when the frames repeat, and identical shapes may come with different
+ * ids, this way they are found in the client cache anyway. */
+static uint64_t cursor_shape_hash(const SpiceCursor *shape)
+{
+    const SpiceCursorHeader *header = &shape->header;
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    hash = hash_bytes(hash, &header->type, sizeof(header->type));
+    hash = hash_bytes(hash, &header->width, sizeof(header->width));
+    hash = hash_bytes(hash, &header->height, sizeof(header->height));
+    hash = hash_bytes(hash, &header->hot_spot_x, sizeof(header->hot_spot_x));
+    hash = hash_bytes(hash, &header->hot_spot_y, sizeof(header->hot_spot_y));
+    hash = hash_bytes(hash, shape->data, shape->data_size);
+
+    /* 0 is used for "no shape" */
+    return hash ? hash : 1;
+}
+
 static RedCursorPipeItem *cursor_pipe_item_new(RedCursorCmd *cmd)
 {
     RedCursorPipeItem *item = g_new0(RedCursorPipeItem, 1);
@@ -62,6 +96,9 @@ static RedCursorPipeItem *cursor_pipe_item_new(RedCursorCmd *cmd)
     red_pipe_item_init_full(&item->base, RED_PIPE_ITEM_TYPE_CURSOR,
                             cursor_pipe_item_free);
     item->red_cursor = red_cursor_cmd_ref(cmd);
+    if (cmd->type == QXL_CURSOR_SET && cmd->u.set.shape.data_size) {
+        item->shape_id = cursor_shape_hash(&cmd->u.set.shape);
+    }
 
     return item;
 }
@@ -98,12 +135,14 @@ static void cursor_fill(CursorChannelClient *ccc, RedCursorPipeItem *cursor,
     cursor_cmd = cursor->red_cursor;
     *red_cursor = cursor_cmd->u.set.shape;
 
-    if (red_cursor->header.unique) {
-        if (cursor_channel_client_cache_find(ccc, red_cursor->header.unique)) {
+    if (cursor->shape_id) {
+        /* the client only uses the id as the cache key */
+        red_cursor->header.unique = cursor->shape_id;
+        if (cursor_channel_client_cache_find(ccc, cursor->shape_id)) {
             red_cursor->flags |= SPICE_CURSOR_FLAGS_FROM_CACHE;
             return;
         }
-        if (cursor_channel_client_cache_add(ccc, red_cursor->header.unique, 1)) {
+        if (cursor_channel_client_cache_add(ccc, cursor->shape_id, red_cursor->data_size)) {
             red_cursor->flags |= SPICE_CURSOR_FLAGS_CACHE_ME;
         }
     }
@@ -25,6 +25,7 @@
 #include "dcc-private.h"
 #include "display-channel-private.h"
 #include "red-qxl.h"
+#include "red-probes.h"
 
 typedef enum {
     FILL_BITS_TYPE_INVALID,
@@ -329,17 +330,31 @@ static void marshaller_compress_buf_free(uint8_t *data, void *opaque)
     compress_buf_free(opaque);
 }
 
+static void marshaller_unref_shared_image(uint8_t *data, void *opaque)
+{
+    red_shared_image_unref(opaque);
+}
+
 static void marshaller_add_compressed(SpiceMarshaller *m,
-                                      RedCompressBuf *comp_buf, size_t size)
+                                      const compress_send_data_t *comp_data)
 {
-    size_t max = size;
+    RedCompressBuf *comp_buf = comp_data->comp_buf;
+    size_t max = comp_data->comp_buf_size;
     size_t now;
     do {
         spice_return_if_fail(comp_buf);
         now = MIN(sizeof(comp_buf->buf), max);
         max -= now;
-        spice_marshaller_add_by_ref_full(m, comp_buf->buf.bytes, now,
-                                         marshaller_compress_buf_free, comp_buf);
+        if (comp_data->shared) {
+            /* buffers are owned by the shared image, which is kept alive
+             * until the message is sent */
+            spice_marshaller_add_by_ref_full(m, comp_buf->buf.bytes, now,
+                                             marshaller_unref_shared_image,
+                                             red_shared_image_ref(comp_data->shared));
+        } else {
+            spice_marshaller_add_by_ref_full(m, comp_buf->buf.bytes, now,
+                                             marshaller_compress_buf_free, comp_buf);
+        }
         comp_buf = comp_buf->send_next;
     } while (max);
 }
@@ -477,8 +492,10 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
                                  &bitmap_palette_out, &lzplt_palette_out);
             spice_assert(bitmap_palette_out == NULL);
 
-            marshaller_add_compressed(m, comp_send_data.comp_buf,
-                                      comp_send_data.comp_buf_size);
+            marshaller_add_compressed(m, &comp_send_data);
+            red_channel_client_add_compressed_data(rcc, comp_send_data.comp_buf_size,
+                                                   (uint64_t) simage->u.bitmap.y *
+                                                   simage->u.bitmap.stride);
 
             if (lzplt_palette_out && comp_send_data.lzplt_palette) {
                 spice_marshall_Palette(lzplt_palette_out, comp_send_data.lzplt_palette);
@@ -1723,6 +1740,8 @@ static bool red_marshall_stream_data(RedChannelClient *rcc,
                                              &copy->src_area, stream->top_down,
                                              drawable->red_drawable,
                                              &outbuf);
+    RED_PROBE6(video_encode, dcc, stream_id, stream->width, stream->height, ret,
+               ret == VIDEO_ENCODER_FRAME_ENCODE_DONE ? outbuf->size : 0);
     switch (ret) {
     case VIDEO_ENCODER_FRAME_DROP:
 #ifdef STREAM_STATS
@@ -1764,6 +1783,9 @@ static bool red_marshall_stream_data(RedChannelClient *rcc,
         rect_debug(&stream_data.dest);
         spice_marshall_msg_display_stream_data_sized(base_marshaller, &stream_data);
     }
+    red_channel_client_add_compressed_data(rcc, outbuf->size,
+                                           (uint64_t) (copy->src_area.bottom - copy->src_area.top) *
+                                           copy->src_bitmap->u.bitmap.stride);
     spice_marshaller_add_by_ref_full(base_marshaller, outbuf->data, outbuf->size,
                                      &red_release_video_encoder_buffer, outbuf);
 #ifdef STREAM_STATS
@@ -1827,6 +1849,7 @@ static void display_channel_marshall_migrate_data(RedChannelClient *rcc,
     DisplayChannelClient *dcc = DISPLAY_CHANNEL_CLIENT(rcc);
     ImageEncoders *encoders = dcc_get_encoders(dcc);
     SpiceMigrateDataDisplay display_data = {0,};
+    SpiceMarshaller *m2;
 
     display_channel = DISPLAY_CHANNEL(red_channel_client_get_channel(rcc));
 
@@ -1835,8 +1858,10 @@ static void display_channel_marshall_migrate_data(RedChannelClient *rcc,
     spice_marshaller_add_uint32(base_marshaller, SPICE_MIGRATE_DATA_DISPLAY_VERSION);
 
     spice_assert(dcc->priv->pixmap_cache);
-    spice_assert(MIGRATE_DATA_DISPLAY_MAX_CACHE_CLIENTS == 4 &&
-                 MIGRATE_DATA_DISPLAY_MAX_CACHE_CLIENTS == MAX_CACHE_CLIENTS);
+    /* the migration protocol only carries the sync serials of the first
+     * MIGRATE_DATA_DISPLAY_MAX_CACHE_CLIENTS display channels */
+    SPICE_VERIFY(MIGRATE_DATA_DISPLAY_MAX_CACHE_CLIENTS == 4 &&
+                 MIGRATE_DATA_DISPLAY_MAX_CACHE_CLIENTS <= MAX_CACHE_CLIENTS);
 
     display_data.message_serial = red_channel_client_get_message_serial(rcc);
     display_data.low_bandwidth_setting = dcc_is_low_bandwidth(dcc);
@@ -1850,11 +1875,18 @@ static void display_channel_marshall_migrate_data(RedChannelClient *rcc,
     image_encoders_glz_get_restore_data(encoders, &display_data.glz_dict_id,
                                         &display_data.glz_dict_data);
 
-    /* all data besided the surfaces ref */
+    /* all data besided the surfaces and pixmap cache refs */
     spice_marshaller_add(base_marshaller,
-                         (uint8_t *)&display_data, sizeof(display_data) - sizeof(uint32_t));
+                         (uint8_t *)&display_data, sizeof(display_data) - 2 * sizeof(uint32_t));
     display_channel_marshall_migrate_data_surfaces(dcc, base_marshaller,
                                                    display_channel->priv->enable_jpeg);
+    m2 = spice_marshaller_get_ptr_submarshaller(base_marshaller);
+    if (display_data.pixmap_cache_freezer) {
+        /* the frozen items are exactly the images the client holds */
+        pixmap_cache_marshall_frozen_index(dcc->priv->pixmap_cache, m2);
+    } else {
+        spice_marshaller_add_uint32(m2, 0);
+    }
 }
 
 static void display_channel_marshall_pixmap_sync(RedChannelClient *rcc,
@@ -1881,17 +1913,16 @@ static void display_channel_marshall_pixmap_sync(RedChannelClient *rcc,
     spice_marshall_msg_wait_for_channels(base_marshaller, &wait);
 }
 
-static void dcc_pixmap_cache_reset(DisplayChannelClient *dcc, SpiceMsgWaitForChannels* sync_data)
+/* Start a new generation of the cache with the message of the given serial.
+ * The client handles this message after the messages of the other channels
+ * which used the previous generation (see sync_data). */
+static void dcc_pixmap_cache_unlocked_new_generation(DisplayChannelClient *dcc, uint64_t serial,
+                                                     SpiceMsgWaitForChannels* sync_data)
 {
     PixmapCache *cache = dcc->priv->pixmap_cache;
     uint8_t wait_count;
-    uint64_t serial;
     uint32_t i;
 
-    serial = red_channel_client_get_message_serial(RED_CHANNEL_CLIENT(dcc));
-    pthread_mutex_lock(&cache->lock);
-    pixmap_cache_clear(cache);
-
     dcc->priv->pixmap_cache_generation = ++cache->generation;
     cache->generation_initiator.client = dcc->priv->id;
     cache->generation_initiator.message = serial;
@@ -1906,6 +1937,17 @@ static void dcc_pixmap_cache_reset(DisplayChannelClient *dcc, SpiceMsgWaitForCha
         }
     }
     sync_data->wait_count = wait_count;
+}
+
+static void dcc_pixmap_cache_reset(DisplayChannelClient *dcc, SpiceMsgWaitForChannels* sync_data)
+{
+    PixmapCache *cache = dcc->priv->pixmap_cache;
+    uint64_t serial;
+
+    serial = red_channel_client_get_message_serial(RED_CHANNEL_CLIENT(dcc));
+    pthread_mutex_lock(&cache->lock);
+    pixmap_cache_clear(cache);
+    dcc_pixmap_cache_unlocked_new_generation(dcc, serial, sync_data);
     pthread_mutex_unlock(&cache->lock);
 }
 
@@ -1913,13 +1955,45 @@ static void display_channel_marshall_reset_cache(RedChannelClient *rcc,
                                                  SpiceMarshaller *base_marshaller)
 {
     DisplayChannelClient *dcc = DISPLAY_CHANNEL_CLIENT(rcc);
-    SpiceMsgWaitForChannels wait;
+    WaitForChannels wait;
 
     red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_INVAL_ALL_PIXMAPS);
-    dcc_pixmap_cache_reset(dcc, &wait);
+    dcc_pixmap_cache_reset(dcc, &wait.header);
 
     spice_marshall_msg_display_inval_all_pixmaps(base_marshaller,
-                                                 &wait);
+                                                 &wait.header);
+}
+
+/* Restore the cache from the index sent by the src, the client keeps its
+ * images. The release messages the src sent on the other channels can still
+ * be pending at the client, so the client waits for them before handling
+ * messages of the new generation. Reset the cache if the index is invalid. */
+static void display_channel_marshall_restore_cache(RedChannelClient *rcc,
+                                                   SpiceMarshaller *base_marshaller,
+                                                   RedPixmapRestoreItem *item)
+{
+    DisplayChannelClient *dcc = DISPLAY_CHANNEL_CLIENT(rcc);
+    PixmapCache *cache = dcc->priv->pixmap_cache;
+    WaitForChannels wait;
+    uint64_t serial;
+    bool restored;
+
+    serial = red_channel_client_get_message_serial(rcc);
+    pthread_mutex_lock(&cache->lock);
+    restored = pixmap_cache_unlocked_restore_index(cache, item->items, item->num_items,
+                                                   cache->size);
+    if (restored) {
+        dcc_pixmap_cache_unlocked_new_generation(dcc, serial, &wait.header);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (!restored) {
+        display_channel_marshall_reset_cache(rcc, base_marshaller);
+        return;
+    }
+    spice_debug("restored %u pixmap cache items", item->num_items);
+    red_channel_client_init_send_data(rcc, SPICE_MSG_WAIT_FOR_CHANNELS);
+    spice_marshall_msg_wait_for_channels(base_marshaller, &wait.header);
 }
 
 static void red_marshall_image(RedChannelClient *rcc,
@@ -1996,8 +2070,9 @@ static void red_marshall_image(RedChannelClient *rcc,
         spice_marshall_Image(src_bitmap_out, &red_image,
                              &bitmap_palette_out, &lzplt_palette_out);
 
-        marshaller_add_compressed(src_bitmap_out,
-                                  comp_send_data.comp_buf, comp_send_data.comp_buf_size);
+        marshaller_add_compressed(src_bitmap_out, &comp_send_data);
+        red_channel_client_add_compressed_data(rcc, comp_send_data.comp_buf_size,
+                                               (uint64_t) bitmap.y * bitmap.stride);
 
         if (lzplt_palette_out && comp_send_data.lzplt_palette) {
             spice_marshall_Palette(lzplt_palette_out, comp_send_data.lzplt_palette);
@@ -2142,6 +2217,22 @@ static void marshall_qxl_drawable(RedChannelClient *rcc,
         DISPLAY_CHANNEL(red_channel_client_get_channel(rcc));
 
     spice_return_if_fail(display);
+    if (!red_drawable_parse_data(item->red_drawable)) {
+        RedDrawable *drawable = item->red_drawable;
+        RedImageItem *image;
+
+        /* the drawable can not be sent as is, send the area as rendered by
+         * the server instead (where the drawable was skipped as well) */
+        spice_warning("invalid drawable data, sending the area as an image");
+        if (ring_item_is_linked(&item->list_link)) {
+            display_channel_draw_until(display, &drawable->bbox, drawable->surface_id, item);
+        }
+        image = dcc_new_surface_area_image(DISPLAY_CHANNEL_CLIENT(rcc), drawable->surface_id,
+                                           &drawable->bbox, FALSE);
+        red_marshall_image(rcc, m, image);
+        red_pipe_item_unref(&image->base);
+        return;
+    }
     /* allow sized frames to be streamed, even if they where replaced by another frame, since
      * newer frames might not cover sized frames completely if they are bigger */
     if (item->stream && red_marshall_stream_data(rcc, m, item)) {
@@ -2390,6 +2481,7 @@ void dcc_send_item(RedChannelClient *rcc, RedPipeItem *pipe_item)
     SpiceMarshaller *m = red_channel_client_get_marshaller(rcc);
 
     reset_send_data(dcc);
+    dcc_update_low_bandwidth(dcc);
     switch (pipe_item->type) {
     case RED_PIPE_ITEM_TYPE_DRAW: {
         RedDrawablePipeItem *dpi = SPICE_UPCAST(RedDrawablePipeItem, pipe_item);
@@ -2427,6 +2519,10 @@ void dcc_send_item(RedChannelClient *rcc, RedPipeItem *pipe_item)
     case RED_PIPE_ITEM_TYPE_PIXMAP_RESET:
         display_channel_marshall_reset_cache(rcc, m);
         break;
+    case RED_PIPE_ITEM_TYPE_PIXMAP_RESTORE:
+        display_channel_marshall_restore_cache(rcc, m,
+                                               SPICE_UPCAST(RedPixmapRestoreItem, pipe_item));
+        break;
     case RED_PIPE_ITEM_TYPE_INVAL_PALETTE_CACHE:
         dcc_palette_cache_reset(dcc);
         red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_INVAL_ALL_PALETTES);
@@ -317,11 +317,18 @@ void dcc_create_surface(DisplayChannelClient *dcc, int surface_id)
     red_channel_client_pipe_add(RED_CHANNEL_CLIENT(dcc), &create->base);
 }
 
+static void red_image_item_free(RedPipeItem *pipe_item)
+{
+    RedImageItem *item = SPICE_UPCAST(RedImageItem, pipe_item);
+
+    surface_pool_release(item->pool, item);
+}
+
 // adding the pipe item after pos. If pos == NULL, adding to head.
-RedImageItem *dcc_add_surface_area_image(DisplayChannelClient *dcc,
+/* the image of the area is not added to the pipe */
+RedImageItem *dcc_new_surface_area_image(DisplayChannelClient *dcc,
                                          int surface_id,
                                          SpiceRect *area,
-                                         GList *pipe_item_pos,
                                          int can_lossy)
 {
     DisplayChannel *display = DCC_TO_DC(dcc);
@@ -341,9 +348,13 @@ RedImageItem *dcc_add_surface_area_image(DisplayChannelClient *dcc,
     bpp = SPICE_SURFACE_FMT_DEPTH(surface->context.format) / 8;
     stride = width * bpp;
 
-    item = (RedImageItem *)g_malloc(height * stride + sizeof(RedImageItem));
+    /* surface images are large and created and freed at each surface
+     * creation, reuse the buffers */
+    item = (RedImageItem *)surface_pool_alloc(display->priv->surface_pool,
+                                              (size_t) height * stride + sizeof(RedImageItem));
 
-    red_pipe_item_init(&item->base, RED_PIPE_ITEM_TYPE_IMAGE);
+    red_pipe_item_init_full(&item->base, RED_PIPE_ITEM_TYPE_IMAGE, red_image_item_free);
+    item->pool = display->priv->surface_pool;
 
     item->surface_id = surface_id;
     item->image_format =
@@ -371,6 +382,17 @@ RedImageItem *dcc_add_surface_area_image(DisplayChannelClient *dcc,
         }
     }
 
+    return item;
+}
+
+RedImageItem *dcc_add_surface_area_image(DisplayChannelClient *dcc,
+                                         int surface_id,
+                                         SpiceRect *area,
+                                         GList *pipe_item_pos,
+                                         int can_lossy)
+{
+    RedImageItem *item = dcc_new_surface_area_image(dcc, surface_id, area, can_lossy);
+
     if (pipe_item_pos) {
         red_channel_client_pipe_add_after_pos(RED_CHANNEL_CLIENT(dcc), &item->base, pipe_item_pos);
     } else {
@@ -453,6 +475,7 @@ static RedDrawablePipeItem *red_drawable_pipe_item_new(DisplayChannelClient *dcc
     drawable->pipes = g_list_prepend(drawable->pipes, dpi);
     red_pipe_item_init_full(&dpi->base, RED_PIPE_ITEM_TYPE_DRAW,
                             red_drawable_pipe_item_free);
+    dpi->base.input_time = drawable->input_time;
     drawable->refs++;
     return dpi;
 }
@@ -835,6 +858,45 @@ static SpiceImageCompression get_compression_for_bitmap(SpiceBitmap *bitmap,
     return SPICE_IMAGE_COMPRESSION_INVALID;
 }
 
+typedef bool (*ImageEncodersCompressFunc)(ImageEncoders *enc, SpiceImage *dest,
+                                          SpiceBitmap *src, compress_send_data_t* o_comp_data);
+
+/* Compress with one of the stateless encoders. When several clients are
+ * connected the result is attached to the drawable so that the other
+ * clients with the same compression settings reuse it instead of encoding
+ * the same image again. */
+static bool dcc_compress_image_shared(DisplayChannelClient *dcc,
+                                      ImageEncodersCompressFunc compress,
+                                      SpiceImageCompression compression, int lossy,
+                                      SpiceImage *dest, SpiceBitmap *src, Drawable *drawable,
+                                      compress_send_data_t* o_comp_data)
+{
+    DisplayChannel *display_channel = DCC_TO_DC(dcc);
+    ImageEncoders *enc = &dcc->priv->encoders;
+    int jpeg_quality = lossy ? enc->jpeg_quality : 0;
+    RedSharedImage *shared;
+
+    if (drawable == NULL ||
+        red_channel_get_n_clients(RED_CHANNEL(display_channel)) < 2) {
+        return compress(enc, dest, src, o_comp_data);
+    }
+
+    shared = red_shared_image_find(drawable->shared_images, src, dest->descriptor.id,
+                                   compression, jpeg_quality);
+    if (shared) {
+        red_shared_image_apply(shared, dest, o_comp_data);
+        stat_inc_counter(display_channel->priv->shared_image_hits_counter, 1);
+        return TRUE;
+    }
+
+    if (!compress(enc, dest, src, o_comp_data)) {
+        return FALSE;
+    }
+    red_shared_image_new(&drawable->shared_images, src, dest->descriptor.id,
+                         compression, jpeg_quality, dest, o_comp_data);
+    return TRUE;
+}
+
 int dcc_compress_image(DisplayChannelClient *dcc,
                        SpiceImage *dest, SpiceBitmap *src, Drawable *drawable,
                        int can_lossy,
@@ -854,10 +916,14 @@ int dcc_compress_image(DisplayChannelClient *dcc,
     case SPICE_IMAGE_COMPRESSION_QUIC:
         if (can_lossy && display_channel->priv->enable_jpeg &&
             (src->format != SPICE_BITMAP_FMT_RGBA || !bitmap_has_extra_stride(src))) {
-            success = image_encoders_compress_jpeg(&dcc->priv->encoders, dest, src, o_comp_data);
+            success = dcc_compress_image_shared(dcc, image_encoders_compress_jpeg,
+                                                image_compression, TRUE,
+                                                dest, src, drawable, o_comp_data);
             break;
         }
-        success = image_encoders_compress_quic(&dcc->priv->encoders, dest, src, o_comp_data);
+        success = dcc_compress_image_shared(dcc, image_encoders_compress_quic,
+                                            image_compression, FALSE,
+                                            dest, src, drawable, o_comp_data);
         break;
     case SPICE_IMAGE_COMPRESSION_GLZ:
         success = image_encoders_compress_glz(&dcc->priv->encoders, dest, src,
@@ -872,14 +938,18 @@ int dcc_compress_image(DisplayChannelClient *dcc,
     case SPICE_IMAGE_COMPRESSION_LZ4:
         if (red_channel_client_test_remote_cap(RED_CHANNEL_CLIENT(dcc),
                                                SPICE_DISPLAY_CAP_LZ4_COMPRESSION)) {
-            success = image_encoders_compress_lz4(&dcc->priv->encoders, dest, src, o_comp_data);
+            success = dcc_compress_image_shared(dcc, image_encoders_compress_lz4,
+                                                image_compression, FALSE,
+                                                dest, src, drawable, o_comp_data);
             break;
         }
 #endif
         /* fall through */
     case SPICE_IMAGE_COMPRESSION_LZ:
 lz_compress:
-        success = image_encoders_compress_lz(&dcc->priv->encoders, dest, src, o_comp_data);
+        success = dcc_compress_image_shared(dcc, image_encoders_compress_lz,
+                                            SPICE_IMAGE_COMPRESSION_LZ, FALSE,
+                                            dest, src, drawable, o_comp_data);
         if (success && !bitmap_fmt_is_rgb(src->format)) {
             dcc_palette_cache_palette(dcc, dest->u.lz_plt.palette, &(dest->u.lz_plt.flags));
         }
@@ -1023,6 +1093,7 @@ static bool dcc_handle_init(DisplayChannelClient *dcc, SpiceMsgcDisplayInit *ini
     spice_return_val_if_fail(dcc->priv->pixmap_cache, FALSE);
 
     success = image_encoders_get_glz_dictionary(&dcc->priv->encoders,
+                                                red_client_get_server(client),
                                                 client,
                                                 init->glz_dictionary_id,
                                                 init->glz_dictionary_window_size);
@@ -1253,8 +1324,11 @@ bool dcc_handle_message(RedChannelClient *rcc, uint16_t type, uint32_t size, voi
 static int dcc_handle_migrate_glz_dictionary(DisplayChannelClient *dcc,
                                              SpiceMigrateDataDisplay *migrate)
 {
+    RedClient *client = red_channel_client_get_client(RED_CHANNEL_CLIENT(dcc));
+
     return image_encoders_restore_glz_dictionary(&dcc->priv->encoders,
-                                                 red_channel_client_get_client(RED_CHANNEL_CLIENT(dcc)),
+                                                 red_client_get_server(client),
+                                                 client,
                                                  migrate->glz_dict_id,
                                                  &migrate->glz_dict_data);
 }
@@ -1317,14 +1391,29 @@ bool dcc_handle_migrate_data(DisplayChannelClient *dcc, uint32_t size, void *mes
     int surfaces_restored = FALSE;
     SpiceMigrateDataHeader *header = (SpiceMigrateDataHeader *)message;
     SpiceMigrateDataDisplay *migrate_data = (SpiceMigrateDataDisplay *)(header + 1);
+    MigrateDisplayPixmapCacheIndex *pixmap_cache_index = NULL;
     uint8_t *surfaces;
     int i;
 
+    /* version 1 ends with the surfaces ref */
     spice_return_val_if_fail(
-        size >= (sizeof(*migrate_data) + sizeof(SpiceMigrateDataHeader)), FALSE);
+        size >= (sizeof(*migrate_data) - sizeof(uint32_t) + sizeof(SpiceMigrateDataHeader)), FALSE);
     spice_return_val_if_fail(
          migration_protocol_validate_header(header,
              SPICE_MIGRATE_DATA_DISPLAY_MAGIC, SPICE_MIGRATE_DATA_DISPLAY_VERSION), FALSE);
+    if (header->version >= 2) {
+        uint32_t index_ptr;
+
+        spice_return_val_if_fail(
+            size >= (sizeof(*migrate_data) + sizeof(SpiceMigrateDataHeader)), FALSE);
+        index_ptr = migrate_data->pixmap_cache_index_ptr;
+        spice_return_val_if_fail(
+            index_ptr <= size - sizeof(MigrateDisplayPixmapCacheIndex), FALSE);
+        pixmap_cache_index = (MigrateDisplayPixmapCacheIndex *)((uint8_t *)message + index_ptr);
+        spice_return_val_if_fail(pixmap_cache_index->num_items <=
+            (size - index_ptr - sizeof(*pixmap_cache_index)) /
+            sizeof(MigrateDisplayPixmapCacheItem), FALSE);
+    }
 
     /* size is set to -1 in order to keep the cache frozen until the original
      * channel client that froze the cache on the src size receives the migrate
@@ -1335,7 +1424,7 @@ bool dcc_handle_migrate_data(DisplayChannelClient *dcc, uint32_t size, void *mes
     spice_return_val_if_fail(dcc->priv->pixmap_cache, FALSE);
 
     pthread_mutex_lock(&dcc->priv->pixmap_cache->lock);
-    for (i = 0; i < MAX_CACHE_CLIENTS; i++) {
+    for (i = 0; i < MIGRATE_DATA_DISPLAY_MAX_CACHE_CLIENTS; i++) {
         dcc->priv->pixmap_cache->sync[i] = MAX(dcc->priv->pixmap_cache->sync[i],
                                                migrate_data->pixmap_cache_clients[i]);
     }
@@ -1343,9 +1432,23 @@ bool dcc_handle_migrate_data(DisplayChannelClient *dcc, uint32_t size, void *mes
 
     if (migrate_data->pixmap_cache_freezer) {
         /* activating the cache. The cache will start to be active after
-         * pixmap_cache_reset is called, when handling RED_PIPE_ITEM_TYPE_PIXMAP_RESET */
+         * pixmap_cache_reset is called, when handling RED_PIPE_ITEM_TYPE_PIXMAP_RESET,
+         * or after restoring the index of the src cache, when handling
+         * RED_PIPE_ITEM_TYPE_PIXMAP_RESTORE */
         dcc->priv->pixmap_cache->size = migrate_data->pixmap_cache_size;
-        red_channel_client_pipe_add_type(RED_CHANNEL_CLIENT(dcc), RED_PIPE_ITEM_TYPE_PIXMAP_RESET);
+        if (pixmap_cache_index) {
+            RedPixmapRestoreItem *item;
+            size_t items_size = pixmap_cache_index->num_items * sizeof(item->items[0]);
+
+            item = g_malloc(sizeof(*item) + items_size);
+            red_pipe_item_init(&item->base, RED_PIPE_ITEM_TYPE_PIXMAP_RESTORE);
+            item->num_items = pixmap_cache_index->num_items;
+            memcpy(item->items, pixmap_cache_index->items, items_size);
+            red_channel_client_pipe_add(RED_CHANNEL_CLIENT(dcc), &item->base);
+        } else {
+            red_channel_client_pipe_add_type(RED_CHANNEL_CLIENT(dcc),
+                                             RED_PIPE_ITEM_TYPE_PIXMAP_RESET);
+        }
     }
 
     if (dcc_handle_migrate_glz_dictionary(dcc, migrate_data)) {
@@ -1426,6 +1529,12 @@ static bool dcc_config_socket(RedChannelClient *rcc)
 
     DISPLAY_CHANNEL_CLIENT(rcc)->is_low_bandwidth = main_channel_client_is_low_bandwidth(mcc);
 
+    /* keep the data waiting in the kernel to what the network can send
+     * in a roundtrip, the rest stays in the pipe where drawables can still
+     * be replaced. Ignore failures, the socket just uses the default
+     * buffering */
+    red_stream_set_latency_managed(red_channel_client_get_stream(rcc));
+
     return common_channel_client_config_socket(rcc);
 }
 
@@ -1453,3 +1562,33 @@ gboolean dcc_is_low_bandwidth(DisplayChannelClient *dcc)
 {
     return dcc->is_low_bandwidth;
 }
+
+/* Follow the bandwidth estimation of the stream, the net test of the main
+ * channel is done only once at connection */
+void dcc_update_low_bandwidth(DisplayChannelClient *dcc)
+{
+    RedChannelClient *rcc = RED_CHANNEL_CLIENT(dcc);
+    uint64_t bandwidth = red_stream_get_bandwidth(red_channel_client_get_stream(rcc));
+    uint64_t threshold = LOW_BANDWIDTH_BIT_RATE;
+    gboolean is_low_bandwidth;
+
+    if (bandwidth == 0) {
+        return;
+    }
+    /* some hysteresis to not flip compression at each sample */
+    if (dcc->is_low_bandwidth) {
+        threshold += threshold / 4;
+    }
+    is_low_bandwidth = bandwidth < threshold;
+    if (is_low_bandwidth == dcc->is_low_bandwidth) {
+        return;
+    }
+
+    spice_debug("bandwidth %.2f Mbps, switching to %s bandwidth settings",
+                bandwidth / 1024.0 / 1024.0, is_low_bandwidth ? "low" : "high");
+    dcc->is_low_bandwidth = is_low_bandwidth;
+    red_channel_client_ack_set_client_window(rcc, is_low_bandwidth ?
+                                             WIDE_CLIENT_ACK_WINDOW : NARROW_CLIENT_ACK_WINDOW);
+    red_channel_client_push_set_ack(rcc);
+    display_channel_update_compression(DCC_TO_DC(dcc), dcc);
+}
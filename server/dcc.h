@@ -25,6 +25,7 @@
 #include "image-cache.h"
 #include "pixmap-cache.h"
 #include "display-limits.h"
+#include "surface-pool.h"
 #include "common-graphics-channel.h"
 
 G_BEGIN_DECLS
@@ -120,9 +121,17 @@ typedef struct RedImageItem {
     int image_format;
     uint32_t image_flags;
     int can_lossy;
+    SurfacePool *pool;
     uint8_t data[0];
 } RedImageItem;
 
+/* index of the pixmap cache received with the migration data */
+typedef struct RedPixmapRestoreItem {
+    RedPipeItem base;
+    uint32_t num_items;
+    MigrateDisplayPixmapCacheItem items[0];
+} RedPixmapRestoreItem;
+
 typedef struct RedDrawablePipeItem {
     RedPipeItem base;
     Drawable *drawable;
@@ -154,6 +163,10 @@ void                       dcc_create_surface                        (DisplayCha
                                                                       int surface_id);
 void                       dcc_push_surface_image                    (DisplayChannelClient *dcc,
                                                                       int surface_id);
+RedImageItem *             dcc_new_surface_area_image                (DisplayChannelClient *dcc,
+                                                                      int surface_id,
+                                                                      SpiceRect *area,
+                                                                      int can_lossy);
 RedImageItem *             dcc_add_surface_area_image                (DisplayChannelClient *dcc,
                                                                       int surface_id,
                                                                       SpiceRect *area,
@@ -198,6 +211,7 @@ void dcc_set_max_stream_latency(DisplayChannelClient *dcc, uint32_t latency);
 uint64_t dcc_get_max_stream_bit_rate(DisplayChannelClient *dcc);
 void dcc_set_max_stream_bit_rate(DisplayChannelClient *dcc, uint64_t rate);
 gboolean dcc_is_low_bandwidth(DisplayChannelClient *dcc);
+void dcc_update_low_bandwidth(DisplayChannelClient *dcc);
 GArray *dcc_get_preferred_video_codecs_for_encoding(DisplayChannelClient *dcc);
 
 G_END_DECLS
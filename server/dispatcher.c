@@ -29,6 +29,7 @@
 #endif
 
 #include "dispatcher.h"
+#include "red-probes.h"
 
 //#define DEBUG_DISPATCHER
 
@@ -272,6 +273,7 @@ static int dispatcher_handle_single_read(Dispatcher *dispatcher)
         /* TODO: close socketpair? */
         return 0;
     }
+    RED_PROBE3(dispatcher_handle, dispatcher, type, msg->size);
     if (dispatcher->priv->any_handler) {
         dispatcher->priv->any_handler(dispatcher->priv->opaque, type, payload);
     }
@@ -310,6 +312,7 @@ void dispatcher_send_message(Dispatcher *dispatcher, uint32_t message_type,
     assert(dispatcher->priv->max_message_type > message_type);
     assert(dispatcher->priv->messages[message_type].handler);
     msg = &dispatcher->priv->messages[message_type];
+    RED_PROBE3(dispatcher_send, dispatcher, message_type, msg->size);
     pthread_mutex_lock(&dispatcher->priv->lock);
     if (write_safe(send_fd, (uint8_t*)&message_type, sizeof(message_type)) == -1) {
         g_warning("error: failed to send message type for message %d",
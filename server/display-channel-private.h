@@ -68,6 +68,9 @@ typedef struct MonitorsConfig {
 } MonitorsConfig;
 
 #define NUM_DRAWABLES 1000
+/* In lazy rendering mode the drawable pool can grow up to this many times
+ * NUM_DRAWABLES before the oldest drawables are rendered to make room */
+#define MAX_LAZY_DRAWABLES_CHUNKS 16
 typedef struct _Drawable _Drawable;
 struct _Drawable {
     union {
@@ -99,6 +102,12 @@ struct DisplayChannelPrivate
     uint32_t drawable_count;
     _Drawable drawables[NUM_DRAWABLES];
     _Drawable *free_drawables;
+    GPtrArray *lazy_drawables_chunks; // extra pools allocated in lazy mode
+
+    /* lazy rendering: drawables are only rendered when needed, or when the
+     * memory held by the pending drawables exceeds this size, 0 if disabled */
+    uint64_t max_pending_size;
+    uint64_t pending_size;
 
     int stream_video;
     GArray *video_codecs;
@@ -115,6 +124,8 @@ struct DisplayChannelPrivate
     SpiceImageSurfaces image_surfaces;
 
     ImageCache image_cache;
+    GThreadPool *render_pool; // tile rendering threads, NULL to render serially
+    SurfacePool *surface_pool; // buffers of the surface images sent to the clients
 
     int gl_draw_async_count;
 
@@ -129,6 +140,10 @@ struct DisplayChannelPrivate
     RedStatCounter cache_hits_counter;
     RedStatCounter add_to_cache_counter;
     RedStatCounter non_cache_counter;
+    RedStatCounter shared_image_hits_counter;
+    RedStatCounter render_tiles_counter;
+    RedStatCounter rendered_drawables_counter;
+    RedStatCounter forced_render_counter;
     ImageEncoderSharedData encoder_shared_data;
 };
 
@@ -151,6 +166,7 @@ enum {
     RED_PIPE_ITEM_TYPE_MIGRATE_DATA,
     RED_PIPE_ITEM_TYPE_PIXMAP_SYNC,
     RED_PIPE_ITEM_TYPE_PIXMAP_RESET,
+    RED_PIPE_ITEM_TYPE_PIXMAP_RESTORE,
     RED_PIPE_ITEM_TYPE_INVAL_PALETTE_CACHE,
     RED_PIPE_ITEM_TYPE_CREATE_SURFACE,
     RED_PIPE_ITEM_TYPE_DESTROY_SURFACE,
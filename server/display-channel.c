@@ -23,6 +23,7 @@
 #include "display-channel-private.h"
 #include "glib-compat.h"
 #include "red-qxl.h"
+#include "red-probes.h"
 
 G_DEFINE_TYPE(DisplayChannel, display_channel, TYPE_COMMON_GRAPHICS_CHANNEL)
 
@@ -88,6 +89,10 @@ display_channel_finalize(GObject *object)
 
     display_channel_destroy_surfaces(self);
     image_cache_reset(&self->priv->image_cache);
+    if (self->priv->render_pool) {
+        g_thread_pool_free(self->priv->render_pool, FALSE, TRUE);
+    }
+    surface_pool_free(self->priv->surface_pool);
 
     if (spice_extra_checks) {
         unsigned int count;
@@ -98,7 +103,7 @@ display_channel_finalize(GObject *object)
         for (drawable = self->priv->free_drawables; drawable; drawable = drawable->u.next) {
             ++count;
         }
-        spice_assert(count == NUM_DRAWABLES);
+        spice_assert(count == NUM_DRAWABLES * (1 + self->priv->lazy_drawables_chunks->len));
 
         count = 0;
         for (stream = self->priv->free_streams; stream; stream = stream->next) {
@@ -113,6 +118,7 @@ display_channel_finalize(GObject *object)
     }
 
     monitors_config_unref(self->priv->monitors_config);
+    g_ptr_array_free(self->priv->lazy_drawables_chunks, TRUE);
     g_array_unref(self->priv->video_codecs);
     g_free(self->priv);
 
@@ -120,6 +126,7 @@ display_channel_finalize(GObject *object)
 }
 
 static void drawable_draw(DisplayChannel *display, Drawable *drawable);
+static bool free_one_drawable(DisplayChannel *display, int force_glz_free);
 static Drawable *display_channel_drawable_try_new(DisplayChannel *display,
                                                   uint32_t process_commands_generation);
 
@@ -253,6 +260,15 @@ void display_channel_set_video_codecs(DisplayChannel *display, GArray *video_cod
     g_object_notify(G_OBJECT(display), "video-codecs");
 }
 
+void display_channel_set_max_pending_size(DisplayChannel *display, uint64_t max_pending_size)
+{
+    spice_return_if_fail(display);
+
+    spice_debug("lazy rendering %s, max pending size %" G_GUINT64_FORMAT,
+                max_pending_size ? "on" : "off", max_pending_size);
+    display->priv->max_pending_size = max_pending_size;
+}
+
 GArray *display_channel_get_video_codecs(DisplayChannel *display)
 {
     spice_return_val_if_fail(display, NULL);
@@ -425,6 +441,7 @@ static void current_add_drawable(DisplayChannel *display,
     ring_add(&display->priv->current_list, &drawable->list_link);
     ring_add(&surface->current_list, &drawable->surface_list_link);
     drawable->refs++;
+    display->priv->pending_size += drawable->pending_size;
 }
 
 /* Unrefs the drawable and removes it from any rings that it's in, as well as
@@ -437,6 +454,7 @@ static void current_remove_drawable(DisplayChannel *display, Drawable *item)
     ring_remove(&item->tree_item.base.siblings_link);
     ring_remove(&item->list_link);
     ring_remove(&item->surface_list_link);
+    display->priv->pending_size -= item->pending_size;
     drawable_unref(item);
 }
 
@@ -787,6 +805,7 @@ static void exclude_region(DisplayChannel *display, Ring *ring, RingItem *ring_i
     if (!ring_item) {
         return;
     }
+    RED_PROBE2(tree_exclude, display, frame_candidate);
 
     top_ring = ring;
 
@@ -1335,6 +1354,43 @@ static bool validate_drawable_bbox(DisplayChannel *display, RedDrawable *drawabl
         return TRUE;
 }
 
+/* Estimates the memory kept alive by a drawable waiting to be rendered */
+static uint64_t red_drawable_get_pending_size(RedDrawable *red_drawable)
+{
+    SpiceImage *image = NULL;
+    uint64_t size = sizeof(Drawable) + sizeof(RedDrawable);
+
+    switch (red_drawable->type) {
+    case QXL_DRAW_OPAQUE:
+        image = red_drawable->u.opaque.src_bitmap;
+        break;
+    case QXL_DRAW_COPY:
+        image = red_drawable->u.copy.src_bitmap;
+        break;
+    case QXL_DRAW_TRANSPARENT:
+        image = red_drawable->u.transparent.src_bitmap;
+        break;
+    case QXL_DRAW_ALPHA_BLEND:
+        image = red_drawable->u.alpha_blend.src_bitmap;
+        break;
+    case QXL_DRAW_BLEND:
+        image = red_drawable->u.blend.src_bitmap;
+        break;
+    case QXL_DRAW_ROP3:
+        image = red_drawable->u.rop3.src_bitmap;
+        break;
+    case QXL_DRAW_COMPOSITE:
+        image = red_drawable->u.composite.src_bitmap;
+        break;
+    default:
+        break;
+    }
+    if (image && image->descriptor.type == SPICE_IMAGE_TYPE_BITMAP) {
+        size += (uint64_t) image->u.bitmap.stride * image->u.bitmap.y;
+    }
+    return size;
+}
+
 /**
  * @brief Get a new Drawable
  *
@@ -1369,6 +1425,7 @@ static Drawable *display_channel_get_drawable(DisplayChannel *display, uint8_t e
 
     drawable->tree_item.effect = effect;
     drawable->red_drawable = red_drawable_ref(red_drawable);
+    drawable->pending_size = red_drawable_get_pending_size(red_drawable);
 
     drawable->surface_id = red_drawable->surface_id;
     display->priv->surfaces[drawable->surface_id].refs++;
@@ -1423,12 +1480,14 @@ static void display_channel_add_drawable(DisplayChannel *display, Drawable *draw
 
     Ring *ring = &display->priv->surfaces[surface_id].current;
     int add_to_pipe;
+    RED_PROBE3(tree_insert, drawable, surface_id, drawable->tree_item.effect);
     if (has_shadow(red_drawable)) {
         add_to_pipe = current_add_with_shadow(display, ring, drawable);
     } else {
         drawable->streamable = drawable_can_stream(display, drawable);
         add_to_pipe = current_add(display, ring, drawable);
     }
+    RED_PROBE2(tree_insert_done, drawable, add_to_pipe);
 
     if (add_to_pipe)
         pipes_add_drawable(display, drawable);
@@ -1450,9 +1509,20 @@ void display_channel_process_draw(DisplayChannel *display, RedDrawable *red_draw
         return;
     }
 
+    drawable->input_time =
+        red_input_trace_take(reds_get_input_trace(red_channel_get_server(RED_CHANNEL(display))));
     display_channel_add_drawable(display, drawable);
 
     drawable_unref(drawable);
+
+    /* in lazy mode, render the oldest drawables once they hold too much memory */
+    while (display->priv->max_pending_size &&
+           display->priv->pending_size > display->priv->max_pending_size) {
+        if (!free_one_drawable(display, FALSE)) {
+            break;
+        }
+        stat_inc_counter(display->priv->forced_render_counter, 1);
+    }
 }
 
 bool display_channel_wait_for_migrate_data(DisplayChannel *display)
@@ -1504,6 +1574,12 @@ void display_channel_flush_all_surfaces(DisplayChannel *display)
     }
 }
 
+/* release the memory kept for reuse */
+void display_channel_trim_memory(DisplayChannel *display)
+{
+    surface_pool_trim(display->priv->surface_pool, 0);
+}
+
 void display_channel_free_glz_drawables_to_free(DisplayChannel *display)
 {
     DisplayChannelClient *dcc;
@@ -1612,8 +1688,31 @@ static void drawables_init(DisplayChannel *display)
     for (i = 0; i < NUM_DRAWABLES; i++) {
         drawable_free(display, &display->priv->drawables[i].u.drawable);
     }
+    display->priv->lazy_drawables_chunks = g_ptr_array_new_with_free_func(g_free);
+}
+
+/* In lazy rendering mode, allocates more drawables instead of rendering the
+ * oldest ones as long as they don't hold too much memory */
+static bool drawables_grow(DisplayChannel *display)
+{
+    _Drawable *chunk;
+    int i;
+
+    if (!display->priv->max_pending_size ||
+        display->priv->pending_size >= display->priv->max_pending_size ||
+        display->priv->lazy_drawables_chunks->len >= MAX_LAZY_DRAWABLES_CHUNKS) {
+        return FALSE;
+    }
+
+    chunk = g_new(_Drawable, NUM_DRAWABLES);
+    g_ptr_array_add(display->priv->lazy_drawables_chunks, chunk);
+    for (i = 0; i < NUM_DRAWABLES; i++) {
+        drawable_free(display, &chunk[i].u.drawable);
+    }
+    return TRUE;
 }
 
+
 /**
  * Allocate a Drawable
  *
@@ -1625,6 +1724,9 @@ static Drawable *display_channel_drawable_try_new(DisplayChannel *display,
     Drawable *drawable;
 
     while (!(drawable = drawable_try_new(display))) {
+        if (drawables_grow(display)) {
+            continue;
+        }
         if (!free_one_drawable(display, FALSE))
             return NULL;
     }
@@ -1703,6 +1805,7 @@ void drawable_unref(Drawable *drawable)
     display_channel_surface_unref(display, drawable->surface_id);
 
     glz_retention_detach_drawables(&drawable->glz_retention);
+    red_shared_images_release(&drawable->shared_images);
 
     if (drawable->red_drawable) {
         red_drawable_unref(drawable->red_drawable);
@@ -1725,22 +1828,9 @@ static void drawable_deps_draw(DisplayChannel *display, Drawable *drawable)
     }
 }
 
-static void drawable_draw(DisplayChannel *display, Drawable *drawable)
+static void drawable_draw_on_canvas(DisplayChannel *display, Drawable *drawable,
+                                    SpiceCanvas *canvas, SpiceClip *clip)
 {
-    RedSurface *surface;
-    SpiceCanvas *canvas;
-    SpiceClip clip = drawable->red_drawable->clip;
-
-    drawable_deps_draw(display, drawable);
-
-    surface = &display->priv->surfaces[drawable->surface_id];
-    canvas = surface->context.canvas;
-    spice_return_if_fail(canvas);
-
-    image_cache_aging(&display->priv->image_cache);
-
-    region_add(&surface->draw_dirty_region, &drawable->red_drawable->bbox);
-
     switch (drawable->red_drawable->type) {
     case QXL_DRAW_FILL: {
         SpiceFill fill = drawable->red_drawable->u.fill;
@@ -1748,7 +1838,7 @@ static void drawable_draw(DisplayChannel *display, Drawable *drawable)
         image_cache_localize_brush(&display->priv->image_cache, &fill.brush, &img1);
         image_cache_localize_mask(&display->priv->image_cache, &fill.mask, &img2);
         canvas->ops->draw_fill(canvas, &drawable->red_drawable->bbox,
-                               &clip, &fill);
+                               clip, &fill);
         break;
     }
     case QXL_DRAW_OPAQUE: {
@@ -1757,7 +1847,7 @@ static void drawable_draw(DisplayChannel *display, Drawable *drawable)
         image_cache_localize_brush(&display->priv->image_cache, &opaque.brush, &img1);
         image_cache_localize(&display->priv->image_cache, &opaque.src_bitmap, &img2, drawable);
         image_cache_localize_mask(&display->priv->image_cache, &opaque.mask, &img3);
-        canvas->ops->draw_opaque(canvas, &drawable->red_drawable->bbox, &clip, &opaque);
+        canvas->ops->draw_opaque(canvas, &drawable->red_drawable->bbox, clip, &opaque);
         break;
     }
     case QXL_DRAW_COPY: {
@@ -1766,7 +1856,7 @@ static void drawable_draw(DisplayChannel *display, Drawable *drawable)
         image_cache_localize(&display->priv->image_cache, &copy.src_bitmap, &img1, drawable);
         image_cache_localize_mask(&display->priv->image_cache, &copy.mask, &img2);
         canvas->ops->draw_copy(canvas, &drawable->red_drawable->bbox,
-                               &clip, &copy);
+                               clip, &copy);
         break;
     }
     case QXL_DRAW_TRANSPARENT: {
@@ -1774,7 +1864,7 @@ static void drawable_draw(DisplayChannel *display, Drawable *drawable)
         SpiceImage img1;
         image_cache_localize(&display->priv->image_cache, &transparent.src_bitmap, &img1, drawable);
         canvas->ops->draw_transparent(canvas,
-                                      &drawable->red_drawable->bbox, &clip, &transparent);
+                                      &drawable->red_drawable->bbox, clip, &transparent);
         break;
     }
     case QXL_DRAW_ALPHA_BLEND: {
@@ -1782,12 +1872,12 @@ static void drawable_draw(DisplayChannel *display, Drawable *drawable)
         SpiceImage img1;
         image_cache_localize(&display->priv->image_cache, &alpha_blend.src_bitmap, &img1, drawable);
         canvas->ops->draw_alpha_blend(canvas,
-                                      &drawable->red_drawable->bbox, &clip, &alpha_blend);
+                                      &drawable->red_drawable->bbox, clip, &alpha_blend);
         break;
     }
     case QXL_COPY_BITS: {
         canvas->ops->copy_bits(canvas, &drawable->red_drawable->bbox,
-                               &clip, &drawable->red_drawable->u.copy_bits.src_pos);
+                               clip, &drawable->red_drawable->u.copy_bits.src_pos);
         break;
     }
     case QXL_DRAW_BLEND: {
@@ -1796,7 +1886,7 @@ static void drawable_draw(DisplayChannel *display, Drawable *drawable)
         image_cache_localize(&display->priv->image_cache, &blend.src_bitmap, &img1, drawable);
         image_cache_localize_mask(&display->priv->image_cache, &blend.mask, &img2);
         canvas->ops->draw_blend(canvas, &drawable->red_drawable->bbox,
-                                &clip, &blend);
+                                clip, &blend);
         break;
     }
     case QXL_DRAW_BLACKNESS: {
@@ -1804,7 +1894,7 @@ static void drawable_draw(DisplayChannel *display, Drawable *drawable)
         SpiceImage img1;
         image_cache_localize_mask(&display->priv->image_cache, &blackness.mask, &img1);
         canvas->ops->draw_blackness(canvas,
-                                    &drawable->red_drawable->bbox, &clip, &blackness);
+                                    &drawable->red_drawable->bbox, clip, &blackness);
         break;
     }
     case QXL_DRAW_WHITENESS: {
@@ -1812,7 +1902,7 @@ static void drawable_draw(DisplayChannel *display, Drawable *drawable)
         SpiceImage img1;
         image_cache_localize_mask(&display->priv->image_cache, &whiteness.mask, &img1);
         canvas->ops->draw_whiteness(canvas,
-                                    &drawable->red_drawable->bbox, &clip, &whiteness);
+                                    &drawable->red_drawable->bbox, clip, &whiteness);
         break;
     }
     case QXL_DRAW_INVERS: {
@@ -1820,7 +1910,7 @@ static void drawable_draw(DisplayChannel *display, Drawable *drawable)
         SpiceImage img1;
         image_cache_localize_mask(&display->priv->image_cache, &invers.mask, &img1);
         canvas->ops->draw_invers(canvas,
-                                 &drawable->red_drawable->bbox, &clip, &invers);
+                                 &drawable->red_drawable->bbox, clip, &invers);
         break;
     }
     case QXL_DRAW_ROP3: {
@@ -1830,7 +1920,7 @@ static void drawable_draw(DisplayChannel *display, Drawable *drawable)
         image_cache_localize(&display->priv->image_cache, &rop3.src_bitmap, &img2, drawable);
         image_cache_localize_mask(&display->priv->image_cache, &rop3.mask, &img3);
         canvas->ops->draw_rop3(canvas, &drawable->red_drawable->bbox,
-                               &clip, &rop3);
+                               clip, &rop3);
         break;
     }
     case QXL_DRAW_COMPOSITE: {
@@ -1840,7 +1930,7 @@ static void drawable_draw(DisplayChannel *display, Drawable *drawable)
         if (composite.mask_bitmap)
             image_cache_localize(&display->priv->image_cache, &composite.mask_bitmap, &mask, drawable);
         canvas->ops->draw_composite(canvas, &drawable->red_drawable->bbox,
-                                    &clip, &composite);
+                                    clip, &composite);
         break;
     }
     case QXL_DRAW_STROKE: {
@@ -1848,7 +1938,7 @@ static void drawable_draw(DisplayChannel *display, Drawable *drawable)
         SpiceImage img1;
         image_cache_localize_brush(&display->priv->image_cache, &stroke.brush, &img1);
         canvas->ops->draw_stroke(canvas,
-                                 &drawable->red_drawable->bbox, &clip, &stroke);
+                                 &drawable->red_drawable->bbox, clip, &stroke);
         break;
     }
     case QXL_DRAW_TEXT: {
@@ -1857,7 +1947,7 @@ static void drawable_draw(DisplayChannel *display, Drawable *drawable)
         image_cache_localize_brush(&display->priv->image_cache, &text.fore_brush, &img1);
         image_cache_localize_brush(&display->priv->image_cache, &text.back_brush, &img2);
         canvas->ops->draw_text(canvas, &drawable->red_drawable->bbox,
-                               &clip, &text);
+                               clip, &text);
         break;
     }
     default:
@@ -1865,6 +1955,31 @@ static void drawable_draw(DisplayChannel *display, Drawable *drawable)
     }
 }
 
+static void drawable_draw(DisplayChannel *display, Drawable *drawable)
+{
+    RedSurface *surface;
+    SpiceCanvas *canvas;
+    SpiceClip clip = drawable->red_drawable->clip;
+
+    drawable_deps_draw(display, drawable);
+
+    if (!red_drawable_parse_data(drawable->red_drawable)) {
+        spice_warning("invalid drawable data, not rendered");
+        return;
+    }
+
+    surface = &display->priv->surfaces[drawable->surface_id];
+    canvas = surface->context.canvas;
+    spice_return_if_fail(canvas);
+
+    image_cache_aging(&display->priv->image_cache);
+
+    region_add(&surface->draw_dirty_region, &drawable->red_drawable->bbox);
+
+    drawable_draw_on_canvas(display, drawable, canvas, &clip);
+    stat_inc_counter(display->priv->rendered_drawables_counter, 1);
+}
+
 static void surface_update_dest(RedSurface *surface, const SpiceRect *area)
 {
     SpiceCanvas *canvas = surface->context.canvas;
@@ -1885,6 +2000,284 @@ static void surface_update_dest(RedSurface *surface, const SpiceRect *area)
     canvas->ops->read_bits(canvas, dest, -stride, area);
 }
 
+/* Tile rendering
+ *
+ * Runs of drawables that only read from guest bitmaps and only write inside
+ * their clip are independent per region of the destination. When a render
+ * pool is configured such runs are split in horizontal tiles which are drawn
+ * in parallel, each tile on its own canvas over the surface memory.
+ * Drawables touching the image cache or reading surfaces are drawn serially
+ * on the worker thread, flushing the pending run first to keep the order.
+ */
+#define RENDER_TILE_HEIGHT 64
+#define RENDER_TILES_MIN_AREA (256 * 256)
+#define RENDER_THREADS_MAX 16
+
+typedef struct RenderTilesBatch {
+    DisplayChannel *display;
+    RedSurface *surface;
+    GPtrArray *drawables;
+    GMutex lock;
+    GCond done;
+    int pending;
+} RenderTilesBatch;
+
+typedef struct RenderTile {
+    RenderTilesBatch *batch;
+    SpiceRect area;
+} RenderTile;
+
+static bool tile_image_is_safe(DisplayChannel *display, const SpiceImage *image)
+{
+    if (image->descriptor.type != SPICE_IMAGE_TYPE_BITMAP) {
+        return FALSE;
+    }
+    return !(image->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_ME) &&
+           !(image->u.bitmap.flags & (SPICE_BITMAP_FLAGS_PAL_CACHE_ME |
+                                      SPICE_BITMAP_FLAGS_PAL_FROM_CACHE)) &&
+           !image_cache_contains(&display->priv->image_cache, image->descriptor.id);
+}
+
+static bool tile_src_is_safe(DisplayChannel *display, Drawable *drawable,
+                             const SpiceImage *image)
+{
+    if (image == NULL) {
+        image = drawable->red_drawable->self_bitmap_image;
+    }
+    return image != NULL && tile_image_is_safe(display, image);
+}
+
+static bool tile_brush_is_safe(DisplayChannel *display, const SpiceBrush *brush)
+{
+    return brush->type != SPICE_BRUSH_TYPE_PATTERN ||
+           (brush->u.pattern.pat != NULL && tile_image_is_safe(display, brush->u.pattern.pat));
+}
+
+static bool tile_mask_is_safe(DisplayChannel *display, const SpiceQMask *mask)
+{
+    return mask->bitmap == NULL || tile_image_is_safe(display, mask->bitmap);
+}
+
+static bool drawable_is_tile_safe(DisplayChannel *display, Drawable *drawable)
+{
+    RedDrawable *red_drawable = drawable->red_drawable;
+
+    if (red_drawable->clip.type != SPICE_CLIP_TYPE_NONE &&
+        red_drawable->clip.type != SPICE_CLIP_TYPE_RECTS) {
+        return FALSE;
+    }
+
+    switch (red_drawable->type) {
+    case QXL_DRAW_FILL:
+        return tile_brush_is_safe(display, &red_drawable->u.fill.brush) &&
+               tile_mask_is_safe(display, &red_drawable->u.fill.mask);
+    case QXL_DRAW_OPAQUE:
+        return tile_brush_is_safe(display, &red_drawable->u.opaque.brush) &&
+               tile_src_is_safe(display, drawable, red_drawable->u.opaque.src_bitmap) &&
+               tile_mask_is_safe(display, &red_drawable->u.opaque.mask);
+    case QXL_DRAW_COPY:
+        return tile_src_is_safe(display, drawable, red_drawable->u.copy.src_bitmap) &&
+               tile_mask_is_safe(display, &red_drawable->u.copy.mask);
+    case QXL_DRAW_TRANSPARENT:
+        return tile_src_is_safe(display, drawable, red_drawable->u.transparent.src_bitmap);
+    case QXL_DRAW_ALPHA_BLEND:
+        return tile_src_is_safe(display, drawable, red_drawable->u.alpha_blend.src_bitmap);
+    case QXL_DRAW_BLACKNESS:
+        return tile_mask_is_safe(display, &red_drawable->u.blackness.mask);
+    case QXL_DRAW_WHITENESS:
+        return tile_mask_is_safe(display, &red_drawable->u.whiteness.mask);
+    case QXL_DRAW_INVERS:
+        return tile_mask_is_safe(display, &red_drawable->u.invers.mask);
+    case QXL_DRAW_TEXT:
+        return tile_brush_is_safe(display, &red_drawable->u.text.fore_brush) &&
+               tile_brush_is_safe(display, &red_drawable->u.text.back_brush);
+    default:
+        /* copy_bits, rop3 and blend read the destination outside of the
+         * clip, stroke and composite are rare enough to not bother */
+        return FALSE;
+    }
+}
+
+static bool drawable_has_pending_deps(Drawable *drawable)
+{
+    int x;
+
+    for (x = 0; x < 3; ++x) {
+        if (drawable->surface_deps[x] != -1 && drawable->depend_items[x].drawable) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Returns the clip of @drawable restricted to @area, NULL if empty */
+static SpiceClipRects *drawable_get_tile_clip(Drawable *drawable, const SpiceRect *area)
+{
+    RedDrawable *red_drawable = drawable->red_drawable;
+    SpiceClipRects *rects;
+    SpiceRect bbox = red_drawable->bbox;
+    uint32_t i;
+
+    rect_sect(&bbox, area);
+    if (rect_is_empty(&bbox)) {
+        return NULL;
+    }
+
+    if (red_drawable->clip.type == SPICE_CLIP_TYPE_NONE) {
+        rects = g_malloc(sizeof(SpiceClipRects) + sizeof(SpiceRect));
+        rects->num_rects = 1;
+        rects->rects[0] = bbox;
+        return rects;
+    }
+
+    rects = g_malloc(sizeof(SpiceClipRects) +
+                     red_drawable->clip.rects->num_rects * sizeof(SpiceRect));
+    rects->num_rects = 0;
+    for (i = 0; i < red_drawable->clip.rects->num_rects; i++) {
+        SpiceRect r = red_drawable->clip.rects->rects[i];
+
+        rect_sect(&r, &bbox);
+        if (!rect_is_empty(&r)) {
+            rects->rects[rects->num_rects++] = r;
+        }
+    }
+    if (rects->num_rects == 0) {
+        g_free(rects);
+        return NULL;
+    }
+    return rects;
+}
+
+static void render_tile(gpointer data, gpointer user_data)
+{
+    RenderTile *tile = data;
+    RenderTilesBatch *batch = tile->batch;
+    DisplayChannel *display = batch->display;
+    DrawContext *context = &batch->surface->context;
+    SpiceCanvas *canvas;
+    guint i;
+
+    canvas = canvas_create_for_data(context->width, context->height, context->format,
+                                    context->line_0, context->stride,
+                                    &display->priv->image_cache.base,
+                                    &display->priv->image_surfaces, NULL, NULL, NULL);
+    if (canvas) {
+        for (i = 0; i < batch->drawables->len; i++) {
+            Drawable *drawable = g_ptr_array_index(batch->drawables, i);
+            SpiceClip clip;
+
+            clip.type = SPICE_CLIP_TYPE_RECTS;
+            clip.rects = drawable_get_tile_clip(drawable, &tile->area);
+            if (clip.rects) {
+                drawable_draw_on_canvas(display, drawable, canvas, &clip);
+                g_free(clip.rects);
+            }
+        }
+        canvas->ops->destroy(canvas);
+    } else {
+        spice_warning("failed to create tile canvas");
+    }
+
+    g_mutex_lock(&batch->lock);
+    if (--batch->pending == 0) {
+        g_cond_signal(&batch->done);
+    }
+    g_mutex_unlock(&batch->lock);
+}
+
+/* Draws and releases the drawables of @drawables, which must all be tile safe */
+static void render_tiles(DisplayChannel *display, RedSurface *surface, GPtrArray *drawables)
+{
+    SpiceRect area = { 0, 0, 0, 0 };
+    SpiceRect bounds = { 0, 0, surface->context.width, surface->context.height };
+    guint i;
+
+    if (drawables->len == 0) {
+        return;
+    }
+
+    for (i = 0; i < drawables->len; i++) {
+        Drawable *drawable = g_ptr_array_index(drawables, i);
+        if (i == 0) {
+            area = drawable->red_drawable->bbox;
+        } else {
+            rect_union(&area, &drawable->red_drawable->bbox);
+        }
+    }
+    rect_sect(&area, &bounds);
+
+    if (rect_is_empty(&area)) {
+        /* nothing to draw */
+    } else if ((area.right - area.left) * (area.bottom - area.top) < RENDER_TILES_MIN_AREA) {
+        for (i = 0; i < drawables->len; i++) {
+            Drawable *drawable = g_ptr_array_index(drawables, i);
+            SpiceClip clip = drawable->red_drawable->clip;
+
+            drawable_draw_on_canvas(display, drawable, surface->context.canvas, &clip);
+        }
+    } else {
+        int n_tiles = (area.bottom - area.top + RENDER_TILE_HEIGHT - 1) / RENDER_TILE_HEIGHT;
+        RenderTile *tiles = g_new(RenderTile, n_tiles);
+        RenderTilesBatch batch;
+        int t;
+
+        batch.display = display;
+        batch.surface = surface;
+        batch.drawables = drawables;
+        batch.pending = n_tiles;
+        g_mutex_init(&batch.lock);
+        g_cond_init(&batch.done);
+
+        for (t = 0; t < n_tiles; t++) {
+            tiles[t].batch = &batch;
+            tiles[t].area = area;
+            tiles[t].area.top = area.top + t * RENDER_TILE_HEIGHT;
+            tiles[t].area.bottom = MIN(tiles[t].area.top + RENDER_TILE_HEIGHT, area.bottom);
+            g_thread_pool_push(display->priv->render_pool, &tiles[t], NULL);
+        }
+
+        g_mutex_lock(&batch.lock);
+        while (batch.pending > 0) {
+            g_cond_wait(&batch.done, &batch.lock);
+        }
+        g_mutex_unlock(&batch.lock);
+
+        g_cond_clear(&batch.done);
+        g_mutex_clear(&batch.lock);
+        g_free(tiles);
+        stat_inc_counter(display->priv->render_tiles_counter, n_tiles);
+    }
+
+    for (i = 0; i < drawables->len; i++) {
+        drawable_unref(g_ptr_array_index(drawables, i));
+    }
+    g_ptr_array_set_size(drawables, 0);
+}
+
+void display_channel_set_render_threads(DisplayChannel *display, int n_threads)
+{
+    GError *error = NULL;
+
+    spice_return_if_fail(display);
+
+    if (display->priv->render_pool) {
+        g_thread_pool_free(display->priv->render_pool, FALSE, TRUE);
+        display->priv->render_pool = NULL;
+    }
+    if (n_threads <= 1) {
+        return;
+    }
+    n_threads = MIN(n_threads, RENDER_THREADS_MAX);
+
+    display->priv->render_pool = g_thread_pool_new(render_tile, NULL, n_threads, TRUE, &error);
+    if (display->priv->render_pool == NULL) {
+        spice_warning("failed to create render thread pool: %s", error->message);
+        g_error_free(error);
+        return;
+    }
+    spice_debug("rendering with %d threads", n_threads);
+}
+
 /* Draws all drawables associated with @surface, starting from the tail of the
  * ring, and stopping after it draws @last */
 static void draw_until(DisplayChannel *display, RedSurface *surface, Drawable *last)
@@ -1892,6 +2285,11 @@ static void draw_until(DisplayChannel *display, RedSurface *surface, Drawable *l
     RingItem *ring_item;
     Container *container;
     Drawable *now;
+    GPtrArray *tiled = NULL;
+
+    if (display->priv->render_pool && surface->context.canvas) {
+        tiled = g_ptr_array_new();
+    }
 
     do {
         ring_item = ring_get_tail(&surface->current_list);
@@ -1900,6 +2298,24 @@ static void draw_until(DisplayChannel *display, RedSurface *surface, Drawable *l
         container = now->tree_item.base.container;
         current_remove_drawable(display, now);
         container_cleanup(container);
+
+        /* lazy data must be parsed here, the memory slots are not thread safe */
+        if (tiled && red_drawable_parse_data(now->red_drawable) &&
+            drawable_is_tile_safe(display, now)) {
+            /* dependencies are drawn in order with the pending run */
+            if (drawable_has_pending_deps(now)) {
+                render_tiles(display, surface, tiled);
+                drawable_deps_draw(display, now);
+            }
+            image_cache_aging(&display->priv->image_cache);
+            region_add(&surface->draw_dirty_region, &now->red_drawable->bbox);
+            g_ptr_array_add(tiled, now);
+            continue;
+        }
+        if (tiled) {
+            render_tiles(display, surface, tiled);
+        }
+
         /* drawable_draw may call display_channel_draw for the surfaces 'now' depends on. Notice,
            that it is valid to call display_channel_draw in this case and not display_channel_draw_till:
            It is impossible that there was newer item then 'last' in one of the surfaces
@@ -1908,6 +2324,11 @@ static void draw_until(DisplayChannel *display, RedSurface *surface, Drawable *l
         drawable_draw(display, now);
         drawable_unref(now);
     } while (now != last);
+
+    if (tiled) {
+        render_tiles(display, surface, tiled);
+        g_ptr_array_free(tiled, TRUE);
+    }
 }
 
 /* Find the first Drawable in the @current ring that intersects the given
@@ -2297,6 +2718,16 @@ display_channel_constructed(GObject *object)
                       "add_to_cache", TRUE);
     stat_init_counter(&self->priv->non_cache_counter, reds, stat,
                       "non_cache", TRUE);
+    stat_init_counter(&self->priv->shared_image_hits_counter, reds, stat,
+                      "shared_image_hits", TRUE);
+    stat_init_counter(&self->priv->render_tiles_counter, reds, stat,
+                      "render_tiles", TRUE);
+    stat_init_counter(&self->priv->rendered_drawables_counter, reds, stat,
+                      "rendered_drawables", TRUE);
+    stat_init_counter(&self->priv->forced_render_counter, reds, stat,
+                      "forced_renders", TRUE);
+    self->priv->surface_pool = surface_pool_new(red_channel_get_core_interface(channel),
+                                                reds, stat);
     image_cache_init(&self->priv->image_cache);
     self->priv->stream_video = SPICE_STREAM_VIDEO_OFF;
     display_channel_init_video_streams(self);
@@ -78,6 +78,7 @@ struct Drawable {
     RedDrawable *red_drawable;
 
     GlzImageRetention glz_retention;
+    RedSharedImage *shared_images; // compressed images shared by all clients
 
     red_time_t creation_time;
     red_time_t first_frame_time;
@@ -93,7 +94,10 @@ struct Drawable {
     int surface_deps[3];
 
     uint32_t process_commands_generation;
+    /* time of the input event which preceded the drawing command, 0 if none */
+    red_time_t input_time;
     DisplayChannel *display;
+    uint64_t pending_size; // memory accounted while in the current tree
 };
 
 DisplayChannel*            display_channel_new                       (RedsState *reds,
@@ -117,10 +121,15 @@ void                       display_channel_update                    (DisplayCha
                                                                       QXLRect **qxl_dirty_rects,
                                                                       uint32_t *num_dirty_rects);
 void                       display_channel_free_some                 (DisplayChannel *display);
+void                       display_channel_trim_memory               (DisplayChannel *display);
 void                       display_channel_set_stream_video          (DisplayChannel *display,
                                                                       int stream_video);
 void                       display_channel_set_video_codecs          (DisplayChannel *display,
                                                                       GArray *video_codecs);
+void                       display_channel_set_max_pending_size      (DisplayChannel *display,
+                                                                      uint64_t max_pending_size);
+void                       display_channel_set_render_threads        (DisplayChannel *display,
+                                                                      int n_threads);
 int                        display_channel_get_streams_timeout       (DisplayChannel *display);
 void                       display_channel_compress_stats_print      (DisplayChannel *display);
 void                       display_channel_compress_stats_reset      (DisplayChannel *display);
@@ -39,6 +39,7 @@ static inline void __glz_dictionary_window_reset_images(SharedDictionary *dict)
         dict->window.used_images_head = dict->window.used_images_head->next;
         if (tmp->is_alive) {
             dict->cur_usr->free_image(dict->cur_usr, tmp->usr_context);
+            dict->window.used_bytes -= tmp->bytes;
         }
         tmp->next = dict->window.free_images;
         tmp->is_alive = FALSE;
@@ -55,6 +56,7 @@ static bool glz_dictionary_window_create(SharedDictionary *dict, uint32_t size)
     }
 
     dict->window.size_limit = size;
+    dict->window.max_size_limit = size;
     dict->window.segs = (WindowImageSegment *)(
             dict->cur_usr->malloc(dict->cur_usr, sizeof(WindowImageSegment) * INIT_IMAGE_SEGS_NUM));
 
@@ -76,6 +78,7 @@ static bool glz_dictionary_window_create(SharedDictionary *dict, uint32_t size)
     dict->window.used_images_tail = NULL;
     dict->window.free_images = NULL;
     dict->window.pixels_so_far = 0;
+    dict->window.used_bytes = 0;
 
     return TRUE;
 }
@@ -144,6 +147,9 @@ static inline void glz_dictionary_window_destroy(SharedDictionary *dict)
 /* logic removal only */
 static inline void glz_dictionary_window_kill_image(SharedDictionary *dict, WindowImage *image)
 {
+    if (image->is_alive) {
+        dict->window.used_bytes -= image->bytes;
+    }
     image->is_alive = FALSE;
 }
 
@@ -188,7 +194,7 @@ void glz_enc_dictionary_get_restore_data(GlzEncDictContext *opaque_dict,
 
     out_data->last_image_id = dict->last_image_id;
     out_data->max_encoders = dict->max_encoders;
-    out_data->size = dict->window.size_limit;
+    out_data->size = dict->window.max_size_limit;
 }
 
 GlzEncDictContext *glz_enc_dictionary_restore(GlzEncDictRestoreData *restore_data,
@@ -364,6 +370,7 @@ static inline void __glz_dictionary_window_free_image(SharedDictionary *dict, Wi
 {
     if (image->is_alive) {
         dict->cur_usr->free_image(dict->cur_usr, image->usr_context);
+        dict->window.used_bytes -= image->bytes;
     }
     image->is_alive = FALSE;
     image->next = dict->window.free_images;
@@ -496,6 +503,7 @@ static WindowImage *glz_dictionary_window_add_image(SharedDictionary *dict, LzIm
     WindowImage *image = __glz_dictionary_window_alloc_image(dict);
     image->id = dict->last_image_id++;
     image->size = image_size;
+    image->bytes = image_height * image_stride;
     image->type = image_type;
     image->usr_context = usr_image_context;
 
@@ -548,6 +556,7 @@ static WindowImage *glz_dictionary_window_add_image(SharedDictionary *dict, LzIm
         dict->window.used_segs_tail = seg_id;
     }
     image->is_alive = TRUE;
+    dict->window.used_bytes += image->bytes;
 
     return image;
 }
@@ -636,3 +645,70 @@ void glz_dictionary_post_encode(uint32_t encoder_id, GlzEncoderUsrContext *usr,
     dict->window.encoders_heads[encoder_id] = NULL_IMAGE_SEG_ID;
     pthread_mutex_unlock(&dict->lock);
 }
+
+uint64_t glz_enc_dictionary_get_used_bytes(GlzEncDictContext *opaque_dict)
+{
+    SharedDictionary *dict = (SharedDictionary *)opaque_dict;
+    uint64_t used_bytes;
+
+    if (!opaque_dict) {
+        return 0;
+    }
+    pthread_mutex_lock(&dict->lock);
+    used_bytes = dict->window.used_bytes;
+    pthread_mutex_unlock(&dict->lock);
+    return used_bytes;
+}
+
+uint32_t glz_enc_dictionary_get_used_size(GlzEncDictContext *opaque_dict)
+{
+    SharedDictionary *dict = (SharedDictionary *)opaque_dict;
+    uint32_t used_size = 0;
+
+    if (!opaque_dict) {
+        return 0;
+    }
+    pthread_mutex_lock(&dict->lock);
+    if (dict->window.used_segs_head != NULL_IMAGE_SEG_ID) {
+        used_size = dict->window.segs[dict->window.used_segs_tail].pixels_num +
+            dict->window.segs[dict->window.used_segs_tail].pixels_so_far -
+            dict->window.segs[dict->window.used_segs_head].pixels_so_far;
+    }
+    pthread_mutex_unlock(&dict->lock);
+    return used_size;
+}
+
+/*  NOTE - you should use this routine only when no encoder uses the dictionary. */
+uint32_t glz_enc_dictionary_resize(GlzEncDictContext *opaque_dict, uint32_t size,
+                                   GlzEncoderUsrContext *usr)
+{
+    SharedDictionary *dict = (SharedDictionary *)opaque_dict;
+    WindowImage *new_head;
+    uint32_t cur_win_size;
+
+    pthread_mutex_lock(&dict->lock);
+    dict->cur_usr = usr;
+    GLZ_ASSERT(dict->cur_usr, !glz_dictionary_is_in_use(dict));
+
+    if (size > dict->window.max_size_limit) {
+        size = dict->window.max_size_limit;
+    }
+    dict->window.size_limit = size;
+
+    if (dict->window.used_images_head) {
+        // same as glz_dictionary_window_get_new_head, for an empty new image
+        new_head = dict->window.segs[dict->window.used_segs_head].image;
+        cur_win_size = dict->window.segs[dict->window.used_segs_tail].pixels_num +
+            dict->window.segs[dict->window.used_segs_tail].pixels_so_far -
+            dict->window.segs[dict->window.used_segs_head].pixels_so_far;
+
+        while (new_head && cur_win_size > size) {
+            cur_win_size -= new_head->size;
+            new_head = new_head->next;
+        }
+        glz_dictionary_window_remove_head(dict, 0, new_head);
+    }
+
+    pthread_mutex_unlock(&dict->lock);
+    return size;
+}
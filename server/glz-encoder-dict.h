@@ -50,6 +50,19 @@ void glz_enc_dictionary_destroy(GlzEncDictContext *opaque_dict, GlzEncoderUsrCon
 /* returns the window capacity in pixels */
 uint32_t glz_enc_dictionary_get_size(GlzEncDictContext *);
 
+/* returns the number of pixels currently occupying the window */
+uint32_t glz_enc_dictionary_get_used_size(GlzEncDictContext *);
+
+/* returns the number of bytes of image data the window keeps references to */
+uint64_t glz_enc_dictionary_get_used_bytes(GlzEncDictContext *);
+
+/* changes the window capacity to size pixels (never more than the size the dictionary
+   was created with, which is the window of the decoder) and removes from the window
+   the oldest images that don't fit in it anymore. Returns the new capacity.
+   NOTE - you should use this routine only when no encoder uses the dictionary. */
+uint32_t glz_enc_dictionary_resize(GlzEncDictContext *opaque_dict, uint32_t size,
+                                   GlzEncoderUsrContext *usr);
+
 /* returns the current state of the dictionary.
    NOTE - you should use it only when no encoder uses the dictionary. */
 void glz_enc_dictionary_get_restore_data(GlzEncDictContext *opaque_dict,
@@ -51,6 +51,7 @@ struct WindowImage {
     uint64_t id;
     LzImageType type;
     int size;                    // in pixels
+    uint32_t bytes;              // size of the referenced image data
     uint32_t first_seg;
     GlzUsrImageContext  *usr_context;
     WindowImage*       next;
@@ -111,6 +112,8 @@ struct SharedDictionary {
 
         uint64_t pixels_so_far;
         uint32_t size_limit;                 // max number of pixels in a window (per encoder)
+        uint32_t max_size_limit;             // the size the dictionary was created with
+        uint64_t used_bytes;                 // image data referenced by the alive images
     } window;
 
     /* Concurrency issues: the reading/writing of each entry field should be atomic.
@@ -592,7 +592,15 @@ static void update_next_frame_mm_time(SpiceGstEncoder *encoder)
 static uint64_t get_bit_rate_cap(SpiceGstEncoder *encoder)
 {
     uint32_t raw_frame_bits = encoder->width * encoder->height * encoder->format->bpp;
-    return raw_frame_bits * get_source_fps(encoder) / 10;
+    uint64_t cap = raw_frame_bits * get_source_fps(encoder) / 10;
+
+    /* and what the network is currently estimated to carry */
+    uint64_t estimate = encoder->cbs.get_bit_rate_estimate ?
+        encoder->cbs.get_bit_rate_estimate(encoder->cbs.opaque) : 0;
+    if (estimate) {
+        cap = MIN(cap, MAX(estimate, SPICE_GST_MIN_BITRATE));
+    }
+    return cap;
 }
 
 static void set_bit_rate(SpiceGstEncoder *encoder, uint64_t bit_rate)
@@ -113,6 +113,13 @@ static pixman_image_t *image_cache_get(SpiceImageCache *spice_cache, uint64_t id
     return pixman_image_ref(item->image);
 }
 
+/* Read-only lookup, used to check whether drawing an image will need to
+ * touch the cache */
+bool image_cache_contains(ImageCache *cache, uint64_t id)
+{
+    return image_cache_find(cache, id) != NULL;
+}
+
 void image_cache_init(ImageCache *cache)
 {
     static const SpiceImageCacheOps image_cache_ops = {
@@ -20,6 +20,7 @@
 #define IMAGE_CACHE_H_
 
 #include <inttypes.h>
+#include <stdbool.h>
 #include <common/pixman_utils.h>
 #include <common/canvas_base.h>
 #include <common/ring.h>
@@ -53,6 +54,7 @@ typedef struct ImageCache {
 void         image_cache_init              (ImageCache *cache);
 void         image_cache_reset             (ImageCache *cache);
 void         image_cache_aging             (ImageCache *cache);
+bool         image_cache_contains          (ImageCache *cache, uint64_t id);
 void         image_cache_localize          (ImageCache *cache, SpiceImage **image_ptr,
                                             SpiceImage *image_store, Drawable *drawable);
 void         image_cache_localize_brush    (ImageCache *cache, SpiceBrush *brush,
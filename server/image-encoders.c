@@ -25,6 +25,8 @@
 #include "spice-bitmap-utils.h"
 #include "red-parse-qxl.h" // red_drawable_unref
 #include "pixmap-cache.h" // MAX_CACHE_CLIENTS
+#include "reds.h"
+#include "red-probes.h"
 
 #define ZLIB_DEFAULT_COMPRESSION_LEVEL 3
 
@@ -43,6 +45,8 @@
 typedef struct RedGlzDrawable RedGlzDrawable;
 typedef struct GlzDrawableInstanceItem GlzDrawableInstanceItem;
 
+typedef struct GlzMemoryBudget GlzMemoryBudget;
+
 struct GlzSharedDictionary {
     GlzEncDictContext *dict;
     uint32_t refs;
@@ -50,8 +54,35 @@ struct GlzSharedDictionary {
     pthread_rwlock_t encode_lock;
     int migrate_freeze;
     RedClient *client; // channel clients of the same client share the dict
+    GlzMemoryBudget *budget;
+    uint32_t window_size; // the window of the client, the dict never grows above it
+    red_time_t last_use; // last time an image was encoded with the dict
+};
+
+/* Memory accounting of the dictionaries of all the clients of a server.
+ * When the image data referenced by the dictionaries exceeds the limit set
+ * with spice_server_set_glz_memory_limit() the windows of the least recently
+ * used dictionaries are shrunk, they grow back when the memory is available.
+ * Protected by glz_dictionary_list_lock. */
+struct GlzMemoryBudget {
+    RedsState *reds;
+    uint32_t dicts;
+    red_time_t last_check;
+
+    RedStatNode stat;
+    RedStatCounter used_bytes_counter;
+    RedStatCounter limit_counter;
+    RedStatCounter dicts_counter;
+    RedStatCounter shrinks_counter;
+    RedStatCounter evicted_bytes_counter;
 };
 
+#define GLZ_BUDGET_CHECK_INTERVAL (100 * NSEC_PER_MILLISEC)
+/* dictionaries not used for this long are shrunk first */
+#define GLZ_IDLE_TIMEOUT (10 * NSEC_PER_SEC)
+/* windows are not shrunk below this number of pixels */
+#define GLZ_MIN_WINDOW_SIZE (256 * 1024)
+
 /* for each qxl drawable, there may be several instances of lz drawables */
 /* TODO - reuse this stuff for the top level. I just added a second level of multiplicity
  * at the Drawable by keeping a ring, so:
@@ -697,6 +728,8 @@ static GlzSharedDictionary *glz_shared_dictionary_new(RedClient *client, uint8_t
     shared_dict->refs = 1;
     shared_dict->migrate_freeze = FALSE;
     shared_dict->client = client;
+    shared_dict->window_size = glz_enc_dictionary_get_size(dict);
+    shared_dict->last_use = spice_get_monotonic_time_ns();
     pthread_rwlock_init(&shared_dict->encode_lock, NULL);
 
     return shared_dict;
@@ -704,6 +737,186 @@ static GlzSharedDictionary *glz_shared_dictionary_new(RedClient *client, uint8_t
 
 static pthread_mutex_t glz_dictionary_list_lock = PTHREAD_MUTEX_INITIALIZER;
 static GList *glz_dictionary_list;
+static GList *glz_memory_budgets;
+
+/* NOTE - the caller should hold glz_dictionary_list_lock */
+static void glz_memory_budget_attach(GlzSharedDictionary *shared_dict, RedsState *reds)
+{
+    GlzMemoryBudget *budget = NULL;
+    GList *l;
+
+    if (!reds) {
+        return;
+    }
+
+    for (l = glz_memory_budgets; l != NULL; l = l->next) {
+        if (((GlzMemoryBudget *) l->data)->reds == reds) {
+            budget = l->data;
+            break;
+        }
+    }
+
+    if (!budget) {
+        budget = g_new0(GlzMemoryBudget, 1);
+        budget->reds = reds;
+        stat_init_node(&budget->stat, reds, NULL, "glz_dictionaries", TRUE);
+        stat_init_counter(&budget->used_bytes_counter, reds, &budget->stat, "used_bytes", TRUE);
+        stat_init_counter(&budget->limit_counter, reds, &budget->stat, "limit_bytes", TRUE);
+        stat_init_counter(&budget->dicts_counter, reds, &budget->stat, "dictionaries", TRUE);
+        stat_init_counter(&budget->shrinks_counter, reds, &budget->stat, "shrinks", TRUE);
+        stat_init_counter(&budget->evicted_bytes_counter, reds, &budget->stat,
+                          "evicted_bytes", TRUE);
+        glz_memory_budgets = g_list_prepend(glz_memory_budgets, budget);
+    }
+
+    budget->dicts++;
+    stat_set_counter(budget->dicts_counter, budget->dicts);
+    shared_dict->budget = budget;
+}
+
+/* NOTE - the caller should hold glz_dictionary_list_lock */
+static void glz_memory_budget_detach(GlzSharedDictionary *shared_dict)
+{
+    GlzMemoryBudget *budget = shared_dict->budget;
+
+    if (!budget) {
+        return;
+    }
+    shared_dict->budget = NULL;
+    if (--budget->dicts != 0) {
+        stat_set_counter(budget->dicts_counter, budget->dicts);
+        return;
+    }
+
+    glz_memory_budgets = g_list_remove(glz_memory_budgets, budget);
+    stat_remove_counter(budget->reds, &budget->used_bytes_counter);
+    stat_remove_counter(budget->reds, &budget->limit_counter);
+    stat_remove_counter(budget->reds, &budget->dicts_counter);
+    stat_remove_counter(budget->reds, &budget->shrinks_counter);
+    stat_remove_counter(budget->reds, &budget->evicted_bytes_counter);
+    stat_remove_node(budget->reds, &budget->stat);
+    g_free(budget);
+}
+
+static gint glz_dictionary_compare_last_use(gconstpointer a, gconstpointer b)
+{
+    const GlzSharedDictionary *dict_a = a;
+    const GlzSharedDictionary *dict_b = b;
+
+    if (dict_a->last_use == dict_b->last_use) {
+        return 0;
+    }
+    return dict_a->last_use < dict_b->last_use ? -1 : 1;
+}
+
+/* Shrink or grow a dictionary, skipped if another thread is using it.
+ * Returns the number of bytes released from the window */
+static uint64_t glz_dictionary_try_resize(GlzSharedDictionary *shared_dict, uint32_t size,
+                                          ImageEncoders *enc)
+{
+    uint64_t used_bytes;
+
+    if (pthread_rwlock_trywrlock(&shared_dict->encode_lock) != 0) {
+        return 0;
+    }
+    if (shared_dict->migrate_freeze) {
+        pthread_rwlock_unlock(&shared_dict->encode_lock);
+        return 0;
+    }
+    used_bytes = glz_enc_dictionary_get_used_bytes(shared_dict->dict);
+    /* the images leaving the window are released through glz_usr_free_image,
+     * the ones of other clients are queued to the threads owning them */
+    glz_enc_dictionary_resize(shared_dict->dict, size, &enc->glz_data.usr);
+    used_bytes -= glz_enc_dictionary_get_used_bytes(shared_dict->dict);
+    pthread_rwlock_unlock(&shared_dict->encode_lock);
+    return used_bytes;
+}
+
+/* Bring the memory referenced by the dictionaries of the server under the limit,
+ * shrinking the windows of the least recently used dictionaries first.
+ * NOTE - the caller should hold glz_dictionary_list_lock and must not be
+ * encoding with its own dictionary */
+static void glz_memory_budget_balance(GlzMemoryBudget *budget, ImageEncoders *enc,
+                                      red_time_t now)
+{
+    uint64_t limit = reds_get_glz_memory_limit(budget->reds);
+    uint64_t used_bytes = 0;
+    GList *dicts = NULL, *l;
+
+    for (l = glz_dictionary_list; l != NULL; l = l->next) {
+        GlzSharedDictionary *shared_dict = l->data;
+        if (shared_dict->budget == budget) {
+            used_bytes += glz_enc_dictionary_get_used_bytes(shared_dict->dict);
+            dicts = g_list_prepend(dicts, shared_dict);
+        }
+    }
+    dicts = g_list_sort(dicts, glz_dictionary_compare_last_use);
+
+    if (limit != 0 && used_bytes > limit) {
+        for (l = dicts; l != NULL && used_bytes > limit; l = l->next) {
+            GlzSharedDictionary *shared_dict = l->data;
+            uint64_t dict_bytes = glz_enc_dictionary_get_used_bytes(shared_dict->dict);
+            uint64_t excess = used_bytes - limit;
+            uint64_t size = 0;
+
+            if (dict_bytes == 0) {
+                continue;
+            }
+            /* idle dictionaries go down to the minimal window, the others
+             * drop the oldest images in proportion of the excess. The minimal
+             * window is kept so a client coming back can still use GLZ till
+             * there is room to grow again */
+            if (now - shared_dict->last_use < GLZ_IDLE_TIMEOUT && excess < dict_bytes) {
+                size = glz_enc_dictionary_get_used_size(shared_dict->dict) *
+                       (dict_bytes - excess) / dict_bytes;
+            }
+            size = MAX(size, GLZ_MIN_WINDOW_SIZE);
+            if (size >= glz_enc_dictionary_get_size(shared_dict->dict)) {
+                continue;
+            }
+            uint64_t evicted = glz_dictionary_try_resize(shared_dict, size, enc);
+            if (evicted) {
+                stat_inc_counter(budget->shrinks_counter, 1);
+                stat_inc_counter(budget->evicted_bytes_counter, evicted);
+                used_bytes -= MIN(evicted, used_bytes);
+            }
+        }
+    } else if (limit == 0 || used_bytes < limit / 2) {
+        /* plenty of room, let the most recently used windows grow back */
+        for (l = g_list_last(dicts); l != NULL; l = l->prev) {
+            GlzSharedDictionary *shared_dict = l->data;
+            uint32_t size = glz_enc_dictionary_get_size(shared_dict->dict);
+
+            if (size < shared_dict->window_size) {
+                glz_dictionary_try_resize(shared_dict, MAX(size * 2, GLZ_MIN_WINDOW_SIZE), enc);
+            }
+        }
+    }
+
+    g_list_free(dicts);
+    stat_set_counter(budget->used_bytes_counter, used_bytes);
+    stat_set_counter(budget->limit_counter, limit);
+}
+
+/* NOTE - the caller must not be encoding with its dictionary */
+static void image_encoders_glz_check_budget(ImageEncoders *enc)
+{
+    red_time_t now = spice_get_monotonic_time_ns();
+    GlzSharedDictionary *shared_dict = enc->glz_dict;
+
+    shared_dict->last_use = now;
+    if (!shared_dict->budget ||
+        now - shared_dict->budget->last_check < GLZ_BUDGET_CHECK_INTERVAL) {
+        return;
+    }
+
+    pthread_mutex_lock(&glz_dictionary_list_lock);
+    if (now - shared_dict->budget->last_check >= GLZ_BUDGET_CHECK_INTERVAL) {
+        shared_dict->budget->last_check = now;
+        glz_memory_budget_balance(shared_dict->budget, enc, now);
+    }
+    pthread_mutex_unlock(&glz_dictionary_list_lock);
+}
 
 static GlzSharedDictionary *find_glz_dictionary(RedClient *client, uint8_t dict_id)
 {
@@ -736,6 +949,7 @@ static GlzSharedDictionary *create_glz_dictionary(ImageEncoders *enc,
 }
 
 gboolean image_encoders_get_glz_dictionary(ImageEncoders *enc,
+                                           RedsState *reds,
                                            RedClient *client,
                                            uint8_t id, int window_size)
 {
@@ -751,6 +965,7 @@ gboolean image_encoders_get_glz_dictionary(ImageEncoders *enc,
     } else {
         shared_dict = create_glz_dictionary(enc, client, id, window_size);
         if (shared_dict != NULL) {
+            glz_memory_budget_attach(shared_dict, reds);
             glz_dictionary_list = g_list_prepend(glz_dictionary_list, shared_dict);
         }
     }
@@ -772,6 +987,7 @@ static GlzSharedDictionary *restore_glz_dictionary(ImageEncoders *enc,
 }
 
 gboolean image_encoders_restore_glz_dictionary(ImageEncoders *enc,
+                                               RedsState *reds,
                                                RedClient *client,
                                                uint8_t id,
                                                GlzEncDictRestoreData *restore_data)
@@ -789,6 +1005,7 @@ gboolean image_encoders_restore_glz_dictionary(ImageEncoders *enc,
     } else {
         shared_dict = restore_glz_dictionary(enc, client, id, restore_data);
         if(shared_dict != NULL) {
+            glz_memory_budget_attach(shared_dict, reds);
             glz_dictionary_list = g_list_prepend(glz_dictionary_list, shared_dict);
         }
     }
@@ -825,6 +1042,7 @@ static void image_encoders_release_glz(ImageEncoders *enc)
         return;
     }
     glz_dictionary_list = g_list_remove(glz_dictionary_list, shared_dict);
+    glz_memory_budget_detach(shared_dict);
     pthread_mutex_unlock(&glz_dictionary_list_lock);
     glz_enc_dictionary_destroy(shared_dict->dict, &enc->glz_data.usr);
     pthread_rwlock_destroy(&shared_dict->encode_lock);
@@ -899,6 +1117,8 @@ bool image_encoders_compress_quic(ImageEncoders *enc, SpiceImage *dest,
 
     stat_compress_add(&enc->shared_data->quic_stat, start_time, src->stride * src->y,
                       o_comp_data->comp_buf_size);
+    RED_PROBE6(image_compress, enc, dest->descriptor.type, src->x, src->y,
+               src->stride * src->y, o_comp_data->comp_buf_size);
     return TRUE;
 }
 
@@ -976,6 +1196,8 @@ bool image_encoders_compress_lz(ImageEncoders *enc,
 
     stat_compress_add(&enc->shared_data->lz_stat, start_time, src->stride * src->y,
                       o_comp_data->comp_buf_size);
+    RED_PROBE6(image_compress, enc, dest->descriptor.type, src->x, src->y,
+               src->stride * src->y, o_comp_data->comp_buf_size);
     return TRUE;
 }
 
@@ -1059,6 +1281,8 @@ bool image_encoders_compress_jpeg(ImageEncoders *enc, SpiceImage *dest,
 
         stat_compress_add(&enc->shared_data->jpeg_stat, start_time, src->stride * src->y,
                           o_comp_data->comp_buf_size);
+        RED_PROBE6(image_compress, enc, dest->descriptor.type, src->x, src->y,
+                   src->stride * src->y, o_comp_data->comp_buf_size);
         return TRUE;
     }
 
@@ -1099,6 +1323,8 @@ bool image_encoders_compress_jpeg(ImageEncoders *enc, SpiceImage *dest,
     o_comp_data->is_lossy = TRUE;
     stat_compress_add(&enc->shared_data->jpeg_alpha_stat, start_time, src->stride * src->y,
                       o_comp_data->comp_buf_size);
+    RED_PROBE6(image_compress, enc, dest->descriptor.type, src->x, src->y,
+               src->stride * src->y, o_comp_data->comp_buf_size);
     return TRUE;
 }
 
@@ -1147,6 +1373,8 @@ bool image_encoders_compress_lz4(ImageEncoders *enc, SpiceImage *dest,
 
     stat_compress_add(&enc->shared_data->lz4_stat, start_time, src->stride * src->y,
                       o_comp_data->comp_buf_size);
+    RED_PROBE6(image_compress, enc, dest->descriptor.type, src->x, src->y,
+               src->stride * src->y, o_comp_data->comp_buf_size);
     return TRUE;
 }
 #endif
@@ -1224,13 +1452,17 @@ bool image_encoders_compress_glz(ImageEncoders *enc,
 
     COMPRESS_DEBUG("LZ global compress fmt=%d", src->format);
 
-    if ((src->x * src->y) >= glz_enc_dictionary_get_size(enc->glz_dict->dict)) {
-        return FALSE;
-    }
+    image_encoders_glz_check_budget(enc);
+
+    /* the window accounts the pixels including the stride padding */
+    uint64_t glz_pixels = (uint64_t) src->stride * src->y /
+                          bitmap_fmt_get_bytes_per_pixel(src->format);
 
     pthread_rwlock_rdlock(&enc->glz_dict->encode_lock);
-    /* using the global dictionary only if it is not frozen */
-    if (enc->glz_dict->migrate_freeze) {
+    /* using the global dictionary only if it is not frozen.
+     * The size is checked with the lock held as the window can be shrunk */
+    if (enc->glz_dict->migrate_freeze ||
+        MAX(src->x * src->y, glz_pixels) >= glz_enc_dictionary_get_size(enc->glz_dict->dict)) {
         pthread_rwlock_unlock(&enc->glz_dict->encode_lock);
         return FALSE;
     }
@@ -1292,6 +1524,8 @@ bool image_encoders_compress_glz(ImageEncoders *enc,
     o_comp_data->comp_buf_size = zlib_size;
 
     stat_compress_add(&enc->shared_data->zlib_glz_stat, start_time, glz_size, zlib_size);
+    RED_PROBE6(image_compress, enc, dest->descriptor.type, src->x, src->y,
+               src->stride * src->y, o_comp_data->comp_buf_size);
     pthread_rwlock_unlock(&enc->glz_dict->encode_lock);
     return TRUE;
 
@@ -1304,9 +1538,96 @@ glz:
     o_comp_data->comp_buf = glz_data->data.bufs_head;
     o_comp_data->comp_buf_size = glz_size;
 
+    RED_PROBE6(image_compress, enc, dest->descriptor.type, src->x, src->y,
+               src->stride * src->y, o_comp_data->comp_buf_size);
     return TRUE;
 }
 
+RedSharedImage *red_shared_image_find(RedSharedImage *list, const SpiceBitmap *src,
+                                      uint64_t image_id, SpiceImageCompression compression,
+                                      int jpeg_quality)
+{
+    for (; list; list = list->next) {
+        if (list->src == src && list->image_id == image_id &&
+            list->compression == compression && list->jpeg_quality == jpeg_quality) {
+            return list;
+        }
+    }
+    return NULL;
+}
+
+/* Takes ownership of the compressed buffers in comp_data.
+ * The list holds a reference to the returned image. */
+RedSharedImage *red_shared_image_new(RedSharedImage **list, const SpiceBitmap *src,
+                                     uint64_t image_id, SpiceImageCompression compression,
+                                     int jpeg_quality, const SpiceImage *dest,
+                                     compress_send_data_t *comp_data)
+{
+    RedSharedImage *shared = g_new0(RedSharedImage, 1);
+
+    shared->refs = 1;
+    shared->src = src;
+    shared->image_id = image_id;
+    shared->compression = compression;
+    shared->jpeg_quality = jpeg_quality;
+    shared->dest.descriptor.type = dest->descriptor.type;
+    shared->dest.u = dest->u;
+    shared->data = *comp_data;
+    shared->data.shared = NULL;
+
+    shared->next = *list;
+    *list = shared;
+
+    comp_data->shared = shared;
+    return shared;
+}
+
+void red_shared_image_apply(RedSharedImage *shared, SpiceImage *dest,
+                            compress_send_data_t *o_comp_data)
+{
+    dest->descriptor.type = shared->dest.descriptor.type;
+    dest->u = shared->dest.u;
+    *o_comp_data = shared->data;
+    o_comp_data->shared = shared;
+}
+
+RedSharedImage *red_shared_image_ref(RedSharedImage *shared)
+{
+    shared->refs++;
+    return shared;
+}
+
+void red_shared_image_unref(RedSharedImage *shared)
+{
+    RedCompressBuf *buf;
+
+    if (--shared->refs != 0) {
+        return;
+    }
+    buf = shared->data.comp_buf;
+    while (buf) {
+        RedCompressBuf *next = buf->send_next;
+        compress_buf_free(buf);
+        buf = next;
+    }
+    g_free(shared);
+}
+
+/* Drop the references held by the owner of the list, images still
+ * referenced by pending messages are freed once they are sent */
+void red_shared_images_release(RedSharedImage **list)
+{
+    RedSharedImage *shared = *list;
+
+    *list = NULL;
+    while (shared) {
+        RedSharedImage *next = shared->next;
+        shared->next = NULL;
+        red_shared_image_unref(shared);
+        shared = next;
+    }
+}
+
 void image_encoder_shared_init(ImageEncoderSharedData *shared_data)
 {
     clockid_t stat_clock = CLOCK_THREAD_CPUTIME_ID;
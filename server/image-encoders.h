@@ -77,10 +77,14 @@ static inline void compress_buf_free(RedCompressBuf *buf)
     g_free(buf);
 }
 
+/* reds is used to account the memory of the dictionaries of its clients,
+ * see spice_server_set_glz_memory_limit(), it can be NULL */
 gboolean image_encoders_get_glz_dictionary(ImageEncoders *enc,
+                                           RedsState *reds,
                                            struct RedClient *client,
                                            uint8_t id, int window_size);
 gboolean image_encoders_restore_glz_dictionary(ImageEncoders *enc,
+                                               RedsState *reds,
                                                struct RedClient *client,
                                                uint8_t id,
                                                GlzEncDictRestoreData *restore_data);
@@ -191,13 +195,47 @@ struct ImageEncoders {
     pthread_mutex_t glz_drawables_inst_to_free_lock;
 };
 
+typedef struct RedSharedImage RedSharedImage;
+
 typedef struct compress_send_data_t {
     RedCompressBuf *comp_buf;
     uint32_t comp_buf_size;
     SpicePalette *lzplt_palette;
     gboolean is_lossy;
+    RedSharedImage *shared; // if set, comp_buf is owned by this shared image
 } compress_send_data_t;
 
+/* Compressed payload of an image which can be sent to several clients.
+ * Only the stateless encoders (QUIC, LZ, JPEG, LZ4) produce output that
+ * does not depend on per-client state, GLZ is never shared.
+ * The key is the source bitmap, its image id and the encoding parameters.
+ */
+struct RedSharedImage {
+    RedSharedImage *next;
+    uint32_t refs;
+
+    const SpiceBitmap *src;
+    uint64_t image_id;
+    SpiceImageCompression compression;
+    int jpeg_quality; // 0 if not lossy
+
+    SpiceImage dest; // only descriptor.type and u are meaningful
+    compress_send_data_t data;
+};
+
+RedSharedImage *red_shared_image_find(RedSharedImage *list, const SpiceBitmap *src,
+                                      uint64_t image_id, SpiceImageCompression compression,
+                                      int jpeg_quality);
+RedSharedImage *red_shared_image_new(RedSharedImage **list, const SpiceBitmap *src,
+                                     uint64_t image_id, SpiceImageCompression compression,
+                                     int jpeg_quality, const SpiceImage *dest,
+                                     compress_send_data_t *comp_data);
+void red_shared_image_apply(RedSharedImage *shared, SpiceImage *dest,
+                            compress_send_data_t *o_comp_data);
+RedSharedImage *red_shared_image_ref(RedSharedImage *shared);
+void red_shared_image_unref(RedSharedImage *shared);
+void red_shared_images_release(RedSharedImage **list);
+
 bool image_encoders_compress_quic(ImageEncoders *enc, SpiceImage *dest,
                                   SpiceBitmap *src, compress_send_data_t* o_comp_data);
 bool image_encoders_compress_lz(ImageEncoders *enc, SpiceImage *dest,
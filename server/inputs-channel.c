@@ -20,6 +20,7 @@
 #endif
 
 #include <stddef.h> // NULL
+#include <string.h>
 #include <spice/macros.h>
 #include <spice/vd_agent.h>
 #include <spice/protocol.h>
@@ -39,7 +40,9 @@
 #include "inputs-channel-client.h"
 #include "main-channel-client.h"
 #include "inputs-channel.h"
+#include "main-dispatcher.h"
 #include "migration-protocol.h"
+#include "red-io-thread.h"
 #include "utils.h"
 
 struct InputsChannel
@@ -53,6 +56,10 @@ struct InputsChannel
     SpiceKbdInstance *keyboard;
     SpiceMouseInstance *mouse;
     SpiceTabletInstance *tablet;
+
+    /* thread running the channel, NULL if it runs in the main loop.
+     * The devices are only used from the main thread */
+    RedIOThread *io_thread;
 };
 
 struct InputsChannelClass
@@ -245,24 +252,15 @@ static void inputs_channel_send_item(RedChannelClient *rcc, RedPipeItem *base)
     red_channel_client_begin_send_message(rcc);
 }
 
-static bool inputs_channel_handle_message(RedChannelClient *rcc, uint16_t type,
-                                          uint32_t size, void *message)
+/* Pass a message of the client to the devices, from the main thread */
+static void inputs_channel_handle_device_message(InputsChannel *inputs_channel, uint16_t type,
+                                                 uint32_t size, void *message)
 {
-    InputsChannel *inputs_channel = INPUTS_CHANNEL(red_channel_client_get_channel(rcc));
-    InputsChannelClient *icc = INPUTS_CHANNEL_CLIENT(rcc);
     uint32_t i;
     RedsState *reds = red_channel_get_server(RED_CHANNEL(inputs_channel));
 
     switch (type) {
-    case SPICE_MSGC_INPUTS_KEY_DOWN: {
-        SpiceMsgcKeyDown *key_down = message;
-        if (key_down->code == CAPS_LOCK_SCAN_CODE ||
-            key_down->code == NUM_LOCK_SCAN_CODE ||
-            key_down->code == SCROLL_LOCK_SCAN_CODE) {
-            activate_modifiers_watch(inputs_channel);
-        }
-    }
-        /* fallthrough */
+    case SPICE_MSGC_INPUTS_KEY_DOWN:
     case SPICE_MSGC_INPUTS_KEY_UP: {
         SpiceMsgcKeyUp *key_up = message;
         for (i = 0; i < 4; i++) {
@@ -285,7 +283,6 @@ static bool inputs_channel_handle_message(RedChannelClient *rcc, uint16_t type,
         SpiceMouseInstance *mouse = inputs_channel_get_mouse(inputs_channel);
         SpiceMsgcMouseMotion *mouse_motion = message;
 
-        inputs_channel_client_on_mouse_motion(icc);
         if (mouse && reds_get_mouse_mode(reds) == SPICE_MOUSE_MODE_SERVER) {
             SpiceMouseInterface *sif;
             sif = SPICE_UPCAST(SpiceMouseInterface, mouse->base.sif);
@@ -299,7 +296,6 @@ static bool inputs_channel_handle_message(RedChannelClient *rcc, uint16_t type,
         SpiceMsgcMousePosition *pos = message;
         SpiceTabletInstance *tablet = inputs_channel_get_tablet(inputs_channel);
 
-        inputs_channel_client_on_mouse_motion(icc);
         if (reds_get_mouse_mode(reds) != SPICE_MOUSE_MODE_CLIENT) {
             break;
         }
@@ -396,12 +392,100 @@ static bool inputs_channel_handle_message(RedChannelClient *rcc, uint16_t type,
             kbd_push_scan(keyboard, CAPS_LOCK_SCAN_CODE);
             kbd_push_scan(keyboard, CAPS_LOCK_SCAN_CODE | SCAN_CODE_RELEASE);
         }
-        activate_modifiers_watch(inputs_channel);
         break;
     }
+    default:
+        break;
+    }
+}
+
+typedef struct InputsDeviceMessage {
+    InputsChannel *inputs;
+    uint16_t type;
+    uint32_t size;
+    uint8_t data[0];
+} InputsDeviceMessage;
+
+static void inputs_device_message_handler(void *opaque)
+{
+    InputsDeviceMessage *msg = opaque;
+
+    inputs_channel_handle_device_message(msg->inputs, msg->type, msg->size, msg->data);
+    g_free(msg);
+}
+
+/* size of the parsed message, to copy it to the main thread */
+static size_t inputs_message_parsed_size(uint16_t type, uint32_t size)
+{
+    switch (type) {
+    case SPICE_MSGC_INPUTS_KEY_DOWN:
+        return sizeof(SpiceMsgcKeyDown);
+    case SPICE_MSGC_INPUTS_KEY_UP:
+        return sizeof(SpiceMsgcKeyUp);
+    case SPICE_MSGC_INPUTS_KEY_SCANCODE:
+        return size;
+    case SPICE_MSGC_INPUTS_MOUSE_MOTION:
+        return sizeof(SpiceMsgcMouseMotion);
+    case SPICE_MSGC_INPUTS_MOUSE_POSITION:
+        return sizeof(SpiceMsgcMousePosition);
+    case SPICE_MSGC_INPUTS_MOUSE_PRESS:
+        return sizeof(SpiceMsgcMousePress);
+    case SPICE_MSGC_INPUTS_MOUSE_RELEASE:
+        return sizeof(SpiceMsgcMouseRelease);
+    case SPICE_MSGC_INPUTS_KEY_MODIFIERS:
+        return sizeof(SpiceMsgcKeyModifiers);
+    default:
+        return 0;
+    }
+}
+
+static bool inputs_channel_handle_message(RedChannelClient *rcc, uint16_t type,
+                                          uint32_t size, void *message)
+{
+    InputsChannel *inputs_channel = INPUTS_CHANNEL(red_channel_client_get_channel(rcc));
+    InputsChannelClient *icc = INPUTS_CHANNEL_CLIENT(rcc);
+
+    switch (type) {
+    case SPICE_MSGC_INPUTS_KEY_DOWN: {
+        SpiceMsgcKeyDown *key_down = message;
+        if (key_down->code == CAPS_LOCK_SCAN_CODE ||
+            key_down->code == NUM_LOCK_SCAN_CODE ||
+            key_down->code == SCROLL_LOCK_SCAN_CODE) {
+            activate_modifiers_watch(inputs_channel);
+        }
+        break;
+    }
+    case SPICE_MSGC_INPUTS_KEY_MODIFIERS:
+        activate_modifiers_watch(inputs_channel);
+        break;
+    case SPICE_MSGC_INPUTS_MOUSE_MOTION:
+    case SPICE_MSGC_INPUTS_MOUSE_POSITION:
+        inputs_channel_client_on_mouse_motion(icc);
+        break;
+    case SPICE_MSGC_INPUTS_KEY_UP:
+    case SPICE_MSGC_INPUTS_KEY_SCANCODE:
+    case SPICE_MSGC_INPUTS_MOUSE_PRESS:
+    case SPICE_MSGC_INPUTS_MOUSE_RELEASE:
+        break;
     default:
         return red_channel_client_handle_message(rcc, type, size, message);
     }
+
+    red_input_trace_input(reds_get_input_trace(red_channel_get_server(RED_CHANNEL(inputs_channel))));
+
+    if (!inputs_channel->io_thread) {
+        inputs_channel_handle_device_message(inputs_channel, type, size, message);
+    } else {
+        RedsState *reds = red_channel_get_server(RED_CHANNEL(inputs_channel));
+        size_t parsed_size = inputs_message_parsed_size(type, size);
+        InputsDeviceMessage *msg = g_malloc(sizeof(InputsDeviceMessage) + parsed_size);
+
+        msg->inputs = inputs_channel;
+        msg->type = type;
+        msg->size = size;
+        memcpy(msg->data, message, parsed_size);
+        main_dispatcher_call(reds_get_main_dispatcher(reds), inputs_device_message_handler, msg);
+    }
     return TRUE;
 }
 
@@ -434,49 +518,135 @@ void inputs_release_keys(InputsChannel *inputs)
     }
 }
 
-static void inputs_pipe_add_init(RedChannelClient *rcc)
+static void inputs_pipe_add_init(RedChannelClient *rcc, uint8_t modifiers)
 {
     RedInputsInitPipeItem *item = g_new(RedInputsInitPipeItem, 1);
-    InputsChannel *inputs = INPUTS_CHANNEL(red_channel_client_get_channel(rcc));
 
     red_pipe_item_init(&item->base, RED_PIPE_ITEM_INPUTS_INIT);
-    item->modifiers = kbd_get_leds(inputs_channel_get_keyboard(inputs));
+    item->modifiers = modifiers;
     red_channel_client_pipe_add_push(rcc, &item->base);
 }
 
+typedef struct InputsConnectMessage {
+    RedChannel *channel;
+    RedClient *client;
+    RedStream *stream;
+    RedChannelCapabilities caps;
+    uint8_t modifiers;
+} InputsConnectMessage;
+
+static void inputs_connect_handler(void *opaque)
+{
+    InputsConnectMessage *msg = opaque;
+    RedChannelClient *rcc;
+
+    rcc = inputs_channel_client_create(msg->channel, msg->client, msg->stream, &msg->caps);
+    if (rcc) {
+        inputs_pipe_add_init(rcc, msg->modifiers);
+    }
+    g_object_unref(msg->client);
+    red_channel_capabilities_reset(&msg->caps);
+    g_free(msg);
+}
+
 static void inputs_connect(RedChannel *channel, RedClient *client,
                            RedStream *stream, int migration,
                            RedChannelCapabilities *caps)
 {
-    RedChannelClient *rcc;
+    InputsChannel *inputs = INPUTS_CHANNEL(channel);
+    InputsConnectMessage *msg;
 
     if (!red_stream_is_ssl(stream) && !red_client_during_migrate_at_target(client)) {
         main_channel_client_push_notify(red_client_get_main(client),
                                         "keyboard channel is insecure");
     }
 
-    rcc = inputs_channel_client_create(channel, client, stream, caps);
-    if (!rcc) {
-        return;
+    msg = g_new0(InputsConnectMessage, 1);
+    msg->channel = channel;
+    // the client can be destroyed by the main thread before the I/O thread uses it
+    msg->client = g_object_ref(client);
+    msg->stream = stream;
+    red_channel_capabilities_init(&msg->caps, caps);
+    msg->modifiers = kbd_get_leds(inputs_channel_get_keyboard(inputs));
+
+    if (inputs->io_thread) {
+        red_io_thread_call(inputs->io_thread, inputs_connect_handler, msg, false);
+    } else {
+        inputs_connect_handler(msg);
     }
-    inputs_pipe_add_init(rcc);
 }
 
-static void inputs_migrate(RedChannelClient *rcc)
+static void inputs_disconnect_handler(void *opaque)
+{
+    red_channel_client_disconnect(opaque);
+}
+
+static void inputs_disconnect(RedChannelClient *rcc)
+{
+    InputsChannel *inputs = INPUTS_CHANNEL(red_channel_client_get_channel(rcc));
+
+    // synchronous, the client is destroyed on return (see red_client_destroy)
+    if (inputs->io_thread) {
+        red_io_thread_call(inputs->io_thread, inputs_disconnect_handler, rcc, true);
+    } else {
+        inputs_disconnect_handler(rcc);
+    }
+}
+
+static void inputs_migrate_handler(void *opaque)
 {
+    RedChannelClient *rcc = opaque;
     InputsChannel *inputs = INPUTS_CHANNEL(red_channel_client_get_channel(rcc));
+
     inputs->src_during_migrate = TRUE;
     red_channel_client_default_migrate(rcc);
+    g_object_unref(rcc);
+}
+
+static void inputs_migrate(RedChannelClient *rcc)
+{
+    InputsChannel *inputs = INPUTS_CHANNEL(red_channel_client_get_channel(rcc));
+
+    if (inputs->io_thread) {
+        red_io_thread_call(inputs->io_thread, inputs_migrate_handler, g_object_ref(rcc), false);
+    } else {
+        inputs_migrate_handler(g_object_ref(rcc));
+    }
+}
+
+typedef struct InputsModifiersMessage {
+    InputsChannel *inputs;
+    uint8_t modifiers;
+} InputsModifiersMessage;
+
+static void inputs_push_keyboard_modifiers_handler(void *opaque)
+{
+    InputsModifiersMessage *msg = opaque;
+    InputsChannel *inputs = msg->inputs;
+
+    if (red_channel_is_connected(RED_CHANNEL(inputs)) && !inputs->src_during_migrate) {
+        red_channel_pipes_add(RED_CHANNEL(inputs),
+                              red_inputs_key_modifiers_item_new(msg->modifiers));
+    }
+    g_free(msg);
 }
 
 static void inputs_channel_push_keyboard_modifiers(InputsChannel *inputs, uint8_t modifiers)
 {
-    if (!inputs || !red_channel_is_connected(RED_CHANNEL(inputs)) ||
-        inputs->src_during_migrate) {
+    InputsModifiersMessage *msg;
+
+    if (!inputs) {
         return;
     }
-    red_channel_pipes_add(RED_CHANNEL(inputs),
-                          red_inputs_key_modifiers_item_new(modifiers));
+
+    msg = g_new(InputsModifiersMessage, 1);
+    msg->inputs = inputs;
+    msg->modifiers = modifiers;
+    if (inputs->io_thread) {
+        red_io_thread_call(inputs->io_thread, inputs_push_keyboard_modifiers_handler, msg, false);
+    } else {
+        inputs_push_keyboard_modifiers_handler(msg);
+    }
 }
 
 SPICE_GNUC_VISIBLE int spice_server_kbd_leds(SpiceKbdInstance *sin, int leds)
@@ -485,12 +655,25 @@ SPICE_GNUC_VISIBLE int spice_server_kbd_leds(SpiceKbdInstance *sin, int leds)
     return 0;
 }
 
-static void key_modifiers_sender(void *opaque)
+static void inputs_send_keyboard_leds(void *opaque)
 {
     InputsChannel *inputs = opaque;
     inputs_channel_push_keyboard_modifiers(inputs, kbd_get_leds(inputs_channel_get_keyboard(inputs)));
 }
 
+static void key_modifiers_sender(void *opaque)
+{
+    InputsChannel *inputs = opaque;
+
+    // the leds are read from the keyboard in the main thread
+    if (inputs->io_thread) {
+        RedsState *reds = red_channel_get_server(RED_CHANNEL(inputs));
+        main_dispatcher_call(reds_get_main_dispatcher(reds), inputs_send_keyboard_leds, inputs);
+    } else {
+        inputs_send_keyboard_leds(inputs);
+    }
+}
+
 static bool inputs_channel_handle_migrate_flush_mark(RedChannelClient *rcc)
 {
     red_channel_client_pipe_add_type(rcc, RED_PIPE_ITEM_MIGRATE_DATA);
@@ -525,18 +708,23 @@ static bool inputs_channel_handle_migrate_data(RedChannelClient *rcc,
     return TRUE;
 }
 
-InputsChannel* inputs_channel_new(RedsState *reds)
+InputsChannel* inputs_channel_new(RedsState *reds, RedIOThread *io_thread)
 {
-    return  g_object_new(TYPE_INPUTS_CHANNEL,
-                         "spice-server", reds,
-                         "core-interface", reds_get_core_interface(reds),
-                         "channel-type", (int)SPICE_CHANNEL_INPUTS,
-                         "id", 0,
-                         "handle-acks", FALSE,
-                         "migration-flags",
-                         (guint)(SPICE_MIGRATE_NEED_FLUSH | SPICE_MIGRATE_NEED_DATA_TRANSFER),
-                         NULL);
-
+    InputsChannel *inputs;
+    SpiceCoreInterfaceInternal *core =
+        io_thread ? red_io_thread_get_core(io_thread) : reds_get_core_interface(reds);
+
+    inputs = g_object_new(TYPE_INPUTS_CHANNEL,
+                          "spice-server", reds,
+                          "core-interface", core,
+                          "channel-type", (int)SPICE_CHANNEL_INPUTS,
+                          "id", 0,
+                          "handle-acks", FALSE,
+                          "migration-flags",
+                          (guint)(SPICE_MIGRATE_NEED_FLUSH | SPICE_MIGRATE_NEED_DATA_TRANSFER),
+                          NULL);
+    inputs->io_thread = io_thread;
+    return inputs;
 }
 
 static void
@@ -550,6 +738,7 @@ inputs_channel_constructed(GObject *object)
     G_OBJECT_CLASS(inputs_channel_parent_class)->constructed(object);
 
     client_cbs.connect = inputs_connect;
+    client_cbs.disconnect = inputs_disconnect;
     client_cbs.migrate = inputs_migrate;
     red_channel_register_client_cbs(RED_CHANNEL(self), &client_cbs);
 
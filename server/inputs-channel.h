@@ -26,6 +26,7 @@
 #include <spice/vd_agent.h>
 
 #include "red-channel.h"
+#include "red-io-thread.h"
 
 G_BEGIN_DECLS
 
@@ -44,7 +45,8 @@ typedef struct InputsChannelClass InputsChannelClass;
 
 GType inputs_channel_get_type(void) G_GNUC_CONST;
 
-InputsChannel* inputs_channel_new(RedsState *reds);
+/* io_thread is the thread running the channel, NULL for the main loop */
+InputsChannel* inputs_channel_new(RedsState *reds, RedIOThread *io_thread);
 
 const VDAgentMouseState *inputs_channel_get_mouse_state(InputsChannel *inputs);
 void inputs_channel_set_tablet_logical_size(InputsChannel *inputs, int x_res, int y_res);
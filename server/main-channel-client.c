@@ -40,8 +40,14 @@ typedef enum {
 
 #define CLIENT_CONNECTIVITY_TIMEOUT (MSEC_PER_SEC * 30)
 
-// approximate max receive message size for main channel
-#define MAIN_CHANNEL_RECEIVE_BUF_SIZE \
+// approximate max receive message size for main channel, agent data is
+// received directly in the VDI port buffers so this does not depend on
+// the agent window
+#define MAIN_CHANNEL_RECEIVE_BUF_SIZE (4096 + 11 * SPICE_AGENT_MAX_DATA_SIZE)
+
+// the migration data carry the agent data not yet written to the device,
+// up to a whole agent window, they are allocated when received
+#define MAIN_CHANNEL_MIGRATE_DATA_MAX_SIZE \
     (4096 + (REDS_AGENT_WINDOW_SIZE + REDS_NUM_INTERNAL_AGENT_MESSAGES) * SPICE_AGENT_MAX_DATA_SIZE)
 
 struct MainChannelClientPrivate {
@@ -175,6 +181,11 @@ main_channel_client_alloc_msg_rcv_buf(RedChannelClient *rcc,
     if (type == SPICE_MSGC_MAIN_AGENT_DATA) {
         RedChannel *channel = red_channel_client_get_channel(rcc);
         return reds_get_agent_data_buffer(red_channel_get_server(channel), mcc, size);
+    } else if (type == SPICE_MSGC_MAIN_MIGRATE_DATA) {
+        if (size > MAIN_CHANNEL_MIGRATE_DATA_MAX_SIZE) {
+            return NULL;
+        }
+        return g_malloc(size);
     } else if (size > sizeof(mcc->priv->recv_buf)) {
         /* message too large, caller will log a message and close the connection */
         return NULL;
@@ -190,6 +201,8 @@ main_channel_client_release_msg_rcv_buf(RedChannelClient *rcc,
     if (type == SPICE_MSGC_MAIN_AGENT_DATA) {
         RedChannel *channel = red_channel_client_get_channel(rcc);
         reds_release_agent_data_buffer(red_channel_get_server(channel), msg);
+    } else if (type == SPICE_MSGC_MAIN_MIGRATE_DATA) {
+        g_free(msg);
     }
 }
 
@@ -653,7 +666,7 @@ int main_channel_client_is_network_info_initialized(MainChannelClient *mcc)
 int main_channel_client_is_low_bandwidth(MainChannelClient *mcc)
 {
     // TODO: configurable?
-    return mcc->priv->bitrate_per_sec < 10 * 1024 * 1024;
+    return mcc->priv->bitrate_per_sec < LOW_BANDWIDTH_BIT_RATE;
 }
 
 uint64_t main_channel_client_get_bitrate_per_sec(MainChannelClient *mcc)
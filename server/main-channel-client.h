@@ -95,6 +95,8 @@ void main_channel_client_handle_pong(MainChannelClient *mcc, SpiceMsgPing *ping,
  * If FALSE, bitrate_per_sec is set to MAX_UINT64 and the roundtrip is set to 0
  */
 int main_channel_client_is_network_info_initialized(MainChannelClient *mcc);
+/* bit rate under which a client is considered on a low bandwidth link */
+#define LOW_BANDWIDTH_BIT_RATE (10 * 1024 * 1024)
 int main_channel_client_is_low_bandwidth(MainChannelClient *mcc);
 uint64_t main_channel_client_get_bitrate_per_sec(MainChannelClient *mcc);
 uint64_t main_channel_client_get_roundtrip_ms(MainChannelClient *mcc);
@@ -44,7 +44,12 @@ GType main_channel_get_type(void) G_GNUC_CONST;
 
 // TODO: Defines used to calculate receive buffer size, and also by reds.c
 // other options: is to make a reds_main_consts.h, to duplicate defines.
-#define REDS_AGENT_WINDOW_SIZE 10
+// The agent flow control counts SPICE_AGENT_MAX_DATA_SIZE chunks, the window
+// is given in bytes so that a single client can keep the VDI port busy on
+// links with a high latency (a 1MB window sustains ~100MB/s at 10ms RTT).
+// Older servers use a window of 10 tokens, see SPICE_MIGRATE_DATA_MAIN_VERSION.
+#define REDS_AGENT_WINDOW_BYTES (1024 * 1024)
+#define REDS_AGENT_WINDOW_SIZE (REDS_AGENT_WINDOW_BYTES / SPICE_AGENT_MAX_DATA_SIZE)
 #define REDS_NUM_INTERNAL_AGENT_MESSAGES 1
 
 struct RedsMigSpice {
@@ -126,6 +126,7 @@ enum {
     MAIN_DISPATCHER_MIGRATE_SEAMLESS_DST_COMPLETE,
     MAIN_DISPATCHER_SET_MM_TIME_LATENCY,
     MAIN_DISPATCHER_CLIENT_DISCONNECT,
+    MAIN_DISPATCHER_CALL,
 
     MAIN_DISPATCHER_NUM_MESSAGES
 };
@@ -148,6 +149,11 @@ typedef struct MainDispatcherClientDisconnectMessage {
     RedClient *client;
 } MainDispatcherClientDisconnectMessage;
 
+typedef struct MainDispatcherCallMessage {
+    MainDispatcherFunc func;
+    void *opaque;
+} MainDispatcherCallMessage;
+
 /* channel_event - calls core->channel_event, must be done in main thread */
 static void main_dispatcher_self_handle_channel_event(MainDispatcher *self,
                                                       int event,
@@ -256,6 +262,28 @@ void main_dispatcher_client_disconnect(MainDispatcher *self, RedClient *client)
     }
 }
 
+static void main_dispatcher_handle_call(void *opaque,
+                                        void *payload)
+{
+    MainDispatcherCallMessage *msg = payload;
+
+    msg->func(msg->opaque);
+}
+
+void main_dispatcher_call(MainDispatcher *self, MainDispatcherFunc func, void *opaque)
+{
+    MainDispatcherCallMessage msg;
+
+    if (pthread_self() == dispatcher_get_thread_id(DISPATCHER(self))) {
+        func(opaque);
+        return;
+    }
+
+    msg.func = func;
+    msg.opaque = opaque;
+    dispatcher_send_message(DISPATCHER(self), MAIN_DISPATCHER_CALL, &msg);
+}
+
 static void dispatcher_handle_read(int fd, int event, void *opaque)
 {
     Dispatcher *dispatcher = opaque;
@@ -301,6 +329,9 @@ void main_dispatcher_constructed(GObject *object)
     dispatcher_register_handler(DISPATCHER(self), MAIN_DISPATCHER_CLIENT_DISCONNECT,
                                 main_dispatcher_handle_client_disconnect,
                                 sizeof(MainDispatcherClientDisconnectMessage), false);
+    dispatcher_register_handler(DISPATCHER(self), MAIN_DISPATCHER_CALL,
+                                main_dispatcher_handle_call,
+                                sizeof(MainDispatcherCallMessage), false);
 }
 
 static void main_dispatcher_finalize(GObject *object)
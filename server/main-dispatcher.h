@@ -59,6 +59,14 @@ void main_dispatcher_set_mm_time_latency(MainDispatcher *self, RedClient *client
  */
 void main_dispatcher_client_disconnect(MainDispatcher *self, RedClient *client);
 
+typedef void (*MainDispatcherFunc)(void *opaque);
+/*
+ * Call func(opaque) from the main thread, used to reach the devices from
+ * the channels running in other threads. Asynchronous unless called from
+ * the main thread.
+ */
+void main_dispatcher_call(MainDispatcher *self, MainDispatcherFunc func, void *opaque);
+
 MainDispatcher* main_dispatcher_new(RedsState *reds);
 
 #endif /* MAIN_DISPATCHER_H_ */
@@ -47,9 +47,16 @@ static void print_memslots(RedMemSlotInfo *info)
     }
 }
 
+static void memslot_info_reset_cache(RedMemSlotInfo *info)
+{
+    info->cached_slot = NULL;
+    info->cached_slot_key = 0;
+    info->cached_group_id = -1;
+}
+
 /* return 1 if validation successfull, 0 otherwise */
-int memslot_validate_virt(RedMemSlotInfo *info, unsigned long virt, int slot_id,
-                          uint32_t add_size, uint32_t group_id)
+int memslot_validate_virt_slow(RedMemSlotInfo *info, unsigned long virt, int slot_id,
+                               uint32_t add_size, uint32_t group_id)
 {
     MemSlot *slot;
 
@@ -88,8 +95,8 @@ unsigned long memslot_max_size_virt(RedMemSlotInfo *info,
 /*
  * returns NULL on failure.
  */
-void *memslot_get_virt(RedMemSlotInfo *info, QXLPHYSICAL addr, uint32_t add_size,
-                       int group_id)
+void *memslot_get_virt_slow(RedMemSlotInfo *info, QXLPHYSICAL addr, uint32_t add_size,
+                            int group_id)
 {
     int slot_id;
     int generation;
@@ -124,10 +131,14 @@ void *memslot_get_virt(RedMemSlotInfo *info, QXLPHYSICAL addr, uint32_t add_size
     h_virt = __get_clean_virt(info, addr);
     h_virt += slot->address_delta;
 
-    if (!memslot_validate_virt(info, h_virt, slot_id, add_size, group_id)) {
+    if (!memslot_validate_virt_slow(info, h_virt, slot_id, add_size, group_id)) {
         return NULL;
     }
 
+    info->cached_slot = slot;
+    info->cached_slot_key = addr >> info->memslot_gen_shift;
+    info->cached_group_id = group_id;
+
     return (void*)(uintptr_t)h_virt;
 }
 
@@ -160,6 +171,7 @@ void memslot_info_init(RedMemSlotInfo *info,
     info->memslot_gen_mask = ~((QXLPHYSICAL)-1 << info->generation_bits);
     info->memslot_clean_virt_mask = (((QXLPHYSICAL)(-1)) >>
                                        (info->mem_slot_bits + info->generation_bits));
+    memslot_info_reset_cache(info);
 }
 
 void memslot_info_destroy(RedMemSlotInfo *info)
@@ -183,6 +195,7 @@ void memslot_info_add_slot(RedMemSlotInfo *info, uint32_t slot_group_id, uint32_
     info->mem_slots[slot_group_id][slot_id].virt_start_addr = virt_start;
     info->mem_slots[slot_group_id][slot_id].virt_end_addr = virt_end;
     info->mem_slots[slot_group_id][slot_id].generation = generation;
+    memslot_info_reset_cache(info);
 }
 
 void memslot_info_del_slot(RedMemSlotInfo *info, uint32_t slot_group_id, uint32_t slot_id)
@@ -192,6 +205,7 @@ void memslot_info_del_slot(RedMemSlotInfo *info, uint32_t slot_group_id, uint32_
 
     info->mem_slots[slot_group_id][slot_id].virt_start_addr = 0;
     info->mem_slots[slot_group_id][slot_id].virt_end_addr = 0;
+    memslot_info_reset_cache(info);
 }
 
 void memslot_info_reset(RedMemSlotInfo *info)
@@ -200,4 +214,5 @@ void memslot_info_reset(RedMemSlotInfo *info)
         for (i = 0; i < info->num_memslots_groups; ++i) {
             memset(info->mem_slots[i], 0, sizeof(MemSlot) * info->num_memslots);
         }
+        memslot_info_reset_cache(info);
 }
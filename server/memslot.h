@@ -41,6 +41,12 @@ typedef struct RedMemSlotInfo {
     uint8_t internal_groupslot_id;
     unsigned long memslot_gen_mask;
     unsigned long memslot_clean_virt_mask;
+    /* last successful lookup, reset whenever the slot table changes.
+     * A command and its chunks almost always live in the same slot so
+     * this saves decoding and checking slot id and generation again */
+    const MemSlot *cached_slot;
+    uint64_t cached_slot_key;
+    int cached_group_id;
 } RedMemSlotInfo;
 
 static inline int memslot_get_id(RedMemSlotInfo *info, uint64_t addr)
@@ -53,13 +59,102 @@ static inline int memslot_get_generation(RedMemSlotInfo *info, uint64_t addr)
     return (addr >> info->memslot_gen_shift) & info->memslot_gen_mask;
 }
 
-int memslot_validate_virt(RedMemSlotInfo *info, unsigned long virt, int slot_id,
-                          uint32_t add_size, uint32_t group_id);
+/* check [virt, virt + size) is inside slot without overflowing */
+static inline bool memslot_range_is_valid(const MemSlot *slot, unsigned long virt,
+                                          uint64_t size)
+{
+    return (virt >= slot->virt_start_addr) & (virt <= slot->virt_end_addr) &
+           (size <= slot->virt_end_addr - virt);
+}
+
+int memslot_validate_virt_slow(RedMemSlotInfo *info, unsigned long virt, int slot_id,
+                               uint32_t add_size, uint32_t group_id);
+void *memslot_get_virt_slow(RedMemSlotInfo *info, QXLPHYSICAL addr, uint32_t add_size,
+                            int group_id);
+
+/* return 1 if validation successfull, 0 otherwise */
+static inline int memslot_validate_virt(RedMemSlotInfo *info, unsigned long virt, int slot_id,
+                                        uint32_t add_size, uint32_t group_id)
+{
+    if (G_LIKELY(memslot_range_is_valid(&info->mem_slots[group_id][slot_id], virt, add_size))) {
+        return 1;
+    }
+    /* report the error */
+    return memslot_validate_virt_slow(info, virt, slot_id, add_size, group_id);
+}
+
+/* same as memslot_validate_virt for an array of count elements,
+ * the total size is computed without overflowing */
+static inline int memslot_validate_virt_array(RedMemSlotInfo *info, unsigned long virt,
+                                              int slot_id, uint32_t elem_size,
+                                              uint32_t count, uint32_t group_id)
+{
+    uint64_t size = (uint64_t) elem_size * count;
+
+    if (G_LIKELY(memslot_range_is_valid(&info->mem_slots[group_id][slot_id], virt, size))) {
+        return 1;
+    }
+    if (size > UINT32_MAX) {
+        spice_warning("array too big, virt=0x%lx elem_size=%u count=%u",
+                      virt, elem_size, count);
+        return 0;
+    }
+    return memslot_validate_virt_slow(info, virt, slot_id, size, group_id);
+}
+
 unsigned long memslot_max_size_virt(RedMemSlotInfo *info,
                                     unsigned long virt, int slot_id,
                                     uint32_t group_id);
-void *memslot_get_virt(RedMemSlotInfo *info, QXLPHYSICAL addr, uint32_t add_size,
-                       int group_id);
+
+/*
+ * returns NULL on failure.
+ * Addresses in the same slot as the previous successful call only
+ * need a range check, anything else goes through memslot_get_virt_slow
+ * which also reports errors.
+ */
+static inline void *memslot_get_virt(RedMemSlotInfo *info, QXLPHYSICAL addr, uint32_t add_size,
+                                     int group_id)
+{
+    const MemSlot *slot = info->cached_slot;
+
+    /* slot id and generation are the top bits of the address */
+    if (G_LIKELY(slot != NULL &&
+                 info->cached_slot_key == (addr >> info->memslot_gen_shift) &&
+                 info->cached_group_id == group_id)) {
+        unsigned long h_virt = (addr & info->memslot_clean_virt_mask) + slot->address_delta;
+        if (G_LIKELY(memslot_range_is_valid(slot, h_virt, add_size))) {
+            return (void*)(uintptr_t)h_virt;
+        }
+    }
+    return memslot_get_virt_slow(info, addr, add_size, group_id);
+}
+
+/*
+ * Translates a QXLDataChunk and validates both the header and its data.
+ * The data size is read from guest memory only once and returned in
+ * data_size, callers must use that value and not qxl->data_size.
+ * returns NULL on failure.
+ */
+static inline QXLDataChunk *memslot_get_data_chunk(RedMemSlotInfo *info, QXLPHYSICAL addr,
+                                                   int group_id, uint32_t *data_size)
+{
+    QXLDataChunk *qxl;
+    uint32_t size;
+
+    qxl = (QXLDataChunk *)memslot_get_virt(info, addr, sizeof(*qxl), group_id);
+    if (qxl == NULL) {
+        return NULL;
+    }
+    size = qxl->data_size;
+    /* the header was just validated so the slot is the cached one */
+    if (G_LIKELY(memslot_range_is_valid(info->cached_slot, (uintptr_t)qxl->data, size))) {
+        *data_size = size;
+        return qxl;
+    }
+    memslot_validate_virt_slow(info, (uintptr_t)qxl->data, memslot_get_id(info, addr),
+                               size, group_id);
+    return NULL;
+}
 
 void memslot_info_init(RedMemSlotInfo *info,
                        uint32_t num_groups, uint32_t num_slots,
@@ -30,7 +30,7 @@
 
 /* increase the version when the version of any
  * of the migration data messages is increased */
-#define SPICE_MIGRATION_PROTOCOL_VERSION 1
+#define SPICE_MIGRATION_PROTOCOL_VERSION 2
 
 typedef struct __attribute__ ((__packed__)) SpiceMigrateDataHeader {
     uint32_t magic;
@@ -85,8 +85,12 @@ typedef struct __attribute__ ((__packed__)) SpiceMigrateDataSmartcard {
 /* *********************************
  * main channel (mainly guest agent)
  * *********************************/
-#define SPICE_MIGRATE_DATA_MAIN_VERSION 1 /* NOTE: increase version when CHAR_DEVICE_VERSION
+#define SPICE_MIGRATE_DATA_MAIN_VERSION 2 /* NOTE: increase version when CHAR_DEVICE_VERSION
                                              is increased */
+/* Version 2: the agent client tokens window is REDS_AGENT_WINDOW_SIZE instead
+ * of 10 tokens, so the client can hold more tokens and more agent data can be
+ * pending than an older dest handles. Such a dest refuses the seamless
+ * migration from this version (see SPICE_MIGRATION_PROTOCOL_VERSION). */
 #define SPICE_MIGRATE_DATA_MAIN_MAGIC SPICE_MAGIC_CONST("MNMD")
 
 typedef struct __attribute__ ((__packed__)) SpiceMigrateDataMain {
@@ -117,7 +121,7 @@ typedef struct __attribute__ ((__packed__)) SpiceMigrateDataMain {
  * display channel
  * ***************/
 
-#define SPICE_MIGRATE_DATA_DISPLAY_VERSION 1
+#define SPICE_MIGRATE_DATA_DISPLAY_VERSION 2 /* version 2 added pixmap_cache_index_ptr */
 #define SPICE_MIGRATE_DATA_DISPLAY_MAGIC SPICE_MAGIC_CONST("DCMD")
 
 /*
@@ -134,9 +138,14 @@ typedef struct __attribute__ ((__packed__)) SpiceMigrateDataDisplay {
 
     /*
      * Synchronizing the shared pixmap cache.
-     * For now, the cache is not migrated, and instead, we reset it and send
-     * SPICE_MSG_DISPLAY_INVAL_ALL_PIXMAPS to the client.
-     * In order to keep the client and server caches consistent:
+     * The channel which froze the cache on the src side sends the index of
+     * the cache (see pixmap_cache_index_ptr), so that the dest can keep using
+     * the images which are at the client. The dest starts a new generation
+     * of the cache with a SPICE_MSG_WAIT_FOR_CHANNELS, so that the client
+     * handles the releases sent by the src before the messages of the dest.
+     * Without the index (older src, or an invalid index), we reset the cache
+     * and send SPICE_MSG_DISPLAY_INVAL_ALL_PIXMAPS to the client.
+     * In order to keep the client and server caches consistent on reset:
      * The channel which froze the cache on the src side, unfreezes it
      * on the dest side, and increases its generation (see 'reset' in red_client_shared_cach.h).
      * In order to enforce that images that are added to the cache by other channels
@@ -156,7 +165,8 @@ typedef struct __attribute__ ((__packed__)) SpiceMigrateDataDisplay {
                                         Lossy: when jpeg-wan-compression(qemu cmd line)=always
                                         or when jpeg-wan-compression=auto,
                                         and low_bandwidth_setting=TRUE */
-
+    uint32_t pixmap_cache_index_ptr; /* reference to MigrateDisplayPixmapCacheIndex,
+                                        since version 2 */
 } SpiceMigrateDataDisplay;
 
 typedef struct __attribute__ ((__packed__)) SpiceMigrateDataRect {
@@ -185,6 +195,18 @@ typedef struct __attribute__ ((__packed__)) MigrateDisplaySurfacesAtClientLossy
     MigrateDisplaySurfaceLossy surfaces[0];
 } MigrateDisplaySurfacesAtClientLossy;
 
+/* cache items, from the least to the most recently used */
+typedef struct __attribute__ ((__packed__)) MigrateDisplayPixmapCacheItem {
+    uint64_t id;
+    uint32_t size;
+    uint8_t lossy;
+} MigrateDisplayPixmapCacheItem;
+
+typedef struct __attribute__ ((__packed__)) MigrateDisplayPixmapCacheIndex {
+    uint32_t num_items; /* 0 if the channel is not the freezer of the cache */
+    MigrateDisplayPixmapCacheItem items[0];
+} MigrateDisplayPixmapCacheIndex;
+
 /* ****************
  * inputs channel
  * ***************/
@@ -344,6 +344,13 @@ static inline uint32_t mjpeg_encoder_get_source_fps(MJpegEncoder *encoder)
         encoder->cbs.get_source_fps(encoder->cbs.opaque) : MJPEG_MAX_FPS;
 }
 
+/* in bytes per second, 0 if unknown */
+static inline uint64_t mjpeg_encoder_get_byte_rate_estimate(MJpegEncoder *encoder)
+{
+    return encoder->cbs.get_bit_rate_estimate ?
+        encoder->cbs.get_bit_rate_estimate(encoder->cbs.opaque) / 8 : 0;
+}
+
 static inline uint32_t mjpeg_encoder_get_latency(MJpegEncoder *encoder)
 {
     return encoder->cbs.get_roundtrip_ms ?
@@ -1114,7 +1121,14 @@ static void mjpeg_encoder_increase_bit_rate(MJpegEncoder *encoder)
     if (measured_byte_rate + increase_size < rate_control->byte_rate) {
         spice_debug("measured byte rate is small: not upgrading, just re-evaluating");
     } else {
-        rate_control->byte_rate = MIN(measured_byte_rate, rate_control->byte_rate) + increase_size;
+        uint64_t estimate = mjpeg_encoder_get_byte_rate_estimate(encoder);
+        uint64_t byte_rate = MIN(measured_byte_rate, rate_control->byte_rate) + increase_size;
+
+        /* don't go over what the network is known to carry */
+        if (estimate) {
+            byte_rate = MIN(byte_rate, MAX(estimate, rate_control->byte_rate));
+        }
+        rate_control->byte_rate = byte_rate;
     }
 
     bit_rate_info->change_start_time = 0;
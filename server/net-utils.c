@@ -141,3 +141,67 @@ int red_socket_get_no_delay(int fd)
 
     return delay_val;
 }
+
+/**
+ * red_socket_get_tcp_info:
+ * @fd: a socket file descriptor
+ * @info: filled with the kernel TCP statistics of @fd
+ *
+ * Does not print any warning as it is expected to fail for
+ * non TCP sockets.
+ *
+ * Returns: #true if the operation succeeded, #false otherwise.
+ */
+bool red_socket_get_tcp_info(int fd, RedSocketTcpInfo *info)
+{
+#if defined(TCP_INFO) && !defined(_WIN32)
+    struct tcp_info tcp_info;
+    socklen_t opt_size = sizeof(tcp_info);
+
+    /* older kernels can return a shorter structure */
+    memset(&tcp_info, 0, sizeof(tcp_info));
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &tcp_info, &opt_size) == -1) {
+        return false;
+    }
+
+    info->rtt_us = tcp_info.tcpi_rtt;
+#ifdef HAVE_TCP_INFO_DELIVERY_RATE
+    info->delivery_rate = tcp_info.tcpi_delivery_rate;
+    info->notsent_bytes = tcp_info.tcpi_notsent_bytes;
+    info->bytes_acked = tcp_info.tcpi_bytes_acked;
+#else
+    info->delivery_rate = 0;
+    info->notsent_bytes = 0;
+    info->bytes_acked = 0;
+#endif
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+ * red_socket_set_notsent_lowat:
+ * @fd: a socket file descriptor
+ * @bytes: maximum amount of data not sent yet the kernel will accept
+ *
+ * Once @bytes are waiting to be sent in the kernel @fd is no longer
+ * writable, keeping data in the application where it can still be
+ * replaced by newer one.
+ *
+ * Returns: #true if the operation succeeded, #false otherwise.
+ */
+bool red_socket_set_notsent_lowat(int fd, int bytes)
+{
+#ifdef TCP_NOTSENT_LOWAT
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes, sizeof(bytes)) == -1) {
+        if (errno != ENOTSUP && errno != ENOPROTOOPT) {
+            spice_warning("setsockopt for TCP_NOTSENT_LOWAT failed, %s", strerror(errno));
+        }
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
@@ -19,10 +19,22 @@
 #define RED_NET_UTILS_H_
 
 #include <stdbool.h>
+#include <stdint.h>
+
+typedef struct RedSocketTcpInfo {
+    uint32_t rtt_us;
+    /* bytes per second, 0 if not available */
+    uint64_t delivery_rate;
+    uint32_t notsent_bytes;
+    /* total bytes acknowledged by the peer, 0 if not available */
+    uint64_t bytes_acked;
+} RedSocketTcpInfo;
 
 bool red_socket_set_keepalive(int fd, bool enable, int timeout);
 bool red_socket_set_no_delay(int fd, bool no_delay);
 int red_socket_get_no_delay(int fd);
 bool red_socket_set_non_blocking(int fd, bool non_blocking);
+bool red_socket_get_tcp_info(int fd, RedSocketTcpInfo *info);
+bool red_socket_set_notsent_lowat(int fd, int bytes);
 
 #endif /* RED_NET_UTILS_H_ */
@@ -18,6 +18,9 @@
 #include <config.h>
 #endif
 
+#include <inttypes.h>
+#include <string.h>
+
 #include "pixmap-cache.h"
 
 int pixmap_cache_unlocked_set_lossy(PixmapCache *cache, uint64_t id, int lossy)
@@ -77,6 +80,80 @@ bool pixmap_cache_freeze(PixmapCache *cache)
     return TRUE;
 }
 
+/* Add the index of the frozen cache to the display migration data, see
+ * MigrateDisplayPixmapCacheIndex. The index is empty if the cache is not frozen. */
+void pixmap_cache_marshall_frozen_index(PixmapCache *cache, SpiceMarshaller *m)
+{
+    uint32_t num_items = 0;
+    uint8_t *num_items_ptr;
+    RingItem *link;
+
+    num_items_ptr = spice_marshaller_reserve_space(m, sizeof(uint32_t));
+    pthread_mutex_lock(&cache->lock);
+    if (cache->frozen) {
+        /* the frozen list is still linked to the (reinitialized) lru ring head,
+         * walk it from the tail to send the least recently used items first */
+        for (link = cache->frozen_tail; link != &cache->lru; link = link->prev) {
+            NewCacheItem *item = SPICE_CONTAINEROF(link, NewCacheItem, lru_link);
+
+            spice_marshaller_add_uint64(m, item->id);
+            spice_marshaller_add_uint32(m, item->size);
+            spice_marshaller_add_uint8(m, item->lossy);
+            num_items++;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    spice_marshaller_set_uint32(m, num_items_ptr, num_items);
+}
+
+/* Rebuild an empty cache from the index of the migration data. The cache is
+ * cleared if the index is not valid. */
+bool pixmap_cache_unlocked_restore_index(PixmapCache *cache,
+                                         const MigrateDisplayPixmapCacheItem *items,
+                                         uint32_t num_items, int64_t size)
+{
+    int64_t available = size;
+    uint32_t i;
+
+    if (cache->items || cache->frozen) {
+        return FALSE;
+    }
+    for (i = 0; i < num_items; i++) {
+        const MigrateDisplayPixmapCacheItem *mig_item = &items[i];
+        NewCacheItem *item;
+        int key = BITS_CACHE_HASH_KEY(mig_item->id);
+
+        for (item = cache->hash_table[key]; item; item = item->next) {
+            if (item->id == mig_item->id) {
+                break;
+            }
+        }
+        available -= mig_item->size;
+        if (item || mig_item->size == 0 || available < 0) {
+            spice_warning("invalid pixmap cache item %" PRIu64, mig_item->id);
+            cache->size = size;
+            pixmap_cache_clear(cache);
+            return FALSE;
+        }
+
+        item = g_new(NewCacheItem, 1);
+        item->next = cache->hash_table[key];
+        cache->hash_table[key] = item;
+        ring_item_init(&item->lru_link);
+        ring_add(&cache->lru, &item->lru_link);
+        item->id = mig_item->id;
+        item->size = mig_item->size;
+        item->lossy = mig_item->lossy;
+        /* all the serials of the src were sent before the migration data,
+         * so releasing with the latest ones is always safe */
+        memcpy(item->sync, cache->sync, sizeof(item->sync));
+        cache->items++;
+    }
+    cache->size = size;
+    cache->available = available;
+    return TRUE;
+}
+
 static void pixmap_cache_destroy(PixmapCache *cache)
 {
     spice_assert(cache);
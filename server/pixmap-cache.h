@@ -19,9 +19,14 @@
 #ifndef PIXMAP_CACHE_H_
 #define PIXMAP_CACHE_H_
 
+#include <common/marshaller.h>
+
 #include "red-channel.h"
+#include "migration-protocol.h"
 
-#define MAX_CACHE_CLIENTS 4
+/* Maximum number of display channels of the same client sharing a cache.
+ * Only the first MIGRATE_DATA_DISPLAY_MAX_CACHE_CLIENTS are migrated. */
+#define MAX_CACHE_CLIENTS 16
 
 #define BITS_CACHE_HASH_SHIFT 10
 #define BITS_CACHE_HASH_SIZE (1 << BITS_CACHE_HASH_SHIFT)
@@ -70,5 +75,9 @@ void         pixmap_cache_unref(PixmapCache *cache);
 void         pixmap_cache_clear(PixmapCache *cache);
 int          pixmap_cache_unlocked_set_lossy(PixmapCache *cache, uint64_t id, int lossy);
 bool         pixmap_cache_freeze(PixmapCache *cache);
+void         pixmap_cache_marshall_frozen_index(PixmapCache *cache, SpiceMarshaller *m);
+bool         pixmap_cache_unlocked_restore_index(PixmapCache *cache,
+                                                 const MigrateDisplayPixmapCacheItem *items,
+                                                 uint32_t num_items, int64_t size);
 
 #endif /* PIXMAP_CACHE_H_ */
@@ -37,6 +37,10 @@
 
 #include "red-channel-client.h"
 #include "red-client.h"
+#include "red-message-stats.h"
+#include "red-input-trace.h"
+#include "red-probes.h"
+#include "reds.h"
 #include "glib-compat.h"
 
 #define CLIENT_ACK_WINDOW 20
@@ -105,6 +109,7 @@ typedef struct RedChannelClientConnectivityMonitor {
 typedef struct OutgoingMessageBuffer {
     int pos;
     int size;
+    red_time_t start_time;
 } OutgoingMessageBuffer;
 
 typedef struct IncomingMessageBuffer {
@@ -137,6 +142,15 @@ struct RedChannelClientPrivate
         int blocked;
         uint64_t last_sent_serial;
 
+        /* accounting of the message being sent */
+        red_time_t item_queue_time;
+        red_time_t item_input_time;
+        int64_t compression_saved; /* bytes saved by compression, not yet accounted */
+        uint16_t msg_type;
+        uint64_t msg_uncompressed_size;
+        red_time_t msg_queue_time;
+        red_time_t msg_input_time; /* see RedInputTrace */
+
         struct {
             SpiceMarshaller *marshaller;
             uint8_t *header_data;
@@ -165,6 +179,7 @@ struct RedChannelClientPrivate
 
     RedStatCounter out_messages;
     RedStatCounter out_bytes;
+    RedMessageStats *message_stats;
 };
 
 static const SpiceDataHeaderOpaque full_header_wrapper;
@@ -355,6 +370,9 @@ red_channel_client_finalize(GObject *object)
         spice_marshaller_destroy(self->priv->send_data.urgent.marshaller);
     }
 
+    red_message_stats_free(self->priv->message_stats);
+    self->priv->message_stats = NULL;
+
     red_channel_capabilities_reset(&self->priv->remote_caps);
     if (self->priv->channel) {
         g_object_unref(self->priv->channel);
@@ -394,6 +412,11 @@ static void red_channel_client_constructed(GObject *object)
     const RedStatNode *node = red_channel_get_stat_node(channel);
     stat_init_counter(&self->priv->out_messages, reds, node, "out_messages", TRUE);
     stat_init_counter(&self->priv->out_bytes, reds, node, "out_bytes", TRUE);
+
+    uint32_t type, id;
+    g_object_get(channel, "channel-type", &type, "id", &id, NULL);
+    self->priv->message_stats = red_message_stats_new(reds, node, self->priv->client,
+                                                      type, id);
 }
 
 static void red_channel_client_class_init(RedChannelClientClass *klass)
@@ -592,7 +615,11 @@ static void red_channel_client_send_empty_msg(RedChannelClient *rcc, RedPipeItem
 static void red_channel_client_send_item(RedChannelClient *rcc, RedPipeItem *item)
 {
     spice_assert(red_channel_client_no_item_being_sent(rcc));
+    RED_PROBE3(pipe_send, rcc, item->type, item->queue_time);
     red_channel_client_reset_send_data(rcc);
+    rcc->priv->send_data.item_queue_time = item->queue_time;
+    rcc->priv->send_data.item_input_time = item->input_time;
+    rcc->priv->send_data.compression_saved = 0;
     switch (item->type) {
         case RED_PIPE_ITEM_TYPE_SET_ACK:
             red_channel_client_send_set_ack(rcc);
@@ -626,6 +653,16 @@ static void red_channel_client_msg_sent(RedChannelClient *rcc)
 {
     int fd;
 
+    red_message_stats_add(rcc->priv->message_stats,
+                          rcc->priv->send_data.msg_type,
+                          rcc->priv->send_data.size,
+                          rcc->priv->send_data.msg_uncompressed_size,
+                          spice_get_monotonic_time_ns() - rcc->priv->send_data.msg_queue_time);
+    if (rcc->priv->send_data.msg_input_time) {
+        RedsState *reds = red_channel_get_server(rcc->priv->channel);
+        red_input_trace_sent(reds_get_input_trace(reds), rcc->priv->send_data.msg_input_time);
+    }
+
     if (spice_marshaller_get_fd(rcc->priv->send_data.marshaller, &fd)) {
         if (red_stream_send_msgfd(rcc->priv->stream, fd) < 0) {
             perror("sendfd");
@@ -1078,6 +1115,7 @@ static void red_channel_client_handle_outgoing(RedChannelClient *rcc)
         if (!buffer->size) {  // nothing to be sent
             return;
         }
+        buffer->start_time = spice_get_monotonic_time_ns();
     }
 
     for (;;) {
@@ -1105,6 +1143,7 @@ static void red_channel_client_handle_outgoing(RedChannelClient *rcc)
             buffer->pos += n;
             red_channel_client_data_sent(rcc, n);
             if (buffer->pos == buffer->size) { // finished writing data
+                red_stream_net_sample(stream, buffer->size, buffer->start_time);
                 /* reset buffer before calling on_msg_done, since it
                  * can trigger another call to red_channel_client_handle_outgoing (when
                  * switching from the urgent marshaller to the main one */
@@ -1495,8 +1534,10 @@ void red_channel_client_begin_send_message(RedChannelClient *rcc)
 {
     SpiceMarshaller *m = rcc->priv->send_data.marshaller;
 
+    uint16_t msg_type = rcc->priv->send_data.header.get_msg_type(&rcc->priv->send_data.header);
+
     // TODO - better check: type in channel_allowed_types. Better: type in channel_allowed_types(channel_state)
-    if (rcc->priv->send_data.header.get_msg_type(&rcc->priv->send_data.header) == 0) {
+    if (msg_type == 0) {
         red_channel_warning(red_channel_client_get_channel(rcc), "BUG: header->type == 0");
         return;
     }
@@ -1508,6 +1549,19 @@ void red_channel_client_begin_send_message(RedChannelClient *rcc)
 
     spice_marshaller_flush(m);
     rcc->priv->send_data.size = spice_marshaller_get_total_size(m);
+
+    rcc->priv->send_data.msg_type = msg_type;
+    rcc->priv->send_data.msg_uncompressed_size = rcc->priv->send_data.size;
+    /* the compressed data belongs to the main message, the urgent one
+     * only carries the sub messages */
+    if (!red_channel_client_urgent_marshaller_is_active(rcc)) {
+        rcc->priv->send_data.msg_uncompressed_size += rcc->priv->send_data.compression_saved;
+        rcc->priv->send_data.compression_saved = 0;
+    }
+    rcc->priv->send_data.msg_queue_time = rcc->priv->send_data.item_queue_time ?
+        rcc->priv->send_data.item_queue_time : spice_get_monotonic_time_ns();
+    rcc->priv->send_data.msg_input_time = rcc->priv->send_data.item_input_time;
+
     rcc->priv->send_data.header.set_msg_size(&rcc->priv->send_data.header,
                                              rcc->priv->send_data.size -
                                              rcc->priv->send_data.header.header_size);
@@ -1518,6 +1572,13 @@ void red_channel_client_begin_send_message(RedChannelClient *rcc)
     red_channel_client_send(rcc);
 }
 
+void red_channel_client_add_compressed_data(RedChannelClient *rcc,
+                                            uint32_t compressed_size,
+                                            uint64_t uncompressed_size)
+{
+    rcc->priv->send_data.compression_saved += (int64_t) uncompressed_size - compressed_size;
+}
+
 SpiceMarshaller *red_channel_client_switch_to_urgent_sender(RedChannelClient *rcc)
 {
     spice_assert(red_channel_client_no_item_being_sent(rcc));
@@ -1551,6 +1612,8 @@ static inline gboolean prepare_pipe_add(RedChannelClient *rcc, RedPipeItem *item
         red_channel_client_watch_update_mask(rcc,
                                              SPICE_WATCH_EVENT_READ | SPICE_WATCH_EVENT_WRITE);
     }
+    item->queue_time = spice_get_monotonic_time_ns();
+    RED_PROBE3(pipe_add, rcc, item->type, g_queue_get_length(&rcc->priv->pipe));
     return TRUE;
 }
 
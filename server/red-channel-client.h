@@ -47,6 +47,11 @@ bool red_channel_client_handle_message(RedChannelClient *rcc, uint16_t type,
                                        uint32_t size, void *message);
 /* when preparing send_data: should call init and then use marshaller */
 void red_channel_client_init_send_data(RedChannelClient *rcc, uint16_t msg_type);
+/* account data compressed into the message being prepared, used to report
+ * the uncompressed size of the messages in the statistics */
+void red_channel_client_add_compressed_data(RedChannelClient *rcc,
+                                            uint32_t compressed_size,
+                                            uint64_t uncompressed_size);
 
 uint64_t red_channel_client_get_message_serial(RedChannelClient *channel);
 
@@ -22,6 +22,7 @@
 #include "red-channel.h"
 #include "red-client.h"
 #include "reds.h"
+#include "red-probes.h"
 
 #define FOREACH_CHANNEL_CLIENT(_client, _data) \
     GLIST_FOREACH((_client ? (_client)->channels : NULL), RedChannelClient, _data)
@@ -276,6 +277,7 @@ gboolean red_client_add_channel(RedClient *client, RedChannelClient *rcc, GError
     }
 
     client->channels = g_list_prepend(client->channels, rcc);
+    RED_PROBE4(client_connect, client, rcc, type, id);
     if (client->during_target_migrate && client->seamless_migrate) {
         if (red_channel_client_set_migration_seamless(rcc)) {
             client->num_migrated_channels++;
@@ -328,6 +330,7 @@ int red_client_during_migrate_at_target(RedClient *client)
 void red_client_remove_channel(RedChannelClient *rcc)
 {
     RedClient *client = red_channel_client_get_client(rcc);
+    RED_PROBE2(client_disconnect, client, rcc);
     pthread_mutex_lock(&client->lock);
     client->channels = g_list_remove(client->channels, rcc);
     pthread_mutex_unlock(&client->lock);
@@ -0,0 +1,132 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2019 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <common/recorder.h>
+
+#include "red-input-trace.h"
+#include "red-probes.h"
+
+/* upper bounds of the histogram buckets, in ms, the last bucket
+ * holds the higher latencies */
+static const unsigned int latency_buckets_ms[] = { 16, 33, 50, 100, 200 };
+#define N_LATENCY_BUCKETS (G_N_ELEMENTS(latency_buckets_ms) + 1)
+
+struct RedInputTrace {
+    pthread_mutex_t lock;
+    red_time_t pending_input;   /* last input not given to a command yet */
+    red_time_t last_sent_input; /* last input accounted */
+    red_time_t max_latency;
+
+    RedStatNode stat;
+    RedStatCounter events_counter;
+    RedStatCounter total_latency_counter;
+    RedStatCounter max_latency_counter;
+    RedStatCounter bucket_counters[N_LATENCY_BUCKETS];
+};
+
+RECORDER(input_latency, 64, "Input to display latency");
+
+RedInputTrace *red_input_trace_new(RedsState *reds)
+{
+    RedInputTrace *trace = g_new0(RedInputTrace, 1);
+    char name[16];
+    unsigned int i;
+
+    pthread_mutex_init(&trace->lock, NULL);
+
+    stat_init_node(&trace->stat, reds, NULL, "input_latency", TRUE);
+    stat_init_counter(&trace->events_counter, reds, &trace->stat, "events", TRUE);
+    stat_init_counter(&trace->total_latency_counter, reds, &trace->stat, "total_us", TRUE);
+    stat_init_counter(&trace->max_latency_counter, reds, &trace->stat, "max_us", TRUE);
+    for (i = 0; i < G_N_ELEMENTS(latency_buckets_ms); i++) {
+        snprintf(name, sizeof(name), "lt_%ums", latency_buckets_ms[i]);
+        stat_init_counter(&trace->bucket_counters[i], reds, &trace->stat, name, TRUE);
+    }
+    snprintf(name, sizeof(name), "ge_%ums", latency_buckets_ms[i - 1]);
+    stat_init_counter(&trace->bucket_counters[i], reds, &trace->stat, name, TRUE);
+
+    return trace;
+}
+
+void red_input_trace_free(RedInputTrace *trace)
+{
+    if (!trace) {
+        return;
+    }
+    pthread_mutex_destroy(&trace->lock);
+    g_free(trace);
+}
+
+void red_input_trace_input(RedInputTrace *trace)
+{
+    red_time_t now = spice_get_monotonic_time_ns();
+
+    pthread_mutex_lock(&trace->lock);
+    /* the latency is measured from the oldest event still waiting */
+    if (!trace->pending_input) {
+        trace->pending_input = now;
+    }
+    pthread_mutex_unlock(&trace->lock);
+}
+
+red_time_t red_input_trace_take(RedInputTrace *trace)
+{
+    red_time_t input_time;
+
+    pthread_mutex_lock(&trace->lock);
+    input_time = trace->pending_input;
+    trace->pending_input = 0;
+    pthread_mutex_unlock(&trace->lock);
+
+    return input_time;
+}
+
+void red_input_trace_sent(RedInputTrace *trace, red_time_t input_time)
+{
+    red_time_t latency;
+    unsigned int bucket;
+
+    pthread_mutex_lock(&trace->lock);
+    if (input_time <= trace->last_sent_input) {
+        pthread_mutex_unlock(&trace->lock);
+        return;
+    }
+    trace->last_sent_input = input_time;
+    latency = spice_get_monotonic_time_ns() - input_time;
+
+    for (bucket = 0; bucket < G_N_ELEMENTS(latency_buckets_ms); bucket++) {
+        if (latency < latency_buckets_ms[bucket] * NSEC_PER_MILLISEC) {
+            break;
+        }
+    }
+    stat_inc_counter(trace->events_counter, 1);
+    stat_inc_counter(trace->total_latency_counter, latency / NSEC_PER_MICROSEC);
+    stat_inc_counter(trace->bucket_counters[bucket], 1);
+    if (latency > trace->max_latency) {
+        trace->max_latency = latency;
+        stat_set_counter(trace->max_latency_counter, latency / NSEC_PER_MICROSEC);
+    }
+    pthread_mutex_unlock(&trace->lock);
+
+    record(input_latency, "Input to display latency %" PRId64 " us",
+           latency / NSEC_PER_MICROSEC);
+    RED_PROBE2(input_latency, trace, latency);
+}
@@ -0,0 +1,53 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2019 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RED_INPUT_TRACE_H_
+#define RED_INPUT_TRACE_H_
+
+#include <glib.h>
+
+#include "red-common.h"
+#include "stat.h"
+
+G_BEGIN_DECLS
+
+/* Measure of the time between an input event of the client and the first
+ * display message resulting from it fully written to the socket.
+ * The input events are stamped by the inputs channel, the time of the last
+ * one is given to the next drawing command processed by a worker, and
+ * carried by the pipe items of its drawable up to the end of their write.
+ * Can be used from any thread. */
+typedef struct RedInputTrace RedInputTrace;
+
+RedInputTrace *red_input_trace_new(RedsState *reds);
+void red_input_trace_free(RedInputTrace *trace);
+
+/* An input event was received from the client */
+void red_input_trace_input(RedInputTrace *trace);
+
+/* Take the time of the last input event not yet given to a drawing
+ * command, 0 if there is none */
+red_time_t red_input_trace_take(RedInputTrace *trace);
+
+/* A message resulting from the input event received at input_time was
+ * fully written. Only the first message of each event is accounted */
+void red_input_trace_sent(RedInputTrace *trace, red_time_t input_time);
+
+G_END_DECLS
+
+#endif /* RED_INPUT_TRACE_H_ */
@@ -0,0 +1,195 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2019 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <signal.h>
+
+#include "red-io-thread.h"
+#include "dispatcher.h"
+
+// compatibility for FreeBSD
+#ifdef HAVE_PTHREAD_NP_H
+#include <pthread_np.h>
+#define pthread_setname_np pthread_set_name_np
+#endif
+
+enum {
+    RED_IO_THREAD_MESSAGE_CALL,
+    RED_IO_THREAD_MESSAGE_CALL_SYNC,
+    RED_IO_THREAD_MESSAGE_CLOSE,
+
+    RED_IO_THREAD_MESSAGE_COUNT
+};
+
+typedef struct RedIOThreadMessageCall {
+    RedIOThreadFunc func;
+    void *opaque;
+} RedIOThreadMessageCall;
+
+typedef struct RedIOThreadMessageClose {
+} RedIOThreadMessageClose;
+
+struct RedIOThread {
+    pthread_t thread;
+    bool running;
+    SpiceCoreInterfaceInternal core;
+    GMainLoop *loop;
+    Dispatcher *dispatcher;
+    SpiceWatch *dispatch_watch;
+};
+
+static void handle_call(void *opaque, void *payload)
+{
+    RedIOThreadMessageCall *msg = payload;
+
+    msg->func(msg->opaque);
+}
+
+static void handle_close(void *opaque, void *payload)
+{
+    RedIOThread *thread = opaque;
+
+    g_main_loop_quit(thread->loop);
+}
+
+static void handle_dispatcher_input(int fd, int event, void *opaque)
+{
+    Dispatcher *dispatcher = opaque;
+
+    dispatcher_handle_recv_read(dispatcher);
+}
+
+RedIOThread *red_io_thread_new(void)
+{
+    RedIOThread *thread = g_new0(RedIOThread, 1);
+
+    thread->core = event_loop_core;
+    thread->core.main_context = g_main_context_new();
+    thread->loop = g_main_loop_new(thread->core.main_context, FALSE);
+
+    thread->dispatcher = dispatcher_new(RED_IO_THREAD_MESSAGE_COUNT);
+    dispatcher_set_opaque(thread->dispatcher, thread);
+    dispatcher_register_handler(thread->dispatcher, RED_IO_THREAD_MESSAGE_CALL,
+                                handle_call, sizeof(RedIOThreadMessageCall), false);
+    dispatcher_register_handler(thread->dispatcher, RED_IO_THREAD_MESSAGE_CALL_SYNC,
+                                handle_call, sizeof(RedIOThreadMessageCall), true);
+    dispatcher_register_handler(thread->dispatcher, RED_IO_THREAD_MESSAGE_CLOSE,
+                                handle_close, sizeof(RedIOThreadMessageClose), false);
+
+    thread->dispatch_watch =
+        thread->core.watch_add(&thread->core, dispatcher_get_recv_fd(thread->dispatcher),
+                               SPICE_WATCH_EVENT_READ, handle_dispatcher_input,
+                               thread->dispatcher);
+    spice_assert(thread->dispatch_watch != NULL);
+
+    return thread;
+}
+
+static void *red_io_thread_main(void *arg)
+{
+    RedIOThread *thread = arg;
+
+    spice_debug("begin");
+    g_main_loop_run(thread->loop);
+    spice_debug("end");
+
+    return NULL;
+}
+
+bool red_io_thread_run(RedIOThread *thread)
+{
+    sigset_t thread_sig_mask;
+    sigset_t curr_sig_mask;
+    int r;
+
+    spice_return_val_if_fail(!thread->running, FALSE);
+
+    sigfillset(&thread_sig_mask);
+    sigdelset(&thread_sig_mask, SIGILL);
+    sigdelset(&thread_sig_mask, SIGFPE);
+    sigdelset(&thread_sig_mask, SIGSEGV);
+    pthread_sigmask(SIG_SETMASK, &thread_sig_mask, &curr_sig_mask);
+    if ((r = pthread_create(&thread->thread, NULL, red_io_thread_main, thread))) {
+        spice_warning("create thread failed %d", r);
+    }
+    pthread_sigmask(SIG_SETMASK, &curr_sig_mask, NULL);
+    if (r) {
+        return FALSE;
+    }
+    pthread_setname_np(thread->thread, "SPICE I/O");
+    thread->running = TRUE;
+
+    return TRUE;
+}
+
+void red_io_thread_stop(RedIOThread *thread)
+{
+    RedIOThreadMessageClose message;
+
+    if (!thread->running) {
+        return;
+    }
+    dispatcher_send_message(thread->dispatcher, RED_IO_THREAD_MESSAGE_CLOSE, &message);
+    pthread_join(thread->thread, NULL);
+    thread->running = FALSE;
+}
+
+void red_io_thread_free(RedIOThread *thread)
+{
+    if (!thread) {
+        return;
+    }
+
+    red_io_thread_stop(thread);
+    thread->core.watch_remove(&thread->core, thread->dispatch_watch);
+    g_object_unref(thread->dispatcher);
+    g_main_loop_unref(thread->loop);
+    g_main_context_unref(thread->core.main_context);
+    g_free(thread);
+}
+
+SpiceCoreInterfaceInternal *red_io_thread_get_core(RedIOThread *thread)
+{
+    return &thread->core;
+}
+
+bool red_io_thread_is_current(RedIOThread *thread)
+{
+    return thread->running && pthread_equal(pthread_self(), thread->thread);
+}
+
+void red_io_thread_call(RedIOThread *thread, RedIOThreadFunc func, void *opaque, bool wait)
+{
+    RedIOThreadMessageCall msg;
+
+    /* before the thread is started nothing else can use its channels */
+    if (!thread->running || red_io_thread_is_current(thread)) {
+        func(opaque);
+        return;
+    }
+
+    msg.func = func;
+    msg.opaque = opaque;
+    dispatcher_send_message(thread->dispatcher,
+                            wait ? RED_IO_THREAD_MESSAGE_CALL_SYNC : RED_IO_THREAD_MESSAGE_CALL,
+                            &msg);
+}
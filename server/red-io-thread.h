@@ -0,0 +1,54 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2019 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RED_IO_THREAD_H_
+#define RED_IO_THREAD_H_
+
+#include <glib.h>
+
+#include "red-common.h"
+
+G_BEGIN_DECLS
+
+/* Thread owned by the server running its own event loop, used by the
+ * channels which must not depend on the load of the main loop of the
+ * application (see spice_server_set_io_thread()).
+ * The channels using it are created with the core interface returned by
+ * red_io_thread_get_core() and must reach it through red_io_thread_call()
+ * from other threads. */
+typedef struct RedIOThread RedIOThread;
+
+typedef void (*RedIOThreadFunc)(void *opaque);
+
+RedIOThread *red_io_thread_new(void);
+bool red_io_thread_run(RedIOThread *thread);
+/* Stop and join the thread. The channels using it can then be destroyed
+ * from the main thread, before freeing the thread */
+void red_io_thread_stop(RedIOThread *thread);
+void red_io_thread_free(RedIOThread *thread);
+
+SpiceCoreInterfaceInternal *red_io_thread_get_core(RedIOThread *thread);
+bool red_io_thread_is_current(RedIOThread *thread);
+
+/* Call func(opaque) from the I/O thread. If wait is true, return only once
+ * func has returned. Called from the I/O thread func is called directly */
+void red_io_thread_call(RedIOThread *thread, RedIOThreadFunc func, void *opaque, bool wait);
+
+G_END_DECLS
+
+#endif /* RED_IO_THREAD_H_ */
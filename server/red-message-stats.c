@@ -0,0 +1,169 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2019 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <pthread.h>
+
+#include "red-message-stats.h"
+#include "red-client.h"
+#include "main-channel-client.h"
+#include "reds.h"
+
+typedef struct MessageTypeStats {
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t uncompressed_bytes;
+    red_time_t total_latency;
+    red_time_t max_latency;
+
+    /* counters in the stat file, created on the first message of this type */
+    RedStatNode node;
+    RedStatCounter messages_counter;
+    RedStatCounter bytes_counter;
+    RedStatCounter uncompressed_counter;
+    RedStatCounter latency_counter;
+} MessageTypeStats;
+
+struct RedMessageStats {
+    pthread_mutex_t lock;
+    RedsState *reds;
+    const RedStatNode *parent;
+    RedClient *client;
+    uint32_t connection_id;
+    uint8_t channel_type;
+    uint8_t channel_id;
+    GArray *types; /* MessageTypeStats, indexed by message type */
+};
+
+RedMessageStats *red_message_stats_new(RedsState *reds, const RedStatNode *parent,
+                                       RedClient *client,
+                                       uint8_t channel_type, uint8_t channel_id)
+{
+    RedMessageStats *stats = g_new0(RedMessageStats, 1);
+
+    pthread_mutex_init(&stats->lock, NULL);
+    stats->reds = reds;
+    stats->parent = parent;
+    stats->client = client;
+    /* the main channel client is set once before the other channels are
+     * created, only the main channel itself has to look it up later */
+    MainChannelClient *mcc = client ? red_client_get_main(client) : NULL;
+    stats->connection_id = mcc ? main_channel_client_get_connection_id(mcc) : 0;
+    stats->channel_type = channel_type;
+    stats->channel_id = channel_id;
+    stats->types = g_array_new(FALSE, TRUE, sizeof(MessageTypeStats));
+
+    reds_register_message_stats(reds, stats);
+    return stats;
+}
+
+void red_message_stats_free(RedMessageStats *stats)
+{
+    if (!stats) {
+        return;
+    }
+
+    reds_unregister_message_stats(stats->reds, stats);
+
+    /* the counters in the stat file are shared with the other clients
+     * of the channel so are left in place */
+    g_array_free(stats->types, TRUE);
+    pthread_mutex_destroy(&stats->lock);
+    g_free(stats);
+}
+
+static void message_type_stats_init_counters(RedMessageStats *stats,
+                                             MessageTypeStats *type_stats,
+                                             uint16_t msg_type)
+{
+    char name[32];
+
+    snprintf(name, sizeof(name), "msg_%u", msg_type);
+    stat_init_node(&type_stats->node, stats->reds, stats->parent, name, TRUE);
+    stat_init_counter(&type_stats->messages_counter, stats->reds, &type_stats->node,
+                      "messages", TRUE);
+    stat_init_counter(&type_stats->bytes_counter, stats->reds, &type_stats->node,
+                      "bytes", TRUE);
+    stat_init_counter(&type_stats->uncompressed_counter, stats->reds, &type_stats->node,
+                      "uncompressed", TRUE);
+    stat_init_counter(&type_stats->latency_counter, stats->reds, &type_stats->node,
+                      "latency_us", TRUE);
+}
+
+void red_message_stats_add(RedMessageStats *stats, uint16_t msg_type,
+                           uint32_t size, uint64_t uncompressed_size,
+                           red_time_t latency)
+{
+    MessageTypeStats *type_stats;
+
+    if (latency < 0) {
+        latency = 0;
+    }
+
+    pthread_mutex_lock(&stats->lock);
+    if (msg_type >= stats->types->len) {
+        g_array_set_size(stats->types, msg_type + 1);
+    }
+    type_stats = &g_array_index(stats->types, MessageTypeStats, msg_type);
+    if (type_stats->messages == 0) {
+        message_type_stats_init_counters(stats, type_stats, msg_type);
+    }
+    type_stats->messages++;
+    type_stats->bytes += size;
+    type_stats->uncompressed_bytes += uncompressed_size;
+    type_stats->total_latency += latency;
+    type_stats->max_latency = MAX(type_stats->max_latency, latency);
+
+    stat_inc_counter(type_stats->messages_counter, 1);
+    stat_inc_counter(type_stats->bytes_counter, size);
+    stat_inc_counter(type_stats->uncompressed_counter, uncompressed_size);
+    stat_inc_counter(type_stats->latency_counter, latency / NSEC_PER_MICROSEC);
+    pthread_mutex_unlock(&stats->lock);
+}
+
+void red_message_stats_collect(RedMessageStats *stats, GArray *out)
+{
+    unsigned int msg_type;
+
+    if (stats->connection_id == 0 && stats->client) {
+        MainChannelClient *mcc = red_client_get_main(stats->client);
+        stats->connection_id = mcc ? main_channel_client_get_connection_id(mcc) : 0;
+    }
+
+    pthread_mutex_lock(&stats->lock);
+    for (msg_type = 0; msg_type < stats->types->len; msg_type++) {
+        const MessageTypeStats *type_stats =
+            &g_array_index(stats->types, MessageTypeStats, msg_type);
+        SpiceMessageStats out_stats;
+
+        if (type_stats->messages == 0) {
+            continue;
+        }
+        out_stats.connection_id = stats->connection_id;
+        out_stats.channel_type = stats->channel_type;
+        out_stats.channel_id = stats->channel_id;
+        out_stats.message_type = msg_type;
+        out_stats.messages = type_stats->messages;
+        out_stats.bytes = type_stats->bytes;
+        out_stats.uncompressed_bytes = type_stats->uncompressed_bytes;
+        out_stats.total_latency_us = type_stats->total_latency / NSEC_PER_MICROSEC;
+        out_stats.max_latency_us = type_stats->max_latency / NSEC_PER_MICROSEC;
+        g_array_append_val(out, out_stats);
+    }
+    pthread_mutex_unlock(&stats->lock);
+}
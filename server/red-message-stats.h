@@ -0,0 +1,53 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2019 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RED_MESSAGE_STATS_H_
+#define RED_MESSAGE_STATS_H_
+
+#include <glib.h>
+
+#include "red-channel.h"
+#include "stat.h"
+#include "utils.h"
+
+G_BEGIN_DECLS
+
+/* Per message type accounting of the messages sent by a channel client.
+ * Updated from the thread of the channel client, read from the main
+ * thread through spice_server_get_message_stats() */
+typedef struct RedMessageStats RedMessageStats;
+
+RedMessageStats *red_message_stats_new(RedsState *reds, const RedStatNode *parent,
+                                       RedClient *client,
+                                       uint8_t channel_type, uint8_t channel_id);
+void red_message_stats_free(RedMessageStats *stats);
+
+/* Account a message fully written to the socket.
+ * size is the number of bytes on the wire (header included),
+ * uncompressed_size what it would have been without image/data compression,
+ * latency the time between the pipe add and the end of the write */
+void red_message_stats_add(RedMessageStats *stats, uint16_t msg_type,
+                           uint32_t size, uint64_t uncompressed_size,
+                           red_time_t latency);
+
+/* Append a SpiceMessageStats for each message type sent so far to out */
+void red_message_stats_collect(RedMessageStats *stats, GArray *out);
+
+G_END_DECLS
+
+#endif /* RED_MESSAGE_STATS_H_ */
@@ -141,8 +141,8 @@ static size_t red_get_data_chunks_ptr(RedMemSlotInfo *slots, int group_id,
             goto error;
         }
 
-        memslot_id = memslot_get_id(slots, next_chunk);
-        qxl = (QXLDataChunk *)memslot_get_virt(slots, next_chunk, sizeof(*qxl), group_id);
+        /* validates both chunk header and data */
+        qxl = memslot_get_data_chunk(slots, next_chunk, group_id, &chunk_data_size);
         if (qxl == NULL) {
             goto error;
         }
@@ -153,7 +153,6 @@ static size_t red_get_data_chunks_ptr(RedMemSlotInfo *slots, int group_id,
          * All above cases are handled by the check for number
          * of chunks.
          */
-        chunk_data_size = qxl->data_size;
         if (chunk_data_size == 0)
             continue;
 
@@ -170,8 +169,6 @@ static size_t red_get_data_chunks_ptr(RedMemSlotInfo *slots, int group_id,
             spice_warning("too much data inside chunks, avoiding DoS");
             goto error;
         }
-        if (!memslot_validate_virt(slots, (intptr_t)red->data, memslot_id, red->data_size, group_id))
-            goto error;
     }
 
     red->next_chunk = NULL;
@@ -510,9 +507,9 @@ static SpiceImage *red_get_image(RedMemSlotInfo *slots, int group_id,
                 goto error;
             }
             num_ents = qp->num_ents;
-            if (!memslot_validate_virt(slots, (intptr_t)qp->ents,
-                                       memslot_get_id(slots, palette),
-                                       num_ents * sizeof(qp->ents[0]), group_id)) {
+            if (!memslot_validate_virt_array(slots, (intptr_t)qp->ents,
+                                             memslot_get_id(slots, palette),
+                                             sizeof(qp->ents[0]), num_ents, group_id)) {
                 goto error;
             }
             rp = g_malloc(num_ents * sizeof(rp->ents[0]) + sizeof(*rp));
@@ -821,13 +818,10 @@ static void red_put_rop3(SpiceRop3 *red)
     red_put_qmask(&red->mask);
 }
 
+/* the path is read by red_drawable_parse_data */
 static bool red_get_stroke_ptr(RedMemSlotInfo *slots, int group_id,
                                SpiceStroke *red, QXLStroke *qxl, uint32_t flags)
 {
-    red->path = red_get_path(slots, group_id, qxl->path);
-    if (!red->path) {
-        return false;
-    }
     red->attr.flags       = qxl->attr.flags;
     if (red->attr.flags & SPICE_LINE_FLAGS_STYLED) {
         int style_nseg;
@@ -954,10 +948,10 @@ static SpiceString *red_get_string(RedMemSlotInfo *slots, int group_id,
     return red;
 }
 
+/* the string is read by red_drawable_parse_data */
 static void red_get_text_ptr(RedMemSlotInfo *slots, int group_id,
                              SpiceText *red, QXLText *qxl, uint32_t flags)
 {
-   red->str = red_get_string(slots, group_id, qxl->str);
    red_get_rect_ptr(&red->back_area, &qxl->back_area);
    red_get_brush_ptr(slots, group_id, &red->fore_brush, &qxl->fore_brush, flags);
    red_get_brush_ptr(slots, group_id, &red->back_brush, &qxl->back_brush, flags);
@@ -1070,8 +1064,10 @@ static bool red_get_native_drawable(QXLInstance *qxl_instance, RedMemSlotInfo *s
         red_get_composite_ptr(slots, group_id, &red->u.composite, &qxl->u.composite, flags);
         break;
     case QXL_DRAW_STROKE:
+        red->lazy_data = qxl->u.stroke.path;
         return red_get_stroke_ptr(slots, group_id, &red->u.stroke, &qxl->u.stroke, flags);
     case QXL_DRAW_TEXT:
+        red->lazy_data = qxl->u.text.str;
         red_get_text_ptr(slots, group_id, &red->u.text, &qxl->u.text, flags);
         break;
     case QXL_DRAW_TRANSPARENT:
@@ -1153,8 +1149,10 @@ static bool red_get_compat_drawable(QXLInstance *qxl_instance, RedMemSlotInfo *s
         red_get_rop3_ptr(slots, group_id, &red->u.rop3, &qxl->u.rop3, flags);
         break;
     case QXL_DRAW_STROKE:
+        red->lazy_data = qxl->u.stroke.path;
         return red_get_stroke_ptr(slots, group_id, &red->u.stroke, &qxl->u.stroke, flags);
     case QXL_DRAW_TEXT:
+        red->lazy_data = qxl->u.text.str;
         red_get_text_ptr(slots, group_id, &red->u.text, &qxl->u.text, flags);
         break;
     case QXL_DRAW_TRANSPARENT:
@@ -1239,7 +1237,7 @@ static void red_put_drawable(RedDrawable *red)
 
 RedDrawable *red_drawable_new(QXLInstance *qxl, RedMemSlotInfo *slots,
                               int group_id, QXLPHYSICAL addr,
-                              uint32_t flags)
+                              uint32_t flags, bool lazy)
 {
     RedDrawable *red = g_new0(RedDrawable, 1);
 
@@ -1250,9 +1248,41 @@ RedDrawable *red_drawable_new(QXLInstance *qxl, RedMemSlotInfo *slots,
        return NULL;
     }
 
+    red->lazy_slots = slots;
+    red->lazy_group_id = group_id;
+    if (!lazy && !red_drawable_parse_data(red)) {
+       red_drawable_unref(red);
+       return NULL;
+    }
+
     return red;
 }
 
+bool red_drawable_parse_data(RedDrawable *red)
+{
+    if (red->lazy_slots != NULL) {
+        switch (red->type) {
+        case QXL_DRAW_STROKE:
+            red->u.stroke.path = red_get_path(red->lazy_slots, red->lazy_group_id,
+                                              red->lazy_data);
+            break;
+        case QXL_DRAW_TEXT:
+            red->u.text.str = red_get_string(red->lazy_slots, red->lazy_group_id,
+                                             red->lazy_data);
+            break;
+        }
+        red->lazy_slots = NULL;
+    }
+
+    switch (red->type) {
+    case QXL_DRAW_STROKE:
+        return red->u.stroke.path != NULL;
+    case QXL_DRAW_TEXT:
+        return red->u.text.str != NULL;
+    }
+    return true;
+}
+
 RedDrawable *red_drawable_ref(RedDrawable *drawable)
 {
     drawable->refs++;
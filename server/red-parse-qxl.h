@@ -39,6 +39,11 @@ typedef struct RedDrawable {
     uint32_t mm_time;
     int32_t surface_deps[3];
     SpiceRect surfaces_rects[3];
+    /* guest data not parsed yet (path of a stroke or string of a text),
+     * see red_drawable_parse_data */
+    RedMemSlotInfo *lazy_slots;
+    int lazy_group_id;
+    QXLPHYSICAL lazy_data;
     union {
         SpiceFill fill;
         SpiceOpaque opaque;
@@ -117,9 +122,16 @@ typedef struct RedCursorCmd {
 
 void red_get_rect_ptr(SpiceRect *red, const QXLRect *qxl);
 
+/* if lazy is set the data which is expensive to parse and not needed to
+ * add the drawable to the tree is only read by red_drawable_parse_data.
+ * The guest memory is owned by the server till the drawable is released */
 RedDrawable *red_drawable_new(QXLInstance *qxl, RedMemSlotInfo *slots,
                               int group_id, QXLPHYSICAL addr,
-                              uint32_t flags);
+                              uint32_t flags, bool lazy);
+/* parse the data left by lazy parsing if any, must be called before
+ * rendering or sending the drawable.
+ * returns false if the data is invalid and the drawable must be ignored */
+bool red_drawable_parse_data(RedDrawable *red);
 RedDrawable *red_drawable_ref(RedDrawable *drawable);
 void red_drawable_unref(RedDrawable *red_drawable);
 
@@ -44,6 +44,8 @@ void red_pipe_item_init_full(RedPipeItem *item,
 {
     item->type = type;
     item->refcount = 1;
+    item->queue_time = 0;
+    item->input_time = 0;
     item->free_func = free_func ? free_func : (red_pipe_item_free_t *)g_free;
 }
 
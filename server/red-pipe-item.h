@@ -31,6 +31,8 @@ struct RedPipeItem {
 
     /* private */
     int refcount;
+    int64_t queue_time; /* monotonic time (ns) of the last add to a pipe */
+    int64_t input_time; /* time of the input event the item results from, 0 if none */
 
     red_pipe_item_free_t *free_func;
 };
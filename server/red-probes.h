@@ -0,0 +1,80 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2019 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RED_PROBES_H_
+#define RED_PROBES_H_
+
+/* Static tracepoints (USDT) of the server, in the "spice_server" provider.
+ *
+ * When the server is built with USDT support each probe is a single nop
+ * instruction plus a note in the ELF file describing where its arguments
+ * are, so they can be attached at run time without rebuilding, e.g.
+ *
+ *   bpftrace -e 'usdt:libspice-server.so.1:spice_server:stream_writev
+ *                { @[arg2 < 0] = count(); }'
+ *   perf probe -x libspice-server.so.1 sdt_spice_server:pipe_add
+ *
+ * The arguments are always evaluated, so only pass values which are
+ * already at hand. Without USDT support the probes expand to nothing.
+ *
+ * Probes (arguments):
+ *   dispatcher_send(dispatcher, type, size)
+ *   dispatcher_handle(dispatcher, type, size)
+ *   qxl_command_fetch(worker, type, address)
+ *   qxl_command_parse(worker, type, ok)
+ *   tree_insert(drawable, surface_id, effect)
+ *   tree_insert_done(drawable, add_to_pipe)
+ *   tree_exclude(display, frame_candidate)
+ *   image_compress(encoders, image_type, width, height, orig_size, compressed_size)
+ *   video_encode(dcc, stream_id, width, height, result, frame_size)
+ *   pipe_add(rcc, item_type, pipe_size)
+ *   pipe_send(rcc, item_type, queue_time) (CLOCK_MONOTONIC, in ns)
+ *   stream_writev(stream, iovcnt, result)
+ *   client_connect(client, rcc, channel_type, channel_id)
+ *   client_disconnect(client, rcc)
+ *   input_latency(trace, latency) (in ns)
+ */
+
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+
+#define RED_PROBE0(name) \
+    DTRACE_PROBE(spice_server, name)
+#define RED_PROBE1(name, a1) \
+    DTRACE_PROBE1(spice_server, name, a1)
+#define RED_PROBE2(name, a1, a2) \
+    DTRACE_PROBE2(spice_server, name, a1, a2)
+#define RED_PROBE3(name, a1, a2, a3) \
+    DTRACE_PROBE3(spice_server, name, a1, a2, a3)
+#define RED_PROBE4(name, a1, a2, a3, a4) \
+    DTRACE_PROBE4(spice_server, name, a1, a2, a3, a4)
+#define RED_PROBE5(name, a1, a2, a3, a4, a5) \
+    DTRACE_PROBE5(spice_server, name, a1, a2, a3, a4, a5)
+#define RED_PROBE6(name, a1, a2, a3, a4, a5, a6) \
+    DTRACE_PROBE6(spice_server, name, a1, a2, a3, a4, a5, a6)
+#else
+#define RED_PROBE0(name) do {} while (0)
+#define RED_PROBE1(name, a1) do {} while (0)
+#define RED_PROBE2(name, a1, a2) do {} while (0)
+#define RED_PROBE3(name, a1, a2, a3) do {} while (0)
+#define RED_PROBE4(name, a1, a2, a3, a4) do {} while (0)
+#define RED_PROBE5(name, a1, a2, a3, a4, a5) do {} while (0)
+#define RED_PROBE6(name, a1, a2, a3, a4, a5, a6) do {} while (0)
+#endif
+
+#endif /* RED_PROBES_H_ */
@@ -44,6 +44,7 @@ struct StreamDevice {
     } *msg;
     uint32_t msg_pos;
     uint32_t msg_len;
+    StreamDataItem *data_item; // frame being read for STREAM_TYPE_DATA
     bool has_error;
     bool opened;
     bool flow_stopped;
@@ -395,38 +396,33 @@ handle_msg_data(StreamDevice *dev, SpiceCharDeviceInstance *sin)
         spice_assert(dev->hdr.type == STREAM_TYPE_DATA);
     }
 
-    /* make sure we have a large enough buffer for the whole frame */
-    /* ---
-     * TODO: Now that we copy partial data into the buffer, for each frame
-     * the buffer is allocated and freed (look for g_realloc in
-     * stream_device_partial_read).
-     * Probably better to just keep the larger buffer.
-     */
+    if (dev->hdr.size == 0) {
+        return true;
+    }
+
+    /* the frame is read directly in the item queued to the clients */
     if (dev->msg_pos == 0) {
         dev->frame_mmtime = reds_get_mm_time();
         record(stream_device_data, "Stream data packet size %u mm_time %u",
                dev->hdr.size, dev->frame_mmtime);
-        if (dev->msg_len < dev->hdr.size) {
-            g_free(dev->msg);
-            dev->msg = g_malloc(dev->hdr.size);
-            dev->msg_len = dev->hdr.size;
+        if (!dev->data_item) {
+            dev->data_item = stream_channel_data_item_new(dev->stream_channel, dev->hdr.size);
         }
     }
+    uint8_t *data = stream_channel_data_item_get_data(dev->data_item);
 
-    /* read from device */
-    n = sif->read(sin, dev->msg->buf + dev->msg_pos, dev->hdr.size - dev->msg_pos);
-    if (n <= 0) {
-        return dev->msg_pos == dev->hdr.size;
-    }
-
-    dev->msg_pos += n;
-    if (dev->msg_pos != dev->hdr.size) { /* some bytes are still missing */
-        return false;
+    /* read from device all the data available, not just a chunk */
+    while (dev->msg_pos < dev->hdr.size) {
+        n = sif->read(sin, data + dev->msg_pos, dev->hdr.size - dev->msg_pos);
+        if (n <= 0) { /* some bytes are still missing */
+            return false;
+        }
+        dev->msg_pos += n;
     }
 
     /* The whole frame was read from the device, send it */
-    stream_channel_send_data(dev->stream_channel, dev->msg->buf, dev->hdr.size,
-                             dev->frame_mmtime);
+    stream_channel_send_data_item(dev->stream_channel, dev->data_item, dev->frame_mmtime);
+    dev->data_item = NULL;
 
     return true;
 }
@@ -614,10 +610,9 @@ stream_device_stream_queue_stat(void *opaque, const StreamQueueStat *stats G_GNU
         return;
     }
 
-    // very easy control flow... if any data stop
-    // this seems a very small queue but as we use tcp
-    // there's already that queue
-    if (stats->num_items) {
+    // the stream channel decides, from the state of its clients,
+    // whether more frames can be accepted
+    if (stats->congested) {
         dev->flow_stopped = true;
         return;
     }
@@ -646,6 +641,15 @@ stream_device_connect(RedsState *reds, SpiceCharDeviceInstance *sin)
     return dev;
 }
 
+static void
+stream_device_drop_data_item(StreamDevice *dev)
+{
+    if (dev->data_item) {
+        stream_channel_data_item_unref(dev->data_item);
+        dev->data_item = NULL;
+    }
+}
+
 static void
 stream_device_dispose(GObject *object)
 {
@@ -654,6 +658,7 @@ stream_device_dispose(GObject *object)
     RedsState *reds = red_char_device_get_server(RED_CHAR_DEVICE(dev));
     reds_core_timer_remove(reds, dev->close_timer);
 
+    stream_device_drop_data_item(dev);
     if (dev->stream_channel) {
         // close all current connections and drop the reference
         red_channel_destroy(RED_CHANNEL(dev->stream_channel));
@@ -767,6 +772,7 @@ stream_device_port_event(RedCharDevice *char_dev, uint8_t event)
     }
     dev->hdr_pos = 0;
     dev->msg_pos = 0;
+    stream_device_drop_data_item(dev);
     dev->has_error = false;
     dev->flow_stopped = false;
     red_char_device_reset(char_dev);
@@ -39,6 +39,7 @@
 #include "red-common.h"
 #include "red-stream.h"
 #include "reds.h"
+#include "red-probes.h"
 
 // compatibility for *BSD systems
 #ifndef TCP_CORK
@@ -100,8 +101,39 @@ struct RedStreamPrivate {
 
     RedsState *reds;
     SpiceCoreInterfaceInternal *core;
+
+    /* passive network estimation, see red_stream_net_sample */
+    red_time_t net_sample_time;
+    bool no_tcp_info;
+    int64_t rtt_us;
+    uint64_t bandwidth;
+    /* state at the previous TCP_INFO query */
+    uint64_t net_bytes_acked;
+    bool net_backlogged;
+
+    /* not sent data allowed in the kernel, 0 if not latency managed */
+    uint32_t send_low_water;
 };
 
+/* minimum interval between two TCP_INFO queries */
+#define NET_SAMPLE_INTERVAL_NS (100 * NSEC_PER_MILLISEC)
+/* over a longer interval the socket may have drained and stayed idle even
+ * if it was backlogged at both queries, the query only starts a new interval */
+#define NET_SAMPLE_MAX_INTERVAL_NS (2 * NET_SAMPLE_INTERVAL_NS)
+/* a message sent faster than this just went to the socket buffer
+ * and does not tell anything about the bandwidth */
+#define NET_MIN_SEND_TIME_NS (10 * NSEC_PER_MILLISEC)
+/* smaller messages mostly wait for the previous ones to drain from
+ * the socket buffer, their send time gives a much too low rate */
+#define NET_MIN_SAMPLE_BYTES (64 * 1024)
+
+/* bounds of the not sent data allowed in the kernel with latency
+ * managed streams, the default is used till the bandwidth-delay
+ * product is known */
+#define SEND_LOW_WATER_MIN (16 * 1024)
+#define SEND_LOW_WATER_DEFAULT (128 * 1024)
+#define SEND_LOW_WATER_MAX (4 * 1024 * 1024)
+
 /**
  * Set TCP_CORK on socket
  */
@@ -318,6 +350,163 @@ int red_stream_get_no_delay(RedStream *stream)
     return red_socket_get_no_delay(stream->socket);
 }
 
+static void red_stream_update_send_low_water(RedStream *stream)
+{
+    RedStreamPrivate *priv = stream->priv;
+    uint64_t low_water = SEND_LOW_WATER_DEFAULT;
+
+    if (priv->bandwidth && priv->rtt_us >= 0) {
+        /* bandwidth-delay product */
+        low_water = priv->bandwidth / 8 * priv->rtt_us / 1000000;
+        low_water = CLAMP(low_water, SEND_LOW_WATER_MIN, SEND_LOW_WATER_MAX);
+    }
+    /* don't bother for small changes */
+    if (low_water > priv->send_low_water - priv->send_low_water / 4 &&
+        low_water < priv->send_low_water + priv->send_low_water / 4) {
+        return;
+    }
+    if (red_socket_set_notsent_lowat(stream->socket, low_water)) {
+        priv->send_low_water = low_water;
+    }
+}
+
+/**
+ * red_stream_set_latency_managed:
+ * @stream: a #RedStream
+ *
+ * Limits the data waiting to be sent in the kernel to the estimated
+ * bandwidth-delay product of @stream. The stream stops being writable
+ * earlier so messages stay in the pipe where they can be replaced or
+ * dropped instead of adding latency in the socket buffers.
+ *
+ * Returns: #true if the operation succeeded, #false otherwise.
+ */
+bool red_stream_set_latency_managed(RedStream *stream)
+{
+    int family = red_stream_get_family(stream);
+
+    if (family != AF_INET && family != AF_INET6) {
+        return false;
+    }
+    if (!red_socket_set_notsent_lowat(stream->socket, SEND_LOW_WATER_DEFAULT)) {
+        return false;
+    }
+    stream->priv->send_low_water = SEND_LOW_WATER_DEFAULT;
+    return true;
+}
+
+static uint64_t net_average(uint64_t average, uint64_t sample)
+{
+    /* same weight TCP uses for the smoothed rtt, the estimate follows a
+     * 10x change of bandwidth within a couple of seconds of traffic */
+    return average ? (average * 7 + sample) / 8 : sample;
+}
+
+/**
+ * red_stream_net_sample:
+ * @stream: a #RedStream
+ * @bytes: size of the message just sent
+ * @send_start: time the first byte of the message was written
+ *
+ * Updates the bandwidth and roundtrip estimation of @stream. Must be
+ * called each time a message has been completely written.
+ */
+void red_stream_net_sample(RedStream *stream, size_t bytes, red_time_t send_start)
+{
+    RedStreamPrivate *priv = stream->priv;
+    red_time_t now = spice_get_monotonic_time_ns();
+    red_time_t send_time = now - send_start;
+    bool queued = send_time >= NET_MIN_SEND_TIME_NS;
+    RedSocketTcpInfo info;
+
+    /* the socket was full so a large message went out at the network rate,
+     * only used when the kernel does not tell how much data was acknowledged */
+    if (queued && bytes >= NET_MIN_SAMPLE_BYTES && !priv->net_bytes_acked) {
+        priv->bandwidth = net_average(priv->bandwidth,
+                                      (uint64_t) bytes * 8 * NSEC_PER_SEC / send_time);
+    }
+
+    if (priv->no_tcp_info || now - priv->net_sample_time < NET_SAMPLE_INTERVAL_NS) {
+        return;
+    }
+    if (!red_socket_get_tcp_info(stream->socket, &info)) {
+        priv->net_sample_time = now;
+        priv->no_tcp_info = true;
+        return;
+    }
+    red_stream_net_sample_tcp_info(stream, &info, now, queued);
+}
+
+/**
+ * red_stream_net_sample_tcp_info:
+ * @stream: a #RedStream
+ * @info: the kernel TCP statistics of @stream
+ * @now: time @info was queried
+ * @queued: whether the message just sent waited for the socket
+ *
+ * Updates the bandwidth and roundtrip estimation of @stream from the
+ * TCP statistics, see red_stream_net_sample.
+ */
+void red_stream_net_sample_tcp_info(RedStream *stream, const RedSocketTcpInfo *info,
+                                    red_time_t now, bool queued)
+{
+    RedStreamPrivate *priv = stream->priv;
+    red_time_t interval = now - priv->net_sample_time;
+
+    priv->net_sample_time = now;
+    if (info->rtt_us) {
+        /* already smoothed by the kernel */
+        priv->rtt_us = info->rtt_us;
+    }
+    /* the data drained from the socket during the interval is the network
+     * rate if data was waiting in the kernel the whole time */
+    bool backlogged = queued || info->notsent_bytes > 0;
+    if (info->bytes_acked && priv->net_bytes_acked && priv->net_backlogged && backlogged &&
+        interval <= NET_SAMPLE_MAX_INTERVAL_NS && info->bytes_acked > priv->net_bytes_acked) {
+        priv->bandwidth = net_average(priv->bandwidth,
+                                      (info->bytes_acked - priv->net_bytes_acked) * 8 *
+                                      NSEC_PER_SEC / interval);
+    }
+    priv->net_bytes_acked = info->bytes_acked;
+    priv->net_backlogged = backlogged;
+    /* the delivery rate is limited by what we send, so it is only the
+     * network rate if data is waiting, otherwise it's a lower bound */
+    if (info->delivery_rate &&
+        (backlogged || info->delivery_rate * 8 > priv->bandwidth)) {
+        priv->bandwidth = net_average(priv->bandwidth, info->delivery_rate * 8);
+    }
+    if (priv->send_low_water) {
+        red_stream_update_send_low_water(stream);
+    }
+}
+
+/**
+ * red_stream_get_bandwidth:
+ * @stream: a #RedStream
+ *
+ * Returns: the estimated bandwidth of @stream in bits per second,
+ * 0 if not known yet
+ */
+uint64_t red_stream_get_bandwidth(RedStream *stream)
+{
+    return stream->priv->bandwidth;
+}
+
+/**
+ * red_stream_get_roundtrip_ms:
+ * @stream: a #RedStream
+ *
+ * Returns: the estimated roundtrip of @stream in milliseconds,
+ * -1 if not known
+ */
+int red_stream_get_roundtrip_ms(RedStream *stream)
+{
+    if (stream->priv->rtt_us < 0) {
+        return -1;
+    }
+    return stream->priv->rtt_us / 1000;
+}
+
 int red_stream_send_msgfd(RedStream *stream, int fd)
 {
     struct msghdr msgh = { 0, };
@@ -368,16 +557,23 @@ ssize_t red_stream_writev(RedStream *s, const struct iovec *iov, int iovcnt)
     ssize_t ret = 0;
 
     if (s->priv->writev != NULL && iovcnt > 1) {
-        return s->priv->writev(s, iov, iovcnt);
+        ret = s->priv->writev(s, iov, iovcnt);
+        RED_PROBE3(stream_writev, s, iovcnt, ret);
+        return ret;
     }
 
     for (i = 0; i < iovcnt; ++i) {
         n = red_stream_write(s, iov[i].iov_base, iov[i].iov_len);
-        if (n <= 0)
-            return ret == 0 ? n : ret;
+        if (n <= 0) {
+            if (ret == 0) {
+                ret = n;
+            }
+            break;
+        }
         ret += n;
     }
 
+    RED_PROBE3(stream_writev, s, iovcnt, ret);
     return ret;
 }
 
@@ -460,6 +656,7 @@ RedStream *red_stream_new(RedsState *reds, int socket)
     stream->priv->read = stream_read_cb;
     stream->priv->write = stream_write_cb;
     stream->priv->writev = stream_writev_cb;
+    stream->priv->rtt_us = -1;
 
     return stream;
 }
@@ -487,6 +684,9 @@ RedStreamSslStatus red_stream_ssl_accept(RedStream *stream)
 
     return_code = SSL_accept(stream->priv->ssl);
     if (return_code == 1) {
+        if (SSL_session_reused(stream->priv->ssl)) {
+            spice_debug("resumed TLS session");
+        }
         return RED_STREAM_SSL_STATUS_OK;
     }
 
@@ -22,6 +22,7 @@
 
 #include "spice.h"
 #include "red-common.h"
+#include "net-utils.h"
 
 typedef void (*AsyncReadDone)(void *opaque);
 typedef void (*AsyncReadError)(void *opaque, int err);
@@ -68,6 +69,12 @@ bool red_stream_is_plain_unix(const RedStream *stream);
 bool red_stream_set_no_delay(RedStream *stream, bool no_delay);
 int red_stream_get_no_delay(RedStream *stream);
 int red_stream_send_msgfd(RedStream *stream, int fd);
+bool red_stream_set_latency_managed(RedStream *stream);
+void red_stream_net_sample(RedStream *stream, size_t bytes, red_time_t send_start);
+void red_stream_net_sample_tcp_info(RedStream *stream, const RedSocketTcpInfo *info,
+                                    red_time_t now, bool queued);
+uint64_t red_stream_get_bandwidth(RedStream *stream);
+int red_stream_get_roundtrip_ms(RedStream *stream);
 
 /**
  * Set auto flush flag.
@@ -46,6 +46,7 @@
 #include "cursor-channel.h"
 #include "tree.h"
 #include "red-record-qxl.h"
+#include "red-probes.h"
 
 // compatibility for FreeBSD
 #ifdef HAVE_PTHREAD_NP_H
@@ -58,6 +59,10 @@
 
 #define INF_EVENT_WAIT ~0
 
+/* while the display commands are processed, read the cursor ring at least
+ * this often so the cursor keeps moving during long display bursts */
+#define CURSOR_MAX_DELAY_NS (2 * NSEC_PER_MILLISEC)
+
 struct RedWorker {
     pthread_t thread;
     QXLInstance *qxl;
@@ -73,8 +78,17 @@ struct RedWorker {
 
     CursorChannel *cursor_channel;
     uint32_t cursor_poll_tries;
+    /* the cursor ring is read from its own source, with its own timeout */
+    unsigned int cursor_event_timeout;
+    gboolean cursor_was_blocked;
+    red_time_t cursor_last_process;
+    /* time of the first wakeup since the cursor ring was last found empty */
+    red_time_t cursor_wakeup_time;
+    red_time_t cursor_max_latency;
 
     RedMemSlotInfo mem_slots;
+    /* parse the drawables data only when rendered or sent */
+    bool lazy_parsing;
 
     SpiceImageCompression image_compression;
     spice_wan_compression_t jpeg_state;
@@ -86,6 +100,9 @@ struct RedWorker {
     RedStatCounter command_counter;
     RedStatCounter full_loop_counter;
     RedStatCounter total_loop_counter;
+    RedStatCounter cursor_command_counter;
+    RedStatCounter cursor_latency_counter;
+    RedStatCounter cursor_max_latency_counter;
 
     int driver_cap_monitors_config;
 
@@ -99,6 +116,7 @@ static gboolean red_process_cursor_cmd(RedWorker *worker, const QXLCommandExt *e
 
     cursor_cmd = red_cursor_cmd_new(worker->qxl, &worker->mem_slots,
                                     ext->group_id, ext->cmd.data);
+    RED_PROBE3(qxl_command_parse, worker, ext->cmd.type, cursor_cmd != NULL);
     if (cursor_cmd == NULL) {
         return FALSE;
     }
@@ -109,6 +127,25 @@ static gboolean red_process_cursor_cmd(RedWorker *worker, const QXLCommandExt *e
     return TRUE;
 }
 
+/* account the time between the wakeup of the worker by the guest and the
+ * processing of its cursor command */
+static void red_cursor_account_latency(RedWorker *worker, red_time_t now)
+{
+    red_time_t latency;
+
+    stat_inc_counter(worker->cursor_command_counter, 1);
+    if (!worker->cursor_wakeup_time) {
+        return;
+    }
+    latency = now - worker->cursor_wakeup_time;
+    worker->cursor_wakeup_time = 0;
+    stat_inc_counter(worker->cursor_latency_counter, latency / NSEC_PER_MICROSEC);
+    if (latency > worker->cursor_max_latency) {
+        worker->cursor_max_latency = latency;
+        stat_set_counter(worker->cursor_max_latency_counter, latency / NSEC_PER_MICROSEC);
+    }
+}
+
 static int red_process_cursor(RedWorker *worker, int *ring_is_empty)
 {
     QXLCommandExt ext_cmd;
@@ -119,12 +156,16 @@ static int red_process_cursor(RedWorker *worker, int *ring_is_empty)
         return n;
     }
 
+    worker->cursor_last_process = spice_get_monotonic_time_ns();
     *ring_is_empty = FALSE;
     while (red_channel_max_pipe_size(RED_CHANNEL(worker->cursor_channel)) <= MAX_PIPE_SIZE) {
         if (!red_qxl_get_cursor_command(worker->qxl, &ext_cmd)) {
             *ring_is_empty = TRUE;
+            /* the pending wakeup was for the display ring */
+            worker->cursor_wakeup_time = 0;
             if (worker->cursor_poll_tries < CMD_RING_POLL_RETRIES) {
-                worker->event_timeout = MIN(worker->event_timeout, CMD_RING_POLL_TIMEOUT);
+                worker->cursor_event_timeout = MIN(worker->cursor_event_timeout,
+                                                   CMD_RING_POLL_TIMEOUT);
             } else if (worker->cursor_poll_tries == CMD_RING_POLL_RETRIES &&
                        !red_qxl_req_cursor_notification(worker->qxl)) {
                 continue;
@@ -137,6 +178,8 @@ static int red_process_cursor(RedWorker *worker, int *ring_is_empty)
             red_record_qxl_command(worker->record, &worker->mem_slots, ext_cmd);
         }
 
+        RED_PROBE3(qxl_command_fetch, worker, ext_cmd.cmd.type, ext_cmd.cmd.data);
+        red_cursor_account_latency(worker, worker->cursor_last_process);
         worker->cursor_poll_tries = 0;
         switch (ext_cmd.cmd.type) {
         case QXL_CMD_CURSOR:
@@ -147,16 +190,31 @@ static int red_process_cursor(RedWorker *worker, int *ring_is_empty)
         }
         n++;
     }
-    worker->was_blocked = TRUE;
+    worker->cursor_was_blocked = TRUE;
     return n;
 }
 
+/* Read the cursor ring if it was not read for a while, called between
+ * display commands */
+static void red_process_cursor_if_due(RedWorker *worker)
+{
+    int ring_is_empty;
+
+    if (spice_get_monotonic_time_ns() - worker->cursor_last_process < CURSOR_MAX_DELAY_NS) {
+        return;
+    }
+    if (red_process_cursor(worker, &ring_is_empty)) {
+        red_channel_push(RED_CHANNEL(worker->cursor_channel));
+    }
+}
+
 static gboolean red_process_surface_cmd(RedWorker *worker, QXLCommandExt *ext, gboolean loadvm)
 {
     RedSurfaceCmd *surface_cmd;
 
     surface_cmd = red_surface_cmd_new(worker->qxl, &worker->mem_slots,
                                       ext->group_id, ext->cmd.data);
+    RED_PROBE3(qxl_command_parse, worker, ext->cmd.type, surface_cmd != NULL);
     if (surface_cmd == NULL) {
         return false;
     }
@@ -198,6 +256,7 @@ static int red_process_display(RedWorker *worker, int *ring_is_empty)
             red_record_qxl_command(worker->record, &worker->mem_slots, ext_cmd);
         }
 
+        RED_PROBE3(qxl_command_fetch, worker, ext_cmd.cmd.type, ext_cmd.cmd.data);
         stat_inc_counter(worker->command_counter, 1);
         worker->display_poll_tries = 0;
         switch (ext_cmd.cmd.type) {
@@ -205,7 +264,9 @@ static int red_process_display(RedWorker *worker, int *ring_is_empty)
             RedDrawable *red_drawable;
             red_drawable = red_drawable_new(worker->qxl, &worker->mem_slots,
                                             ext_cmd.group_id, ext_cmd.cmd.data,
-                                            ext_cmd.flags); // returns with 1 ref
+                                            ext_cmd.flags,
+                                            worker->lazy_parsing); // returns with 1 ref
+            RED_PROBE3(qxl_command_parse, worker, ext_cmd.cmd.type, red_drawable != NULL);
 
             if (red_drawable != NULL) {
                 display_channel_process_draw(worker->display_channel, red_drawable,
@@ -219,6 +280,7 @@ static int red_process_display(RedWorker *worker, int *ring_is_empty)
 
             update = red_update_cmd_new(worker->qxl, &worker->mem_slots,
                                         ext_cmd.group_id, ext_cmd.cmd.data);
+            RED_PROBE3(qxl_command_parse, worker, ext_cmd.cmd.type, update != NULL);
             if (update == NULL) {
                 break;
             }
@@ -236,6 +298,7 @@ static int red_process_display(RedWorker *worker, int *ring_is_empty)
 
             message = red_message_new(worker->qxl, &worker->mem_slots,
                                       ext_cmd.group_id, ext_cmd.cmd.data);
+            RED_PROBE3(qxl_command_parse, worker, ext_cmd.cmd.type, message != NULL);
             if (message == NULL) {
                 break;
             }
@@ -253,6 +316,7 @@ static int red_process_display(RedWorker *worker, int *ring_is_empty)
             spice_error("bad command type");
         }
         n++;
+        red_process_cursor_if_due(worker);
         if (red_channel_all_blocked(RED_CHANNEL(worker->display_channel))
             || spice_get_monotonic_time_ns() - start > NSEC_PER_SEC / 100) {
             worker->event_timeout = 0;
@@ -266,8 +330,12 @@ static int red_process_display(RedWorker *worker, int *ring_is_empty)
 
 static bool red_process_is_blocked(RedWorker *worker)
 {
-    return red_channel_max_pipe_size(RED_CHANNEL(worker->cursor_channel)) > MAX_PIPE_SIZE ||
-           red_channel_max_pipe_size(RED_CHANNEL(worker->display_channel)) > MAX_PIPE_SIZE;
+    return red_channel_max_pipe_size(RED_CHANNEL(worker->display_channel)) > MAX_PIPE_SIZE;
+}
+
+static bool red_process_cursor_is_blocked(RedWorker *worker)
+{
+    return red_channel_max_pipe_size(RED_CHANNEL(worker->cursor_channel)) > MAX_PIPE_SIZE;
 }
 
 static void red_migrate_display(DisplayChannel *display, RedChannelClient *rcc)
@@ -617,6 +685,7 @@ static void handle_dev_start(void *opaque, void *payload)
     }
     worker->running = TRUE;
     worker->event_timeout = 0;
+    worker->cursor_event_timeout = 0;
     guest_set_client_capabilities(worker);
 }
 
@@ -625,6 +694,9 @@ static void handle_dev_wakeup(void *opaque, void *payload)
     RedWorker *worker = opaque;
 
     stat_inc_counter(worker->wakeup_counter, 1);
+    if (!worker->cursor_wakeup_time) {
+        worker->cursor_wakeup_time = spice_get_monotonic_time_ns();
+    }
     red_qxl_clear_pending(worker->qxl->st, RED_DISPATCHER_PENDING_WAKEUP);
 }
 
@@ -646,6 +718,7 @@ static void handle_dev_oom(void *opaque, void *payload)
         display_channel_free_some(worker->display_channel);
         red_qxl_flush_resources(worker->qxl);
     }
+    display_channel_trim_memory(display);
     display_channel_debug_oom(display, "OOM2");
     red_qxl_clear_pending(worker->qxl->st, RED_DISPATCHER_PENDING_OOM);
 }
@@ -1246,7 +1319,6 @@ static gboolean worker_source_dispatch(GSource *source, GSourceFunc callback,
 
     worker->event_timeout = INF_EVENT_WAIT;
     worker->was_blocked = FALSE;
-    red_process_cursor(worker, &ring_is_empty);
     red_process_display(worker, &ring_is_empty);
 
     return TRUE;
@@ -1259,6 +1331,46 @@ static GSourceFuncs worker_source_funcs = {
     .dispatch = worker_source_dispatch,
 };
 
+/* The cursor ring is polled from its own source so its timeouts don't
+ * depend on the state of the display ring */
+static gboolean cursor_source_prepare(GSource *source, gint *p_timeout)
+{
+    RedWorkerSource *wsource = SPICE_CONTAINEROF(source, RedWorkerSource, source);
+    RedWorker *worker = wsource->worker;
+
+    *p_timeout = (worker->cursor_event_timeout == INF_EVENT_WAIT) ?
+                 -1 : worker->cursor_event_timeout;
+    if (*p_timeout == 0)
+        return TRUE;
+
+    if (worker->cursor_was_blocked && !red_process_cursor_is_blocked(worker)) {
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static gboolean cursor_source_dispatch(GSource *source, GSourceFunc callback,
+                                       gpointer user_data)
+{
+    RedWorkerSource *wsource = SPICE_CONTAINEROF(source, RedWorkerSource, source);
+    RedWorker *worker = wsource->worker;
+    int ring_is_empty;
+
+    worker->cursor_event_timeout = INF_EVENT_WAIT;
+    worker->cursor_was_blocked = FALSE;
+    red_process_cursor(worker, &ring_is_empty);
+
+    return TRUE;
+}
+
+/* cannot be const */
+static GSourceFuncs cursor_source_funcs = {
+    .prepare = cursor_source_prepare,
+    .check = worker_source_check,
+    .dispatch = cursor_source_dispatch,
+};
+
 RedWorker* red_worker_new(QXLInstance *qxl,
                           const ClientCbs *client_cursor_cbs,
                           const ClientCbs *client_display_cbs)
@@ -1296,13 +1408,26 @@ RedWorker* red_worker_new(QXLInstance *qxl,
     stat_init_counter(&worker->command_counter, reds, &worker->stat, "commands", TRUE);
     stat_init_counter(&worker->full_loop_counter, reds, &worker->stat, "full_loops", TRUE);
     stat_init_counter(&worker->total_loop_counter, reds, &worker->stat, "total_loops", TRUE);
+    stat_init_counter(&worker->cursor_command_counter, reds, &worker->stat,
+                      "cursor_commands", TRUE);
+    stat_init_counter(&worker->cursor_latency_counter, reds, &worker->stat,
+                      "cursor_latency_us", TRUE);
+    stat_init_counter(&worker->cursor_max_latency_counter, reds, &worker->stat,
+                      "cursor_max_latency_us", TRUE);
 
     worker->dispatch_watch =
         worker->core.watch_add(&worker->core, dispatcher_get_recv_fd(dispatcher),
                                SPICE_WATCH_EVENT_READ, handle_dev_input, dispatcher);
     spice_assert(worker->dispatch_watch != NULL);
 
-    GSource *source = g_source_new(&worker_source_funcs, sizeof(RedWorkerSource));
+    /* attached first so the cursor is processed before the display
+     * when both rings are ready */
+    GSource *source = g_source_new(&cursor_source_funcs, sizeof(RedWorkerSource));
+    SPICE_CONTAINEROF(source, RedWorkerSource, source)->worker = worker;
+    g_source_attach(source, worker->core.main_context);
+    g_source_unref(source);
+
+    source = g_source_new(&worker_source_funcs, sizeof(RedWorkerSource));
     SPICE_CONTAINEROF(source, RedWorkerSource, source)->worker = worker;
     g_source_attach(source, worker->core.main_context);
     g_source_unref(source);
@@ -1315,6 +1440,7 @@ RedWorker* red_worker_new(QXLInstance *qxl,
                       init_info.internal_groupslot_id);
 
     worker->event_timeout = INF_EVENT_WAIT;
+    worker->cursor_event_timeout = INF_EVENT_WAIT;
 
     worker->cursor_channel = cursor_channel_new(reds, qxl->id,
                                                 &worker->core);
@@ -1328,6 +1454,13 @@ RedWorker* red_worker_new(QXLInstance *qxl,
                                                   reds_get_streaming_video(reds),
                                                   reds_get_video_codecs(reds),
                                                   init_info.n_surfaces);
+    display_channel_set_max_pending_size(worker->display_channel,
+                                         reds_get_max_pending_drawables_size(reds));
+    /* with lazy rendering most drawables are replaced before being
+     * rendered or sent, don't parse their data either */
+    worker->lazy_parsing = reds_get_max_pending_drawables_size(reds) > 0;
+    display_channel_set_render_threads(worker->display_channel,
+                                       reds_get_render_threads(reds));
     channel = RED_CHANNEL(worker->display_channel);
     red_channel_init_stat_node(channel, &worker->stat, "display_channel");
     red_channel_register_client_cbs(channel, client_display_cbs);
@@ -19,12 +19,14 @@
 #ifndef REDS_PRIVATE_H_
 #define REDS_PRIVATE_H_
 
+#include <pthread.h>
 #include <spice/protocol.h>
 #include <spice/stats.h>
 
 #include "main-dispatcher.h"
 #include "main-channel.h"
 #include "inputs-channel.h"
+#include "red-io-thread.h"
 #include "stat-file.h"
 #include "red-record-qxl.h"
 
@@ -85,6 +87,7 @@ struct RedsState {
     GList *clients;
     MainChannel *main_channel;
     InputsChannel *inputs_channel;
+    RedIOThread *io_thread; /* runs the inputs channel if enabled, NULL otherwise */
 
     int mig_wait_connect; /* src waits for clients to establish connection to dest
                              (before migration starts) */
@@ -102,6 +105,11 @@ struct RedsState {
     GList *mig_target_clients;
 
     GList *channels;
+    /* RedMessageStats of all channel clients, protected by message_stats_lock
+     * as channel clients are created and destroyed in different threads */
+    GList *message_stats;
+    pthread_mutex_t message_stats_lock;
+    RedInputTrace *input_trace;
     SpiceMouseMode mouse_mode;
     int is_client_mouse_allowed;
     int dispatcher_allows_client_mouse;
@@ -79,7 +79,7 @@
 #include "net-utils.h"
 #include "red-stream-device.h"
 
-#define REDS_MAX_STAT_NODES 100
+#define REDS_MAX_STAT_NODES 512
 
 static void reds_client_monitors_config(RedsState *reds, VDAgentMonitorsConfig *monitors_config);
 static gboolean reds_use_client_monitors_config(RedsState *reds);
@@ -149,8 +149,13 @@ static const SpiceCoreInterfaceInternal core_interface_adapter = {
 #define REDS_MIG_ABORT 2
 #define REDS_MIG_DIFF_VERSION 3
 
-#define REDS_TOKENS_TO_SEND 5
-#define REDS_VDI_PORT_NUM_RECEIVE_BUFFS 5
+/* Agent tokens are returned to the client every REDS_AGENT_TOKENS_RETURN_BYTES
+ * consumed by the device, REDS_VDI_PORT_RECEIVE_BYTES can be read from the
+ * device while waiting for the client to send tokens. */
+#define REDS_AGENT_TOKENS_RETURN_BYTES (64 * 1024)
+#define REDS_TOKENS_TO_SEND (REDS_AGENT_TOKENS_RETURN_BYTES / SPICE_AGENT_MAX_DATA_SIZE)
+#define REDS_VDI_PORT_RECEIVE_BYTES (64 * 1024)
+#define REDS_VDI_PORT_NUM_RECEIVE_BUFFS (REDS_VDI_PORT_RECEIVE_BYTES / SPICE_AGENT_MAX_DATA_SIZE)
 
 /* TODO while we can technically create more than one server in a process,
  * the intended use is to support a single server per process */
@@ -185,10 +190,15 @@ struct RedServerConfig {
     gboolean ticketing_enabled;
     uint32_t streaming_video;
     GArray* video_codecs;
+    uint64_t max_pending_drawables_size;
+    int render_threads;
     SpiceImageCompression image_compression;
     bool playback_compression;
+    uint32_t playback_queue_size;
+    bool io_thread;
     spice_wan_compression_t jpeg_state;
     spice_wan_compression_t zlib_glz_state;
+    uint64_t glz_memory_limit;
 
     gboolean agent_mouse;
     gboolean agent_copypaste;
@@ -196,6 +206,7 @@ struct RedServerConfig {
     gboolean exit_on_disconnect;
 
     RedSSLParameters ssl_parameters;
+    int ssl_session_timeout;
 };
 
 
@@ -404,6 +415,25 @@ RedChannel *reds_find_channel(RedsState *reds, uint32_t type, uint32_t id)
     return NULL;
 }
 
+void reds_register_message_stats(RedsState *reds, RedMessageStats *stats)
+{
+    pthread_mutex_lock(&reds->message_stats_lock);
+    reds->message_stats = g_list_prepend(reds->message_stats, stats);
+    pthread_mutex_unlock(&reds->message_stats_lock);
+}
+
+void reds_unregister_message_stats(RedsState *reds, RedMessageStats *stats)
+{
+    pthread_mutex_lock(&reds->message_stats_lock);
+    reds->message_stats = g_list_remove(reds->message_stats, stats);
+    pthread_mutex_unlock(&reds->message_stats_lock);
+}
+
+RedInputTrace *reds_get_input_trace(RedsState *reds)
+{
+    return reds->input_trace;
+}
+
 /* Search for first free channel id for a specific channel type.
  * Return first id free or <0 if not found. */
 int reds_get_free_channel_id(RedsState *reds, uint32_t type)
@@ -641,6 +671,11 @@ bool reds_config_get_playback_compression(RedsState *reds)
     return reds->config->playback_compression;
 }
 
+uint32_t reds_get_playback_queue_size(RedsState *reds)
+{
+    return reds->config->playback_queue_size;
+}
+
 SpiceMouseMode reds_get_mouse_mode(RedsState *reds)
 {
     return reds->mouse_mode;
@@ -1088,6 +1123,27 @@ SPICE_GNUC_VISIBLE int spice_server_get_num_clients(SpiceServer *reds)
     return reds ? g_list_length(reds->clients) : 0;
 }
 
+SPICE_GNUC_VISIBLE SpiceMessageStats *spice_server_get_message_stats(SpiceServer *reds,
+                                                                     size_t *num_stats)
+{
+    GArray *stats = g_array_new(FALSE, FALSE, sizeof(SpiceMessageStats));
+    RedMessageStats *channel_stats;
+
+    pthread_mutex_lock(&reds->message_stats_lock);
+    GLIST_FOREACH(reds->message_stats, RedMessageStats, channel_stats) {
+        red_message_stats_collect(channel_stats, stats);
+    }
+    pthread_mutex_unlock(&reds->message_stats_lock);
+
+    *num_stats = stats->len;
+    return (SpiceMessageStats *) g_array_free(stats, FALSE);
+}
+
+SPICE_GNUC_VISIBLE void spice_server_free_message_stats(SpiceMessageStats *stats)
+{
+    g_free(stats);
+}
+
 static bool channel_supports_multiple_clients(RedChannel *channel)
 {
     uint32_t type;
@@ -1420,6 +1476,9 @@ void reds_marshall_migrate_data(RedsState *reds, SpiceMarshaller *m)
     RedCharDeviceVDIPort *agent_dev = reds->agent_dev;
     SpiceMarshaller *m2;
 
+    /* the agent window must not be used with older dests */
+    G_STATIC_ASSERT(SPICE_MIGRATION_PROTOCOL_VERSION >= SPICE_MIGRATE_DATA_MAIN_VERSION);
+
     memset(&mig_data, 0, sizeof(mig_data));
     spice_marshaller_add_uint32(m, SPICE_MIGRATE_DATA_MAIN_MAGIC);
     spice_marshaller_add_uint32(m, SPICE_MIGRATE_DATA_MAIN_VERSION);
@@ -2901,6 +2960,10 @@ static gpointer openssl_global_init(gpointer arg)
     return NULL;
 }
 
+/* default lifetime of the TLS sessions in seconds, longer than the OpenSSL
+ * default so they survive network outages and roaming */
+#define REDS_SSL_SESSION_TIMEOUT (60*60)
+
 static int reds_init_ssl(RedsState *reds)
 {
     static GOnce openssl_once = G_ONCE_INIT;
@@ -2966,6 +3029,9 @@ static int reds_init_ssl(RedsState *reds)
     }
 
     SSL_CTX_set_session_id_context(reds->ctx, (const unsigned char *)"SPICE", 5);
+    /* The server session cache and the session tickets are enabled by
+     * default, only their lifetime is set. */
+    SSL_CTX_set_timeout(reds->ctx, reds->config->ssl_session_timeout);
     if (strlen(reds->config->ssl_parameters.ciphersuite) > 0) {
         if (!SSL_CTX_set_cipher_list(reds->ctx, reds->config->ssl_parameters.ciphersuite)) {
             return -1;
@@ -3507,6 +3573,11 @@ SPICE_GNUC_VISIBLE int spice_server_remove_interface(SpiceBaseInstance *sin)
     return 0;
 }
 
+static void reds_reset_channel_thread_id(void *opaque)
+{
+    red_channel_reset_thread_id(RED_CHANNEL(opaque));
+}
+
 static int do_spice_init(RedsState *reds, SpiceCoreInterface *core_interface)
 {
     spice_debug("starting %s", VERSION);
@@ -3551,7 +3622,17 @@ static int do_spice_init(RedsState *reds, SpiceCoreInterface *core_interface)
 #endif
 
     reds->main_channel = main_channel_new(reds);
-    reds->inputs_channel = inputs_channel_new(reds);
+    if (reds->config->io_thread) {
+        reds->io_thread = red_io_thread_new();
+    }
+    reds->inputs_channel = inputs_channel_new(reds, reds->io_thread);
+    if (reds->io_thread) {
+        if (!red_io_thread_run(reds->io_thread)) {
+            goto err;
+        }
+        red_io_thread_call(reds->io_thread, reds_reset_channel_thread_id,
+                           reds->inputs_channel, true);
+    }
 
     reds->mouse_mode = SPICE_MOUSE_MODE_SERVER;
 
@@ -3604,12 +3685,14 @@ SPICE_GNUC_VISIBLE SpiceServer *spice_server_new(void)
     reds->config->video_codecs = g_array_new(FALSE, FALSE, sizeof(RedVideoCodec));
     reds->config->image_compression = SPICE_IMAGE_COMPRESSION_AUTO_GLZ;
     reds->config->playback_compression = TRUE;
+    reds->config->playback_queue_size = PLAYBACK_DEFAULT_QUEUE_SIZE;
     reds->config->jpeg_state = SPICE_WAN_COMPRESSION_AUTO;
     reds->config->zlib_glz_state = SPICE_WAN_COMPRESSION_AUTO;
     reds->config->agent_mouse = TRUE;
     reds->config->agent_copypaste = TRUE;
     reds->config->agent_file_xfer = TRUE;
     reds->config->exit_on_disconnect = FALSE;
+    reds->config->ssl_session_timeout = REDS_SSL_SESSION_TIMEOUT;
 #ifdef RED_STATISTICS
     reds->stat_file = stat_file_new(REDS_MAX_STAT_NODES);
     /* Create an initial node. This will be the 0 node making easier
@@ -3617,6 +3700,8 @@ SPICE_GNUC_VISIBLE SpiceServer *spice_server_new(void)
      */
     stat_file_add_node(reds->stat_file, INVALID_STAT_REF, "default_channel", TRUE);
 #endif
+    pthread_mutex_init(&reds->message_stats_lock, NULL);
+    reds->input_trace = red_input_trace_new(reds);
     reds->listen_socket = -1;
     reds->secure_listen_socket = -1;
 
@@ -3819,12 +3904,19 @@ SPICE_GNUC_VISIBLE void spice_server_destroy(SpiceServer *reds)
 
     g_list_free_full(reds->qxl_instances, (GDestroyNotify)red_qxl_destroy);
 
+    if (reds->io_thread) {
+        red_io_thread_stop(reds->io_thread);
+        if (reds->inputs_channel) {
+            red_channel_reset_thread_id(RED_CHANNEL(reds->inputs_channel));
+        }
+    }
     if (reds->inputs_channel) {
         red_channel_destroy(RED_CHANNEL(reds->inputs_channel));
     }
     if (reds->main_channel) {
         red_channel_destroy(RED_CHANNEL(reds->main_channel));
     }
+    red_io_thread_free(reds->io_thread);
     reds_core_timer_remove(reds, reds->mig_timer);
 
     if (reds->ctx) {
@@ -3857,6 +3949,9 @@ SPICE_GNUC_VISIBLE void spice_server_destroy(SpiceServer *reds)
 #endif
 
     reds_config_free(reds->config);
+    red_input_trace_free(reds->input_trace);
+    g_list_free(reds->message_stats);
+    pthread_mutex_destroy(&reds->message_stats_lock);
     g_free(reds);
 }
 
@@ -4026,6 +4121,15 @@ SPICE_GNUC_VISIBLE int spice_server_set_tls(SpiceServer *s, int port,
     return 0;
 }
 
+SPICE_GNUC_VISIBLE int spice_server_set_tls_session_timeout(SpiceServer *s, int timeout)
+{
+    if (timeout <= 0) {
+        return -1;
+    }
+    s->config->ssl_session_timeout = timeout;
+    return 0;
+}
+
 SPICE_GNUC_VISIBLE int spice_server_set_image_compression(SpiceServer *s,
                                                           SpiceImageCompression comp)
 {
@@ -4068,6 +4172,12 @@ SPICE_GNUC_VISIBLE int spice_server_set_zlib_glz_compression(SpiceServer *s, spi
     return 0;
 }
 
+SPICE_GNUC_VISIBLE int spice_server_set_glz_memory_limit(SpiceServer *s, uint64_t limit)
+{
+    s->config->glz_memory_limit = limit;
+    return 0;
+}
+
 SPICE_GNUC_VISIBLE int spice_server_set_channel_security(SpiceServer *s, const char *channel, int security)
 {
     int type;
@@ -4142,6 +4252,31 @@ GArray* reds_get_video_codecs(const RedsState *reds)
     return reds->config->video_codecs;
 }
 
+SPICE_GNUC_VISIBLE int spice_server_set_lazy_rendering(SpiceServer *reds, uint64_t max_pending_size)
+{
+    reds->config->max_pending_drawables_size = max_pending_size;
+    return 0;
+}
+
+uint64_t reds_get_max_pending_drawables_size(const RedsState *reds)
+{
+    return reds->config->max_pending_drawables_size;
+}
+
+SPICE_GNUC_VISIBLE int spice_server_set_render_threads(SpiceServer *reds, int threads)
+{
+    if (threads < 0) {
+        return -1;
+    }
+    reds->config->render_threads = threads;
+    return 0;
+}
+
+int reds_get_render_threads(const RedsState *reds)
+{
+    return reds->config->render_threads;
+}
+
 static void reds_set_video_codecs(RedsState *reds, GArray *video_codecs)
 {
     /* The video_codecs array is immutable */
@@ -4159,6 +4294,21 @@ SPICE_GNUC_VISIBLE int spice_server_set_playback_compression(SpiceServer *reds,
     return 0;
 }
 
+SPICE_GNUC_VISIBLE int spice_server_set_io_thread(SpiceServer *reds, int enable)
+{
+    reds->config->io_thread = !!enable;
+    return 0;
+}
+
+SPICE_GNUC_VISIBLE int spice_server_set_playback_queue_size(SpiceServer *reds, uint32_t frames)
+{
+    if (frames == 0 || frames > PLAYBACK_MAX_QUEUE_SIZE) {
+        return -1;
+    }
+    reds->config->playback_queue_size = frames;
+    return 0;
+}
+
 SPICE_GNUC_VISIBLE int spice_server_set_agent_mouse(SpiceServer *reds, int enable)
 {
     reds->config->agent_mouse = enable;
@@ -4366,6 +4516,11 @@ spice_wan_compression_t reds_get_zlib_glz_state(const RedsState *reds)
     return reds->config->zlib_glz_state;
 }
 
+uint64_t reds_get_glz_memory_limit(const RedsState *reds)
+{
+    return reds->config->glz_memory_limit;
+}
+
 SpiceCoreInterfaceInternal* reds_get_core_interface(RedsState *reds)
 {
     return &reds->core;
@@ -29,6 +29,8 @@
 #include "red-channel.h"
 #include "main-dispatcher.h"
 #include "migration-protocol.h"
+#include "red-message-stats.h"
+#include "red-input-trace.h"
 
 static inline QXLInterface * qxl_get_interface(QXLInstance *qxl)
 {
@@ -44,11 +46,15 @@ uint32_t reds_get_mm_time(void);
 void reds_register_channel(RedsState *reds, RedChannel *channel);
 void reds_unregister_channel(RedsState *reds, RedChannel *channel);
 RedChannel *reds_find_channel(RedsState *reds, uint32_t type, uint32_t id);
+void reds_register_message_stats(RedsState *reds, RedMessageStats *stats);
+void reds_unregister_message_stats(RedsState *reds, RedMessageStats *stats);
+RedInputTrace *reds_get_input_trace(RedsState *reds);
 int reds_get_free_channel_id(RedsState *reds, uint32_t type);
 SpiceMouseMode reds_get_mouse_mode(RedsState *reds); // used by inputs_channel
 gboolean reds_config_get_agent_mouse(const RedsState *reds); // used by inputs_channel
 int reds_has_vdagent(RedsState *reds); // used by inputs channel
 bool reds_config_get_playback_compression(RedsState *reds); // used by playback channel
+uint32_t reds_get_playback_queue_size(RedsState *reds); // used by playback channel
 
 void reds_send_device_display_info(RedsState *reds);
 void reds_handle_agent_mouse_event(RedsState *reds, const VDAgentMouseState *mouse_state); // used by inputs_channel
@@ -94,8 +100,11 @@ void reds_on_main_channel_migrate(RedsState *reds, MainChannelClient *mcc);
 void reds_set_client_mm_time_latency(RedsState *reds, RedClient *client, uint32_t latency);
 uint32_t reds_get_streaming_video(const RedsState *reds);
 GArray* reds_get_video_codecs(const RedsState *reds);
+uint64_t reds_get_max_pending_drawables_size(const RedsState *reds);
+int reds_get_render_threads(const RedsState *reds);
 spice_wan_compression_t reds_get_jpeg_state(const RedsState *reds);
 spice_wan_compression_t reds_get_zlib_glz_state(const RedsState *reds);
+uint64_t reds_get_glz_memory_limit(const RedsState *reds);
 SpiceCoreInterfaceInternal* reds_get_core_interface(RedsState *reds);
 void reds_update_client_mouse_allowed(RedsState *reds);
 MainDispatcher* reds_get_main_dispatcher(RedsState *reds);
@@ -122,20 +122,33 @@ enum {
 
 struct AudioFrame {
     uint32_t time;
+    red_time_t queue_time;
     uint32_t samples[SND_CODEC_MAX_FRAME_SIZE];
+    /* the samples are encoded when queued, 0 if not encoded */
+    int encoded_size;
+    uint8_t encoded[SND_CODEC_MAX_COMPRESSED_BYTES];
     PlaybackChannelClient *client;
     AudioFrame *next;
     AudioFrameContainer *container;
     bool allocated;
 };
 
-#define NUM_AUDIO_FRAMES 3
+/* Besides the queued frames, one frame can be in progress
+ * and another one filled by the device */
+#define NUM_EXTRA_AUDIO_FRAMES 2
 struct AudioFrameContainer
 {
     int refs;
-    AudioFrame items[NUM_AUDIO_FRAMES];
+    unsigned int num_items;
+    AudioFrame items[0];
 };
 
+/* limits of the adaptive playback latency, in ms */
+#define PLAYBACK_MIN_LATENCY 100
+#define PLAYBACK_MAX_LATENCY 400
+/* the latency is reported again to the client after changing this much */
+#define PLAYBACK_LATENCY_HYSTERESIS 20
+
 #define TYPE_PLAYBACK_CHANNEL_CLIENT playback_channel_client_get_type()
 #define PLAYBACK_CHANNEL_CLIENT(obj) \
     (G_TYPE_CHECK_INSTANCE_CAST((obj), TYPE_PLAYBACK_CHANNEL_CLIENT, PlaybackChannelClient))
@@ -147,11 +160,20 @@ struct PlaybackChannelClient {
     AudioFrameContainer *frames;
     AudioFrame *free_frames;
     AudioFrame *in_progress;   /* Frame being sent to the client */
-    AudioFrame *pending_frame; /* Next frame to send to the client */
+    /* Frames to send to the client, in a ring. The device callbacks and
+     * the channel both run in the main loop so it needs no locking */
+    AudioFrame **queue;
+    unsigned int queue_size;
+    unsigned int queue_head;
+    unsigned int queue_len;
     uint32_t mode;
-    uint32_t latency;
+    uint32_t latency;          /* latency reported to the client */
+    uint32_t stream_latency;   /* latency required by the video streams */
+    /* average and deviation of the time the frames spend in the server,
+     * in ns, used to compute the latency the client needs to play smoothly */
+    red_time_t avg_delay;
+    red_time_t delay_jitter;
     SndCodec codec;
-    uint8_t  encode_buf[SND_CODEC_MAX_COMPRESSED_BYTES];
 };
 
 typedef struct PlaybackChannelClientClass {
@@ -274,16 +296,85 @@ static void snd_playback_free_frame(PlaybackChannelClient *playback_client, Audi
     playback_client->free_frames = frame;
 }
 
+static void snd_playback_queue_push(PlaybackChannelClient *playback_client, AudioFrame *frame)
+{
+    unsigned int tail = (playback_client->queue_head + playback_client->queue_len) %
+                        playback_client->queue_size;
+
+    spice_assert(playback_client->queue_len < playback_client->queue_size);
+    playback_client->queue[tail] = frame;
+    playback_client->queue_len++;
+}
+
+static AudioFrame *snd_playback_queue_pop(PlaybackChannelClient *playback_client)
+{
+    AudioFrame *frame;
+
+    if (playback_client->queue_len == 0) {
+        return NULL;
+    }
+    frame = playback_client->queue[playback_client->queue_head];
+    playback_client->queue_head = (playback_client->queue_head + 1) % playback_client->queue_size;
+    playback_client->queue_len--;
+    return frame;
+}
+
+static void snd_playback_queue_clear(PlaybackChannelClient *playback_client)
+{
+    AudioFrame *frame;
+
+    while ((frame = snd_playback_queue_pop(playback_client))) {
+        snd_playback_free_frame(playback_client, frame);
+    }
+}
+
+/* Report to the client the latency it should buffer, the largest of the one
+ * required by the video streams and of the one needed to absorb the delay
+ * variations of the audio frames.
+ * Clients are left with their own default till one of these needs more than
+ * PLAYBACK_MIN_LATENCY */
+static void snd_playback_update_latency(PlaybackChannelClient *playback_client, bool force)
+{
+    SndChannelClient *client = SND_CHANNEL_CLIENT(playback_client);
+    red_time_t delay = playback_client->avg_delay + 4 * playback_client->delay_jitter;
+    uint32_t latency = delay / NSEC_PER_MILLISEC;
+
+    if (!red_channel_client_test_remote_cap(RED_CHANNEL_CLIENT(playback_client),
+                                            SPICE_PLAYBACK_CAP_LATENCY)) {
+        return;
+    }
+    if (!force && playback_client->latency == 0 && latency <= PLAYBACK_MIN_LATENCY) {
+        return;
+    }
+
+    latency = CLAMP(latency, PLAYBACK_MIN_LATENCY, PLAYBACK_MAX_LATENCY);
+    latency = MAX(latency, playback_client->stream_latency);
+    if (!force && ABS((int64_t) latency - (int64_t) playback_client->latency) <
+                  PLAYBACK_LATENCY_HYSTERESIS) {
+        return;
+    }
+    playback_client->latency = latency;
+    client->command |= SND_PLAYBACK_LATENCY_MASK;
+}
+
 static void snd_playback_on_message_done(SndChannelClient *client)
 {
     PlaybackChannelClient *playback_client = (PlaybackChannelClient *)client;
     if (playback_client->in_progress) {
+        red_time_t delay = spice_get_monotonic_time_ns() -
+                           playback_client->in_progress->queue_time;
+        red_time_t deviation = ABS(delay - playback_client->avg_delay);
+
+        playback_client->avg_delay += (delay - playback_client->avg_delay) / 8;
+        playback_client->delay_jitter += (deviation - playback_client->delay_jitter) / 8;
+        snd_playback_update_latency(playback_client, false);
+
         snd_playback_free_frame(playback_client, playback_client->in_progress);
         playback_client->in_progress = NULL;
-        if (playback_client->pending_frame) {
+        if (playback_client->queue_len) {
             client->command |= SND_PLAYBACK_PCM_MASK;
-            snd_send(client);
         }
+        snd_send(client);
     }
 }
 
@@ -588,6 +679,21 @@ static bool snd_record_send_migrate(RecordChannelClient *record_client)
     return snd_channel_send_migrate(SND_CHANNEL_CLIENT(record_client));
 }
 
+static bool snd_playback_encode_frame(PlaybackChannelClient *playback_client, AudioFrame *frame)
+{
+    int n = sizeof(frame->encoded);
+
+    if (snd_codec_encode(playback_client->codec, (uint8_t *) frame->samples,
+                         snd_codec_frame_size(playback_client->codec) * sizeof(frame->samples[0]),
+                         frame->encoded, &n) != SND_CODEC_OK) {
+        red_channel_warning(red_channel_client_get_channel(RED_CHANNEL_CLIENT(playback_client)),
+                            "encode failed");
+        return false;
+    }
+    frame->encoded_size = n;
+    return true;
+}
+
 static bool snd_playback_send_write(PlaybackChannelClient *playback_client)
 {
     RedChannelClient *rcc = RED_CHANNEL_CLIENT(playback_client);
@@ -601,6 +707,13 @@ static bool snd_playback_send_write(PlaybackChannelClient *playback_client)
     frame = playback_client->in_progress;
     msg.time = frame->time;
 
+    /* frames queued before the mode changed to compressed are encoded here */
+    if (playback_client->mode != SPICE_AUDIO_DATA_MODE_RAW && frame->encoded_size == 0 &&
+        !snd_playback_encode_frame(playback_client, frame)) {
+        red_channel_client_disconnect(rcc);
+        return false;
+    }
+
     spice_marshall_msg_playback_data(m, &msg);
 
     if (playback_client->mode == SPICE_AUDIO_DATA_MODE_RAW) {
@@ -610,15 +723,7 @@ static bool snd_playback_send_write(PlaybackChannelClient *playback_client)
                                          marshaller_unref_pipe_item, pipe_item);
     }
     else {
-        int n = sizeof(playback_client->encode_buf);
-        if (snd_codec_encode(playback_client->codec, (uint8_t *) frame->samples,
-                                    snd_codec_frame_size(playback_client->codec) * sizeof(frame->samples[0]),
-                                    playback_client->encode_buf, &n) != SND_CODEC_OK) {
-            red_channel_warning(red_channel_client_get_channel(rcc), "encode failed");
-            red_channel_client_disconnect(rcc);
-            return false;
-        }
-        spice_marshaller_add_by_ref_full(m, playback_client->encode_buf, n,
+        spice_marshaller_add_by_ref_full(m, frame->encoded, frame->encoded_size,
                                          marshaller_unref_pipe_item, pipe_item);
     }
 
@@ -694,9 +799,8 @@ static void playback_channel_send_item(RedChannelClient *rcc, G_GNUC_UNUSED RedP
             }
         }
         if (client->command & SND_PLAYBACK_PCM_MASK) {
-            spice_assert(!playback_client->in_progress && playback_client->pending_frame);
-            playback_client->in_progress = playback_client->pending_frame;
-            playback_client->pending_frame = NULL;
+            spice_assert(!playback_client->in_progress && playback_client->queue_len);
+            playback_client->in_progress = snd_playback_queue_pop(playback_client);
             client->command &= ~SND_PLAYBACK_PCM_MASK;
             if (snd_playback_send_write(playback_client)) {
                 break;
@@ -924,12 +1028,7 @@ SPICE_GNUC_VISIBLE void spice_server_playback_stop(SpicePlaybackInstance *sin)
         client->command &= ~SND_CTRL_MASK;
         client->command &= ~SND_PLAYBACK_PCM_MASK;
 
-        if (playback_client->pending_frame) {
-            spice_assert(!playback_client->in_progress);
-            snd_playback_free_frame(playback_client,
-                                    playback_client->pending_frame);
-            playback_client->pending_frame = NULL;
-        }
+        snd_playback_queue_clear(playback_client);
     }
 }
 
@@ -945,7 +1044,13 @@ SPICE_GNUC_VISIBLE void spice_server_playback_get_buffer(SpicePlaybackInstance *
     }
     PlaybackChannelClient *playback_client = PLAYBACK_CHANNEL_CLIENT(client);
     if (!playback_client->free_frames) {
-        return;
+        /* the queue is full, drop its oldest frame rather than the new one
+         * so the client gets the most recent samples */
+        AudioFrame *oldest = snd_playback_queue_pop(playback_client);
+        if (!oldest) {
+            return;
+        }
+        snd_playback_free_frame(playback_client, oldest);
     }
     spice_assert(client->active);
     if (!playback_client->free_frames->allocated) {
@@ -979,11 +1084,22 @@ SPICE_GNUC_VISIBLE void spice_server_playback_put_samples(SpicePlaybackInstance
     }
     spice_assert(SND_CHANNEL_CLIENT(playback_client)->active);
 
-    if (playback_client->pending_frame) {
-        snd_playback_free_frame(playback_client, playback_client->pending_frame);
-    }
     frame->time = reds_get_mm_time();
-    playback_client->pending_frame = frame;
+    frame->queue_time = spice_get_monotonic_time_ns();
+    /* encode now so sending the frames only has to write them */
+    frame->encoded_size = 0;
+    if (playback_client->mode != SPICE_AUDIO_DATA_MODE_RAW &&
+        !snd_playback_encode_frame(playback_client, frame)) {
+        snd_playback_free_frame(playback_client, frame);
+        red_channel_client_disconnect(RED_CHANNEL_CLIENT(playback_client));
+        return;
+    }
+    if (playback_client->queue_len == playback_client->queue_size) {
+        /* the client doesn't keep up and no frame is in progress, the channel
+         * is blocked on another message. Drop the oldest frame */
+        snd_playback_free_frame(playback_client, snd_playback_queue_pop(playback_client));
+    }
+    snd_playback_queue_push(playback_client, frame);
     snd_set_command(SND_CHANNEL_CLIENT(playback_client), SND_PLAYBACK_PCM_MASK);
     snd_send(SND_CHANNEL_CLIENT(playback_client));
 }
@@ -1004,8 +1120,8 @@ void snd_set_playback_latency(RedClient *client, uint32_t latency)
                 SPICE_PLAYBACK_CAP_LATENCY)) {
                 PlaybackChannelClient* playback = (PlaybackChannelClient*)scc;
 
-                playback->latency = latency;
-                snd_set_command(scc, SND_PLAYBACK_LATENCY_MASK);
+                playback->stream_latency = latency;
+                snd_playback_update_latency(playback, true);
                 snd_send(scc);
             } else {
                 spice_debug("client doesn't not support SPICE_PLAYBACK_CAP_LATENCY");
@@ -1037,12 +1153,13 @@ playback_channel_client_finalize(GObject *object)
     SndChannelClient *client = SND_CHANNEL_CLIENT(playback_client);
 
     // free frames, unref them
-    for (i = 0; i < NUM_AUDIO_FRAMES; ++i) {
+    for (i = 0; i < playback_client->frames->num_items; ++i) {
         playback_client->frames->items[i].client = NULL;
     }
     if (--playback_client->frames->refs == 0) {
         g_free(playback_client->frames);
     }
+    g_free(playback_client->queue);
 
     if (client->active) {
         reds_enable_mm_time(snd_channel_get_server(client));
@@ -1053,6 +1170,22 @@ playback_channel_client_finalize(GObject *object)
     G_OBJECT_CLASS(playback_channel_client_parent_class)->finalize(object);
 }
 
+static void snd_playback_alloc_frames(PlaybackChannelClient *playback, unsigned int queue_size)
+{
+    unsigned int i, num_items = queue_size + NUM_EXTRA_AUDIO_FRAMES;
+
+    playback->queue_size = queue_size;
+    playback->queue = g_new0(AudioFrame *, queue_size);
+
+    playback->frames = g_malloc0(sizeof(AudioFrameContainer) + num_items * sizeof(AudioFrame));
+    playback->frames->refs = 1;
+    playback->frames->num_items = num_items;
+    for (i = 0; i < num_items; ++i) {
+        playback->frames->items[i].container = playback->frames;
+        snd_playback_free_frame(playback, &playback->frames->items[i]);
+    }
+}
+
 static void
 playback_channel_client_constructed(GObject *object)
 {
@@ -1065,6 +1198,8 @@ playback_channel_client_constructed(GObject *object)
     G_OBJECT_CLASS(playback_channel_client_parent_class)->constructed(object);
 
     scc->on_message_done = snd_playback_on_message_done;
+    snd_playback_alloc_frames(playback_client,
+                              reds_get_playback_queue_size(red_channel_get_server(red_channel)));
 
     bool client_can_celt = red_channel_client_test_remote_cap(rcc,
                                           SPICE_PLAYBACK_CAP_CELT_0_5_1);
@@ -1539,23 +1674,10 @@ playback_channel_client_class_init(PlaybackChannelClientClass *klass)
     object_class->finalize = playback_channel_client_finalize;
 }
 
-static void snd_playback_alloc_frames(PlaybackChannelClient *playback)
-{
-    int i;
-
-    playback->frames = g_new0(AudioFrameContainer, 1);
-    playback->frames->refs = 1;
-    for (i = 0; i < NUM_AUDIO_FRAMES; ++i) {
-        playback->frames->items[i].container = playback->frames;
-        snd_playback_free_frame(playback, &playback->frames->items[i]);
-    }
-}
-
 static void
 playback_channel_client_init(PlaybackChannelClient *playback)
 {
     playback->mode = SPICE_AUDIO_DATA_MODE_RAW;
-    snd_playback_alloc_frames(playback);
 }
 
 static void
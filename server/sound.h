@@ -22,6 +22,10 @@
 
 struct RedClient;
 
+/* number of audio frames queued for each playback client */
+#define PLAYBACK_DEFAULT_QUEUE_SIZE 8
+#define PLAYBACK_MAX_QUEUE_SIZE 64
+
 void snd_attach_playback(RedsState *reds, SpicePlaybackInstance *sin);
 void snd_detach_playback(SpicePlaybackInstance *sin);
 
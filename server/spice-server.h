@@ -59,6 +59,10 @@ int spice_server_set_tls(SpiceServer *s, int port,
                          const char *ca_cert_file, const char *certs_file,
                          const char *private_key_file, const char *key_passwd,
                          const char *dh_key_file, const char *ciphersuite);
+/* Set how long a client can resume its TLS session, from the server session
+ * cache or with a session ticket, in seconds. The default is one hour.
+ * Since 0.14.3 */
+int spice_server_set_tls_session_timeout(SpiceServer *s, int timeout);
 
 int spice_server_add_client(SpiceServer *s, int socket, int skip_auth);
 int spice_server_add_ssl_client(SpiceServer *s, int socket, int skip_auth);
@@ -112,6 +116,12 @@ typedef enum {
 
 int spice_server_set_jpeg_compression(SpiceServer *s, spice_wan_compression_t comp);
 int spice_server_set_zlib_glz_compression(SpiceServer *s, spice_wan_compression_t comp);
+/* Limit the memory the GLZ dictionaries of all the clients can keep alive, in
+ * bytes of image data. Over the limit the dictionaries of the idle clients are
+ * shrunk first, then the windows of the others. A small window is always kept
+ * so the limit can be exceeded by about 1MiB per client.
+ * 0, the default, means no limit. Since 0.14.3 */
+int spice_server_set_glz_memory_limit(SpiceServer *s, uint64_t limit);
 
 #define SPICE_CHANNEL_SECURITY_NONE (1 << 0)
 #define SPICE_CHANNEL_SECURITY_SSL (1 << 1)
@@ -136,7 +146,29 @@ enum {
 };
 
 int spice_server_set_video_codecs(SpiceServer *s, const char* video_codecs);
+
+/* Only render the guest drawing commands in the server when the result is
+ * needed (update area, new client, migration...) or when the pending commands
+ * hold more than max_pending_size bytes. The text and path data of the
+ * commands is also only parsed when they are rendered or sent.
+ * 0 disables lazy rendering.
+ * Must be called before adding the QXL interface. Since 0.14.3 */
+int spice_server_set_lazy_rendering(SpiceServer *s, uint64_t max_pending_size);
+/* Render the large update areas in horizontal tiles drawn in parallel by
+ * this number of threads, up to 16. 0 or 1, the default, renders serially.
+ * Must be called before adding the QXL interface. Since 0.14.3 */
+int spice_server_set_render_threads(SpiceServer *s, int threads);
 int spice_server_set_playback_compression(SpiceServer *s, int enable);
+/* Run the inputs channel in a thread owned by the server rather than in the
+ * main loop of the application, so that reading the client input does not
+ * wait for the other work of the main loop. The input events are still
+ * passed to the devices from the main loop.
+ * Disabled by default. Must be called before spice_server_init(). Since 0.14.3 */
+int spice_server_set_io_thread(SpiceServer *s, int enable);
+/* Number of audio frames (10ms each at 48kHz) queued for each playback client
+ * before the oldest ones are dropped, from 1 to 64, 8 by default.
+ * Applies to the clients connecting after the call. Since 0.14.3 */
+int spice_server_set_playback_queue_size(SpiceServer *s, uint32_t frames);
 int spice_server_set_agent_mouse(SpiceServer *s, int enable);
 int spice_server_set_agent_copypaste(SpiceServer *s, int enable);
 int spice_server_set_agent_file_xfer(SpiceServer *s, int enable);
@@ -154,4 +186,27 @@ void spice_server_vm_stop(SpiceServer *s);
 
 int spice_server_get_num_clients(SpiceServer *s) SPICE_GNUC_DEPRECATED;
 
+/* Accounting of the messages sent to a client on a channel, per message type.
+ * Latencies are measured from the time the message was queued to the time
+ * it was fully written to the socket. uncompressed_bytes is the size the
+ * messages would have had without image, video or data compression. */
+typedef struct SpiceMessageStats {
+    uint32_t connection_id;
+    uint8_t channel_type;
+    uint8_t channel_id;
+    uint16_t message_type;
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t uncompressed_bytes;
+    uint64_t total_latency_us;
+    uint64_t max_latency_us;
+} SpiceMessageStats;
+
+/* Returns the statistics of every message type sent so far by every
+ * connected channel client, num_stats is set to the number of entries.
+ * The array must be released with spice_server_free_message_stats().
+ * Must be called from the main thread. Since 0.14.3 */
+SpiceMessageStats *spice_server_get_message_stats(SpiceServer *s, size_t *num_stats);
+void spice_server_free_message_stats(SpiceMessageStats *stats);
+
 #endif /* SPICE_SERVER_H_ */
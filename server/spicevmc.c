@@ -44,6 +44,10 @@
 #define BUF_SIZE (64 * 1024 + 32)
 #define COMPRESS_THRESHOLD 1000
 
+/* Reading from the device stops while the data queued for the client
+ * reach this size, so the guest is throttled instead of the queue growing */
+#define MAX_QUEUED_BYTES (16 * BUF_SIZE)
+
 SPICE_DECLARE_TYPE(RedCharDeviceSpiceVmc, red_char_device_spicevmc, CHAR_DEVICE_SPICEVMC);
 #define RED_TYPE_CHAR_DEVICE_SPICEVMC red_char_device_spicevmc_get_type()
 
@@ -70,6 +74,9 @@ typedef struct RedVmcPipeItem {
     /* writes which don't fit this will get split, this is not a problem */
     uint8_t buf[BUF_SIZE];
     uint32_t buf_used;
+    /* compressed data, allocated on first use and kept with the item */
+    uint8_t *compressed_buf;
+    uint32_t compressed_size;
 } RedVmcPipeItem;
 
 struct RedCharDeviceSpiceVmc {
@@ -96,6 +103,10 @@ struct RedVmcChannel
     RedCharDevice *chardev; /* weak */
     SpiceCharDeviceInstance *chardev_sin;
     RedVmcPipeItem *pipe_item;
+    /* last data item added to the pipe, while it is not sent the data read
+     * from the device are appended to it */
+    RedVmcPipeItem *queued_item;
+    uint64_t queued_bytes;
     RedCharDeviceWriteBuffer *recv_from_client_buf;
     uint8_t port_opened;
     RedStatCounter in_data;
@@ -223,6 +234,9 @@ red_vmc_channel_finalize(GObject *object)
     if (self->pipe_item) {
         red_pipe_item_unref(&self->pipe_item->base);
     }
+    if (self->queued_item) {
+        red_pipe_item_unref(&self->queued_item->base);
+    }
 
     G_OBJECT_CLASS(red_vmc_channel_parent_class)->finalize(object);
 }
@@ -285,93 +299,128 @@ static void spicevmc_red_channel_release_msg_rcv_buf(RedChannelClient *rcc,
                                                      uint16_t type,
                                                      uint32_t size,
                                                      uint8_t *msg);
-/* n is the data size (uncompressed)
- * msg_item -- the current pipe item with the uncompressed data
- * This function returns:
- *  - NULL upon failure.
- *  - a new pipe item with the compressed data in it upon success
- */
+
 #ifdef USE_LZ4
-static RedVmcPipeItem* try_compress_lz4(RedVmcChannel *channel, int n, RedVmcPipeItem *msg_item)
+/* Compress the data of a data item about to be sent, return whether it
+ * was compressed */
+static bool try_compress_lz4(RedVmcChannel *channel, RedChannelClient *rcc,
+                             RedVmcPipeItem *msg_item)
 {
-    RedVmcPipeItem *msg_item_compressed;
+    int n = msg_item->buf_used;
     int compressed_data_count;
 
-    if (red_stream_get_family(red_channel_client_get_stream(channel->rcc)) == AF_UNIX) {
+    if (red_stream_get_family(red_channel_client_get_stream(rcc)) == AF_UNIX) {
         /* AF_LOCAL - data will not be compressed */
-        return NULL;
+        return FALSE;
     }
     if (n <= COMPRESS_THRESHOLD) {
         /* n <= threshold - data will not be compressed */
-        return NULL;
+        return FALSE;
     }
-    if (!red_channel_test_remote_cap(RED_CHANNEL(channel), SPICE_SPICEVMC_CAP_DATA_COMPRESS_LZ4)) {
+    if (!red_channel_client_test_remote_cap(rcc, SPICE_SPICEVMC_CAP_DATA_COMPRESS_LZ4)) {
         /* Client doesn't have compression cap - data will not be compressed */
-        return NULL;
+        return FALSE;
+    }
+    if (!msg_item->compressed_buf) {
+        msg_item->compressed_buf = g_malloc(BUF_SIZE);
     }
-    msg_item_compressed = g_new0(RedVmcPipeItem, 1);
-    red_pipe_item_init(&msg_item_compressed->base, RED_PIPE_ITEM_TYPE_SPICEVMC_DATA);
     compressed_data_count = LZ4_compress_default((char*)&msg_item->buf,
-                                                 (char*)&msg_item_compressed->buf,
+                                                 (char*)msg_item->compressed_buf,
                                                  n,
                                                  BUF_SIZE);
 
     if (compressed_data_count > 0 && compressed_data_count < n) {
         stat_inc_counter(channel->out_uncompressed, n);
         stat_inc_counter(channel->out_compressed, compressed_data_count);
-        msg_item_compressed->type = SPICE_DATA_COMPRESSION_TYPE_LZ4;
-        msg_item_compressed->uncompressed_data_size = n;
-        msg_item_compressed->buf_used = compressed_data_count;
-        g_free(msg_item);
-        return msg_item_compressed;
+        msg_item->type = SPICE_DATA_COMPRESSION_TYPE_LZ4;
+        msg_item->compressed_size = compressed_data_count;
+        return TRUE;
     }
 
     /* LZ4 compression failed or did non compress, fallback a non-compressed data is to be sent */
-    g_free(msg_item_compressed);
-    return NULL;
+    return FALSE;
 }
 #endif
 
+static void spicevmc_pipe_item_free(RedPipeItem *base)
+{
+    RedVmcPipeItem *item = SPICE_UPCAST(RedVmcPipeItem, base);
+
+    g_free(item->compressed_buf);
+    g_free(item);
+}
+
+/* Read from the device until it has no more data or the buffer of the
+ * item is full, return the number of bytes read */
+static int spicevmc_read_to_item(SpiceCharDeviceInstance *sin, RedVmcPipeItem *item)
+{
+    SpiceCharDeviceInterface *sif = spice_char_device_get_interface(sin);
+    int total = 0;
+
+    while (item->buf_used < sizeof(item->buf)) {
+        int n = sif->read(sin, item->buf + item->buf_used,
+                          sizeof(item->buf) - item->buf_used);
+        if (n <= 0) {
+            break;
+        }
+        item->buf_used += n;
+        total += n;
+    }
+    return total;
+}
+
+static void spicevmc_release_queued_item(RedVmcChannel *channel)
+{
+    if (channel->queued_item) {
+        red_pipe_item_unref(&channel->queued_item->base);
+        channel->queued_item = NULL;
+    }
+}
+
 static RedPipeItem *spicevmc_chardev_read_msg_from_dev(RedCharDevice *self,
                                                        SpiceCharDeviceInstance *sin)
 {
     RedCharDeviceSpiceVmc *vmc = RED_CHAR_DEVICE_SPICEVMC(self);
     RedVmcChannel *channel = RED_VMC_CHANNEL(vmc->channel);
-    SpiceCharDeviceInterface *sif;
     RedVmcPipeItem *msg_item;
     int n;
 
-    sif = spice_char_device_get_interface(sin);
-
     if (!channel->rcc) {
         return NULL;
     }
 
+    if (channel->queued_bytes >= MAX_QUEUED_BYTES) {
+        /* the client is not keeping up, reading is resumed once some of
+         * the queued data are sent */
+        return NULL;
+    }
+
+    /* the client did not get the last message yet, coalesce the new data
+     * with it instead of queueing more messages */
+    if (channel->queued_item) {
+        n = spicevmc_read_to_item(sin, channel->queued_item);
+        channel->queued_bytes += n;
+        if (channel->queued_item->buf_used < sizeof(channel->queued_item->buf)) {
+            return NULL;
+        }
+        spicevmc_release_queued_item(channel);
+    }
+
     if (!channel->pipe_item) {
         msg_item = g_new0(RedVmcPipeItem, 1);
         msg_item->type = SPICE_DATA_COMPRESSION_TYPE_NONE;
-        red_pipe_item_init(&msg_item->base, RED_PIPE_ITEM_TYPE_SPICEVMC_DATA);
+        red_pipe_item_init_full(&msg_item->base, RED_PIPE_ITEM_TYPE_SPICEVMC_DATA,
+                                spicevmc_pipe_item_free);
     } else {
         spice_assert(channel->pipe_item->buf_used == 0);
         msg_item = channel->pipe_item;
         channel->pipe_item = NULL;
     }
 
-    n = sif->read(sin, msg_item->buf,
-                  sizeof(msg_item->buf));
+    n = spicevmc_read_to_item(sin, msg_item);
     if (n > 0) {
         spice_debug("read from dev %d", n);
-#ifdef USE_LZ4
-        RedVmcPipeItem *msg_item_compressed;
-
-        msg_item_compressed = try_compress_lz4(channel, n, msg_item);
-        if (msg_item_compressed != NULL) {
-            return &msg_item_compressed->base;
-        }
-#endif
-        stat_inc_counter(channel->out_data, n);
-        msg_item->uncompressed_data_size = n;
-        msg_item->buf_used = n;
+        channel->queued_bytes += n;
         return &msg_item->base;
     } else {
         channel->pipe_item = msg_item;
@@ -387,6 +436,9 @@ static void spicevmc_chardev_send_msg_to_client(RedCharDevice *self,
     RedVmcChannel *channel = RED_VMC_CHANNEL(vmc->channel);
 
     spice_assert(red_channel_client_get_client(channel->rcc) == client);
+    spicevmc_release_queued_item(channel);
+    red_pipe_item_ref(msg);
+    channel->queued_item = SPICE_UPCAST(RedVmcPipeItem, msg);
     red_pipe_item_ref(msg);
     red_channel_client_pipe_add_push(channel->rcc, msg);
 }
@@ -408,15 +460,19 @@ static void spicevmc_port_send_init(RedChannelClient *rcc)
     red_pipe_item_init_full(&item->base, RED_PIPE_ITEM_TYPE_PORT_INIT, red_port_init_item_free);
     item->name = g_strdup(sin->portname);
     item->opened = channel->port_opened;
+    /* later data must not be appended to a message sent before this one */
+    spicevmc_release_queued_item(channel);
     red_channel_client_pipe_add_push(rcc, &item->base);
 }
 
 static void spicevmc_port_send_event(RedChannelClient *rcc, uint8_t event)
 {
+    RedVmcChannel *channel = RED_VMC_CHANNEL(red_channel_client_get_channel(rcc));
     RedPortEventPipeItem *item = g_new(RedPortEventPipeItem, 1);
 
     red_pipe_item_init(&item->base, RED_PIPE_ITEM_TYPE_PORT_EVENT);
     item->event = event;
+    spicevmc_release_queued_item(channel);
     red_channel_client_pipe_add_push(rcc, &item->base);
 }
 
@@ -443,6 +499,10 @@ static void spicevmc_red_channel_client_on_disconnect(RedChannelClient *rcc)
     /* partial message which wasn't pushed to device */
     red_char_device_write_buffer_release(channel->chardev, &channel->recv_from_client_buf);
 
+    /* the data queued for the client were dropped with the pipe */
+    spicevmc_release_queued_item(channel);
+    channel->queued_bytes = 0;
+
     if (channel->chardev) {
         if (red_char_device_client_exists(channel->chardev, client)) {
             red_char_device_client_remove(channel->chardev, client);
@@ -467,6 +527,10 @@ static void spicevmc_red_channel_client_on_disconnect(RedChannelClient *rcc)
 
 static bool spicevmc_channel_client_handle_migrate_flush_mark(RedChannelClient *rcc)
 {
+    RedVmcChannel *channel = RED_VMC_CHANNEL(red_channel_client_get_channel(rcc));
+
+    /* no data must be appended to a message queued before the migration data */
+    spicevmc_release_queued_item(channel);
     red_channel_client_pipe_add_type(rcc, RED_PIPE_ITEM_TYPE_SPICEVMC_MIGRATE_DATA);
     return TRUE;
 }
@@ -624,11 +688,28 @@ static void spicevmc_red_channel_send_data(RedChannelClient *rcc,
                                            SpiceMarshaller *m,
                                            RedPipeItem *item)
 {
+    RedVmcChannel *channel = RED_VMC_CHANNEL(red_channel_client_get_channel(rcc));
     RedVmcPipeItem *i = SPICE_UPCAST(RedVmcPipeItem, item);
+    bool was_full = channel->queued_bytes >= MAX_QUEUED_BYTES;
+
+    /* no more data can be added to the item */
+    if (channel->queued_item == i) {
+        spicevmc_release_queued_item(channel);
+    }
+    channel->queued_bytes -= MIN(channel->queued_bytes, i->buf_used);
+
+    i->uncompressed_data_size = i->buf_used;
+#ifdef USE_LZ4
+    try_compress_lz4(channel, rcc, i);
+#endif
 
     /* for compatibility send using not compressed data message */
     if (i->type == SPICE_DATA_COMPRESSION_TYPE_NONE) {
+        stat_inc_counter(channel->out_data, i->buf_used);
         red_channel_client_init_send_data(rcc, SPICE_MSG_SPICEVMC_DATA);
+        red_pipe_item_ref(item);
+        spice_marshaller_add_by_ref_full(m, i->buf, i->buf_used,
+                                         marshaller_unref_pipe_item, item);
     } else {
         /* send as compressed */
         red_channel_client_init_send_data(rcc, SPICE_MSG_SPICEVMC_COMPRESSED_DATA);
@@ -637,10 +718,16 @@ static void spicevmc_red_channel_send_data(RedChannelClient *rcc,
             .uncompressed_size = i->uncompressed_data_size
         };
         spice_marshall_SpiceMsgCompressedData(m, &compressed_msg);
+        red_channel_client_add_compressed_data(rcc, i->compressed_size,
+                                               i->uncompressed_data_size);
+        red_pipe_item_ref(item);
+        spice_marshaller_add_by_ref_full(m, i->compressed_buf, i->compressed_size,
+                                         marshaller_unref_pipe_item, item);
+    }
+
+    if (was_full && channel->queued_bytes < MAX_QUEUED_BYTES && channel->chardev) {
+        red_char_device_wakeup(channel->chardev);
     }
-    red_pipe_item_ref(item);
-    spice_marshaller_add_by_ref_full(m, i->buf, i->buf_used,
-                                     marshaller_unref_pipe_item, item);
 }
 
 static void spicevmc_red_channel_send_migrate_data(RedChannelClient *rcc,
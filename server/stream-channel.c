@@ -54,6 +54,14 @@ struct StreamChannelClient {
     /* current video stream id, <0 if not initialized or
      * we are not sending a stream */
     int stream_id;
+
+    /* frames in the pipe, not yet given to the socket */
+    uint32_t queued_frames;
+    uint64_t queued_bytes;
+    /* the last stream report showed the client dropping or
+     * displaying late the frames */
+    bool lagging;
+    uint32_t num_frames;
 };
 
 struct StreamChannelClientClass {
@@ -72,6 +80,9 @@ struct StreamChannel {
     int stream_id;
     /* size of the current video stream */
     unsigned width, height;
+    /* every frame of the current stream can be decoded alone (MJPEG) so
+     * frames can be dropped for the clients that can't keep up */
+    bool frames_droppable;
 
     StreamQueueStat queue_stat;
 
@@ -106,16 +117,24 @@ typedef struct StreamCreateItem {
     SpiceMsgDisplayStreamCreate stream_create;
 } StreamCreateItem;
 
-typedef struct StreamDataItem {
+struct StreamDataItem {
     RedPipeItem base;
-    StreamChannel *channel;
+    StreamChannel *channel; // set once the item is queued to the clients
     // NOTE: this must be the last field in the structure
     SpiceMsgDisplayStreamData data;
-} StreamDataItem;
+};
 
 #define PRIMARY_SURFACE_ID 0
 
+/* a client with this number of frames in its pipe is congested */
+#define STREAM_CLIENT_MAX_QUEUED_FRAMES 2
+/* a client is also congested if it would take more than this time to
+ * send it its queued frames and for them to reach it */
+#define STREAM_CLIENT_MAX_LATENCY_MS 150
+
 static void stream_channel_client_on_disconnect(RedChannelClient *rcc);
+static void stream_channel_update_queue_stat(StreamChannel *channel,
+                                             int32_t num_diff, int32_t size_diff);
 
 RECORDER(stream_channel_data, 32, "Stream channel data packet");
 
@@ -287,6 +306,10 @@ stream_channel_send_item(RedChannelClient *rcc, RedPipeItem *pipe_item)
     }
     case RED_PIPE_ITEM_TYPE_STREAM_DATA: {
         StreamDataItem *item = SPICE_UPCAST(StreamDataItem, pipe_item);
+        client->queued_frames--;
+        client->queued_bytes -= item->data.data_size;
+        // the client may be able to accept frames again
+        stream_channel_update_queue_stat(channel, 0, 0);
         red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_STREAM_DATA);
         spice_marshall_msg_display_stream_data(m, &item->data);
         red_pipe_item_ref(pipe_item);
@@ -313,6 +336,22 @@ stream_channel_send_item(RedChannelClient *rcc, RedPipeItem *pipe_item)
     red_channel_client_begin_send_message(rcc);
 }
 
+static void
+stream_channel_client_handle_stream_report(StreamChannelClient *client,
+                                           const SpiceMsgcDisplayStreamReport *report)
+{
+    if ((int) report->stream_id != client->stream_id || report->num_frames == 0) {
+        return;
+    }
+
+    // more than 10% of the frames dropped by the client or frames
+    // displayed after their time, the client can't keep up
+    client->lagging = report->num_drops * 10 > report->num_frames ||
+                      report->last_frame_delay < 0;
+    record(stream_channel_data, "Stream report frames %u drops %u delay %d",
+           report->num_frames, report->num_drops, report->last_frame_delay);
+}
+
 static bool
 handle_message(RedChannelClient *rcc, uint16_t type, uint32_t size, void *msg)
 {
@@ -321,7 +360,7 @@ handle_message(RedChannelClient *rcc, uint16_t type, uint32_t size, void *msg)
     case SPICE_MSGC_DISPLAY_PREFERRED_COMPRESSION:
         return true;
     case SPICE_MSGC_DISPLAY_STREAM_REPORT:
-        /* TODO these will help tune the streaming reducing/increasing quality */
+        stream_channel_client_handle_stream_report(STREAM_CHANNEL_CLIENT(rcc), msg);
         return true;
     case SPICE_MSGC_DISPLAY_GL_DRAW_DONE:
         /* client should not send this message */
@@ -503,6 +542,7 @@ stream_channel_change_format(StreamChannel *channel, const StreamMsgFormat *fmt)
 
     // allocate a new stream id
     channel->stream_id = (channel->stream_id + 1) % NUM_STREAMS;
+    channel->frames_droppable = fmt->codec == SPICE_VIDEO_CODEC_TYPE_MJPEG;
 
     // send create stream
     StreamCreateItem *item = g_new0(StreamCreateItem, 1);
@@ -522,12 +562,64 @@ stream_channel_change_format(StreamChannel *channel, const StreamMsgFormat *fmt)
     red_channel_pipes_add_type(red_channel, RED_PIPE_ITEM_TYPE_STREAM_ACTIVATE_REPORT);
 }
 
-static inline void
+static bool
+stream_channel_client_is_congested(StreamChannelClient *client)
+{
+    if (client->queued_frames >= STREAM_CLIENT_MAX_QUEUED_FRAMES) {
+        return true;
+    }
+    if (client->queued_frames == 0) {
+        return false;
+    }
+
+    RedStream *stream = red_channel_client_get_stream(RED_CHANNEL_CLIENT(client));
+    uint64_t bandwidth = red_stream_get_bandwidth(stream);
+    int roundtrip = red_stream_get_roundtrip_ms(stream);
+    if (bandwidth == 0) {
+        return false;
+    }
+    uint64_t latency = client->queued_bytes * 8 * 1000 / bandwidth + MAX(roundtrip, 0) / 2;
+    return latency > STREAM_CLIENT_MAX_LATENCY_MS;
+}
+
+// whether the frame should not be sent to the client to let it catch up
+static bool
+stream_channel_client_drop_frame(StreamChannelClient *client)
+{
+    client->num_frames++;
+    if (stream_channel_client_is_congested(client)) {
+        return true;
+    }
+    // send half of the frames while the client reports it can't keep up
+    return client->lagging && (client->num_frames & 1);
+}
+
+static bool
+stream_channel_is_congested(StreamChannel *channel)
+{
+    RedChannelClient *rcc;
+
+    // the frames can't be dropped, the slowest client sets the pace
+    if (!channel->frames_droppable) {
+        return channel->queue_stat.num_items > 0;
+    }
+
+    // read frames as long as a client can take them
+    FOREACH_CLIENT(channel, rcc) {
+        if (!stream_channel_client_is_congested(STREAM_CHANNEL_CLIENT(rcc))) {
+            return false;
+        }
+    }
+    return channel->queue_stat.num_items > 0;
+}
+
+static void
 stream_channel_update_queue_stat(StreamChannel *channel,
                                  int32_t num_diff, int32_t size_diff)
 {
     channel->queue_stat.num_items += num_diff;
     channel->queue_stat.size += size_diff;
+    channel->queue_stat.congested = stream_channel_is_congested(channel);
     if (channel->queue_cb) {
         channel->queue_cb(channel->queue_opaque, &channel->queue_stat, channel);
     }
@@ -538,34 +630,66 @@ data_item_free(RedPipeItem *base)
 {
     StreamDataItem *pipe_item = SPICE_UPCAST(StreamDataItem, base);
 
-    stream_channel_update_queue_stat(pipe_item->channel, -1, -pipe_item->data.data_size);
+    if (pipe_item->channel) {
+        stream_channel_update_queue_stat(pipe_item->channel, -1, -pipe_item->data.data_size);
+    }
 
     g_free(pipe_item);
 }
 
+StreamDataItem *
+stream_channel_data_item_new(StreamChannel *channel, size_t size)
+{
+    StreamDataItem *item = g_malloc(sizeof(*item) + size);
+    red_pipe_item_init_full(&item->base, RED_PIPE_ITEM_TYPE_STREAM_DATA,
+                            data_item_free);
+    item->channel = NULL;
+    item->data.data_size = size;
+    return item;
+}
+
+uint8_t *
+stream_channel_data_item_get_data(StreamDataItem *item)
+{
+    return item->data.data;
+}
+
+void
+stream_channel_data_item_unref(StreamDataItem *item)
+{
+    red_pipe_item_unref(&item->base);
+}
+
 void
-stream_channel_send_data(StreamChannel *channel, const void *data, size_t size, uint32_t mm_time)
+stream_channel_send_data_item(StreamChannel *channel, StreamDataItem *item, uint32_t mm_time)
 {
     if (channel->stream_id < 0) {
         // this condition can happen if the guest didn't handle
         // the format stop that we send so think the stream is still
         // started
+        stream_channel_data_item_unref(item);
         return;
     }
 
-    RedChannel *red_channel = RED_CHANNEL(channel);
+    RedChannelClient *rcc;
 
-    StreamDataItem *item = g_malloc(sizeof(*item) + size);
-    red_pipe_item_init_full(&item->base, RED_PIPE_ITEM_TYPE_STREAM_DATA,
-                            data_item_free);
     item->data.base.id = channel->stream_id;
     item->data.base.multi_media_time = mm_time;
-    item->data.data_size = size;
     item->channel = channel;
-    stream_channel_update_queue_stat(channel, 1, size);
-    // TODO try to optimize avoiding the copy
-    memcpy(item->data.data, data, size);
-    red_channel_pipes_add(red_channel, &item->base);
+    // the same item is referenced by all the clients until sent
+    FOREACH_CLIENT(channel, rcc) {
+        StreamChannelClient *client = STREAM_CHANNEL_CLIENT(rcc);
+        if (channel->frames_droppable && stream_channel_client_drop_frame(client)) {
+            record(stream_channel_data, "Stream data packet dropped mm_time %u", mm_time);
+            continue;
+        }
+        client->queued_frames++;
+        client->queued_bytes += item->data.data_size;
+        red_pipe_item_ref(&item->base);
+        red_channel_client_pipe_add(rcc, &item->base);
+    }
+    stream_channel_update_queue_stat(channel, 1, item->data.data_size);
+    stream_channel_data_item_unref(item);
 }
 
 void
@@ -584,6 +708,18 @@ stream_channel_register_queue_stat_cb(StreamChannel *channel,
     channel->queue_opaque = opaque;
 }
 
+uint32_t
+stream_channel_get_max_queued_frames(StreamChannel *channel)
+{
+    RedChannelClient *rcc;
+    uint32_t max_queued_frames = 0;
+
+    FOREACH_CLIENT(channel, rcc) {
+        max_queued_frames = MAX(max_queued_frames, STREAM_CHANNEL_CLIENT(rcc)->queued_frames);
+    }
+    return max_queued_frames;
+}
+
 void
 stream_channel_reset(StreamChannel *channel)
 {
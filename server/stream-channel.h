@@ -60,9 +60,21 @@ struct StreamMsgStartStop;
 
 void stream_channel_change_format(StreamChannel *channel,
                                   const struct StreamMsgFormat *fmt);
-void stream_channel_send_data(StreamChannel *channel,
-                              const void *data, size_t size,
-                              uint32_t mm_time);
+
+typedef struct StreamDataItem StreamDataItem;
+
+/**
+ * Allocate the item holding a frame of size bytes.
+ * The frame has to be written to stream_channel_data_item_get_data()
+ * and the item then passed to stream_channel_send_data_item(), so the
+ * frame is not copied again before being sent to the clients.
+ */
+StreamDataItem *stream_channel_data_item_new(StreamChannel *channel, size_t size);
+uint8_t *stream_channel_data_item_get_data(StreamDataItem *item);
+void stream_channel_data_item_unref(StreamDataItem *item);
+/* takes ownership of item */
+void stream_channel_send_data_item(StreamChannel *channel, StreamDataItem *item,
+                                   uint32_t mm_time);
 
 typedef void (*stream_channel_start_proc)(void *opaque, struct StreamMsgStartStop *start,
                                           StreamChannel *channel);
@@ -72,6 +84,9 @@ void stream_channel_register_start_cb(StreamChannel *channel,
 typedef struct StreamQueueStat {
     uint32_t num_items;
     uint32_t size;
+    /* the clients can't take more frames for now, the device should stop
+     * reading them until the stats change again */
+    bool congested;
 } StreamQueueStat;
 
 typedef void (*stream_channel_queue_stat_proc)(void *opaque, const StreamQueueStat *stats,
@@ -79,6 +94,11 @@ typedef void (*stream_channel_queue_stat_proc)(void *opaque, const StreamQueueSt
 void stream_channel_register_queue_stat_cb(StreamChannel *channel,
                                            stream_channel_queue_stat_proc cb, void *opaque);
 
+/**
+ * Number of frames waiting to be sent to the slowest client.
+ */
+uint32_t stream_channel_get_max_queued_frames(StreamChannel *channel);
+
 G_END_DECLS
 
 #endif /* STREAM_CHANNEL_H_ */
@@ -0,0 +1,237 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2019 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <sys/mman.h>
+
+#include "surface-pool.h"
+
+/* buffers smaller than 64KB are left to the allocator, the ones bigger
+ * than 64MB are rare enough not to be worth keeping */
+#define SURFACE_POOL_MIN_SHIFT 16
+#define SURFACE_POOL_MAX_SHIFT 26
+#define SURFACE_POOL_N_BUCKETS (SURFACE_POOL_MAX_SHIFT - SURFACE_POOL_MIN_SHIFT + 1)
+
+/* maximum size of the unused buffers kept by the pool */
+#define SURFACE_POOL_MAX_POOLED_BYTES (128 * 1024 * 1024)
+
+/* buffers not reused for this long are freed */
+#define SURFACE_POOL_IDLE_TIME_MS 5000
+
+typedef struct SurfacePoolBlock SurfacePoolBlock;
+struct SurfacePoolBlock {
+    SurfacePoolBlock *next;
+    size_t alloc_size; // header included
+    int bucket; // -1 if the block is not pooled
+    bool mapped;
+    red_time_t release_time;
+};
+
+/* keep the data aligned on a cache line */
+#define SURFACE_POOL_HEADER_SIZE SPICE_ALIGN(sizeof(SurfacePoolBlock), 64)
+#define BLOCK_DATA(block) ((uint8_t *)(block) + SURFACE_POOL_HEADER_SIZE)
+#define DATA_BLOCK(data) ((SurfacePoolBlock *)((uint8_t *)(data) - SURFACE_POOL_HEADER_SIZE))
+
+struct SurfacePool {
+    SurfacePoolBlock *buckets[SURFACE_POOL_N_BUCKETS];
+    uint64_t pooled_bytes;
+    uint64_t resident_bytes;
+
+    SpiceCoreInterfaceInternal *core;
+    SpiceTimer *trim_timer;
+    bool trim_pending;
+
+    RedStatNode stat;
+    RedStatCounter hits_counter;
+    RedStatCounter misses_counter;
+    RedStatCounter resident_bytes_counter;
+    RedStatCounter pooled_bytes_counter;
+    RedStatCounter trimmed_bytes_counter;
+};
+
+static void surface_pool_trim_timer(void *opaque)
+{
+    SurfacePool *pool = opaque;
+
+    pool->trim_pending = false;
+    surface_pool_trim(pool, SURFACE_POOL_IDLE_TIME_MS * NSEC_PER_MILLISEC);
+    if (pool->pooled_bytes) {
+        pool->trim_pending = true;
+        pool->core->timer_start(pool->core, pool->trim_timer, SURFACE_POOL_IDLE_TIME_MS);
+    }
+}
+
+SurfacePool *surface_pool_new(SpiceCoreInterfaceInternal *core,
+                              RedsState *reds, const RedStatNode *parent)
+{
+    SurfacePool *pool = g_new0(SurfacePool, 1);
+
+    pool->core = core;
+    pool->trim_timer = core->timer_add(core, surface_pool_trim_timer, pool);
+
+    stat_init_node(&pool->stat, reds, parent, "surface_pool", TRUE);
+    stat_init_counter(&pool->hits_counter, reds, &pool->stat, "hits", TRUE);
+    stat_init_counter(&pool->misses_counter, reds, &pool->stat, "misses", TRUE);
+    stat_init_counter(&pool->resident_bytes_counter, reds, &pool->stat, "resident_bytes", TRUE);
+    stat_init_counter(&pool->pooled_bytes_counter, reds, &pool->stat, "pooled_bytes", TRUE);
+    stat_init_counter(&pool->trimmed_bytes_counter, reds, &pool->stat, "trimmed_bytes", TRUE);
+    return pool;
+}
+
+void surface_pool_free(SurfacePool *pool)
+{
+    if (!pool) {
+        return;
+    }
+    surface_pool_trim(pool, 0);
+    pool->core->timer_remove(pool->core, pool->trim_timer);
+    g_free(pool);
+}
+
+static int surface_pool_get_bucket(size_t size)
+{
+    int shift;
+
+    for (shift = SURFACE_POOL_MIN_SHIFT; shift <= SURFACE_POOL_MAX_SHIFT; shift++) {
+        if (size <= ((size_t) 1 << shift)) {
+            return shift - SURFACE_POOL_MIN_SHIFT;
+        }
+    }
+    return -1;
+}
+
+static SurfacePoolBlock *surface_pool_block_new(SurfacePool *pool, size_t alloc_size)
+{
+    SurfacePoolBlock *block = NULL;
+    bool mapped = false;
+
+    /* large blocks are mapped so they are returned to the system when freed,
+     * the pages of the bucket rounding not written are not resident */
+    if (alloc_size >= ((size_t) 1 << SURFACE_POOL_MIN_SHIFT)) {
+        void *ptr = mmap(NULL, alloc_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr != MAP_FAILED) {
+            block = ptr;
+            mapped = true;
+        }
+    }
+    if (!block) {
+        block = g_malloc(alloc_size);
+    }
+
+    block->next = NULL;
+    block->alloc_size = alloc_size;
+    block->mapped = mapped;
+    pool->resident_bytes += alloc_size;
+    return block;
+}
+
+static void surface_pool_block_free(SurfacePool *pool, SurfacePoolBlock *block)
+{
+    pool->resident_bytes -= block->alloc_size;
+    if (block->mapped) {
+        munmap(block, block->alloc_size);
+    } else {
+        g_free(block);
+    }
+}
+
+void *surface_pool_alloc(SurfacePool *pool, size_t size)
+{
+    SurfacePoolBlock *block;
+    int bucket = -1;
+
+    if (size >= ((size_t) 1 << (SURFACE_POOL_MIN_SHIFT - 1))) {
+        bucket = surface_pool_get_bucket(size);
+    }
+
+    if (bucket >= 0 && (block = pool->buckets[bucket]) != NULL) {
+        pool->buckets[bucket] = block->next;
+        pool->pooled_bytes -= block->alloc_size;
+        stat_inc_counter(pool->hits_counter, 1);
+    } else {
+        size_t alloc_size = SURFACE_POOL_HEADER_SIZE +
+            (bucket >= 0 ? (size_t) 1 << (bucket + SURFACE_POOL_MIN_SHIFT) : size);
+        block = surface_pool_block_new(pool, alloc_size);
+        stat_inc_counter(pool->misses_counter, 1);
+    }
+    block->bucket = bucket;
+    block->next = NULL;
+
+    stat_set_counter(pool->resident_bytes_counter, pool->resident_bytes);
+    stat_set_counter(pool->pooled_bytes_counter, pool->pooled_bytes);
+    return BLOCK_DATA(block);
+}
+
+void surface_pool_release(SurfacePool *pool, void *data)
+{
+    SurfacePoolBlock *block;
+
+    if (!data) {
+        return;
+    }
+    block = DATA_BLOCK(data);
+
+    if (block->bucket < 0 ||
+        pool->pooled_bytes + block->alloc_size > SURFACE_POOL_MAX_POOLED_BYTES) {
+        surface_pool_block_free(pool, block);
+    } else {
+        block->release_time = spice_get_monotonic_time_ns();
+        block->next = pool->buckets[block->bucket];
+        pool->buckets[block->bucket] = block;
+        pool->pooled_bytes += block->alloc_size;
+        if (!pool->trim_pending) {
+            pool->trim_pending = true;
+            pool->core->timer_start(pool->core, pool->trim_timer, SURFACE_POOL_IDLE_TIME_MS);
+        }
+    }
+
+    stat_set_counter(pool->resident_bytes_counter, pool->resident_bytes);
+    stat_set_counter(pool->pooled_bytes_counter, pool->pooled_bytes);
+}
+
+uint64_t surface_pool_get_pooled_bytes(const SurfacePool *pool)
+{
+    return pool->pooled_bytes;
+}
+
+void surface_pool_trim(SurfacePool *pool, red_time_t idle_time)
+{
+    red_time_t now = spice_get_monotonic_time_ns();
+    int bucket;
+
+    for (bucket = 0; bucket < SURFACE_POOL_N_BUCKETS; bucket++) {
+        SurfacePoolBlock **link = &pool->buckets[bucket];
+
+        /* the most recently released blocks are at the head */
+        while (*link && now - (*link)->release_time < idle_time) {
+            link = &(*link)->next;
+        }
+        while (*link) {
+            SurfacePoolBlock *block = *link;
+
+            *link = block->next;
+            pool->pooled_bytes -= block->alloc_size;
+            stat_inc_counter(pool->trimmed_bytes_counter, block->alloc_size);
+            surface_pool_block_free(pool, block);
+        }
+    }
+
+    stat_set_counter(pool->resident_bytes_counter, pool->resident_bytes);
+    stat_set_counter(pool->pooled_bytes_counter, pool->pooled_bytes);
+}
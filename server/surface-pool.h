@@ -0,0 +1,52 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2019 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SURFACE_POOL_H_
+#define SURFACE_POOL_H_
+
+#include <glib.h>
+
+#include "red-common.h"
+#include "stat.h"
+
+G_BEGIN_DECLS
+
+/* Pool of the large buffers holding copies of surface areas.
+ * Released buffers are kept in power of two size buckets and reused, so
+ * guests creating and destroying off-screen surfaces don't cause
+ * allocations and page faults for each of them. The buffers not reused
+ * for a while are released from a timer.
+ * Not thread safe, to be used from the thread of the worker only. */
+typedef struct SurfacePool SurfacePool;
+
+SurfacePool *surface_pool_new(SpiceCoreInterfaceInternal *core,
+                              RedsState *reds, const RedStatNode *parent);
+void surface_pool_free(SurfacePool *pool);
+
+void *surface_pool_alloc(SurfacePool *pool, size_t size);
+void surface_pool_release(SurfacePool *pool, void *data);
+
+/* Returns the size of the unused buffers kept by the pool */
+uint64_t surface_pool_get_pooled_bytes(const SurfacePool *pool);
+
+/* Free the pooled buffers not used since at least idle_time, 0 frees them all */
+void surface_pool_trim(SurfacePool *pool, red_time_t idle_time);
+
+G_END_DECLS
+
+#endif /* SURFACE_POOL_H_ */
@@ -0,0 +1,700 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/* Throughput benchmark of the agent (VDI port) path
+ * (see program_description below)
+ */
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <glib.h>
+#include <openssl/bio.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+#include <spice/protocol.h>
+#include <spice/vd_agent.h>
+
+#include "test-display-base.h"
+#include "main-channel.h"
+
+static const char program_description[] =
+    "Transfers file data through the agent channel between an in-process\n"
+    "client, connected with a socket pair, and a fake vdagent char device\n"
+    "which produces and discards data as fast as the server allows.\n"
+    "Both directions are measured with several simulated round trip times,\n"
+    "the client delays the handling of each received message (including the\n"
+    "agent tokens) by the round trip time. As the device is never the\n"
+    "bottleneck the results show the limits of the flow control window.\n"
+    "Throughput and agent messages per second are reported as JSON.";
+
+#define MINI_HEADER_SIZE 6
+
+typedef enum {
+    DIRECTION_CLIENT_TO_GUEST,
+    DIRECTION_GUEST_TO_CLIENT,
+} Direction;
+
+typedef struct {
+    const char *name;
+    Direction direction;
+    int rtt_ms;
+} Profile;
+
+static const Profile profiles[] = {
+    { "client-to-guest", DIRECTION_CLIENT_TO_GUEST, 0 },
+    { "client-to-guest-10ms", DIRECTION_CLIENT_TO_GUEST, 10 },
+    { "client-to-guest-50ms", DIRECTION_CLIENT_TO_GUEST, 50 },
+    { "guest-to-client", DIRECTION_GUEST_TO_CLIENT, 0 },
+    { "guest-to-client-10ms", DIRECTION_GUEST_TO_CLIENT, 10 },
+    { "guest-to-client-50ms", DIRECTION_GUEST_TO_CLIENT, 50 },
+};
+
+/* Counters of the current profile.
+ * Updated from the main thread (device) and the client thread. */
+typedef struct {
+    pthread_mutex_t lock;
+    uint64_t bytes;
+    uint64_t messages;
+} BenchStats;
+
+static BenchStats stats = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* a file transfer message, written or read in a loop */
+typedef struct {
+    uint8_t *data;
+    uint32_t size;
+    uint32_t pos;
+} AgentStream;
+
+typedef struct {
+    gint64 due;
+    uint16_t type;
+    uint32_t size;
+    uint8_t data[];
+} PendingMessage;
+
+typedef struct {
+    int fd;
+    GByteArray *in;
+    GQueue pending;
+    uint32_t ack_window;
+    uint32_t ack_pending;
+    uint32_t agent_tokens;
+    uint32_t tokens_to_return;
+    AgentStream stream;
+} AgentClient;
+
+static int client_fd;
+static int client_ready;
+static int client_quit;
+static int current_direction = -1;
+static int current_rtt_ms;
+static uint32_t message_size = 64 * 1024;
+static uint32_t client_window = REDS_AGENT_WINDOW_SIZE;
+static AgentStream device_stream;
+static Test *test;
+
+static void record_transfer(uint64_t bytes, uint64_t messages)
+{
+    pthread_mutex_lock(&stats.lock);
+    stats.bytes += bytes;
+    stats.messages += messages;
+    pthread_mutex_unlock(&stats.lock);
+}
+
+/* build a VD_AGENT_FILE_XFER_DATA message, optionally preceded by a chunk header */
+static void agent_stream_init(AgentStream *stream, bool chunk_header)
+{
+    uint32_t header_size = chunk_header ? sizeof(VDIChunkHeader) : 0;
+    uint32_t msg_size = sizeof(VDAgentMessage) + sizeof(VDAgentFileXferDataMessage) +
+                        message_size;
+    VDAgentMessage msg = {
+        .protocol = VD_AGENT_PROTOCOL,
+        .type = VD_AGENT_FILE_XFER_DATA,
+        .size = msg_size - sizeof(VDAgentMessage),
+    };
+    VDAgentFileXferDataMessage xfer = {
+        .id = 1,
+        .size = message_size,
+    };
+
+    stream->size = header_size + msg_size;
+    stream->data = g_malloc(stream->size);
+    stream->pos = 0;
+    // avoid data which could look like an agent message header
+    memset(stream->data, 0xa5, stream->size);
+    if (chunk_header) {
+        VDIChunkHeader chunk = {
+            .port = VDP_CLIENT_PORT,
+            .size = msg_size,
+        };
+        memcpy(stream->data, &chunk, sizeof(chunk));
+    }
+    memcpy(stream->data + header_size, &msg, sizeof(msg));
+    memcpy(stream->data + header_size + sizeof(msg), &xfer, sizeof(xfer));
+}
+
+/* fake vdagent device, runs in the main thread */
+
+static int vmc_write(SPICE_GNUC_UNUSED SpiceCharDeviceInstance *sin,
+                     SPICE_GNUC_UNUSED const uint8_t *buf,
+                     int len)
+{
+    record_transfer(len, 0);
+    return len;
+}
+
+static int vmc_read(SPICE_GNUC_UNUSED SpiceCharDeviceInstance *sin,
+                    uint8_t *buf,
+                    int len)
+{
+    AgentStream *stream = &device_stream;
+    int ret;
+
+    if (g_atomic_int_get(&current_direction) != DIRECTION_GUEST_TO_CLIENT) {
+        return 0;
+    }
+    ret = MIN(stream->size - stream->pos, len);
+    memcpy(buf, stream->data + stream->pos, ret);
+    stream->pos += ret;
+    if (stream->pos == stream->size) {
+        stream->pos = 0;
+    }
+    return ret;
+}
+
+static void vmc_state(SPICE_GNUC_UNUSED SpiceCharDeviceInstance *sin,
+                      SPICE_GNUC_UNUSED int connected)
+{
+}
+
+static SpiceCharDeviceInterface vmc_interface = {
+    .base = {
+        .type          = SPICE_INTERFACE_CHAR_DEVICE,
+        .description   = "fake vdagent char device",
+        .major_version = SPICE_INTERFACE_CHAR_DEVICE_MAJOR,
+        .minor_version = SPICE_INTERFACE_CHAR_DEVICE_MINOR,
+    },
+    .state              = vmc_state,
+    .write              = vmc_write,
+    .read               = vmc_read,
+};
+
+static SpiceCharDeviceInstance vmc_instance = {
+    .subtype = "vdagent",
+};
+
+/* client */
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool client_send(AgentClient *client, uint16_t type, const void *data, uint32_t size)
+{
+    uint8_t header[MINI_HEADER_SIZE];
+    uint16_t type_le = GUINT16_TO_LE(type);
+    uint32_t size_le = GUINT32_TO_LE(size);
+
+    memcpy(header, &type_le, 2);
+    memcpy(header + 2, &size_le, 4);
+    return write_all(client->fd, header, sizeof(header)) &&
+           (size == 0 || write_all(client->fd, data, size));
+}
+
+static bool client_send_uint32(AgentClient *client, uint16_t type, uint32_t value)
+{
+    value = GUINT32_TO_LE(value);
+    return client_send(client, type, &value, sizeof(value));
+}
+
+static bool client_link(AgentClient *client)
+{
+    SpiceLinkHeader header = {
+        .magic = SPICE_MAGIC,
+        .major_version = GUINT32_TO_LE(SPICE_VERSION_MAJOR),
+        .minor_version = GUINT32_TO_LE(SPICE_VERSION_MINOR),
+        .size = GUINT32_TO_LE(sizeof(SpiceLinkMess) + sizeof(uint32_t)),
+    };
+    SpiceLinkMess mess = {
+        .connection_id = 0,
+        .channel_type = SPICE_CHANNEL_MAIN,
+        .channel_id = 0,
+        .num_common_caps = GUINT32_TO_LE(1),
+        .num_channel_caps = 0,
+        .caps_offset = GUINT32_TO_LE(sizeof(SpiceLinkMess)),
+    };
+    uint32_t common_caps = GUINT32_TO_LE(1u << SPICE_COMMON_CAP_MINI_HEADER);
+
+    if (!write_all(client->fd, &header, sizeof(header)) ||
+        !write_all(client->fd, &mess, sizeof(mess)) ||
+        !write_all(client->fd, &common_caps, sizeof(common_caps))) {
+        return false;
+    }
+
+    // reply contains the public key used to encrypt the ticket
+    SpiceLinkReply *reply;
+    if (!read_all(client->fd, &header, sizeof(header))) {
+        return false;
+    }
+    uint32_t reply_size = GUINT32_FROM_LE(header.size);
+    if (GUINT32_FROM_LE(header.magic) != SPICE_MAGIC || reply_size < sizeof(*reply)) {
+        return false;
+    }
+    reply = g_malloc(reply_size);
+    if (!read_all(client->fd, reply, reply_size) ||
+        GUINT32_FROM_LE(reply->error) != SPICE_LINK_ERR_OK) {
+        g_free(reply);
+        return false;
+    }
+
+    // the server does not check the password, send an empty one
+    BIO *bio = BIO_new_mem_buf(reply->pub_key, sizeof(reply->pub_key));
+    EVP_PKEY *pub_key = d2i_PUBKEY_bio(bio, NULL);
+    RSA *rsa = pub_key ? EVP_PKEY_get1_RSA(pub_key) : NULL;
+    uint8_t *ticket = NULL;
+    int ticket_size = -1;
+    if (rsa) {
+        ticket = g_malloc0(RSA_size(rsa));
+        ticket_size = RSA_public_encrypt(1, (const uint8_t *) "", ticket,
+                                         rsa, RSA_PKCS1_OAEP_PADDING);
+        RSA_free(rsa);
+    }
+    EVP_PKEY_free(pub_key);
+    BIO_free(bio);
+    g_free(reply);
+
+    uint32_t link_result = SPICE_LINK_ERR_ERROR;
+    bool ok = ticket_size > 0 && write_all(client->fd, ticket, ticket_size) &&
+              read_all(client->fd, &link_result, sizeof(link_result)) &&
+              GUINT32_FROM_LE(link_result) == SPICE_LINK_ERR_OK;
+    g_free(ticket);
+    return ok;
+}
+
+static uint32_t read_uint32(const uint8_t *data, uint32_t offset)
+{
+    uint32_t value;
+
+    memcpy(&value, data + offset, sizeof(value));
+    return GUINT32_FROM_LE(value);
+}
+
+static bool client_handle_message(AgentClient *client, PendingMessage *msg)
+{
+    switch (msg->type) {
+    case SPICE_MSG_SET_ACK:
+        if (msg->size < 8) {
+            return false;
+        }
+        client->ack_window = read_uint32(msg->data, 4);
+        client->ack_pending = client->ack_window;
+        // generation
+        return client_send(client, SPICE_MSGC_ACK_SYNC, msg->data, 4);
+    case SPICE_MSG_PING:
+        // pong contains id and timestamp of the ping
+        if (msg->size < 12 || !client_send(client, SPICE_MSGC_PONG, msg->data, 12)) {
+            return false;
+        }
+        break;
+    case SPICE_MSG_MAIN_INIT:
+        // session_id, display_channels_hint, supported_mouse_modes,
+        // current_mouse_mode, agent_connected, agent_tokens, ...
+        if (msg->size < 24 || !read_uint32(msg->data, 16)) {
+            g_printerr("agent not connected\n");
+            return false;
+        }
+        client->agent_tokens = read_uint32(msg->data, 20);
+        if (!client_send_uint32(client, SPICE_MSGC_MAIN_AGENT_START, client_window)) {
+            return false;
+        }
+        g_atomic_int_set(&client_ready, 1);
+        break;
+    case SPICE_MSG_MAIN_AGENT_TOKEN:
+        if (msg->size < 4) {
+            return false;
+        }
+        client->agent_tokens += read_uint32(msg->data, 0);
+        break;
+    case SPICE_MSG_MAIN_AGENT_DATA:
+        record_transfer(msg->size, 1);
+        client->tokens_to_return++;
+        break;
+    case SPICE_MSG_MAIN_AGENT_DISCONNECTED:
+        g_printerr("agent disconnected\n");
+        return false;
+    default:
+        break;
+    }
+
+    if (client->ack_window && --client->ack_pending == 0) {
+        client->ack_pending = client->ack_window;
+        return client_send(client, SPICE_MSGC_ACK, NULL, 0);
+    }
+    return true;
+}
+
+/* read available data and queue all complete messages */
+static bool client_read(AgentClient *client)
+{
+    uint8_t buf[64 * 1024];
+    ssize_t n;
+    size_t pos = 0;
+
+    n = read(client->fd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR) {
+        return true;
+    }
+    if (n <= 0) {
+        return false;
+    }
+    // received messages are handled after the round trip time
+    gint64 due = g_get_monotonic_time() + g_atomic_int_get(&current_rtt_ms) * 1000;
+    g_byte_array_append(client->in, buf, n);
+
+    while (client->in->len - pos >= MINI_HEADER_SIZE) {
+        const uint8_t *header = client->in->data + pos;
+        PendingMessage *msg;
+        uint16_t type;
+        uint32_t size;
+
+        memcpy(&type, header, 2);
+        memcpy(&size, header + 2, 4);
+        type = GUINT16_FROM_LE(type);
+        size = GUINT32_FROM_LE(size);
+        if (client->in->len - pos - MINI_HEADER_SIZE < size) {
+            break;
+        }
+        // only the size of the agent data is needed
+        msg = g_malloc(sizeof(*msg) + (type == SPICE_MSG_MAIN_AGENT_DATA ? 0 : size));
+        msg->due = due;
+        msg->type = type;
+        msg->size = size;
+        if (type != SPICE_MSG_MAIN_AGENT_DATA) {
+            memcpy(msg->data, header + MINI_HEADER_SIZE, size);
+        }
+        g_queue_push_tail(&client->pending, msg);
+        pos += MINI_HEADER_SIZE + size;
+    }
+    g_byte_array_remove_range(client->in, 0, pos);
+    return true;
+}
+
+/* handle the received messages which are due, returns the poll timeout */
+static int client_handle_pending(AgentClient *client, bool *ok)
+{
+    gint64 now = g_get_monotonic_time();
+    PendingMessage *msg;
+    int timeout = 100;
+
+    *ok = true;
+    while ((msg = g_queue_peek_head(&client->pending)) != NULL) {
+        if (msg->due > now) {
+            timeout = MAX(1, (msg->due - now) / 1000);
+            break;
+        }
+        g_queue_pop_head(&client->pending);
+        *ok = client_handle_message(client, msg);
+        g_free(msg);
+        if (!*ok) {
+            return -1;
+        }
+    }
+    if (client->tokens_to_return) {
+        *ok = client_send_uint32(client, SPICE_MSGC_MAIN_AGENT_TOKEN, client->tokens_to_return);
+        client->tokens_to_return = 0;
+    }
+    return timeout;
+}
+
+/* send the next chunk of the file transfer, a token is used for each chunk */
+static bool client_send_agent_data(AgentClient *client)
+{
+    AgentStream *stream = &client->stream;
+    uint32_t size = MIN(stream->size - stream->pos, SPICE_AGENT_MAX_DATA_SIZE);
+
+    if (!client_send(client, SPICE_MSGC_MAIN_AGENT_DATA, stream->data + stream->pos, size)) {
+        return false;
+    }
+    client->agent_tokens--;
+    stream->pos += size;
+    if (stream->pos == stream->size) {
+        stream->pos = 0;
+        record_transfer(0, 1);
+    }
+    return true;
+}
+
+static void *client_thread(SPICE_GNUC_UNUSED void *arg)
+{
+    AgentClient client = { .fd = client_fd, .in = g_byte_array_new() };
+    bool ok = true;
+
+    g_queue_init(&client.pending);
+    agent_stream_init(&client.stream, false);
+    if (!client_link(&client)) {
+        g_printerr("failed to link main channel\n");
+        goto end;
+    }
+
+    while (ok && !g_atomic_int_get(&client_quit)) {
+        int timeout = client_handle_pending(&client, &ok);
+        if (!ok) {
+            break;
+        }
+
+        // a message is never left incomplete, the filter of the server would
+        // discard the rest of it
+        bool sending = client.agent_tokens > 0 &&
+            (g_atomic_int_get(&current_direction) == DIRECTION_CLIENT_TO_GUEST ||
+             client.stream.pos != 0);
+        struct pollfd fd = {
+            .fd = client.fd,
+            .events = POLLIN | (sending ? POLLOUT : 0),
+        };
+
+        if (poll(&fd, 1, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            ok = client_read(&client);
+        }
+        if (ok && (fd.revents & POLLOUT)) {
+            ok = client_send_agent_data(&client);
+        }
+    }
+
+end:
+    while (!g_queue_is_empty(&client.pending)) {
+        g_free(g_queue_pop_head(&client.pending));
+    }
+    g_byte_array_free(client.in, TRUE);
+    g_free(client.stream.data);
+    return NULL;
+}
+
+/* profile scheduling, runs in the main thread */
+
+static int profile_duration_ms = 5000;
+static gchar *profile_filter;
+static int current_profile = -1;
+static SpiceTimer *profile_timer;
+static gint64 profile_start;
+static GString *report;
+
+static void reset_stats(void)
+{
+    pthread_mutex_lock(&stats.lock);
+    stats.bytes = 0;
+    stats.messages = 0;
+    pthread_mutex_unlock(&stats.lock);
+}
+
+static void report_profile(const Profile *profile)
+{
+    double duration = (g_get_monotonic_time() - profile_start) / 1000000.0;
+
+    pthread_mutex_lock(&stats.lock);
+    g_string_append_printf(report,
+        "%s\n    {\"profile\": \"%s\", \"rtt_ms\": %d, \"duration_s\": %.2f, "
+        "\"message_size\": %u, \"client_window\": %u, \"server_window\": %u,\n"
+        "     \"bytes\": %" G_GUINT64_FORMAT ", \"messages\": %" G_GUINT64_FORMAT ", "
+        "\"mbytes_per_sec\": %.2f, \"messages_per_sec\": %.1f}",
+        report->len > 1 ? "," : "", profile->name, profile->rtt_ms, duration,
+        message_size, client_window, REDS_AGENT_WINDOW_SIZE,
+        stats.bytes, stats.messages,
+        stats.bytes / duration / (1024 * 1024), stats.messages / duration);
+    pthread_mutex_unlock(&stats.lock);
+}
+
+static bool start_next_profile(void)
+{
+    while (++current_profile < G_N_ELEMENTS(profiles)) {
+        const Profile *profile = &profiles[current_profile];
+
+        if (profile_filter && strcmp(profile_filter, profile->name) != 0) {
+            continue;
+        }
+        g_atomic_int_set(&current_rtt_ms, profile->rtt_ms);
+        g_atomic_int_set(&current_direction, profile->direction);
+        reset_stats();
+        profile_start = g_get_monotonic_time();
+        if (profile->direction == DIRECTION_GUEST_TO_CLIENT) {
+            spice_server_char_device_wakeup(&vmc_instance);
+        }
+        return true;
+    }
+    return false;
+}
+
+static void profile_timer_cb(SPICE_GNUC_UNUSED void *opaque)
+{
+    if (current_profile < 0 && !g_atomic_int_get(&client_ready)) {
+        test->core->timer_start(profile_timer, 100);
+        return;
+    }
+    if (current_profile >= 0) {
+        report_profile(&profiles[current_profile]);
+    }
+    if (!start_next_profile()) {
+        g_atomic_int_set(&current_direction, -1);
+        basic_event_loop_quit();
+        return;
+    }
+    test->core->timer_start(profile_timer, profile_duration_ms);
+}
+
+int main(int argc, char *argv[])
+{
+    gchar *output_name = NULL;
+    int duration = 5;
+    int size = message_size;
+    int window = client_window;
+
+    GOptionEntry entries[] = {
+        { "duration", 'd', 0, G_OPTION_ARG_INT, &duration,
+          "Duration of each profile in seconds", "SECONDS" },
+        { "profile", 'p', 0, G_OPTION_ARG_STRING, &profile_filter,
+          "Run only the given profile (e.g. client-to-guest-10ms)", "NAME" },
+        { "message-size", 's', 0, G_OPTION_ARG_INT, &size,
+          "Size of the data of each file transfer message in bytes", "BYTES" },
+        { "client-window", 'w', 0, G_OPTION_ARG_INT, &window,
+          "Agent tokens given by the client to the server", "TOKENS" },
+        { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output_name,
+          "Write the report to a file instead of standard output", "FILENAME" },
+        { NULL }
+    };
+
+    GOptionContext *context = NULL;
+    GError *error = NULL;
+    context = g_option_context_new("- agent throughput benchmark");
+    g_option_context_set_description(context, program_description);
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("Option parsing failed: %s\n", error->message);
+        exit(1);
+    }
+    g_option_context_free(context);
+
+    if (duration < 1) {
+        g_printerr("Invalid --duration option: %d\n", duration);
+        exit(1);
+    }
+    if (size < 1 || size > 64 * 1024 * 1024) {
+        g_printerr("Invalid --message-size option: %d\n", size);
+        exit(1);
+    }
+    if (window < 1) {
+        g_printerr("Invalid --client-window option: %d\n", window);
+        exit(1);
+    }
+    profile_duration_ms = duration * 1000;
+    message_size = size;
+    client_window = window;
+
+    report = g_string_new("[");
+    agent_stream_init(&device_stream, true);
+
+    SpiceCoreInterface *core = basic_event_loop_init();
+    test = test_new(core);
+
+    // the agent is attached before the client connects, so the client
+    // receives the agent tokens with the main channel init message
+    vmc_instance.base.sif = &vmc_interface.base;
+    spice_server_add_interface(test->server, &vmc_instance.base);
+
+    int sv[2];
+    g_assert_cmpint(socketpair(AF_LOCAL, SOCK_STREAM, 0, sv), ==, 0);
+    g_assert_cmpint(spice_server_add_client(test->server, sv[0], 0), ==, 0);
+    client_fd = sv[1];
+
+    pthread_t thread;
+    g_assert_cmpint(pthread_create(&thread, NULL, client_thread, NULL), ==, 0);
+
+    profile_timer = core->timer_add(profile_timer_cb, NULL);
+    core->timer_start(profile_timer, 100);
+
+    basic_event_loop_mainloop();
+
+    core->timer_remove(profile_timer);
+    g_atomic_int_set(&client_quit, 1);
+    pthread_join(thread, NULL);
+    close(client_fd);
+    spice_server_remove_interface(&vmc_instance.base);
+    test_destroy(test);
+    basic_event_loop_destroy();
+
+    g_string_append(report, "\n]\n");
+    if (output_name) {
+        if (!g_file_set_contents(output_name, report->str, report->len, &error)) {
+            g_printerr("Error writing report: %s\n", error->message);
+            exit(1);
+        }
+    } else {
+        printf("%s", report->str);
+    }
+
+    g_string_free(report, TRUE);
+    g_free(device_stream.data);
+    g_free(output_name);
+    g_free(profile_filter);
+    return 0;
+}
@@ -0,0 +1,922 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/* End to end benchmark of the display path
+ * (see program_description below)
+ */
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <glib.h>
+#include <openssl/bio.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+#include <spice/protocol.h>
+#include <spice/qxl_dev.h>
+
+#include "test-display-base.h"
+#include "red-channel.h"
+#include "reds.h"
+
+static const char program_description[] =
+    "Runs scripted display workloads (office, scrolling, video and resolution\n"
+    "changes) at the maximum rate the server accepts against an in-process\n"
+    "client connected through socket pairs. The client performs the real link\n"
+    "handshake, acknowledges messages and discards the data.\n"
+    "For each workload frames per second, bytes per frame, worker CPU usage,\n"
+    "display pipe depth and the latency from command submission to the\n"
+    "reception of the drawing by the client are reported as JSON.\n"
+    "Only drawings carrying an image can be matched to their command, stream\n"
+    "frames are counted but do not produce latency samples.";
+
+#define PRIMARY_WIDTH 1280
+#define PRIMARY_HEIGHT 800
+#define TEXT_LINE_HEIGHT 16
+#define VIDEO_WIDTH 640
+#define VIDEO_HEIGHT 360
+#define MINI_HEADER_SIZE 6
+#define PUSHED_RING_SIZE 4096
+/* same as the default client caches */
+#define SINK_PIXMAP_CACHE_SIZE (1024 * 1024 * 80)
+#define SINK_GLZ_WINDOW_SIZE (1024 * 1024 * 16)
+
+typedef struct {
+    uint64_t image_id;
+    gint64 time;
+} PushedCommand;
+
+/* Counters of the current profile.
+ * Updated from the main thread (commands), the worker thread (pipe depth)
+ * and the client thread (received data). */
+typedef struct {
+    pthread_mutex_t lock;
+    PushedCommand pushed[PUSHED_RING_SIZE];
+    GArray *latencies;
+    uint64_t commands;
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t pipe_samples;
+    uint64_t pipe_total;
+    uint32_t pipe_max;
+} BenchStats;
+
+static BenchStats stats = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+typedef struct {
+    int fd;
+    GByteArray *in;
+    uint32_t ack_window;
+    uint32_t ack_pending;
+} SinkChannel;
+
+typedef struct {
+    int main_fd;
+    int display_fd;
+    uint32_t session_id;
+    int ready;
+    int quit;
+} Sink;
+
+static Sink sink;
+static Test *test;
+static RedChannel *display_channel;
+static GRand *rand_gen;
+static uint64_t last_image_id;
+
+/* client */
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool sink_send(SinkChannel *channel, uint16_t type, const void *data, uint32_t size)
+{
+    uint8_t header[MINI_HEADER_SIZE];
+    uint16_t type_le = GUINT16_TO_LE(type);
+    uint32_t size_le = GUINT32_TO_LE(size);
+
+    memcpy(header, &type_le, 2);
+    memcpy(header + 2, &size_le, 4);
+    return write_all(channel->fd, header, sizeof(header)) &&
+           (size == 0 || write_all(channel->fd, data, size));
+}
+
+static bool sink_link(SinkChannel *channel, uint8_t channel_type, uint32_t connection_id)
+{
+    SpiceLinkHeader header = {
+        .magic = SPICE_MAGIC,
+        .major_version = GUINT32_TO_LE(SPICE_VERSION_MAJOR),
+        .minor_version = GUINT32_TO_LE(SPICE_VERSION_MINOR),
+        .size = GUINT32_TO_LE(sizeof(SpiceLinkMess) + sizeof(uint32_t)),
+    };
+    SpiceLinkMess mess = {
+        .connection_id = GUINT32_TO_LE(connection_id),
+        .channel_type = channel_type,
+        .channel_id = 0,
+        .num_common_caps = GUINT32_TO_LE(1),
+        .num_channel_caps = 0,
+        .caps_offset = GUINT32_TO_LE(sizeof(SpiceLinkMess)),
+    };
+    uint32_t common_caps = GUINT32_TO_LE(1u << SPICE_COMMON_CAP_MINI_HEADER);
+
+    if (!write_all(channel->fd, &header, sizeof(header)) ||
+        !write_all(channel->fd, &mess, sizeof(mess)) ||
+        !write_all(channel->fd, &common_caps, sizeof(common_caps))) {
+        return false;
+    }
+
+    // reply contains the public key used to encrypt the ticket
+    SpiceLinkReply *reply;
+    if (!read_all(channel->fd, &header, sizeof(header))) {
+        return false;
+    }
+    uint32_t reply_size = GUINT32_FROM_LE(header.size);
+    if (GUINT32_FROM_LE(header.magic) != SPICE_MAGIC || reply_size < sizeof(*reply)) {
+        return false;
+    }
+    reply = g_malloc(reply_size);
+    if (!read_all(channel->fd, reply, reply_size) ||
+        GUINT32_FROM_LE(reply->error) != SPICE_LINK_ERR_OK) {
+        g_free(reply);
+        return false;
+    }
+
+    // the server does not check the password, send an empty one
+    BIO *bio = BIO_new_mem_buf(reply->pub_key, sizeof(reply->pub_key));
+    EVP_PKEY *pub_key = d2i_PUBKEY_bio(bio, NULL);
+    RSA *rsa = pub_key ? EVP_PKEY_get1_RSA(pub_key) : NULL;
+    uint8_t *ticket = NULL;
+    int ticket_size = -1;
+    if (rsa) {
+        ticket = g_malloc0(RSA_size(rsa));
+        ticket_size = RSA_public_encrypt(1, (const uint8_t *) "", ticket,
+                                         rsa, RSA_PKCS1_OAEP_PADDING);
+        RSA_free(rsa);
+    }
+    EVP_PKEY_free(pub_key);
+    BIO_free(bio);
+    g_free(reply);
+
+    uint32_t link_result = SPICE_LINK_ERR_ERROR;
+    bool ok = ticket_size > 0 && write_all(channel->fd, ticket, ticket_size) &&
+              read_all(channel->fd, &link_result, sizeof(link_result)) &&
+              GUINT32_FROM_LE(link_result) == SPICE_LINK_ERR_OK;
+    g_free(ticket);
+    return ok;
+}
+
+static void record_display_message(uint16_t type, const uint8_t *data, uint32_t size,
+                                   gint64 now)
+{
+    uint32_t offset, image_offset;
+    uint64_t image_id;
+
+    if ((type < SPICE_MSG_DISPLAY_DRAW_FILL || type > SPICE_MSG_DISPLAY_DRAW_ALPHA_BLEND) &&
+        type != SPICE_MSG_DISPLAY_DRAW_COMPOSITE && type != SPICE_MSG_DISPLAY_COPY_BITS &&
+        type != SPICE_MSG_DISPLAY_STREAM_DATA && type != SPICE_MSG_DISPLAY_STREAM_DATA_SIZED) {
+        return;
+    }
+
+    pthread_mutex_lock(&stats.lock);
+    stats.frames++;
+    if (type != SPICE_MSG_DISPLAY_DRAW_COPY) {
+        pthread_mutex_unlock(&stats.lock);
+        return;
+    }
+
+    // DisplayBase is surface_id, box and clip, followed by the source image offset
+    offset = sizeof(uint32_t) + 4 * sizeof(int32_t);
+    if (size < offset + 1) {
+        goto end;
+    }
+    if (data[offset++] == SPICE_CLIP_TYPE_RECTS) {
+        uint32_t num_rects;
+        if (size < offset + sizeof(num_rects)) {
+            goto end;
+        }
+        memcpy(&num_rects, data + offset, sizeof(num_rects));
+        offset += sizeof(num_rects) + GUINT32_FROM_LE(num_rects) * 4 * sizeof(int32_t);
+    }
+    if (size < offset + sizeof(image_offset)) {
+        goto end;
+    }
+    memcpy(&image_offset, data + offset, sizeof(image_offset));
+    image_offset = GUINT32_FROM_LE(image_offset);
+    if (image_offset == 0 || size < image_offset + sizeof(image_id)) {
+        goto end;
+    }
+    memcpy(&image_id, data + image_offset, sizeof(image_id));
+    image_id = GUINT64_FROM_LE(image_id);
+
+    PushedCommand *pushed = &stats.pushed[image_id % PUSHED_RING_SIZE];
+    if (pushed->image_id == image_id && pushed->time) {
+        gint64 latency = now - pushed->time;
+        g_array_append_val(stats.latencies, latency);
+        pushed->time = 0;
+    }
+
+end:
+    pthread_mutex_unlock(&stats.lock);
+}
+
+static bool sink_handle_message(SinkChannel *channel, uint16_t type,
+                                const uint8_t *data, uint32_t size, gint64 now)
+{
+    switch (type) {
+    case SPICE_MSG_SET_ACK: {
+        uint32_t generation, window;
+        if (size < 8) {
+            return false;
+        }
+        memcpy(&generation, data, 4);
+        memcpy(&window, data + 4, 4);
+        channel->ack_window = GUINT32_FROM_LE(window);
+        channel->ack_pending = channel->ack_window;
+        return sink_send(channel, SPICE_MSGC_ACK_SYNC, &generation, sizeof(generation));
+    }
+    case SPICE_MSG_PING:
+        // pong contains id and timestamp of the ping
+        if (size < 12 || !sink_send(channel, SPICE_MSGC_PONG, data, 12)) {
+            return false;
+        }
+        break;
+    case SPICE_MSG_MAIN_INIT:
+        if (channel->fd == sink.main_fd && size >= sizeof(uint32_t)) {
+            memcpy(&sink.session_id, data, sizeof(uint32_t));
+            sink.session_id = GUINT32_FROM_LE(sink.session_id);
+        }
+        break;
+    default:
+        if (channel->fd == sink.display_fd) {
+            record_display_message(type, data, size, now);
+        }
+        break;
+    }
+
+    if (channel->ack_window && --channel->ack_pending == 0) {
+        channel->ack_pending = channel->ack_window;
+        return sink_send(channel, SPICE_MSGC_ACK, NULL, 0);
+    }
+    return true;
+}
+
+/* read available data and handle all complete messages */
+static bool sink_channel_read(SinkChannel *channel)
+{
+    uint8_t buf[64 * 1024];
+    ssize_t n;
+    size_t pos = 0;
+
+    n = read(channel->fd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR) {
+        return true;
+    }
+    if (n <= 0) {
+        return false;
+    }
+    gint64 now = g_get_monotonic_time();
+    g_byte_array_append(channel->in, buf, n);
+    if (channel->fd == sink.display_fd) {
+        pthread_mutex_lock(&stats.lock);
+        stats.bytes += n;
+        pthread_mutex_unlock(&stats.lock);
+    }
+
+    while (channel->in->len - pos >= MINI_HEADER_SIZE) {
+        const uint8_t *header = channel->in->data + pos;
+        uint16_t type;
+        uint32_t size;
+
+        memcpy(&type, header, 2);
+        memcpy(&size, header + 2, 4);
+        type = GUINT16_FROM_LE(type);
+        size = GUINT32_FROM_LE(size);
+        if (channel->in->len - pos - MINI_HEADER_SIZE < size) {
+            break;
+        }
+        if (!sink_handle_message(channel, type, header + MINI_HEADER_SIZE, size, now)) {
+            return false;
+        }
+        pos += MINI_HEADER_SIZE + size;
+    }
+    g_byte_array_remove_range(channel->in, 0, pos);
+    return true;
+}
+
+static void *sink_thread(SPICE_GNUC_UNUSED void *arg)
+{
+    SinkChannel main_channel = { sink.main_fd, g_byte_array_new(), 0, 0 };
+    SinkChannel display = { sink.display_fd, g_byte_array_new(), 0, 0 };
+
+    if (!sink_link(&main_channel, SPICE_CHANNEL_MAIN, 0)) {
+        g_printerr("failed to link main channel\n");
+        goto end;
+    }
+    while (sink.session_id == 0) {
+        if (!sink_channel_read(&main_channel)) {
+            g_printerr("main channel closed before init\n");
+            goto end;
+        }
+    }
+    if (!sink_link(&display, SPICE_CHANNEL_DISPLAY, sink.session_id)) {
+        g_printerr("failed to link display channel\n");
+        goto end;
+    }
+
+    // pixmap_cache_id, pixmap_cache_size, glz_dictionary_id, glz_dictionary_window_size
+    uint8_t init[14] = { 1 };
+    int64_t pixmap_cache_size = GINT64_TO_LE(SINK_PIXMAP_CACHE_SIZE);
+    int32_t glz_window_size = GINT32_TO_LE(SINK_GLZ_WINDOW_SIZE);
+    memcpy(init + 1, &pixmap_cache_size, 8);
+    init[9] = 1;
+    memcpy(init + 10, &glz_window_size, 4);
+    if (!sink_send(&display, SPICE_MSGC_DISPLAY_INIT, init, sizeof(init))) {
+        goto end;
+    }
+    g_atomic_int_set(&sink.ready, 1);
+
+    while (!g_atomic_int_get(&sink.quit)) {
+        struct pollfd fds[2] = {
+            { .fd = main_channel.fd, .events = POLLIN },
+            { .fd = display.fd, .events = POLLIN },
+        };
+
+        if (poll(fds, G_N_ELEMENTS(fds), 100) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if ((fds[0].revents && !sink_channel_read(&main_channel)) ||
+            (fds[1].revents && !sink_channel_read(&display))) {
+            break;
+        }
+    }
+
+end:
+    g_byte_array_free(main_channel.in, TRUE);
+    g_byte_array_free(display.in, TRUE);
+    return NULL;
+}
+
+/* guest workloads */
+
+static uint8_t *create_text_bitmap(int width, int height)
+{
+    uint32_t *bitmap = g_new(uint32_t, width * height);
+    int x, y, i;
+
+    for (i = 0; i < width * height; i++) {
+        bitmap[i] = 0xffffff;
+    }
+    for (x = 2; x + 6 < width; x += 7) {
+        uint32_t glyph = g_rand_int(rand_gen);
+
+        // spaces between words
+        if ((glyph & 0x7) == 0) {
+            continue;
+        }
+        for (y = 2; y < MIN(height - 2, 14); y++) {
+            uint32_t row = (glyph >> (y * 5 % 27)) & 0x1f;
+            for (i = 0; i < 5; i++) {
+                if (row & (1 << i)) {
+                    bitmap[y * width + x + i] = 0x101010;
+                }
+            }
+        }
+    }
+    return (uint8_t *) bitmap;
+}
+
+/* run a setup command (like the primary surface creation) only the first time */
+static void setup_once(SPICE_GNUC_UNUSED Test *test, Command *command)
+{
+    if (command->cb_opaque) {
+        command->command = PATH_PROGRESS;
+    }
+    command->cb_opaque = command;
+}
+
+static void draw_text(Test *test, Command *command)
+{
+    CommandDrawBitmap *cmd = &command->bitmap;
+    int width = g_rand_int_range(rand_gen, 64, MIN(512, test->primary_width));
+    int left = g_rand_int_range(rand_gen, 0, test->primary_width - width + 1);
+    int top = g_rand_int_range(rand_gen, 0, test->primary_height - TEXT_LINE_HEIGHT + 1);
+
+    cmd->surface_id = 0;
+    cmd->bbox.left = left;
+    cmd->bbox.top = top;
+    cmd->bbox.right = left + width;
+    cmd->bbox.bottom = top + TEXT_LINE_HEIGHT;
+    cmd->num_clip_rects = 0;
+    cmd->bitmap = create_text_bitmap(width, TEXT_LINE_HEIGHT);
+}
+
+static void draw_fill(Test *test, Command *command)
+{
+    CommandDrawSolid *cmd = &command->solid;
+    int width = g_rand_int_range(rand_gen, 32, test->primary_width / 2);
+    int height = g_rand_int_range(rand_gen, 32, test->primary_height / 2);
+
+    cmd->surface_id = 0;
+    cmd->bbox.left = g_rand_int_range(rand_gen, 0, test->primary_width - width + 1);
+    cmd->bbox.top = g_rand_int_range(rand_gen, 0, test->primary_height - height + 1);
+    cmd->bbox.right = cmd->bbox.left + width;
+    cmd->bbox.bottom = cmd->bbox.top + height;
+    cmd->color = g_rand_int(rand_gen) & 0xffffff;
+}
+
+static void clear_screen(Test *test, Command *command)
+{
+    CommandDrawSolid *cmd = &command->solid;
+
+    cmd->surface_id = 0;
+    cmd->bbox.left = 0;
+    cmd->bbox.top = 0;
+    cmd->bbox.right = test->primary_width;
+    cmd->bbox.bottom = test->primary_height;
+    cmd->color = 0x3a6ea5;
+}
+
+static void scroll_up(Test *test, Command *command)
+{
+    CommandCopyBits *cmd = &command->copy_bits;
+
+    cmd->bbox.left = 0;
+    cmd->bbox.top = 0;
+    cmd->bbox.right = test->primary_width;
+    cmd->bbox.bottom = test->primary_height - TEXT_LINE_HEIGHT;
+    cmd->src_pos.x = 0;
+    cmd->src_pos.y = TEXT_LINE_HEIGHT;
+}
+
+static void draw_last_line(Test *test, Command *command)
+{
+    CommandDrawBitmap *cmd = &command->bitmap;
+
+    cmd->surface_id = 0;
+    cmd->bbox.left = 0;
+    cmd->bbox.top = test->primary_height - TEXT_LINE_HEIGHT;
+    cmd->bbox.right = test->primary_width;
+    cmd->bbox.bottom = test->primary_height;
+    cmd->num_clip_rects = 0;
+    cmd->bitmap = create_text_bitmap(test->primary_width, TEXT_LINE_HEIGHT);
+}
+
+static void draw_video_frame(SPICE_GNUC_UNUSED Test *test, Command *command)
+{
+    static int frame = 0;
+    CommandDrawBitmap *cmd = &command->bitmap;
+    uint32_t *dst;
+    int x, y;
+
+    cmd->surface_id = 0;
+    cmd->bbox.left = 100;
+    cmd->bbox.top = 100;
+    cmd->bbox.right = cmd->bbox.left + VIDEO_WIDTH;
+    cmd->bbox.bottom = cmd->bbox.top + VIDEO_HEIGHT;
+    cmd->num_clip_rects = 0;
+    cmd->bitmap = g_malloc(VIDEO_WIDTH * VIDEO_HEIGHT * 4);
+
+    // moving gradient with a bouncing box
+    dst = (uint32_t *) cmd->bitmap;
+    int box_x = (frame * 7) % (VIDEO_WIDTH - 64);
+    int box_y = (frame * 3) % (VIDEO_HEIGHT - 64);
+    for (y = 0; y < VIDEO_HEIGHT; y++) {
+        for (x = 0; x < VIDEO_WIDTH; x++, dst++) {
+            if (x >= box_x && x < box_x + 64 && y >= box_y && y < box_y + 64) {
+                *dst = 0xe0e020;
+            } else {
+                *dst = (((x + frame * 4) & 0xff) << 16) | (((y + frame * 2) & 0xff) << 8) |
+                       ((x + y + frame) & 0xff);
+            }
+        }
+    }
+    frame++;
+}
+
+static void set_mode(SPICE_GNUC_UNUSED Test *test, Command *command)
+{
+    static const CommandCreatePrimary modes[] = {
+        { 800, 600 }, { 1024, 768 }, { 1280, 800 }, { 1920, 1080 }, { 1366, 768 },
+    };
+    static int count = 0;
+
+    command->create_primary = modes[count++ % G_N_ELEMENTS(modes)];
+}
+
+static Command *commands_new(int num_commands, bool set_primary)
+{
+    Command *commands = g_new0(Command, num_commands);
+
+    if (set_primary) {
+        commands[0].command = DESTROY_PRIMARY;
+        commands[0].cb = setup_once;
+        commands[1].command = CREATE_PRIMARY;
+        commands[1].cb = setup_once;
+        commands[1].create_primary.width = PRIMARY_WIDTH;
+        commands[1].create_primary.height = PRIMARY_HEIGHT;
+    }
+    return commands;
+}
+
+/* text updates all around the screen with some fills */
+static Command *office_commands(int *num_commands)
+{
+    Command *commands = commands_new(*num_commands = 42, true);
+
+    for (int i = 2; i < *num_commands; i++) {
+        if (i % 10 == 0) {
+            commands[i].command = SIMPLE_DRAW_SOLID;
+            commands[i].cb = draw_fill;
+        } else {
+            commands[i].command = SIMPLE_DRAW_BITMAP;
+            commands[i].cb = draw_text;
+        }
+    }
+    return commands;
+}
+
+/* a terminal scrolling one line at a time */
+static Command *scrolling_commands(int *num_commands)
+{
+    Command *commands = commands_new(*num_commands = 4, true);
+
+    commands[2].command = SIMPLE_COPY_BITS;
+    commands[2].cb = scroll_up;
+    commands[3].command = SIMPLE_DRAW_BITMAP;
+    commands[3].cb = draw_last_line;
+    return commands;
+}
+
+/* a video playing in a window, should be streamed */
+static Command *video_commands(int *num_commands)
+{
+    Command *commands = commands_new(*num_commands = 3, true);
+
+    commands[2].command = SIMPLE_DRAW_BITMAP;
+    commands[2].cb = draw_video_frame;
+    return commands;
+}
+
+/* mode changes, each followed by a redraw of the screen */
+static Command *resolution_change_commands(int *num_commands)
+{
+    Command *commands = commands_new(*num_commands = 8, false);
+
+    commands[0].command = DESTROY_PRIMARY;
+    commands[1].command = CREATE_PRIMARY;
+    commands[1].cb = set_mode;
+    commands[2].command = SIMPLE_DRAW_SOLID;
+    commands[2].cb = clear_screen;
+    for (int i = 3; i < *num_commands; i++) {
+        commands[i].command = SIMPLE_DRAW_BITMAP;
+        commands[i].cb = draw_text;
+    }
+    return commands;
+}
+
+typedef struct {
+    const char *name;
+    Command *(*create_commands)(int *num_commands);
+} Profile;
+
+static const Profile profiles[] = {
+    { "office", office_commands },
+    { "scrolling", scrolling_commands },
+    { "video", video_commands },
+    { "resolution-change", resolution_change_commands },
+};
+
+/* measurements */
+
+static void on_command_pushed(SPICE_GNUC_UNUSED Test *test, QXLCommandExt *ext)
+{
+    pthread_mutex_lock(&stats.lock);
+    stats.commands++;
+    if (ext->cmd.type == QXL_CMD_DRAW) {
+        QXLDrawable *drawable = (QXLDrawable *)(uintptr_t) ext->cmd.data;
+        if (drawable->type == QXL_DRAW_COPY) {
+            QXLImage *image = (QXLImage *)(uintptr_t) drawable->u.copy.src_bitmap;
+            // each image gets its own id to match the drawings to their command
+            QXL_SET_IMAGE_ID(image, QXL_IMAGE_GROUP_DEVICE, ++last_image_id);
+            PushedCommand *pushed = &stats.pushed[image->descriptor.id % PUSHED_RING_SIZE];
+            pushed->image_id = image->descriptor.id;
+            pushed->time = g_get_monotonic_time();
+        }
+    }
+    pthread_mutex_unlock(&stats.lock);
+}
+
+/* called from the worker thread, which owns the display channel */
+static void on_command_fetched(SPICE_GNUC_UNUSED Test *test)
+{
+    uint32_t pipe_size = red_channel_max_pipe_size(display_channel);
+
+    pthread_mutex_lock(&stats.lock);
+    stats.pipe_samples++;
+    stats.pipe_total += pipe_size;
+    stats.pipe_max = MAX(stats.pipe_max, pipe_size);
+    pthread_mutex_unlock(&stats.lock);
+}
+
+static int find_worker_tid(void)
+{
+    GDir *dir = g_dir_open("/proc/self/task", 0, NULL);
+    const char *name;
+    int tid = -1;
+
+    if (!dir) {
+        return -1;
+    }
+    while (tid < 0 && (name = g_dir_read_name(dir)) != NULL) {
+        gchar *path = g_strdup_printf("/proc/self/task/%s/comm", name);
+        gchar *comm = NULL;
+
+        if (g_file_get_contents(path, &comm, NULL, NULL) &&
+            g_str_has_prefix(comm, "SPICE Worker")) {
+            tid = atoi(name);
+        }
+        g_free(comm);
+        g_free(path);
+    }
+    g_dir_close(dir);
+    return tid;
+}
+
+/* user and system time of a thread, in seconds */
+static double thread_cpu_time(int tid)
+{
+    gchar *path, *contents = NULL, *p;
+    unsigned long utime = 0, stime = 0;
+
+    if (tid < 0) {
+        return 0;
+    }
+    path = g_strdup_printf("/proc/self/task/%d/stat", tid);
+    // fields after the command name, utime and stime are 14th and 15th
+    if (g_file_get_contents(path, &contents, NULL, NULL) &&
+        (p = strrchr(contents, ')')) != NULL) {
+        sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+               &utime, &stime);
+    }
+    g_free(contents);
+    g_free(path);
+    return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+    gint64 la = *(const gint64 *) a, lb = *(const gint64 *) b;
+
+    return la < lb ? -1 : la > lb;
+}
+
+static double latency_percentile_ms(GArray *sorted, int percentile)
+{
+    int index = (sorted->len * percentile + 99) / 100 - 1;
+
+    if (sorted->len == 0) {
+        return 0;
+    }
+    return g_array_index(sorted, gint64, CLAMP(index, 0, (int) sorted->len - 1)) / 1000.0;
+}
+
+/* profile scheduling, runs in the main thread */
+
+static int profile_duration_ms = 5000;
+static gchar *profile_filter;
+static int current_profile = -1;
+static Command *current_commands;
+static SpiceTimer *profile_timer;
+static int worker_tid = -1;
+static gint64 profile_start;
+static double profile_start_cpu;
+static GString *report;
+
+static void reset_stats(void)
+{
+    pthread_mutex_lock(&stats.lock);
+    memset(stats.pushed, 0, sizeof(stats.pushed));
+    g_array_set_size(stats.latencies, 0);
+    stats.commands = 0;
+    stats.frames = 0;
+    stats.bytes = 0;
+    stats.pipe_samples = 0;
+    stats.pipe_total = 0;
+    stats.pipe_max = 0;
+    pthread_mutex_unlock(&stats.lock);
+}
+
+static void report_profile(const Profile *profile)
+{
+    double duration = (g_get_monotonic_time() - profile_start) / 1000000.0;
+    double cpu = thread_cpu_time(worker_tid) - profile_start_cpu;
+
+    pthread_mutex_lock(&stats.lock);
+    g_array_sort(stats.latencies, compare_latencies);
+    g_string_append_printf(report,
+        "%s\n    {\"profile\": \"%s\", \"duration_s\": %.2f, \"commands\": %" G_GUINT64_FORMAT ", "
+        "\"frames\": %" G_GUINT64_FORMAT ", \"bytes\": %" G_GUINT64_FORMAT ",\n"
+        "     \"frames_per_sec\": %.1f, \"bytes_per_frame\": %.0f, \"worker_cpu_percent\": %.1f,\n"
+        "     \"pipe_depth\": {\"mean\": %.2f, \"max\": %u},\n"
+        "     \"latency_ms\": {\"samples\": %u, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f}}",
+        report->len > 1 ? "," : "", profile->name, duration, stats.commands,
+        stats.frames, stats.bytes,
+        stats.frames / duration, stats.frames ? (double) stats.bytes / stats.frames : 0.0,
+        worker_tid >= 0 ? cpu * 100 / duration : -1.0,
+        stats.pipe_samples ? (double) stats.pipe_total / stats.pipe_samples : 0.0,
+        stats.pipe_max, stats.latencies->len,
+        latency_percentile_ms(stats.latencies, 50), latency_percentile_ms(stats.latencies, 90),
+        latency_percentile_ms(stats.latencies, 99));
+    pthread_mutex_unlock(&stats.lock);
+}
+
+static bool start_next_profile(void)
+{
+    Command *old_commands = current_commands;
+    int num_commands;
+
+    while (++current_profile < G_N_ELEMENTS(profiles)) {
+        const Profile *profile = &profiles[current_profile];
+
+        if (profile_filter && strcmp(profile_filter, profile->name) != 0) {
+            continue;
+        }
+        current_commands = profile->create_commands(&num_commands);
+        test->cmd_index = 0;
+        test_set_command_list(test, current_commands, num_commands);
+        g_free(old_commands);
+        reset_stats();
+        profile_start = g_get_monotonic_time();
+        profile_start_cpu = thread_cpu_time(worker_tid);
+        return true;
+    }
+    return false;
+}
+
+static void profile_timer_cb(SPICE_GNUC_UNUSED void *opaque)
+{
+    if (current_profile < 0 && !g_atomic_int_get(&sink.ready)) {
+        test->core->timer_start(profile_timer, 100);
+        return;
+    }
+    if (current_profile >= 0) {
+        report_profile(&profiles[current_profile]);
+    }
+    if (!start_next_profile()) {
+        test->num_commands = 0;
+        basic_event_loop_quit();
+        return;
+    }
+    test->core->timer_start(profile_timer, profile_duration_ms);
+}
+
+int main(int argc, char *argv[])
+{
+    gchar *output_name = NULL;
+    int duration = 5;
+
+    GOptionEntry entries[] = {
+        { "duration", 'd', 0, G_OPTION_ARG_INT, &duration,
+          "Duration of each profile in seconds", "SECONDS" },
+        { "profile", 'p', 0, G_OPTION_ARG_STRING, &profile_filter,
+          "Run only the given profile (office/scrolling/video/resolution-change)", "NAME" },
+        { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output_name,
+          "Write the report to a file instead of standard output", "FILENAME" },
+        { NULL }
+    };
+
+    GOptionContext *context = NULL;
+    GError *error = NULL;
+    context = g_option_context_new("- end to end display benchmark");
+    g_option_context_set_description(context, program_description);
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("Option parsing failed: %s\n", error->message);
+        exit(1);
+    }
+    g_option_context_free(context);
+
+    if (duration < 1) {
+        g_printerr("Invalid --duration option: %d\n", duration);
+        exit(1);
+    }
+    profile_duration_ms = duration * 1000;
+
+    rand_gen = g_rand_new_with_seed(1);
+    stats.latencies = g_array_new(FALSE, FALSE, sizeof(gint64));
+    report = g_string_new("[");
+
+    SpiceCoreInterface *core = basic_event_loop_init();
+    test = test_new(core);
+    spice_server_set_streaming_video(test->server, SPICE_STREAM_VIDEO_ALL);
+    test_add_display_interface(test);
+    display_channel = reds_find_channel(test->server, SPICE_CHANNEL_DISPLAY, 0);
+    g_assert_nonnull(display_channel);
+    worker_tid = find_worker_tid();
+
+    // produce as many commands as the server accepts, limiting the queued
+    // commands like the command ring of a QXL device
+    test->display_batch = 32;
+    test->max_queued_commands = 32;
+    test->on_command_pushed = on_command_pushed;
+    test->on_command_fetched = on_command_fetched;
+
+    int main_sv[2], display_sv[2];
+    g_assert_cmpint(socketpair(AF_LOCAL, SOCK_STREAM, 0, main_sv), ==, 0);
+    g_assert_cmpint(socketpair(AF_LOCAL, SOCK_STREAM, 0, display_sv), ==, 0);
+    g_assert_cmpint(spice_server_add_client(test->server, main_sv[0], 0), ==, 0);
+    g_assert_cmpint(spice_server_add_client(test->server, display_sv[0], 0), ==, 0);
+    sink.main_fd = main_sv[1];
+    sink.display_fd = display_sv[1];
+
+    pthread_t thread;
+    g_assert_cmpint(pthread_create(&thread, NULL, sink_thread, NULL), ==, 0);
+
+    profile_timer = core->timer_add(profile_timer_cb, NULL);
+    core->timer_start(profile_timer, 100);
+
+    basic_event_loop_mainloop();
+
+    core->timer_remove(profile_timer);
+    g_atomic_int_set(&sink.quit, 1);
+    pthread_join(thread, NULL);
+    close(sink.main_fd);
+    close(sink.display_fd);
+    test_destroy(test);
+    basic_event_loop_destroy();
+
+    g_string_append(report, "\n]\n");
+    if (output_name) {
+        if (!g_file_set_contents(output_name, report->str, report->len, &error)) {
+            g_printerr("Error writing report: %s\n", error->message);
+            exit(1);
+        }
+    } else {
+        printf("%s", report->str);
+    }
+
+    g_string_free(report, TRUE);
+    g_array_free(stats.latencies, TRUE);
+    g_rand_free(rand_gen);
+    g_free(output_name);
+    g_free(profile_filter);
+    return 0;
+}
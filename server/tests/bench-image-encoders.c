@@ -0,0 +1,521 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/* Benchmark for the image encoders
+ * (see program_description below)
+ */
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <common/mem.h>
+
+#include "image-encoders.h"
+#include "spice-bitmap-utils.h"
+#include "utils.h"
+
+static const char program_description[] =
+    "Compresses a deterministic corpus of synthetic images (text, gradients,\n"
+    "photo-like content and UI chrome) in 16, 24 and 32 bits per pixel, with\n"
+    "odd widths, padded strides and both linear and chunked bitmaps, using\n"
+    "every image encoder and some ImageEncoders configurations.\n"
+    "Input throughput, compression ratio and per-call latency percentiles\n"
+    "are reported as JSON on standard output.";
+
+#define IMAGE_WIDTH 517
+#define IMAGE_HEIGHT 389
+#define IMAGE_STRIDE_PAD 12
+#define CHUNK_LINES 37
+/* same as the default client window */
+#define GLZ_WINDOW_SIZE (1024 * 1024 * 16)
+
+typedef enum {
+    ENCODER_QUIC,
+    ENCODER_LZ,
+    ENCODER_JPEG,
+#ifdef USE_LZ4
+    ENCODER_LZ4,
+#endif
+    ENCODER_GLZ,
+} EncoderType;
+
+typedef struct {
+    const char *name;
+    EncoderType type;
+    int jpeg_quality;
+    int zlib_level; // 0 to disable the zlib wrapping of GLZ
+} EncoderConfig;
+
+static const EncoderConfig encoder_configs[] = {
+    { "quic", ENCODER_QUIC, 0, 0 },
+    { "lz", ENCODER_LZ, 0, 0 },
+    { "jpeg-q50", ENCODER_JPEG, 50, 0 },
+    { "jpeg-q85", ENCODER_JPEG, 85, 0 },
+#ifdef USE_LZ4
+    { "lz4", ENCODER_LZ4, 0, 0 },
+#endif
+    { "glz", ENCODER_GLZ, 0, 0 },
+    { "glz-zlib-1", ENCODER_GLZ, 0, 1 },
+    { "glz-zlib-9", ENCODER_GLZ, 0, 9 },
+};
+
+typedef struct {
+    const char *name;
+    SpiceBitmapFmt format;
+    int bpp;
+} FormatInfo;
+
+static const FormatInfo formats[] = {
+    { "16bit", SPICE_BITMAP_FMT_16BIT, 2 },
+    { "24bit", SPICE_BITMAP_FMT_24BIT, 3 },
+    { "32bit", SPICE_BITMAP_FMT_32BIT, 4 },
+};
+
+typedef void (*ImageGenerator)(uint32_t *pixels, int width, int height);
+
+typedef struct {
+    const char *name;
+    ImageGenerator generate;
+} ImageKind;
+
+/* simple xorshift generator so the corpus is the same on every run */
+static uint32_t prng_state;
+
+static void prng_seed(uint32_t seed)
+{
+    prng_state = seed ? seed : 0x9e3779b9;
+}
+
+static uint32_t prng_next(void)
+{
+    uint32_t x = prng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    prng_state = x;
+    return x;
+}
+
+static inline uint32_t rgb(uint32_t r, uint32_t g, uint32_t b)
+{
+    return (MIN(r, 255) << 16) | (MIN(g, 255) << 8) | MIN(b, 255);
+}
+
+static void fill_rect(uint32_t *pixels, int width, int height,
+                      int x, int y, int w, int h, uint32_t color)
+{
+    int i, j;
+
+    for (j = MAX(y, 0); j < MIN(y + h, height); j++) {
+        for (i = MAX(x, 0); i < MIN(x + w, width); i++) {
+            pixels[j * width + i] = color;
+        }
+    }
+}
+
+/* lines of black glyphs on a white background, like a document or a terminal */
+static void generate_text(uint32_t *pixels, int width, int height)
+{
+    int x, y, i, j;
+
+    prng_seed(1);
+    fill_rect(pixels, width, height, 0, 0, width, height, rgb(255, 255, 255));
+    for (y = 4; y + 14 < height; y += 18) {
+        for (x = 6; x + 7 < width; x += 8) {
+            uint32_t glyph = prng_next();
+
+            // spaces between words
+            if ((glyph & 0x7) == 0) {
+                continue;
+            }
+            for (j = 0; j < 12; j++) {
+                uint32_t row = (glyph >> (j * 5 % 27)) & 0x1f;
+                for (i = 0; i < 5; i++) {
+                    if (row & (1 << i)) {
+                        pixels[(y + j) * width + x + i] = rgb(16, 16, 16);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void generate_gradient(uint32_t *pixels, int width, int height)
+{
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            pixels[y * width + x] = rgb(x * 255 / width, y * 255 / height,
+                                        (x + y) * 255 / (width + height));
+        }
+    }
+}
+
+/* smooth value noise with some grain, a rough approximation of a photo */
+static void generate_photo(uint32_t *pixels, int width, int height)
+{
+    const int cell = 16;
+    const int grid_w = width / cell + 2;
+    const int grid_h = height / cell + 2;
+    uint32_t *grid = g_new(uint32_t, grid_w * grid_h);
+    int x, y, i;
+
+    prng_seed(3);
+    for (i = 0; i < grid_w * grid_h; i++) {
+        grid[i] = prng_next() & 0xffffff;
+    }
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            int gx = x / cell, gy = y / cell;
+            int fx = x % cell, fy = y % cell;
+            uint32_t c00 = grid[gy * grid_w + gx];
+            uint32_t c10 = grid[gy * grid_w + gx + 1];
+            uint32_t c01 = grid[(gy + 1) * grid_w + gx];
+            uint32_t c11 = grid[(gy + 1) * grid_w + gx + 1];
+            uint32_t noise = prng_next() & 0x7;
+            uint32_t color = 0;
+            int shift;
+
+            for (shift = 0; shift < 24; shift += 8) {
+                int top = ((c00 >> shift) & 0xff) * (cell - fx) + ((c10 >> shift) & 0xff) * fx;
+                int bottom = ((c01 >> shift) & 0xff) * (cell - fx) + ((c11 >> shift) & 0xff) * fx;
+                uint32_t v = (top * (cell - fy) + bottom * fy) / (cell * cell) + noise;
+                color |= MIN(v, 255) << shift;
+            }
+            pixels[y * width + x] = color;
+        }
+    }
+    g_free(grid);
+}
+
+/* windows with title bars, buttons and small icons */
+static void generate_ui(uint32_t *pixels, int width, int height)
+{
+    int x, y, i, j;
+
+    prng_seed(4);
+    fill_rect(pixels, width, height, 0, 0, width, height, rgb(58, 110, 165));
+    for (i = 0; i < 4; i++) {
+        int wx = i * width / 5 + 10, wy = i * height / 6 + 10;
+        int ww = width / 2, wh = height / 2;
+
+        fill_rect(pixels, width, height, wx - 1, wy - 1, ww + 2, wh + 2, rgb(40, 40, 40));
+        fill_rect(pixels, width, height, wx, wy, ww, wh, rgb(236, 236, 236));
+        fill_rect(pixels, width, height, wx, wy, ww, 22, rgb(70, 100, 200));
+        for (x = wx + 8; x + 60 < wx + ww; x += 70) {
+            fill_rect(pixels, width, height, x, wy + wh - 30, 60, 22, rgb(120, 120, 120));
+            fill_rect(pixels, width, height, x + 1, wy + wh - 29, 58, 20, rgb(210, 210, 210));
+        }
+        for (y = wy + 32; y + 24 < wy + wh - 36; y += 32) {
+            for (x = wx + 8; x + 24 < wx + ww; x += 32) {
+                for (j = 0; j < 24; j++) {
+                    for (int k = 0; k < 24; k++) {
+                        if (y + j < height && x + k < width) {
+                            pixels[(y + j) * width + x + k] = prng_next() & 0xffffff;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+static const ImageKind image_kinds[] = {
+    { "text", generate_text },
+    { "gradient", generate_gradient },
+    { "photo", generate_photo },
+    { "ui", generate_ui },
+};
+
+static void store_pixel(uint8_t *dest, int bpp, uint32_t pixel)
+{
+    switch (bpp) {
+    case 2: {
+        uint16_t p16 = ((pixel >> 9) & 0x7c00) | ((pixel >> 6) & 0x03e0) | ((pixel >> 3) & 0x001f);
+        memcpy(dest, &p16, 2);
+        break;
+    }
+    case 3:
+        dest[0] = pixel & 0xff;
+        dest[1] = (pixel >> 8) & 0xff;
+        dest[2] = (pixel >> 16) & 0xff;
+        break;
+    default:
+        memcpy(dest, &pixel, 4);
+        break;
+    }
+}
+
+/* Convert the generated pixels to the given format.
+ * If chunked each chunk is a separate allocation of CHUNK_LINES lines. */
+static SpiceChunks *create_chunks(const uint32_t *pixels, int width, int height,
+                                  const FormatInfo *format, int stride, bool chunked)
+{
+    int lines_per_chunk = chunked ? CHUNK_LINES : height;
+    int num_chunks = (height + lines_per_chunk - 1) / lines_per_chunk;
+    SpiceChunks *chunks = spice_chunks_new(num_chunks);
+    int chunk, x, y;
+
+    chunks->flags = SPICE_CHUNKS_FLAGS_FREE;
+    chunks->data_size = 0;
+    for (chunk = 0; chunk < num_chunks; chunk++) {
+        int first_line = chunk * lines_per_chunk;
+        int lines = MIN(lines_per_chunk, height - first_line);
+        uint8_t *data = g_malloc0(lines * stride);
+
+        for (y = 0; y < lines; y++) {
+            for (x = 0; x < width; x++) {
+                store_pixel(data + y * stride + x * format->bpp, format->bpp,
+                            pixels[(first_line + y) * width + x]);
+            }
+        }
+        chunks->chunk[chunk].data = data;
+        chunks->chunk[chunk].len = lines * stride;
+        chunks->data_size += lines * stride;
+    }
+    return chunks;
+}
+
+static bool encoder_supports(const EncoderConfig *config, SpiceBitmapFmt format)
+{
+    switch (config->type) {
+    case ENCODER_QUIC:
+    case ENCODER_JPEG:
+        return bitmap_fmt_has_graduality(format);
+#ifdef USE_LZ4
+    case ENCODER_LZ4:
+        return format == SPICE_BITMAP_FMT_24BIT || format == SPICE_BITMAP_FMT_32BIT;
+#endif
+    case ENCODER_GLZ:
+        return bitmap_fmt_is_rgb(format);
+    default:
+        return true;
+    }
+}
+
+static bool encode(ImageEncoders *enc, const EncoderConfig *config, SpiceBitmap *bitmap,
+                   compress_send_data_t *comp_data)
+{
+    SpiceImage image;
+    RedDrawable *red_drawable;
+    GlzImageRetention retention;
+    bool ret;
+
+    memset(&image, 0, sizeof(image));
+    switch (config->type) {
+    case ENCODER_QUIC:
+        return image_encoders_compress_quic(enc, &image, bitmap, comp_data);
+    case ENCODER_LZ:
+        return image_encoders_compress_lz(enc, &image, bitmap, comp_data);
+    case ENCODER_JPEG:
+        return image_encoders_compress_jpeg(enc, &image, bitmap, comp_data);
+#ifdef USE_LZ4
+    case ENCODER_LZ4:
+        return image_encoders_compress_lz4(enc, &image, bitmap, comp_data);
+#endif
+    case ENCODER_GLZ:
+        // the encoder keeps a reference to the drawable while the image is in the dictionary
+        red_drawable = g_new0(RedDrawable, 1);
+        red_drawable->refs = 1;
+        glz_retention_init(&retention);
+        ret = image_encoders_compress_glz(enc, &image, bitmap, red_drawable, &retention,
+                                          comp_data, config->zlib_level > 0);
+        glz_retention_detach_drawables(&retention);
+        red_drawable_unref(red_drawable);
+        return ret;
+    }
+    return false;
+}
+
+static void free_comp_data(compress_send_data_t *comp_data)
+{
+    RedCompressBuf *buf = comp_data->comp_buf;
+
+    while (buf) {
+        RedCompressBuf *next = buf->send_next;
+        compress_buf_free(buf);
+        buf = next;
+    }
+    g_free(comp_data->lzplt_palette);
+    memset(comp_data, 0, sizeof(*comp_data));
+}
+
+static int compare_times(const void *a, const void *b)
+{
+    red_time_t ta = *(const red_time_t *) a, tb = *(const red_time_t *) b;
+
+    return ta < tb ? -1 : ta > tb;
+}
+
+static double percentile_us(const red_time_t *sorted_times, int count, int percentile)
+{
+    int index = (count * percentile + 99) / 100 - 1;
+
+    return sorted_times[CLAMP(index, 0, count - 1)] / 1000.0;
+}
+
+static bool first_result = true;
+
+static void run_benchmark(ImageEncoders *enc, const EncoderConfig *config,
+                          const ImageKind *kind, const FormatInfo *format, bool chunked,
+                          SpiceBitmap *bitmap, int iterations)
+{
+    red_time_t *times = g_new(red_time_t, iterations);
+    red_time_t total_time = 0;
+    uint64_t bytes_out = 0;
+    bool lossy = false;
+    int i;
+
+    enc->jpeg_quality = config->jpeg_quality ? config->jpeg_quality : 85;
+    if (config->zlib_level > 0) {
+        enc->zlib_level = config->zlib_level;
+    }
+
+    for (i = 0; i < iterations; i++) {
+        compress_send_data_t comp_data;
+        red_time_t start;
+
+        // measure a cold dictionary, previous iterations would give perfect matches
+        if (config->type == ENCODER_GLZ) {
+            image_encoders_free_glz_drawables(enc);
+        }
+
+        memset(&comp_data, 0, sizeof(comp_data));
+        start = spice_get_monotonic_time_ns();
+        if (!encode(enc, config, bitmap, &comp_data)) {
+            g_printerr("%s failed to compress %s %s image\n",
+                       config->name, kind->name, format->name);
+            g_free(times);
+            return;
+        }
+        times[i] = spice_get_monotonic_time_ns() - start;
+        total_time += times[i];
+        bytes_out += comp_data.comp_buf_size;
+        lossy = comp_data.is_lossy;
+        free_comp_data(&comp_data);
+    }
+
+    qsort(times, iterations, sizeof(times[0]), compare_times);
+
+    uint64_t bytes_in = (uint64_t) bitmap->stride * bitmap->y;
+    printf("%s\n    {\"image\": \"%s\", \"format\": \"%s\", \"layout\": \"%s\", "
+           "\"width\": %u, \"height\": %u, \"stride\": %u, \"chunks\": %u,\n"
+           "     \"encoder\": \"%s\", \"lossy\": %s, \"bytes_in\": %" G_GUINT64_FORMAT ", "
+           "\"bytes_out\": %" G_GUINT64_FORMAT ", \"ratio\": %.3f, \"mb_per_sec\": %.2f,\n"
+           "     \"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}}",
+           first_result ? "" : ",",
+           kind->name, format->name, chunked ? "chunked" : "linear",
+           bitmap->x, bitmap->y, bitmap->stride, bitmap->data->num_chunks,
+           config->name, lossy ? "true" : "false", bytes_in, bytes_out / iterations,
+           bytes_out ? (double) bytes_in * iterations / bytes_out : 0.0,
+           total_time ? (double) bytes_in * iterations * 1000.0 / total_time : 0.0,
+           percentile_us(times, iterations, 50), percentile_us(times, iterations, 90),
+           percentile_us(times, iterations, 99), times[iterations - 1] / 1000.0);
+    first_result = false;
+    g_free(times);
+}
+
+int main(int argc, char *argv[])
+{
+    gint iterations = 20;
+    gchar *encoder_filter = NULL;
+
+    GOptionEntry entries[] = {
+        { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations,
+          "Number of compressions for each image and encoder", "COUNT" },
+        { "encoder", 'e', 0, G_OPTION_ARG_STRING, &encoder_filter,
+          "Only run encoders whose name starts with PREFIX", "PREFIX" },
+        { NULL }
+    };
+
+    GOptionContext *context = NULL;
+    GError *error = NULL;
+    context = g_option_context_new("- benchmark image encoders");
+    g_option_context_set_description(context, program_description);
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("Option parsing failed: %s\n", error->message);
+        exit(1);
+    }
+    g_option_context_free(context);
+
+    if (iterations < 1) {
+        g_printerr("Invalid --iterations option: %d\n", iterations);
+        exit(1);
+    }
+
+    ImageEncoderSharedData shared_data;
+    ImageEncoders enc;
+    image_encoder_shared_init(&shared_data);
+    image_encoders_init(&enc, &shared_data);
+
+    // the client is only used as a key to share dictionaries,
+    // without a server there is no memory limit
+    static int fake_client;
+    if (!image_encoders_get_glz_dictionary(&enc, NULL, (struct RedClient *) &fake_client,
+                                           0, GLZ_WINDOW_SIZE) ||
+        !image_encoders_glz_create(&enc, 0)) {
+        g_printerr("Failed to create GLZ encoder\n");
+        exit(1);
+    }
+
+    uint32_t *pixels = g_new(uint32_t, IMAGE_WIDTH * IMAGE_HEIGHT);
+
+    printf("{\"benchmark\": \"image-encoders\", \"iterations\": %d, \"results\": [", iterations);
+    for (int k = 0; k < G_N_ELEMENTS(image_kinds); k++) {
+        const ImageKind *kind = &image_kinds[k];
+
+        kind->generate(pixels, IMAGE_WIDTH, IMAGE_HEIGHT);
+        for (int f = 0; f < G_N_ELEMENTS(formats); f++) {
+            const FormatInfo *format = &formats[f];
+
+            for (int chunked = 0; chunked < 2; chunked++) {
+                SpiceBitmap bitmap;
+
+                memset(&bitmap, 0, sizeof(bitmap));
+                bitmap.format = format->format;
+                bitmap.flags = SPICE_BITMAP_FLAGS_TOP_DOWN;
+                bitmap.x = IMAGE_WIDTH;
+                bitmap.y = IMAGE_HEIGHT;
+                bitmap.stride = IMAGE_WIDTH * format->bpp + IMAGE_STRIDE_PAD;
+                bitmap.data = create_chunks(pixels, IMAGE_WIDTH, IMAGE_HEIGHT,
+                                            format, bitmap.stride, chunked);
+
+                for (int e = 0; e < G_N_ELEMENTS(encoder_configs); e++) {
+                    const EncoderConfig *config = &encoder_configs[e];
+
+                    if (encoder_filter && !g_str_has_prefix(config->name, encoder_filter)) {
+                        continue;
+                    }
+                    if (!encoder_supports(config, format->format)) {
+                        continue;
+                    }
+                    run_benchmark(&enc, config, kind, format, chunked, &bitmap, iterations);
+                }
+                spice_chunks_destroy(bitmap.data);
+            }
+        }
+    }
+    printf("\n]}\n");
+
+    g_free(pixels);
+    image_encoders_free(&enc);
+    g_free(encoder_filter);
+    return 0;
+}
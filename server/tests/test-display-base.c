@@ -301,7 +301,8 @@ static SimpleSpiceUpdate *test_spice_create_update_draw(Test *test, uint32_t sur
     return test_spice_create_update_from_bitmap(surface_id, bbox, bitmap, 0, NULL);
 }
 
-static SimpleSpiceUpdate *test_spice_create_update_copy_bits(Test *test, uint32_t surface_id)
+static SimpleSpiceUpdate *test_spice_create_update_copy_bits(Test *test, uint32_t surface_id,
+                                                             const CommandCopyBits *copy_bits)
 {
     SimpleSpiceUpdate *update;
     QXLDrawable *drawable;
@@ -310,6 +311,7 @@ static SimpleSpiceUpdate *test_spice_create_update_copy_bits(Test *test, uint32_
         .left = 10,
         .top = 0,
     };
+    QXLPoint src_pos = { 0, 0 };
 
     update   = g_new0(SimpleSpiceUpdate, 1);
     drawable = &update->drawable;
@@ -318,6 +320,11 @@ static SimpleSpiceUpdate *test_spice_create_update_copy_bits(Test *test, uint32_
     bh       = 48;
     bbox.right = bbox.left + bw;
     bbox.bottom = bbox.top + bh;
+    // use the command area if specified
+    if (copy_bits->bbox.right > copy_bits->bbox.left) {
+        bbox = copy_bits->bbox;
+        src_pos = copy_bits->src_pos;
+    }
     //printf("allocated %p, %p\n", update, update->bitmap);
 
     drawable->surface_id      = surface_id;
@@ -331,8 +338,7 @@ static SimpleSpiceUpdate *test_spice_create_update_copy_bits(Test *test, uint32_
     drawable->surfaces_dest[1] = -1;
     drawable->surfaces_dest[2] = -1;
 
-    drawable->u.copy_bits.src_pos.x = 0;
-    drawable->u.copy_bits.src_pos.y = 0;
+    drawable->u.copy_bits.src_pos = src_pos;
 
     set_cmd(&update->ext, QXL_CMD_DRAW, (intptr_t)drawable);
 
@@ -475,8 +481,11 @@ static pthread_mutex_t command_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 #define COMMANDS_SIZE G_N_ELEMENTS(commands)
 
-static void push_command(QXLCommandExt *ext)
+static void push_command(Test *test, QXLCommandExt *ext)
 {
+    if (test->on_command_pushed) {
+        test->on_command_pushed(test, ext);
+    }
     pthread_mutex_lock(&command_mutex);
     spice_assert(commands_end - commands_start < COMMANDS_SIZE);
     commands[commands_end % COMMANDS_SIZE] = ext;
@@ -489,6 +498,14 @@ static int get_num_commands(void)
     return commands_end - commands_start;
 }
 
+static int get_queued_commands(void)
+{
+    pthread_mutex_lock(&command_mutex);
+    int ret = get_num_commands();
+    pthread_mutex_unlock(&command_mutex);
+    return ret;
+}
+
 static struct QXLCommandExt *get_simple_command(void)
 {
     pthread_mutex_lock(&command_mutex);
@@ -502,14 +519,17 @@ static struct QXLCommandExt *get_simple_command(void)
 }
 
 // called from spice_server thread (i.e. red_worker thread)
-static int get_command(SPICE_GNUC_UNUSED QXLInstance *qin,
-                       struct QXLCommandExt *ext)
+static int get_command(QXLInstance *qin, struct QXLCommandExt *ext)
 {
+    Test *test = SPICE_CONTAINEROF(qin, Test, qxl_instance);
     struct QXLCommandExt *cmd = get_simple_command();
     if (!cmd) {
         return FALSE;
     }
     *ext = *cmd;
+    if (test->on_command_fetched) {
+        test->on_command_fetched(test);
+    }
     return TRUE;
 }
 
@@ -571,7 +591,7 @@ static void produce_command(Test *test)
 
             switch (command->command) {
             case SIMPLE_COPY_BITS:
-                update = test_spice_create_update_copy_bits(test, 0);
+                update = test_spice_create_update_copy_bits(test, 0, &command->copy_bits);
                 break;
             case SIMPLE_DRAW:
                 update = test_spice_create_update_draw(test, 0, path.t);
@@ -590,7 +610,7 @@ static void produce_command(Test *test)
                 g_assert_not_reached();
                 break;
             }
-            push_command(&update->ext);
+            push_command(test, &update->ext);
             break;
         }
 
@@ -610,7 +630,7 @@ static void produce_command(Test *test)
                                         SURF_WIDTH, SURF_HEIGHT,
                                         test->secondary_surface);
             }
-            push_command(&update->ext);
+            push_command(test, &update->ext);
             test->has_secondary = 1;
             break;
         }
@@ -620,7 +640,7 @@ static void produce_command(Test *test)
             test->has_secondary = 0;
             update = destroy_surface(test->target_surface);
             test->target_surface = 0;
-            push_command(&update->ext);
+            push_command(test, &update->ext);
             break;
         }
 
@@ -652,7 +672,9 @@ static void do_wakeup(void *opaque)
     int notify;
 
     test->cursor_notify = NOTIFY_CURSOR_BATCH;
-    for (notify = NOTIFY_DISPLAY_BATCH; notify > 0;--notify) {
+    for (notify = test->display_batch;
+         notify > 0 && (!test->max_queued_commands ||
+                        get_queued_commands() < test->max_queued_commands); --notify) {
         produce_command(test);
     }
 
@@ -930,6 +952,7 @@ Test* test_new(SpiceCoreInterface* core)
 
     test->core = core;
     test->wakeup_ms = 1;
+    test->display_batch = NOTIFY_DISPLAY_BATCH;
     test->cursor_notify = NOTIFY_CURSOR_BATCH;
     // some common initialization for all display tests
     port = BASE_PORT;
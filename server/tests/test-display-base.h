@@ -69,6 +69,11 @@ typedef struct CommandDrawSolid {
     uint32_t surface_id;
 } CommandDrawSolid;
 
+typedef struct CommandCopyBits {
+    QXLRect bbox;
+    QXLPoint src_pos;
+} CommandCopyBits;
+
 typedef struct CommandSleep {
     uint32_t secs;
 } CommandSleep;
@@ -84,6 +89,7 @@ struct Command {
         CommandCreatePrimary create_primary;
         CommandDrawBitmap bitmap;
         CommandDrawSolid solid;
+        CommandCopyBits copy_bits;
         CommandSleep sleep;
         CommandCreateSurface create_surface;
     };
@@ -108,6 +114,8 @@ struct Test {
 
     SpiceTimer *wakeup_timer;
     int wakeup_ms;
+    int display_batch; // commands produced at each wakeup
+    int max_queued_commands; // stop producing commands over this, 0 for no limit
 
     int cursor_notify;
 
@@ -128,6 +136,10 @@ struct Test {
     // callbacks
     void (*on_client_connected)(Test *test);
     void (*on_client_disconnected)(Test *test);
+    // called before a command is queued for the worker
+    void (*on_command_pushed)(Test *test, QXLCommandExt *ext);
+    // called from the worker thread when it takes a command
+    void (*on_command_fetched)(Test *test);
 };
 
 void test_set_simple_command_list(Test *test, const int *command, int num_commands);
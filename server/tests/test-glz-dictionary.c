@@ -0,0 +1,325 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test the resize of the GLZ dictionary window and the memory limit
+ * set with spice_server_set_glz_memory_limit()
+ */
+#include <config.h>
+#include <stdarg.h>
+#include <spice.h>
+#include <common/mem.h>
+
+#include "test-glib-compat.h"
+#include "basic-event-loop.h"
+#include "image-encoders.h"
+#include "glz-encoder.h"
+#include "reds.h"
+
+#define IMAGE_WIDTH 64
+#define IMAGE_HEIGHT 64
+#define IMAGE_PIXELS (IMAGE_WIDTH * IMAGE_HEIGHT)
+#define IMAGE_STRIDE (IMAGE_WIDTH * 4)
+#define NUM_IMAGES 20
+#define WINDOW_SIZE (32 * IMAGE_PIXELS)
+
+typedef struct {
+    GlzEncoderUsrContext usr;
+    bool freed[NUM_IMAGES * 2 + 1];
+    int num_freed;
+} TestUsrContext;
+
+static SPICE_GNUC_PRINTF(2, 3) void
+test_usr_error(GlzEncoderUsrContext *usr, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    g_logv(G_LOG_DOMAIN, G_LOG_LEVEL_ERROR, fmt, ap);
+    va_end(ap);
+}
+
+static SPICE_GNUC_PRINTF(2, 3) void
+test_usr_warn(GlzEncoderUsrContext *usr, const char *fmt, ...)
+{
+}
+
+static void *test_usr_malloc(GlzEncoderUsrContext *usr, int size)
+{
+    return g_malloc(size);
+}
+
+static void test_usr_free(GlzEncoderUsrContext *usr, void *ptr)
+{
+    g_free(ptr);
+}
+
+static int test_usr_more_lines(GlzEncoderUsrContext *usr, uint8_t **lines)
+{
+    return 0;
+}
+
+static int test_usr_more_space(GlzEncoderUsrContext *usr, uint8_t **io_ptr)
+{
+    return 0;
+}
+
+// the image context is the image number, starting from 1
+static void test_usr_free_image(GlzEncoderUsrContext *usr, GlzUsrImageContext *image)
+{
+    TestUsrContext *ctx = SPICE_CONTAINEROF(usr, TestUsrContext, usr);
+    unsigned int n = GPOINTER_TO_UINT(image);
+
+    g_assert_cmpuint(n, <, G_N_ELEMENTS(ctx->freed));
+    g_assert_false(ctx->freed[n]);
+    ctx->freed[n] = true;
+    ctx->num_freed++;
+}
+
+// the window references the pixels of the images it contains
+static uint32_t images[NUM_IMAGES + 5][IMAGE_PIXELS];
+
+static void encode_image(GlzEncoderContext *encoder, unsigned int n)
+{
+    uint32_t *pixels = images[n];
+    uint8_t out[IMAGE_PIXELS * 4 * 2];
+    GlzEncDictImageContext *dict_image = NULL;
+
+    // a gradient, different for each image
+    for (int i = 0; i < IMAGE_PIXELS; i++) {
+        pixels[i] = (i * n) & 0xffffff;
+    }
+    g_assert_cmpint(glz_encode(encoder, LZ_IMAGE_TYPE_RGB32, IMAGE_WIDTH, IMAGE_HEIGHT, TRUE,
+                               (uint8_t *) pixels, IMAGE_HEIGHT, IMAGE_STRIDE,
+                               out, sizeof(out), GUINT_TO_POINTER(n), &dict_image), >, 0);
+    g_assert_nonnull(dict_image);
+}
+
+static void test_dictionary_resize(void)
+{
+    TestUsrContext ctx;
+    unsigned int n;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.usr.error = test_usr_error;
+    ctx.usr.warn = test_usr_warn;
+    ctx.usr.info = test_usr_warn;
+    ctx.usr.malloc = test_usr_malloc;
+    ctx.usr.free = test_usr_free;
+    ctx.usr.more_lines = test_usr_more_lines;
+    ctx.usr.more_space = test_usr_more_space;
+    ctx.usr.free_image = test_usr_free_image;
+
+    GlzEncDictContext *dict = glz_enc_dictionary_create(WINDOW_SIZE, 1, &ctx.usr);
+    g_assert_nonnull(dict);
+    GlzEncoderContext *encoder = glz_encoder_create(0, dict, &ctx.usr);
+    g_assert_nonnull(encoder);
+
+    for (n = 1; n <= NUM_IMAGES; n++) {
+        encode_image(encoder, n);
+    }
+    g_assert_cmpuint(glz_enc_dictionary_get_size(dict), ==, WINDOW_SIZE);
+    g_assert_cmpuint(glz_enc_dictionary_get_used_size(dict), ==, NUM_IMAGES * IMAGE_PIXELS);
+    g_assert_cmpuint(glz_enc_dictionary_get_used_bytes(dict), ==,
+                     NUM_IMAGES * IMAGE_HEIGHT * IMAGE_STRIDE);
+    g_assert_cmpint(ctx.num_freed, ==, 0);
+
+    // shrinking removes the oldest images
+    g_assert_cmpuint(glz_enc_dictionary_resize(dict, 8 * IMAGE_PIXELS, &ctx.usr), ==,
+                     8 * IMAGE_PIXELS);
+    g_assert_cmpuint(glz_enc_dictionary_get_size(dict), ==, 8 * IMAGE_PIXELS);
+    g_assert_cmpuint(glz_enc_dictionary_get_used_size(dict), ==, 8 * IMAGE_PIXELS);
+    g_assert_cmpuint(glz_enc_dictionary_get_used_bytes(dict), ==,
+                     8 * IMAGE_HEIGHT * IMAGE_STRIDE);
+    g_assert_cmpint(ctx.num_freed, ==, NUM_IMAGES - 8);
+    for (n = 1; n <= NUM_IMAGES; n++) {
+        g_assert_cmpint(ctx.freed[n], ==, n <= NUM_IMAGES - 8);
+    }
+
+    // the window can't grow above the size of the decoder
+    g_assert_cmpuint(glz_enc_dictionary_resize(dict, WINDOW_SIZE * 2, &ctx.usr), ==,
+                     WINDOW_SIZE);
+    g_assert_cmpuint(glz_enc_dictionary_get_size(dict), ==, WINDOW_SIZE);
+    g_assert_cmpuint(glz_enc_dictionary_get_used_size(dict), ==, 8 * IMAGE_PIXELS);
+    g_assert_cmpint(ctx.num_freed, ==, NUM_IMAGES - 8);
+
+    // once grown back new images are added without evicting
+    for (n = NUM_IMAGES + 1; n <= NUM_IMAGES + 4; n++) {
+        encode_image(encoder, n);
+    }
+    g_assert_cmpuint(glz_enc_dictionary_get_used_size(dict), ==, 12 * IMAGE_PIXELS);
+    g_assert_cmpint(ctx.num_freed, ==, NUM_IMAGES - 8);
+
+    // an empty window releases everything
+    g_assert_cmpuint(glz_enc_dictionary_resize(dict, 0, &ctx.usr), ==, 0);
+    g_assert_cmpuint(glz_enc_dictionary_get_used_size(dict), ==, 0);
+    g_assert_cmpuint(glz_enc_dictionary_get_used_bytes(dict), ==, 0);
+    g_assert_cmpint(ctx.num_freed, ==, NUM_IMAGES + 4);
+
+    glz_encoder_destroy(encoder);
+    glz_enc_dictionary_destroy(dict, &ctx.usr);
+}
+
+/*
+ * Memory limit of the server, using ImageEncoders as the display channel does
+ */
+#define LIMIT_IMAGES 16
+#define LIMIT_WIDTH 128
+#define LIMIT_HEIGHT 128
+/* big enough to hold more images than the limit allows */
+#define LIMIT_WINDOW_SIZE (1024 * 1024 * 16)
+/* wait for the budget to be checked again */
+#define BUDGET_CHECK_WAIT_US (110 * 1000)
+/* wait for the dictionary to be considered idle */
+#define IDLE_WAIT_US (10100 * 1000)
+
+typedef struct {
+    ImageEncoderSharedData shared_data;
+    ImageEncoders enc;
+} TestEncoders;
+
+static void test_encoders_init(TestEncoders *encoders, SpiceServer *server, RedClient *client)
+{
+    image_encoder_shared_init(&encoders->shared_data);
+    image_encoders_init(&encoders->enc, &encoders->shared_data);
+    g_assert_true(image_encoders_get_glz_dictionary(&encoders->enc, server, client,
+                                                    0, LIMIT_WINDOW_SIZE));
+    g_assert_true(image_encoders_glz_create(&encoders->enc, 0));
+}
+
+// pixels are added to image_data as the window references them
+static bool compress_image(TestEncoders *encoders, GPtrArray *image_data, unsigned int n)
+{
+    uint32_t *pixels = g_new(uint32_t, LIMIT_WIDTH * LIMIT_HEIGHT);
+    compress_send_data_t comp_data;
+    GlzImageRetention retention;
+    SpiceBitmap bitmap;
+    SpiceImage image;
+    bool ret;
+
+    for (int i = 0; i < LIMIT_WIDTH * LIMIT_HEIGHT; i++) {
+        pixels[i] = (i * n) & 0xffffff;
+    }
+    memset(&bitmap, 0, sizeof(bitmap));
+    bitmap.format = SPICE_BITMAP_FMT_32BIT;
+    bitmap.flags = SPICE_BITMAP_FLAGS_TOP_DOWN;
+    bitmap.x = LIMIT_WIDTH;
+    bitmap.y = LIMIT_HEIGHT;
+    bitmap.stride = LIMIT_WIDTH * 4;
+    bitmap.data = spice_chunks_new_linear((uint8_t *) pixels, LIMIT_WIDTH * LIMIT_HEIGHT * 4);
+
+    // the encoder keeps a reference to the drawable while the image is in the dictionary
+    RedDrawable *red_drawable = g_new0(RedDrawable, 1);
+    red_drawable->refs = 1;
+
+    memset(&image, 0, sizeof(image));
+    memset(&comp_data, 0, sizeof(comp_data));
+    glz_retention_init(&retention);
+    ret = image_encoders_compress_glz(&encoders->enc, &image, &bitmap, red_drawable, &retention,
+                                      &comp_data, FALSE);
+    glz_retention_detach_drawables(&retention);
+    red_drawable_unref(red_drawable);
+
+    RedCompressBuf *buf = comp_data.comp_buf;
+    while (buf) {
+        RedCompressBuf *next = buf->send_next;
+        compress_buf_free(buf);
+        buf = next;
+    }
+    spice_chunks_destroy(bitmap.data);
+    g_ptr_array_add(image_data, pixels);
+    return ret;
+}
+
+// number of images of the encoders still in the shared dictionary
+static uint32_t images_in_window(TestEncoders *encoders)
+{
+    // the images removed by the other client are queued to this one
+    image_encoders_free_glz_drawables_to_free(&encoders->enc);
+    return encoders->shared_data.glz_drawable_count;
+}
+
+static void test_memory_limit(bool idle)
+{
+    SpiceCoreInterface *core;
+    SpiceServer *server = spice_server_new();
+    g_assert_nonnull(server);
+    core = basic_event_loop_init();
+    g_assert_nonnull(core);
+    g_assert_cmpint(spice_server_init(server, core), ==, 0);
+
+    g_assert_cmpint(spice_server_set_glz_memory_limit(server,
+                                                      LIMIT_IMAGES * LIMIT_WIDTH *
+                                                      LIMIT_HEIGHT * 4), ==, 0);
+
+    // the clients are only used as keys to share dictionaries
+    static int fake_clients[2];
+    TestEncoders *encoders_a = g_new0(TestEncoders, 1);
+    TestEncoders *encoders_b = g_new0(TestEncoders, 1);
+    GPtrArray *image_data = g_ptr_array_new_with_free_func(g_free);
+    test_encoders_init(encoders_a, server, (RedClient *) &fake_clients[0]);
+    test_encoders_init(encoders_b, server, (RedClient *) &fake_clients[1]);
+
+    // go over the limit, some images are evicted if the budget
+    // is checked in the meantime
+    for (unsigned int n = 1; n <= LIMIT_IMAGES * 3; n++) {
+        g_assert_true(compress_image(encoders_a, image_data, n));
+    }
+    g_assert_cmpuint(images_in_window(encoders_a), >, LIMIT_IMAGES);
+
+    g_usleep(idle ? IDLE_WAIT_US : BUDGET_CHECK_WAIT_US);
+
+    // the other client checks the budget and shrinks the first dictionary
+    g_assert_true(compress_image(encoders_b, image_data, 1));
+    g_assert_cmpuint(images_in_window(encoders_a), >, 0);
+    g_assert_cmpuint(images_in_window(encoders_a), <=, LIMIT_IMAGES);
+    g_assert_cmpuint(images_in_window(encoders_b), ==, 1);
+
+    // the minimal window is kept, the first client can still use its dictionary
+    g_assert_true(compress_image(encoders_a, image_data, 1));
+    g_assert_cmpuint(images_in_window(encoders_a), >, 0);
+
+    image_encoders_free(&encoders_a->enc);
+    image_encoders_free(&encoders_b->enc);
+    g_free(encoders_a);
+    g_free(encoders_b);
+    g_ptr_array_free(image_data, TRUE);
+
+    spice_server_destroy(server);
+    basic_event_loop_destroy();
+}
+
+static void test_memory_limit_active(void)
+{
+    test_memory_limit(false);
+}
+
+static void test_memory_limit_idle(void)
+{
+    test_memory_limit(true);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/glz-dictionary/resize", test_dictionary_resize);
+    g_test_add_func("/server/glz-dictionary/memory-limit", test_memory_limit_active);
+    g_test_add_func("/server/glz-dictionary/memory-limit-idle", test_memory_limit_idle);
+
+    return g_test_run();
+}
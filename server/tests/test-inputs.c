@@ -0,0 +1,271 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2019 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test the inputs channel, running in the main loop or in the I/O thread
+ * (see spice_server_set_io_thread). In both cases the devices must be
+ * called from the main thread and the client must get the motion acks.
+ */
+#include <config.h>
+#include <unistd.h>
+#include <spice.h>
+
+#include "test-glib-compat.h"
+#include "basic-event-loop.h"
+#include "reds.h"
+#include "red-client.h"
+#include "main-channel.h"
+#include "net-utils.h"
+
+#define NUM_MOTIONS SPICE_INPUT_MOTION_ACK_BUNCH
+#define KEY_A_DOWN 0x1e
+#define KEY_A_UP (KEY_A_DOWN | 0x80)
+
+static GThread *main_thread;
+static SpiceCoreInterface *core;
+static int client_socket = -1;
+
+static uint8_t scancodes[16];
+static int num_scancodes;
+static int num_motions;
+static bool got_motion_ack;
+
+static void kbd_push_key(SpiceKbdInstance *sin, uint8_t frag)
+{
+    g_assert_true(g_thread_self() == main_thread);
+    g_assert_cmpint(num_scancodes, <, G_N_ELEMENTS(scancodes));
+    scancodes[num_scancodes++] = frag;
+}
+
+static uint8_t kbd_get_leds(SpiceKbdInstance *sin)
+{
+    g_assert_true(g_thread_self() == main_thread);
+    return 0;
+}
+
+static const SpiceKbdInterface kbd_sif = {
+    .base = {
+        .type          = SPICE_INTERFACE_KEYBOARD,
+        .description   = "test keyboard",
+        .major_version = SPICE_INTERFACE_KEYBOARD_MAJOR,
+        .minor_version = SPICE_INTERFACE_KEYBOARD_MINOR,
+    },
+    .push_scan_freg = kbd_push_key,
+    .get_leds = kbd_get_leds,
+};
+
+static void mouse_motion(SpiceMouseInstance *sin, int dx, int dy, int dz,
+                         uint32_t buttons_state)
+{
+    g_assert_true(g_thread_self() == main_thread);
+    g_assert_cmpint(dx, ==, 1);
+    g_assert_cmpint(dy, ==, -1);
+    num_motions++;
+}
+
+static void mouse_buttons(SpiceMouseInstance *sin, uint32_t buttons_state)
+{
+    g_assert_true(g_thread_self() == main_thread);
+}
+
+static const SpiceMouseInterface mouse_sif = {
+    .base = {
+        .type          = SPICE_INTERFACE_MOUSE,
+        .description   = "test mouse",
+        .major_version = SPICE_INTERFACE_MOUSE_MAJOR,
+        .minor_version = SPICE_INTERFACE_MOUSE_MINOR,
+    },
+    .motion = mouse_motion,
+    .buttons = mouse_buttons,
+};
+
+static SpiceKbdInstance kbd_instance;
+static SpiceMouseInstance mouse_instance;
+
+static void send_message(uint16_t type, const void *data, uint32_t size)
+{
+    uint8_t msg[64];
+
+    g_assert_cmpuint(size + 6, <=, sizeof(msg));
+    // mini header
+    *(uint16_t *) msg = GUINT16_TO_LE(type);
+    *(uint32_t *) (msg + 2) = GUINT32_TO_LE(size);
+    memcpy(msg + 6, data, size);
+    g_assert_cmpint(write(client_socket, msg, size + 6), ==, size + 6);
+}
+
+static void send_key(uint16_t type, uint32_t code)
+{
+    code = GUINT32_TO_LE(code);
+    send_message(type, &code, sizeof(code));
+}
+
+static void send_motion(int32_t dx, int32_t dy)
+{
+    uint8_t motion[10];
+
+    *(int32_t *) motion = GINT32_TO_LE(dx);
+    *(int32_t *) (motion + 4) = GINT32_TO_LE(dy);
+    *(uint16_t *) (motion + 8) = 0;
+    send_message(SPICE_MSGC_INPUTS_MOUSE_MOTION, motion, sizeof(motion));
+}
+
+static GByteArray *received;
+
+// parse the messages of the server looking for the motion ack
+static void read_server_messages(void)
+{
+    uint8_t buffer[256];
+    ssize_t len;
+
+    while ((len = recv(client_socket, buffer, sizeof(buffer), 0)) > 0) {
+        g_byte_array_append(received, buffer, len);
+    }
+    while (received->len >= 6) {
+        uint16_t type = GUINT16_FROM_LE(*(uint16_t *) received->data);
+        uint32_t size = GUINT32_FROM_LE(*(uint32_t *) (received->data + 2));
+
+        if (received->len < 6 + size) {
+            break;
+        }
+        if (type == SPICE_MSG_INPUTS_MOUSE_MOTION_ACK) {
+            got_motion_ack = true;
+        }
+        g_byte_array_remove_range(received, 0, 6 + size);
+    }
+}
+
+static SpiceTimer *check_timer;
+static int check_countdown = 500;
+
+static void check_events(void *opaque)
+{
+    read_server_messages();
+    if (num_scancodes == 2 && num_motions == NUM_MOTIONS && got_motion_ack) {
+        basic_event_loop_quit();
+        return;
+    }
+    if (--check_countdown <= 0) {
+        g_error("events not received, %d scancodes, %d motions, ack %d",
+                num_scancodes, num_motions, got_motion_ack);
+    }
+    core->timer_start(check_timer, 10);
+}
+
+static RedStream *create_dummy_stream(SpiceServer *server, int *p_socket)
+{
+    int sv[2];
+    g_assert_cmpint(socketpair(AF_LOCAL, SOCK_STREAM, 0, sv), ==, 0);
+    if (p_socket) {
+        *p_socket = sv[1];
+    }
+    red_socket_set_non_blocking(sv[0], true);
+    red_socket_set_non_blocking(sv[1], true);
+
+    RedStream * stream = red_stream_new(server, sv[0]);
+    g_assert_nonnull(stream);
+
+    return stream;
+}
+
+static void test_inputs(gconstpointer user_data)
+{
+    bool io_thread = GPOINTER_TO_INT(user_data);
+    SpiceServer *server = spice_server_new();
+
+    main_thread = g_thread_self();
+    num_scancodes = 0;
+    num_motions = 0;
+    got_motion_ack = false;
+    check_countdown = 500;
+    received = g_byte_array_new();
+
+    g_assert_nonnull(server);
+
+    core = basic_event_loop_init();
+    g_assert_nonnull(core);
+
+    g_assert_cmpint(spice_server_set_io_thread(server, io_thread), ==, 0);
+    g_assert_cmpint(spice_server_init(server, core), ==, 0);
+
+    kbd_instance.base.sif = &kbd_sif.base;
+    g_assert_cmpint(spice_server_add_interface(server, &kbd_instance.base), ==, 0);
+    mouse_instance.base.sif = &mouse_sif.base;
+    g_assert_cmpint(spice_server_add_interface(server, &mouse_instance.base), ==, 0);
+
+    RedChannel *channel = reds_find_channel(server, SPICE_CHANNEL_INPUTS, 0);
+    g_assert_nonnull(channel);
+
+    // create dummy RedClient and MainChannelClient
+    RedChannelCapabilities caps;
+    memset(&caps, 0, sizeof(caps));
+    uint32_t common_caps = 1 << SPICE_COMMON_CAP_MINI_HEADER;
+    caps.num_common_caps = 1;
+    caps.common_caps = spice_memdup(&common_caps, sizeof(common_caps));
+
+    RedClient *client = red_client_new(server, FALSE);
+    g_assert_nonnull(client);
+
+    MainChannel *main_channel = main_channel_new(server);
+    g_assert_nonnull(main_channel);
+
+    MainChannelClient *mcc;
+    mcc = main_channel_link(main_channel, client, create_dummy_stream(server, NULL),
+                            0, FALSE, &caps);
+    g_assert_nonnull(mcc);
+    red_client_set_main(client, mcc);
+
+    // connect the inputs channel and send some events
+    red_channel_connect(channel, client, create_dummy_stream(server, &client_socket),
+                        FALSE, &caps);
+    red_channel_capabilities_reset(&caps);
+
+    send_key(SPICE_MSGC_INPUTS_KEY_DOWN, KEY_A_DOWN);
+    send_key(SPICE_MSGC_INPUTS_KEY_UP, KEY_A_UP);
+    for (int i = 0; i < NUM_MOTIONS; i++) {
+        send_motion(1, -1);
+    }
+
+    check_timer = core->timer_add(check_events, core);
+    core->timer_start(check_timer, 10);
+
+    basic_event_loop_mainloop();
+
+    g_assert_cmpint(scancodes[0], ==, KEY_A_DOWN);
+    g_assert_cmpint(scancodes[1], ==, KEY_A_UP);
+
+    // cleanup
+    core->timer_remove(check_timer);
+    red_client_destroy(client);
+    g_object_unref(main_channel);
+    close(client_socket);
+    g_byte_array_free(received, TRUE);
+
+    spice_server_destroy(server);
+
+    basic_event_loop_destroy();
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_data_func("/server/inputs/main-loop", GINT_TO_POINTER(FALSE), test_inputs);
+    g_test_add_data_func("/server/inputs/io-thread", GINT_TO_POINTER(TRUE), test_inputs);
+
+    return g_test_run();
+}
@@ -0,0 +1,297 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2019 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test the per message type statistics returned by
+ * spice_server_get_message_stats() after a channel sent some messages
+ */
+#include <config.h>
+#include <unistd.h>
+#include <spice.h>
+
+#include "test-glib-compat.h"
+#include "basic-event-loop.h"
+#include "reds.h"
+#include "red-client.h"
+#include "main-channel.h"
+#include "net-utils.h"
+
+#define NUM_MESSAGES 7
+
+/*
+ * Declare a RedTestChannel to be used for the test
+ */
+SPICE_DECLARE_TYPE(RedTestChannel, red_test_channel, TEST_CHANNEL);
+#define RED_TYPE_TEST_CHANNEL red_test_channel_get_type()
+
+struct RedTestChannel
+{
+    RedChannel parent;
+};
+
+struct RedTestChannelClass
+{
+    RedChannelClass parent_class;
+};
+
+G_DEFINE_TYPE(RedTestChannel, red_test_channel, RED_TYPE_CHANNEL)
+
+SPICE_DECLARE_TYPE(RedTestChannelClient, red_test_channel_client, TEST_CHANNEL_CLIENT);
+#define RED_TYPE_TEST_CHANNEL_CLIENT red_test_channel_client_get_type()
+
+struct RedTestChannelClient
+{
+    RedChannelClient parent;
+};
+
+struct RedTestChannelClientClass
+{
+    RedChannelClientClass parent_class;
+};
+
+G_DEFINE_TYPE(RedTestChannelClient, red_test_channel_client, RED_TYPE_CHANNEL_CLIENT)
+
+static void
+red_test_channel_init(RedTestChannel *self)
+{
+}
+
+static void
+red_test_channel_client_init(RedTestChannelClient *self)
+{
+}
+
+static void
+test_channel_send_item(RedChannelClient *rcc, RedPipeItem *item)
+{
+}
+
+static void
+test_connect_client(RedChannel *channel, RedClient *client, RedStream *stream,
+                    int migration, RedChannelCapabilities *caps)
+{
+    RedChannelClient *rcc;
+    rcc = g_initable_new(RED_TYPE_TEST_CHANNEL_CLIENT,
+                         NULL, NULL,
+                         "channel", channel,
+                         "client", client,
+                         "stream", stream,
+                         "caps", caps,
+                         NULL);
+    g_assert_nonnull(rcc);
+
+    for (int i = 0; i < NUM_MESSAGES; ++i) {
+        red_channel_client_pipe_add_empty_msg(rcc, SPICE_MSG_MIGRATE_DATA);
+    }
+}
+
+static void
+red_test_channel_constructed(GObject *object)
+{
+    G_OBJECT_CLASS(red_test_channel_parent_class)->constructed(object);
+
+    ClientCbs client_cbs = { .connect = test_connect_client, };
+    red_channel_register_client_cbs(RED_CHANNEL(object), &client_cbs);
+}
+
+static void
+red_test_channel_class_init(RedTestChannelClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS(klass);
+    object_class->constructed = red_test_channel_constructed;
+
+    RedChannelClass *channel_class = RED_CHANNEL_CLASS(klass);
+    channel_class->parser = spice_get_client_channel_parser(SPICE_CHANNEL_PORT, NULL);
+    channel_class->handle_message = red_channel_client_handle_message;
+    channel_class->send_item = test_channel_send_item;
+}
+
+static uint8_t *
+red_test_channel_client_alloc_msg_rcv_buf(RedChannelClient *rcc, uint16_t type, uint32_t size)
+{
+    return g_malloc(size);
+}
+
+static void
+red_test_channel_client_release_msg_rcv_buf(RedChannelClient *rcc,
+                                            uint16_t type, uint32_t size, uint8_t *msg)
+{
+    g_free(msg);
+}
+
+static void
+red_test_channel_client_class_init(RedTestChannelClientClass *klass)
+{
+    RedChannelClientClass *client_class = RED_CHANNEL_CLIENT_CLASS(klass);
+    client_class->alloc_recv_buf = red_test_channel_client_alloc_msg_rcv_buf;
+    client_class->release_recv_buf = red_test_channel_client_release_msg_rcv_buf;
+}
+
+
+/*
+ * Main test part
+ */
+static int client_socket = -1;
+static SpiceServer *server;
+
+// return the entry of the test channel for the given message type
+static const SpiceMessageStats *
+find_stats(const SpiceMessageStats *stats, size_t num_stats, uint16_t msg_type)
+{
+    for (size_t i = 0; i < num_stats; i++) {
+        if (stats[i].channel_type == SPICE_CHANNEL_PORT && stats[i].channel_id == 0 &&
+            stats[i].message_type == msg_type) {
+            return &stats[i];
+        }
+    }
+    return NULL;
+}
+
+// all messages should be written by now, check the counters
+static void timeout_check_stats(void *opaque)
+{
+    // get all data sent to the client
+    size_t got_data = 0;
+    ssize_t len;
+    alarm(1);
+    char buffer[256];
+    while ((len=recv(client_socket, buffer, sizeof(buffer), 0)) > 0)
+        got_data += len;
+    alarm(0);
+
+    size_t num_stats = 0;
+    SpiceMessageStats *stats = spice_server_get_message_stats(server, &num_stats);
+    g_assert_nonnull(stats);
+
+    const SpiceMessageStats *msg_stats = find_stats(stats, num_stats, SPICE_MSG_MIGRATE_DATA);
+    g_assert_nonnull(msg_stats);
+    g_assert_cmpuint(msg_stats->messages, ==, NUM_MESSAGES);
+    // empty messages are just the mini header
+    g_assert_cmpuint(msg_stats->bytes, ==, NUM_MESSAGES * sizeof(SpiceMiniDataHeader));
+    g_assert_cmpuint(msg_stats->bytes, ==, got_data);
+    // nothing was compressed
+    g_assert_cmpuint(msg_stats->uncompressed_bytes, ==, msg_stats->bytes);
+    g_assert_cmpuint(msg_stats->max_latency_us, <=, msg_stats->total_latency_us);
+
+    // no other message was sent by the channel
+    g_assert_null(find_stats(stats, num_stats, SPICE_MSG_PING));
+
+    spice_server_free_message_stats(stats);
+
+    basic_event_loop_quit();
+}
+
+static RedStream *create_dummy_stream(SpiceServer *server, int *p_socket)
+{
+    int sv[2];
+    g_assert_cmpint(socketpair(AF_LOCAL, SOCK_STREAM, 0, sv), ==, 0);
+    if (p_socket) {
+        *p_socket = sv[1];
+    }
+    red_socket_set_non_blocking(sv[0], true);
+    red_socket_set_non_blocking(sv[1], true);
+
+    RedStream * stream = red_stream_new(server, sv[0]);
+    g_assert_nonnull(stream);
+
+    return stream;
+}
+
+static void message_stats(void)
+{
+    SpiceCoreInterface *core;
+    server = spice_server_new();
+
+    g_assert_nonnull(server);
+
+    core = basic_event_loop_init();
+    g_assert_nonnull(core);
+
+    g_assert_cmpint(spice_server_init(server, core), ==, 0);
+
+    // nothing sent yet
+    size_t num_stats = 1;
+    SpiceMessageStats *stats = spice_server_get_message_stats(server, &num_stats);
+    g_assert_cmpuint(num_stats, ==, 0);
+    spice_server_free_message_stats(stats);
+
+    // create a channel and connect to it
+    RedChannel *channel =
+        g_object_new(RED_TYPE_TEST_CHANNEL,
+                     "spice-server", server,
+                     "core-interface", reds_get_core_interface(server),
+                     "channel-type", SPICE_CHANNEL_PORT, // any other than main is fine
+                     "id", 0,
+                     NULL);
+
+    // create dummy RedClient and MainChannelClient
+    RedChannelCapabilities caps;
+    memset(&caps, 0, sizeof(caps));
+    uint32_t common_caps = 1 << SPICE_COMMON_CAP_MINI_HEADER;
+    caps.num_common_caps = 1;
+    caps.common_caps = spice_memdup(&common_caps, sizeof(common_caps));
+
+    RedClient *client = red_client_new(server, FALSE);
+    g_assert_nonnull(client);
+
+    MainChannel *main_channel = main_channel_new(server);
+    g_assert_nonnull(main_channel);
+
+    MainChannelClient *mcc;
+    mcc = main_channel_link(main_channel, client, create_dummy_stream(server, NULL),
+                            0, FALSE, &caps);
+    g_assert_nonnull(mcc);
+    red_client_set_main(client, mcc);
+
+    // create our testing RedChannelClient
+    red_channel_connect(channel, client, create_dummy_stream(server, &client_socket),
+                        FALSE, &caps);
+    red_channel_capabilities_reset(&caps);
+
+    // give the channel the time to write everything
+    SpiceTimer *check_timer;
+    check_timer = core->timer_add(timeout_check_stats, core);
+    core->timer_start(check_timer, 100);
+
+    basic_event_loop_mainloop();
+
+    // the statistics go away with the client
+    red_client_destroy(client);
+    stats = spice_server_get_message_stats(server, &num_stats);
+    g_assert_null(find_stats(stats, num_stats, SPICE_MSG_MIGRATE_DATA));
+    spice_server_free_message_stats(stats);
+
+    // cleanup
+    g_object_unref(main_channel);
+    g_object_unref(channel);
+
+    core->timer_remove(check_timer);
+
+    spice_server_destroy(server);
+    server = NULL;
+
+    basic_event_loop_destroy();
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/message-stats", message_stats);
+
+    return g_test_run();
+}
@@ -46,11 +46,30 @@ static void agent_options(void)
     spice_server_destroy(server);
 }
 
+static void rendering_options(void)
+{
+    SpiceCoreInterface *core;
+    SpiceServer *server = spice_server_new();
+
+    g_assert_nonnull(server);
+
+    core = basic_event_loop_init();
+    g_assert_nonnull(core);
+
+    g_assert_cmpint(spice_server_set_lazy_rendering(server, 64 * 1024 * 1024), ==, 0);
+    g_assert_cmpint(spice_server_init(server, core), ==, 0);
+    g_assert_cmpint(spice_server_set_lazy_rendering(server, 0), ==, 0);
+
+    spice_server_destroy(server);
+    basic_event_loop_destroy();
+}
+
 int main(int argc, char *argv[])
 {
     g_test_init(&argc, &argv, NULL);
 
     g_test_add_func("/server/agent options", agent_options);
+    g_test_add_func("/server/rendering options", rendering_options);
 
     return g_test_run();
 }
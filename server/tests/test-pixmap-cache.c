@@ -0,0 +1,193 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2019 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test the migration of the pixmap cache index: the index of the frozen
+ * cache is marshalled on the src and restored on the dest
+ */
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test-glib-compat.h"
+#include "pixmap-cache.h"
+
+#define CACHE_SIZE (64 * 1024)
+
+// the caches are only looked up by client, any distinct pointer will do
+static int src_client;
+static int dst_client;
+
+// from the least to the most recently used
+static const MigrateDisplayPixmapCacheItem test_items[] = {
+    { 0x100000001, 1000, 0 },
+    { 0x2, 2000, 1 },
+    { 0x2 + BITS_CACHE_HASH_SIZE, 3000, 0 }, // same hash key as 0x2
+    { 0xffffffffffffffff, 4000, 1 },
+    { 0x5, 5000, 0 },
+};
+
+static PixmapCache *cache_new(int *client, int64_t size)
+{
+    PixmapCache *cache = pixmap_cache_get((RedClient *) client, 0, size);
+    g_assert_nonnull(cache);
+    return cache;
+}
+
+static bool cache_restore(PixmapCache *cache, const MigrateDisplayPixmapCacheItem *items,
+                          uint32_t num_items, int64_t size)
+{
+    bool ret;
+
+    pthread_mutex_lock(&cache->lock);
+    ret = pixmap_cache_unlocked_restore_index(cache, items, num_items, size);
+    pthread_mutex_unlock(&cache->lock);
+    return ret;
+}
+
+// check the content of the cache, in LRU order
+static void check_cache(PixmapCache *cache, const MigrateDisplayPixmapCacheItem *items,
+                        uint32_t num_items, int64_t size)
+{
+    int64_t available = size;
+    RingItem *link = &cache->lru;
+    uint32_t i;
+
+    g_assert_cmpint(cache->items, ==, num_items);
+    for (i = 0; i < num_items; i++) {
+        NewCacheItem *item;
+
+        link = ring_prev(&cache->lru, link);
+        g_assert_nonnull(link);
+        item = SPICE_CONTAINEROF(link, NewCacheItem, lru_link);
+        g_assert_cmpuint(item->id, ==, items[i].id);
+        g_assert_cmpuint(item->size, ==, items[i].size);
+        g_assert_cmpint(item->lossy, ==, items[i].lossy);
+        available -= items[i].size;
+
+        // the item can be found in the hash table
+        g_assert_true(pixmap_cache_unlocked_set_lossy(cache, items[i].id, items[i].lossy));
+    }
+    g_assert_null(ring_prev(&cache->lru, link));
+    g_assert_cmpint(cache->size, ==, size);
+    g_assert_cmpint(cache->available, ==, available);
+}
+
+static uint8_t *marshall_index(PixmapCache *cache, size_t *len, int *free_res)
+{
+    SpiceMarshaller *m = spice_marshaller_new();
+    uint8_t *data;
+
+    pixmap_cache_marshall_frozen_index(cache, m);
+    data = spice_marshaller_linearize(m, 0, len, free_res);
+    spice_marshaller_destroy(m);
+    return data;
+}
+
+static void test_pixmap_cache_round_trip(void)
+{
+    PixmapCache *src = cache_new(&src_client, CACHE_SIZE);
+    PixmapCache *dst = cache_new(&dst_client, -1);
+    MigrateDisplayPixmapCacheIndex *index;
+    size_t len;
+    int free_res;
+    uint8_t *data;
+
+    g_assert_true(cache_restore(src, test_items, G_N_ELEMENTS(test_items), CACHE_SIZE));
+    check_cache(src, test_items, G_N_ELEMENTS(test_items), CACHE_SIZE);
+
+    // the index of a cache which is not frozen is empty
+    data = marshall_index(src, &len, &free_res);
+    g_assert_cmpuint(len, ==, sizeof(uint32_t));
+    g_assert_cmpuint(*(uint32_t *) data, ==, 0);
+    if (free_res) {
+        free(data);
+    }
+
+    // the src is frozen when sending the migration data
+    g_assert_true(pixmap_cache_freeze(src));
+    data = marshall_index(src, &len, &free_res);
+    index = (MigrateDisplayPixmapCacheIndex *) data;
+    g_assert_cmpuint(len, ==, sizeof(*index) + sizeof(test_items));
+    g_assert_cmpuint(index->num_items, ==, G_N_ELEMENTS(test_items));
+    g_assert_cmpint(memcmp(index->items, test_items, sizeof(test_items)), ==, 0);
+
+    // the dest gets the same items in the same order
+    g_assert_true(cache_restore(dst, index->items, index->num_items, CACHE_SIZE));
+    check_cache(dst, test_items, G_N_ELEMENTS(test_items), CACHE_SIZE);
+    if (free_res) {
+        free(data);
+    }
+
+    // a cache with items is not restored
+    g_assert_false(cache_restore(dst, test_items, G_N_ELEMENTS(test_items), CACHE_SIZE));
+    check_cache(dst, test_items, G_N_ELEMENTS(test_items), CACHE_SIZE);
+
+    pixmap_cache_unref(src);
+    pixmap_cache_unref(dst);
+}
+
+static void test_pixmap_cache_invalid_index(void)
+{
+    static const MigrateDisplayPixmapCacheItem duplicate_items[] = {
+        { 0x1, 1000, 0 },
+        { 0x2, 1000, 0 },
+        { 0x1, 1000, 0 },
+    };
+    static const MigrateDisplayPixmapCacheItem empty_item[] = {
+        { 0x1, 1000, 0 },
+        { 0x2, 0, 0 },
+    };
+    static const MigrateDisplayPixmapCacheItem too_big_items[] = {
+        { 0x1, CACHE_SIZE / 2, 0 },
+        { 0x2, CACHE_SIZE / 2 + 1, 0 },
+    };
+    PixmapCache *cache = cache_new(&dst_client, -1);
+
+    // the cache is left empty, ready for a reset
+    g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "*invalid pixmap cache item 1*");
+    g_assert_false(cache_restore(cache, duplicate_items, G_N_ELEMENTS(duplicate_items),
+                                 CACHE_SIZE));
+    g_test_assert_expected_messages();
+    check_cache(cache, NULL, 0, CACHE_SIZE);
+
+    g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "*invalid pixmap cache item 2*");
+    g_assert_false(cache_restore(cache, empty_item, G_N_ELEMENTS(empty_item), CACHE_SIZE));
+    g_test_assert_expected_messages();
+    check_cache(cache, NULL, 0, CACHE_SIZE);
+
+    g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "*invalid pixmap cache item 2*");
+    g_assert_false(cache_restore(cache, too_big_items, G_N_ELEMENTS(too_big_items), CACHE_SIZE));
+    g_test_assert_expected_messages();
+    check_cache(cache, NULL, 0, CACHE_SIZE);
+
+    // a valid index is restored after a failure
+    g_assert_true(cache_restore(cache, too_big_items, 1, CACHE_SIZE));
+    check_cache(cache, too_big_items, 1, CACHE_SIZE);
+
+    pixmap_cache_unref(cache);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/pixmap-cache/round-trip", test_pixmap_cache_round_trip);
+    g_test_add_func("/server/pixmap-cache/invalid-index", test_pixmap_cache_invalid_index);
+
+    return g_test_run();
+}
@@ -0,0 +1,183 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2019 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test the playback queue when the client doesn't read, the device
+ * must always get a buffer and the oldest frames are dropped
+ */
+#include <config.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <spice.h>
+
+#include "test-glib-compat.h"
+#include "basic-event-loop.h"
+#include "reds.h"
+#include "red-client.h"
+#include "main-channel.h"
+#include "net-utils.h"
+
+#define QUEUE_SIZE 8
+
+static SpicePlaybackInstance playback_instance;
+
+static const SpicePlaybackInterface playback_sif = {
+    .base = {
+        .type          = SPICE_INTERFACE_PLAYBACK,
+        .description   = "test playback",
+        .major_version = SPICE_INTERFACE_PLAYBACK_MAJOR,
+        .minor_version = SPICE_INTERFACE_PLAYBACK_MINOR,
+    }
+};
+
+static int client_socket = -1;
+
+static RedStream *create_dummy_stream(SpiceServer *server, int *p_socket)
+{
+    int sv[2];
+    g_assert_cmpint(socketpair(AF_LOCAL, SOCK_STREAM, 0, sv), ==, 0);
+    if (p_socket) {
+        *p_socket = sv[1];
+    }
+    red_socket_set_non_blocking(sv[0], true);
+    red_socket_set_non_blocking(sv[1], true);
+
+    // fill the socket quickly
+    int buf_size = 4096;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+
+    RedStream * stream = red_stream_new(server, sv[0]);
+    g_assert_nonnull(stream);
+
+    return stream;
+}
+
+static void play_frames(int num_frames)
+{
+    for (int i = 0; i < num_frames; i++) {
+        uint32_t *frame = NULL;
+        uint32_t num_samples = 0;
+
+        spice_server_playback_get_buffer(&playback_instance, &frame, &num_samples);
+        g_assert_nonnull(frame);
+        g_assert_cmpuint(num_samples, >, 0);
+        memset(frame, i, num_samples * sizeof(*frame));
+        spice_server_playback_put_samples(&playback_instance, frame);
+    }
+}
+
+static size_t drain_client(void)
+{
+    size_t got_data = 0;
+    ssize_t len;
+    char buffer[4096];
+
+    alarm(1);
+    while ((len=recv(client_socket, buffer, sizeof(buffer), 0)) > 0)
+        got_data += len;
+    alarm(0);
+    return got_data;
+}
+
+static void timeout_drain(void *opaque)
+{
+    // the client reads again, the server sends the rest of the frames
+    g_assert_cmpuint(drain_client(), >, 0);
+    basic_event_loop_quit();
+}
+
+static void playback_queue(void)
+{
+    SpiceCoreInterface *core;
+    SpiceServer *server = spice_server_new();
+
+    g_assert_nonnull(server);
+
+    core = basic_event_loop_init();
+    g_assert_nonnull(core);
+
+    g_assert_cmpint(spice_server_set_playback_queue_size(server, QUEUE_SIZE), ==, 0);
+    g_assert_cmpint(spice_server_set_playback_compression(server, 0), ==, 0);
+    g_assert_cmpint(spice_server_init(server, core), ==, 0);
+
+    playback_instance.base.sif = &playback_sif.base;
+    g_assert_cmpint(spice_server_add_interface(server, &playback_instance.base), ==, 0);
+    RedChannel *channel = reds_find_channel(server, SPICE_CHANNEL_PLAYBACK, 0);
+    g_assert_nonnull(channel);
+
+    // create dummy RedClient and MainChannelClient
+    RedChannelCapabilities caps;
+    memset(&caps, 0, sizeof(caps));
+    uint32_t common_caps = 1 << SPICE_COMMON_CAP_MINI_HEADER;
+    caps.num_common_caps = 1;
+    caps.common_caps = spice_memdup(&common_caps, sizeof(common_caps));
+
+    RedClient *client = red_client_new(server, FALSE);
+    g_assert_nonnull(client);
+
+    MainChannel *main_channel = main_channel_new(server);
+    g_assert_nonnull(main_channel);
+
+    MainChannelClient *mcc;
+    mcc = main_channel_link(main_channel, client, create_dummy_stream(server, NULL),
+                            0, FALSE, &caps);
+    g_assert_nonnull(mcc);
+    red_client_set_main(client, mcc);
+
+    // connect the playback channel, the client supports volume messages
+    uint32_t playback_caps = 1 << SPICE_PLAYBACK_CAP_VOLUME;
+    caps.num_caps = 1;
+    caps.caps = spice_memdup(&playback_caps, sizeof(playback_caps));
+    red_channel_connect(channel, client, create_dummy_stream(server, &client_socket),
+                        FALSE, &caps);
+    red_channel_capabilities_reset(&caps);
+
+    spice_server_playback_start(&playback_instance);
+
+    // the client doesn't read, block the channel on other messages
+    // so no frame is in progress while the queue fills
+    for (int i = 0; i < 100000; i++) {
+        spice_server_playback_set_mute(&playback_instance, i & 1);
+    }
+    play_frames(QUEUE_SIZE * 4);
+
+    SpiceTimer *drain_timer = core->timer_add(timeout_drain, core);
+    core->timer_start(drain_timer, 100);
+
+    basic_event_loop_mainloop();
+
+    spice_server_playback_stop(&playback_instance);
+
+    // cleanup
+    core->timer_remove(drain_timer);
+    red_client_destroy(client);
+    g_object_unref(main_channel);
+
+    spice_server_destroy(server);
+
+    basic_event_loop_destroy();
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/playback-queue", playback_queue);
+
+    return g_test_run();
+}
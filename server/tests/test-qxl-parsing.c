@@ -289,6 +289,55 @@ static void test_circular_small_chunks(void)
     memslot_info_destroy(&mem_info);
 }
 
+static void test_chunk_data_out_of_slot(void)
+{
+    RedMemSlotInfo mem_info;
+    RedCursorCmd *red_cursor_cmd;
+    QXLCursorCmd *cursor_cmd;
+    QXLCursor *cursor;
+    QXLDataChunk *chunk;
+    uint8_t *mem;
+    size_t mem_size;
+
+    /* command, cursor and a second chunk in the same slot, the data of
+     * the second chunk goes 1 byte past the end of the slot */
+    mem_size = sizeof(*cursor_cmd) + sizeof(*cursor) + 16 + sizeof(*chunk) + 16;
+    mem = g_malloc0(mem_size);
+    cursor_cmd = (QXLCursorCmd *) mem;
+    cursor = (QXLCursor *) (mem + sizeof(*cursor_cmd));
+    chunk = (QXLDataChunk *) (mem + sizeof(*cursor_cmd) + sizeof(*cursor) + 16);
+
+    memslot_info_init(&mem_info, 1 /* groups */, 1 /* slots */, 1, 1, 0);
+    memslot_info_add_slot(&mem_info, 0, 0, 0 /* delta */,
+                          (uintptr_t) mem, (uintptr_t) (mem + mem_size), 0 /* generation */);
+    g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "*virtual address out of range*");
+
+    cursor_cmd->type = QXL_CURSOR_SET;
+    cursor_cmd->u.set.shape = to_physical(cursor);
+    cursor->header.unique = 1;
+    cursor->header.width = 4;
+    cursor->header.height = 8;
+    cursor->data_size = 32 + 17;
+    cursor->chunk.data_size = 16;
+    cursor->chunk.next_chunk = to_physical(chunk);
+    chunk->prev_chunk = to_physical(&cursor->chunk);
+    chunk->data_size = 17;
+
+    red_cursor_cmd = red_cursor_cmd_new(NULL, &mem_info, 0, to_physical(cursor_cmd));
+    g_assert_null(red_cursor_cmd);
+    g_test_assert_expected_messages();
+
+    /* same chain fitting in the slot is accepted */
+    chunk->data_size = 16;
+    red_cursor_cmd = red_cursor_cmd_new(NULL, &mem_info, 0, to_physical(cursor_cmd));
+    g_assert_nonnull(red_cursor_cmd);
+    g_assert_cmpuint(red_cursor_cmd->u.set.shape.data_size, ==, 32);
+    red_cursor_cmd_unref(red_cursor_cmd);
+
+    g_free(mem);
+    memslot_info_destroy(&mem_info);
+}
+
 
 int main(int argc, char *argv[])
 {
@@ -326,5 +375,8 @@ int main(int argc, char *argv[])
     /* a circular list of small chunks should not be a problems */
     g_test_add_func("/server/qxl-parsing/circular-small-chunks", test_circular_small_chunks);
 
+    /* chunk data must be inside the memory slot */
+    g_test_add_func("/server/qxl-parsing/chunk-data-out-of-slot", test_chunk_data_out_of_slot);
+
     return g_test_run();
 }
@@ -0,0 +1,181 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2019 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test the rendering of an update area in parallel tiles (see
+ * spice_server_set_render_threads). The same drawing commands are rendered
+ * serially and with a render pool, the primary surfaces must be identical.
+ * The commands mix tile safe drawables, with and without clip, and a
+ * copy_bits which is drawn serially in the middle of the run.
+ */
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test-glib-compat.h"
+#include "test-display-base.h"
+
+#define WIDTH 512
+#define HEIGHT 384
+#define SOLID_COLOR 0xff0000
+
+static uint8_t *rendered;
+
+static uint8_t *create_bitmap(const QXLRect *bbox, int seed)
+{
+    int w = bbox->right - bbox->left;
+    int h = bbox->bottom - bbox->top;
+    uint32_t *bitmap = g_new(uint32_t, w * h);
+    int x, y;
+
+    for (y = 0; y < h; y++) {
+        for (x = 0; x < w; x++) {
+            bitmap[y * w + x] = ((x * 3 + seed) & 0xff) << 16 |
+                                ((y * 5 + seed) & 0xff) << 8 |
+                                ((x + y) * seed & 0xff);
+        }
+    }
+    return (uint8_t *) bitmap;
+}
+
+static void set_bitmap(Command *command, QXLRect bbox, int seed,
+                       const QXLRect *clip_rects, uint32_t num_clip_rects)
+{
+    command->command = SIMPLE_DRAW_BITMAP;
+    command->bitmap.bbox = bbox;
+    command->bitmap.bitmap = create_bitmap(&bbox, seed);
+    command->bitmap.surface_id = 0;
+    command->bitmap.num_clip_rects = num_clip_rects;
+    command->bitmap.clip_rects = num_clip_rects ?
+        g_memdup(clip_rects, num_clip_rects * sizeof(QXLRect)) : NULL;
+}
+
+static void set_solid(Command *command, QXLRect bbox, uint32_t color)
+{
+    command->command = SIMPLE_DRAW_SOLID;
+    command->solid.bbox = bbox;
+    command->solid.color = color;
+    command->solid.surface_id = 0;
+}
+
+static uint32_t get_pixel(const uint8_t *surface, int x, int y)
+{
+    // the primary surface is bottom-up
+    const uint32_t *line = (const uint32_t *) (surface + (HEIGHT - 1 - y) * WIDTH * 4);
+
+    return line[x] & 0xffffff;
+}
+
+static void on_rendered(Test *test, Command *command)
+{
+    g_assert_cmpint(test->primary_width, ==, WIDTH);
+    g_assert_cmpint(test->primary_height, ==, HEIGHT);
+    rendered = g_memdup(test->primary_surface, WIDTH * HEIGHT * 4);
+
+    // only loop on the first command, which does nothing
+    test->num_commands = 1;
+    basic_event_loop_quit();
+}
+
+static void on_timeout(void *opaque)
+{
+    g_error("update area not rendered");
+}
+
+static uint8_t *render(int render_threads)
+{
+    static const QXLRect clip_rects1[] = {
+        { 60, 30, 200, 150 },
+        { 100, 160, 450, 320 },
+        { 300, 50, 460, 120 },
+    };
+    static const QXLRect clip_rects2[] = {
+        { 70, 5, 130, 505 },
+        { 140, 10, 383, 400 },
+    };
+    SpiceCoreInterface *core;
+    SpiceTimer *timeout;
+    Command *commands;
+    Test *test;
+    int n = 0;
+
+    rendered = NULL;
+    core = basic_event_loop_init();
+    test = test_new(core);
+    g_assert_cmpint(spice_server_set_render_threads(test->server, render_threads), ==, 0);
+
+    commands = g_new0(Command, 16);
+    commands[n++].command = PATH_PROGRESS;
+    commands[n].command = CREATE_PRIMARY;
+    commands[n].create_primary.width = WIDTH;
+    commands[n++].create_primary.height = HEIGHT;
+    // large enough to be split in tiles
+    set_bitmap(&commands[n++], (QXLRect) { 0, 0, HEIGHT, WIDTH }, 1, NULL, 0);
+    set_bitmap(&commands[n++], (QXLRect) { 20, 30, 350, 470 }, 2,
+               clip_rects1, G_N_ELEMENTS(clip_rects1));
+    set_solid(&commands[n++], (QXLRect) { 10, 100, 370, 300 }, SOLID_COLOR);
+    // reads the surface, flushes the tiles
+    commands[n].command = SIMPLE_COPY_BITS;
+    commands[n].copy_bits.bbox = (QXLRect) { 0, 0, 100, 200 };
+    commands[n++].copy_bits.src_pos = (QXLPoint) { 250, 200 };
+    set_bitmap(&commands[n++], (QXLRect) { 70, 5, HEIGHT - 1, 505 }, 3,
+               clip_rects2, G_N_ELEMENTS(clip_rects2));
+    // too small to be split in tiles
+    set_solid(&commands[n++], (QXLRect) { 200, 200, 210, 210 }, 0x00ff00);
+    commands[n++].command = SIMPLE_UPDATE;
+    commands[n].command = PATH_PROGRESS;
+    commands[n++].cb = on_rendered;
+    test_set_command_list(test, commands, n);
+
+    test_add_display_interface(test);
+
+    timeout = core->timer_add(on_timeout, NULL);
+    core->timer_start(timeout, 10000);
+
+    basic_event_loop_mainloop();
+
+    core->timer_remove(timeout);
+    test_destroy(test);
+    basic_event_loop_destroy();
+
+    g_assert_nonnull(rendered);
+    return rendered;
+}
+
+static void test_render_tiles(void)
+{
+    uint8_t *serial = render(0);
+    uint8_t *tiled = render(4);
+
+    // the commands were rendered
+    g_assert_cmphex(get_pixel(serial, 250, 40), ==, SOLID_COLOR);
+    g_assert_cmphex(get_pixel(serial, 205, 205), ==, 0x00ff00);
+
+    g_assert_cmpint(memcmp(serial, tiled, WIDTH * HEIGHT * 4), ==, 0);
+
+    g_free(serial);
+    g_free(tiled);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/render-tiles", test_render_tiles);
+
+    return g_test_run();
+}
@@ -0,0 +1,272 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2019 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test the data queued by a port channel while the client is not reading.
+ * The data read from the device must be coalesced into few messages, but
+ * never across a port event, which must reach the client between the data
+ * read before and after it.
+ */
+#include <config.h>
+#include <unistd.h>
+#include <spice.h>
+
+#include "test-glib-compat.h"
+#include "basic-event-loop.h"
+#include "reds.h"
+#include "red-client.h"
+#include "main-channel.h"
+#include "net-utils.h"
+
+/* more than the socket can hold, so the channel gets blocked */
+#define FILLER_SIZE (256 * 1024)
+#define CHUNK_SIZE 16
+#define NUM_CHUNKS 32
+/* minimum size of a data message, but for the last ones */
+#define MIN_MESSAGE_SIZE (64 * 1024)
+
+#define EVENT_OFFSET (FILLER_SIZE + NUM_CHUNKS * CHUNK_SIZE)
+#define TOTAL_SIZE (EVENT_OFFSET + CHUNK_SIZE)
+
+static SpiceCoreInterface *core;
+static int client_socket = -1;
+
+static uint8_t device_data[TOTAL_SIZE];
+static unsigned int device_written;
+static unsigned int device_read;
+
+static GByteArray *received;
+static GByteArray *received_data;
+static unsigned int num_data_messages;
+static unsigned int num_data_messages_before_event;
+static int event_offset = -1;
+static bool got_port_init;
+
+static int vmc_write(SpiceCharDeviceInstance *sin, const uint8_t *buf, int len)
+{
+    return len;
+}
+
+static int vmc_read(SpiceCharDeviceInstance *sin, uint8_t *buf, int len)
+{
+    int n = MIN(len, device_written - device_read);
+
+    memcpy(buf, device_data + device_read, n);
+    device_read += n;
+    return n;
+}
+
+static void vmc_state(SpiceCharDeviceInstance *sin, int connected)
+{
+}
+
+static SpiceCharDeviceInterface vmc_interface = {
+    .base = {
+        .type          = SPICE_INTERFACE_CHAR_DEVICE,
+        .description   = "test spice virtual channel char device",
+        .major_version = SPICE_INTERFACE_CHAR_DEVICE_MAJOR,
+        .minor_version = SPICE_INTERFACE_CHAR_DEVICE_MINOR,
+    },
+    .state              = vmc_state,
+    .write              = vmc_write,
+    .read               = vmc_read,
+};
+
+static SpiceCharDeviceInstance vmc_instance = {
+    .subtype = "port",
+    .portname = "org.spice-space.test.0",
+};
+
+// make some data available from the device
+static void device_add_data(unsigned int size)
+{
+    g_assert_cmpuint(device_written + size, <=, TOTAL_SIZE);
+    device_written += size;
+    spice_server_char_device_wakeup(&vmc_instance);
+}
+
+static void read_server_messages(void)
+{
+    uint8_t buffer[64 * 1024];
+    ssize_t len;
+
+    while ((len = recv(client_socket, buffer, sizeof(buffer), 0)) > 0) {
+        g_byte_array_append(received, buffer, len);
+    }
+    while (received->len >= 6) {
+        uint16_t type = GUINT16_FROM_LE(*(uint16_t *) received->data);
+        uint32_t size = GUINT32_FROM_LE(*(uint32_t *) (received->data + 2));
+
+        if (received->len < 6 + size) {
+            break;
+        }
+        switch (type) {
+        case SPICE_MSG_PORT_INIT:
+            g_assert_false(got_port_init);
+            g_assert_cmpuint(received_data->len, ==, 0);
+            got_port_init = true;
+            break;
+        case SPICE_MSG_PORT_EVENT:
+            g_assert_cmpuint(size, ==, 1);
+            g_assert_cmpint(received->data[6], ==, SPICE_PORT_EVENT_BREAK);
+            g_assert_cmpint(event_offset, ==, -1);
+            event_offset = received_data->len;
+            num_data_messages_before_event = num_data_messages;
+            break;
+        case SPICE_MSG_SPICEVMC_DATA:
+            g_assert_cmpuint(size, >, 0);
+            g_byte_array_append(received_data, received->data + 6, size);
+            num_data_messages++;
+            break;
+        default:
+            g_error("unexpected message %u", type);
+        }
+        g_byte_array_remove_range(received, 0, 6 + size);
+    }
+}
+
+static SpiceTimer *check_timer;
+static int check_countdown = 500;
+
+static void check_messages(void *opaque)
+{
+    read_server_messages();
+    if (received_data->len == TOTAL_SIZE) {
+        basic_event_loop_quit();
+        return;
+    }
+    if (--check_countdown <= 0) {
+        g_error("data not received, got %u bytes", received_data->len);
+    }
+    core->timer_start(check_timer, 10);
+}
+
+static RedStream *create_dummy_stream(SpiceServer *server, int *p_socket)
+{
+    int sv[2];
+    g_assert_cmpint(socketpair(AF_LOCAL, SOCK_STREAM, 0, sv), ==, 0);
+    if (p_socket) {
+        *p_socket = sv[1];
+    }
+    red_socket_set_non_blocking(sv[0], true);
+    red_socket_set_non_blocking(sv[1], true);
+
+    // keep the socket small so the channel gets blocked by the filler
+    int buf_size = 16 * 1024;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+
+    RedStream * stream = red_stream_new(server, sv[0]);
+    g_assert_nonnull(stream);
+
+    return stream;
+}
+
+static void test_spicevmc_port_ordering(void)
+{
+    SpiceServer *server = spice_server_new();
+
+    g_assert_nonnull(server);
+
+    for (unsigned int i = 0; i < TOTAL_SIZE; i++) {
+        device_data[i] = i * 7 + (i >> 11);
+    }
+    received = g_byte_array_new();
+    received_data = g_byte_array_new();
+
+    core = basic_event_loop_init();
+    g_assert_nonnull(core);
+
+    g_assert_cmpint(spice_server_init(server, core), ==, 0);
+
+    vmc_instance.base.sif = &vmc_interface.base;
+    g_assert_cmpint(spice_server_add_interface(server, &vmc_instance.base), ==, 0);
+
+    RedChannel *channel = reds_find_channel(server, SPICE_CHANNEL_PORT, 0);
+    g_assert_nonnull(channel);
+
+    // create dummy RedClient and MainChannelClient
+    RedChannelCapabilities caps;
+    memset(&caps, 0, sizeof(caps));
+    uint32_t common_caps = 1 << SPICE_COMMON_CAP_MINI_HEADER;
+    caps.num_common_caps = 1;
+    caps.common_caps = spice_memdup(&common_caps, sizeof(common_caps));
+
+    RedClient *client = red_client_new(server, FALSE);
+    g_assert_nonnull(client);
+
+    MainChannel *main_channel = main_channel_new(server);
+    g_assert_nonnull(main_channel);
+
+    MainChannelClient *mcc;
+    mcc = main_channel_link(main_channel, client, create_dummy_stream(server, NULL),
+                            0, FALSE, &caps);
+    g_assert_nonnull(mcc);
+    red_client_set_main(client, mcc);
+
+    // connect the port channel, no compression capability is advertised
+    // so the data are sent as they are read
+    red_channel_connect(channel, client, create_dummy_stream(server, &client_socket),
+                        FALSE, &caps);
+    red_channel_capabilities_reset(&caps);
+
+    // the client does not read, so the small chunks are queued
+    device_add_data(FILLER_SIZE);
+    for (int i = 0; i < NUM_CHUNKS; i++) {
+        device_add_data(CHUNK_SIZE);
+    }
+    spice_server_port_event(&vmc_instance, SPICE_PORT_EVENT_BREAK);
+    device_add_data(CHUNK_SIZE);
+
+    check_timer = core->timer_add(check_messages, core);
+    core->timer_start(check_timer, 10);
+
+    basic_event_loop_mainloop();
+
+    // all the data in order, the event where it was sent
+    g_assert_true(got_port_init);
+    g_assert_cmpuint(received_data->len, ==, TOTAL_SIZE);
+    g_assert_cmpint(memcmp(received_data->data, device_data, TOTAL_SIZE), ==, 0);
+    g_assert_cmpint(event_offset, ==, EVENT_OFFSET);
+
+    // the chunks were coalesced with the queued data
+    g_assert_cmpuint(num_data_messages_before_event, <=,
+                     (EVENT_OFFSET + MIN_MESSAGE_SIZE - 1) / MIN_MESSAGE_SIZE);
+    g_assert_cmpuint(num_data_messages, ==, num_data_messages_before_event + 1);
+
+    // cleanup
+    core->timer_remove(check_timer);
+    red_client_destroy(client);
+    g_object_unref(main_channel);
+    close(client_socket);
+    g_byte_array_free(received, TRUE);
+    g_byte_array_free(received_data, TRUE);
+
+    spice_server_remove_interface(&vmc_instance.base);
+    spice_server_destroy(server);
+
+    basic_event_loop_destroy();
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/spicevmc/port-ordering", test_spicevmc_port_ordering);
+
+    return g_test_run();
+}
@@ -0,0 +1,329 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2019 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test the frames queued by a stream channel for a client which is not
+ * reading. The MJPEG frames are dropped while the client is congested
+ * or reports it can't keep up, the other codecs queue all the frames.
+ * test-stream-device replaces the stream channel so this is tested here.
+ */
+#include <config.h>
+#include <unistd.h>
+#include <spice.h>
+
+#include "test-glib-compat.h"
+#include "basic-event-loop.h"
+#include "reds.h"
+#include "red-client.h"
+#include "main-channel.h"
+#include "stream-channel.h"
+#include "net-utils.h"
+
+/* more than the socket can hold, so the client gets blocked by a frame */
+#define FRAME_SIZE (64 * 1024)
+
+static SpiceCoreInterface *core;
+static SpiceServer *server;
+static RedClient *client;
+static MainChannel *main_channel;
+static StreamChannel *channel;
+static int client_socket = -1;
+
+static StreamQueueStat queue_stat;
+static GByteArray *received;
+static GArray *received_frames;
+static bool got_stream_create;
+static unsigned int expected_frames;
+
+static SpiceTimer *check_timer;
+static int check_countdown;
+
+static void queue_stat_cb(void *opaque, const StreamQueueStat *stats,
+                          StreamChannel *stream_channel)
+{
+    queue_stat = *stats;
+}
+
+static RedStream *create_dummy_stream(int *p_socket)
+{
+    int sv[2];
+    g_assert_cmpint(socketpair(AF_LOCAL, SOCK_STREAM, 0, sv), ==, 0);
+    if (p_socket) {
+        *p_socket = sv[1];
+    }
+    red_socket_set_non_blocking(sv[0], true);
+    red_socket_set_non_blocking(sv[1], true);
+
+    // keep the socket small so the channel gets blocked by a frame
+    int buf_size = 16 * 1024;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+
+    RedStream * stream = red_stream_new(server, sv[0]);
+    g_assert_nonnull(stream);
+
+    return stream;
+}
+
+static void send_message(uint16_t type, const void *data, uint32_t size)
+{
+    uint8_t msg[64];
+
+    g_assert_cmpuint(size + 6, <=, sizeof(msg));
+    // mini header
+    *(uint16_t *) msg = GUINT16_TO_LE(type);
+    *(uint32_t *) (msg + 2) = GUINT32_TO_LE(size);
+    memcpy(msg + 6, data, size);
+    g_assert_cmpint(write(client_socket, msg, size + 6), ==, size + 6);
+}
+
+static void send_stream_report(uint32_t num_frames, uint32_t num_drops)
+{
+    uint32_t report[8];
+
+    report[0] = GUINT32_TO_LE(0); // stream_id
+    report[1] = GUINT32_TO_LE(1); // unique_id
+    report[2] = GUINT32_TO_LE(0); // start_frame_mm_time
+    report[3] = GUINT32_TO_LE(0); // end_frame_mm_time
+    report[4] = GUINT32_TO_LE(num_frames);
+    report[5] = GUINT32_TO_LE(num_drops);
+    report[6] = GUINT32_TO_LE(0); // last_frame_delay
+    report[7] = GUINT32_TO_LE(0); // audio_delay
+    send_message(SPICE_MSGC_DISPLAY_STREAM_REPORT, report, sizeof(report));
+}
+
+static void read_server_messages(void)
+{
+    uint8_t buffer[64 * 1024];
+    ssize_t len;
+
+    while ((len = recv(client_socket, buffer, sizeof(buffer), 0)) > 0) {
+        g_byte_array_append(received, buffer, len);
+    }
+    while (received->len >= 6) {
+        uint16_t type = GUINT16_FROM_LE(*(uint16_t *) received->data);
+        uint32_t size = GUINT32_FROM_LE(*(uint32_t *) (received->data + 2));
+        const uint8_t *data = received->data + 6;
+
+        if (received->len < 6 + size) {
+            break;
+        }
+        switch (type) {
+        case SPICE_MSG_DISPLAY_STREAM_CREATE:
+            got_stream_create = true;
+            break;
+        case SPICE_MSG_DISPLAY_STREAM_DATA: {
+            // id, multi_media_time, data_size and the frame
+            g_assert_true(got_stream_create);
+            g_assert_cmpuint(size, ==, 12 + FRAME_SIZE);
+            g_assert_cmpuint(GUINT32_FROM_LE(*(uint32_t *) (data + 8)), ==, FRAME_SIZE);
+            uint32_t mm_time = GUINT32_FROM_LE(*(uint32_t *) (data + 4));
+            g_array_append_val(received_frames, mm_time);
+            break;
+        }
+        default:
+            break;
+        }
+        g_byte_array_remove_range(received, 0, 6 + size);
+    }
+}
+
+static void check_messages(void *opaque)
+{
+    read_server_messages();
+    if (got_stream_create && received_frames->len >= expected_frames &&
+        stream_channel_get_max_queued_frames(channel) == 0) {
+        basic_event_loop_quit();
+        return;
+    }
+    if (--check_countdown <= 0) {
+        g_error("frames not received, got %u", received_frames->len);
+    }
+    core->timer_start(check_timer, 10);
+}
+
+// read from the client socket until num_frames frames were received
+// in total and no frame is queued for the client
+static void receive_frames(unsigned int num_frames)
+{
+    expected_frames = num_frames;
+    check_countdown = 500;
+    core->timer_start(check_timer, 10);
+    basic_event_loop_mainloop();
+
+    g_assert_cmpuint(received_frames->len, ==, num_frames);
+    g_assert_cmpuint(queue_stat.num_items, ==, 0);
+    g_assert_false(queue_stat.congested);
+}
+
+static void send_frame(uint32_t mm_time)
+{
+    StreamDataItem *item = stream_channel_data_item_new(channel, FRAME_SIZE);
+
+    memset(stream_channel_data_item_get_data(item), mm_time, FRAME_SIZE);
+    stream_channel_send_data_item(channel, item, mm_time);
+}
+
+static void check_received_frames(const uint32_t *mm_times, unsigned int num_frames)
+{
+    g_assert_cmpuint(received_frames->len, ==, num_frames);
+    for (unsigned int i = 0; i < num_frames; i++) {
+        g_assert_cmpuint(g_array_index(received_frames, uint32_t, i), ==, mm_times[i]);
+    }
+}
+
+static void setup(uint8_t codec)
+{
+    server = spice_server_new();
+    g_assert_nonnull(server);
+
+    received = g_byte_array_new();
+    received_frames = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+    got_stream_create = false;
+    memset(&queue_stat, 0, sizeof(queue_stat));
+
+    core = basic_event_loop_init();
+    g_assert_nonnull(core);
+
+    g_assert_cmpint(spice_server_init(server, core), ==, 0);
+
+    channel = stream_channel_new(server, 1);
+    g_assert_nonnull(channel);
+    stream_channel_register_queue_stat_cb(channel, queue_stat_cb, NULL);
+
+    // create dummy RedClient and MainChannelClient
+    RedChannelCapabilities caps;
+    memset(&caps, 0, sizeof(caps));
+    uint32_t common_caps = 1 << SPICE_COMMON_CAP_MINI_HEADER;
+    caps.num_common_caps = 1;
+    caps.common_caps = spice_memdup(&common_caps, sizeof(common_caps));
+
+    client = red_client_new(server, FALSE);
+    g_assert_nonnull(client);
+
+    main_channel = main_channel_new(server);
+    g_assert_nonnull(main_channel);
+
+    MainChannelClient *mcc;
+    mcc = main_channel_link(main_channel, client, create_dummy_stream(NULL),
+                            0, FALSE, &caps);
+    g_assert_nonnull(mcc);
+    red_client_set_main(client, mcc);
+
+    red_channel_connect(RED_CHANNEL(channel), client,
+                        create_dummy_stream(&client_socket), FALSE, &caps);
+    red_channel_capabilities_reset(&caps);
+
+    StreamMsgFormat fmt = { .width = 64, .height = 64, .codec = codec };
+    stream_channel_change_format(channel, &fmt);
+
+    check_timer = core->timer_add(check_messages, NULL);
+
+    // the client knows the stream before the frames are sent
+    receive_frames(0);
+    g_assert_true(got_stream_create);
+}
+
+static void teardown(void)
+{
+    core->timer_remove(check_timer);
+    red_client_destroy(client);
+    g_object_unref(main_channel);
+    red_channel_destroy(RED_CHANNEL(channel));
+    close(client_socket);
+    g_byte_array_free(received, TRUE);
+    g_array_free(received_frames, TRUE);
+
+    spice_server_destroy(server);
+
+    basic_event_loop_destroy();
+}
+
+static void test_stream_channel_drop_frames(void)
+{
+    setup(SPICE_VIDEO_CODEC_TYPE_MJPEG);
+
+    // the client does not read, the frames are queued up to the limit
+    send_frame(1);
+    g_assert_cmpuint(stream_channel_get_max_queued_frames(channel), ==, 1);
+    g_assert_false(queue_stat.congested);
+    send_frame(2);
+    g_assert_cmpuint(stream_channel_get_max_queued_frames(channel), ==, 2);
+    g_assert_true(queue_stat.congested);
+
+    // then dropped for the congested client
+    send_frame(3);
+    send_frame(4);
+    send_frame(5);
+    g_assert_cmpuint(stream_channel_get_max_queued_frames(channel), ==, 2);
+    g_assert_cmpuint(queue_stat.num_items, ==, 2);
+    g_assert_true(queue_stat.congested);
+
+    // the client reports it is dropping frames, read while receiving
+    send_stream_report(10, 5);
+
+    receive_frames(2);
+    static const uint32_t sent_frames[] = { 1, 2 };
+    check_received_frames(sent_frames, G_N_ELEMENTS(sent_frames));
+
+    // half of the frames are sent to the lagging client, here the
+    // even ones, but still not more than the limit
+    send_frame(6);
+    send_frame(7);
+    g_assert_cmpuint(stream_channel_get_max_queued_frames(channel), ==, 1);
+    g_assert_false(queue_stat.congested);
+    send_frame(8);
+    send_frame(9);
+    send_frame(10);
+    g_assert_cmpuint(stream_channel_get_max_queued_frames(channel), ==, 2);
+    g_assert_true(queue_stat.congested);
+
+    receive_frames(4);
+    static const uint32_t sent_frames_lagging[] = { 1, 2, 6, 8 };
+    check_received_frames(sent_frames_lagging, G_N_ELEMENTS(sent_frames_lagging));
+
+    teardown();
+}
+
+static void test_stream_channel_queue_frames(void)
+{
+    setup(SPICE_VIDEO_CODEC_TYPE_VP8);
+
+    // the frames depend on the previous ones, none can be dropped
+    for (uint32_t mm_time = 1; mm_time <= 5; mm_time++) {
+        send_frame(mm_time);
+        g_assert_cmpuint(stream_channel_get_max_queued_frames(channel), ==, mm_time);
+        g_assert_cmpuint(queue_stat.num_items, ==, mm_time);
+        g_assert_true(queue_stat.congested);
+    }
+
+    receive_frames(5);
+    static const uint32_t sent_frames[] = { 1, 2, 3, 4, 5 };
+    check_received_frames(sent_frames, G_N_ELEMENTS(sent_frames));
+
+    teardown();
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/stream-channel/drop-frames", test_stream_channel_drop_frames);
+    g_test_add_func("/server/stream-channel/queue-frames", test_stream_channel_queue_frames);
+
+    return g_test_run();
+}
@@ -203,12 +203,34 @@ void stream_channel_change_format(StreamChannel *channel,
 {
 }
 
-void stream_channel_send_data(StreamChannel *channel,
-                              const void *data, size_t size,
-                              uint32_t mm_time)
+struct StreamDataItem {
+    size_t size;
+    uint8_t data[];
+};
+
+StreamDataItem *stream_channel_data_item_new(StreamChannel *channel, size_t size)
+{
+    StreamDataItem *item = g_malloc(sizeof(*item) + size);
+    item->size = size;
+    return item;
+}
+
+uint8_t *stream_channel_data_item_get_data(StreamDataItem *item)
+{
+    return item->data;
+}
+
+void stream_channel_data_item_unref(StreamDataItem *item)
+{
+    g_free(item);
+}
+
+void stream_channel_send_data_item(StreamChannel *channel, StreamDataItem *item,
+                                   uint32_t mm_time)
 {
     ++num_send_data_calls;
-    send_data_bytes += size;
+    send_data_bytes += item->size;
+    stream_channel_data_item_unref(item);
 }
 
 void stream_channel_register_start_cb(StreamChannel *channel,
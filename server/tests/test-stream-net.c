@@ -0,0 +1,173 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2019 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test the bandwidth and roundtrip estimation of the streams, feeding
+ * synthetic TCP statistics (see red_stream_net_sample_tcp_info).
+ */
+#include <config.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "test-glib-compat.h"
+#include "basic-event-loop.h"
+#include "red-stream.h"
+
+#define INTERVAL_NS (100 * NSEC_PER_MILLISEC)
+/* 100Mbit/s during INTERVAL_NS */
+#define BYTES_PER_INTERVAL (100000000 / 8 / 10)
+
+static SpiceServer *server;
+static RedStream *stream;
+static int client_socket = -1;
+static red_time_t now;
+static RedSocketTcpInfo info;
+
+static void setup(void)
+{
+    SpiceCoreInterface *core;
+    int sv[2];
+
+    core = basic_event_loop_init();
+    g_assert_nonnull(core);
+    server = spice_server_new();
+    g_assert_nonnull(server);
+    g_assert_cmpint(spice_server_init(server, core), ==, 0);
+
+    g_assert_cmpint(socketpair(AF_LOCAL, SOCK_STREAM, 0, sv), ==, 0);
+    stream = red_stream_new(server, sv[0]);
+    g_assert_nonnull(stream);
+    client_socket = sv[1];
+
+    now = 1000 * NSEC_PER_SEC;
+    memset(&info, 0, sizeof(info));
+    info.bytes_acked = 1;
+}
+
+static void teardown(void)
+{
+    red_stream_free(stream);
+    close(client_socket);
+    spice_server_destroy(server);
+    basic_event_loop_destroy();
+}
+
+// query the statistics after @elapsed, @acked bytes were acknowledged since
+// the previous query and @notsent are still waiting in the socket
+static void sample(red_time_t elapsed, uint64_t acked, uint32_t notsent)
+{
+    now += elapsed;
+    info.bytes_acked += acked;
+    info.notsent_bytes = notsent;
+    red_stream_net_sample_tcp_info(stream, &info, now, false);
+}
+
+static void test_stream_net_backlogged(void)
+{
+    setup();
+
+    g_assert_cmpuint(red_stream_get_bandwidth(stream), ==, 0);
+
+    // the first query only starts an interval
+    sample(0, 0, 1000);
+    g_assert_cmpuint(red_stream_get_bandwidth(stream), ==, 0);
+
+    // the data acked while the socket is backlogged gives the rate
+    sample(INTERVAL_NS, BYTES_PER_INTERVAL, 1000);
+    g_assert_cmpuint(red_stream_get_bandwidth(stream), ==, 100000000);
+    sample(INTERVAL_NS, BYTES_PER_INTERVAL, 1000);
+    g_assert_cmpuint(red_stream_get_bandwidth(stream), ==, 100000000);
+
+    // the rate decreases smoothly
+    sample(INTERVAL_NS, BYTES_PER_INTERVAL / 2, 1000);
+    g_assert_cmpuint(red_stream_get_bandwidth(stream), ==, (100000000 * 7 + 50000000) / 8);
+
+    teardown();
+}
+
+static void test_stream_net_not_backlogged(void)
+{
+    setup();
+
+    sample(0, 0, 1000);
+    sample(INTERVAL_NS, BYTES_PER_INTERVAL, 1000);
+    g_assert_cmpuint(red_stream_get_bandwidth(stream), ==, 100000000);
+
+    // the socket drained, the rate is limited by the application
+    sample(INTERVAL_NS, BYTES_PER_INTERVAL / 10, 0);
+    g_assert_cmpuint(red_stream_get_bandwidth(stream), ==, 100000000);
+
+    // the interval started with an empty socket
+    sample(INTERVAL_NS, BYTES_PER_INTERVAL / 10, 1000);
+    g_assert_cmpuint(red_stream_get_bandwidth(stream), ==, 100000000);
+
+    // both ends backlogged again
+    sample(INTERVAL_NS, BYTES_PER_INTERVAL, 1000);
+    g_assert_cmpuint(red_stream_get_bandwidth(stream), ==, 100000000);
+
+    teardown();
+}
+
+static void test_stream_net_idle(void)
+{
+    setup();
+
+    sample(0, 0, 1000);
+    sample(INTERVAL_NS, BYTES_PER_INTERVAL, 1000);
+    g_assert_cmpuint(red_stream_get_bandwidth(stream), ==, 100000000);
+
+    // backlogged at both queries but the socket could have been idle
+    // in between, the long interval is not used
+    sample(10 * INTERVAL_NS, BYTES_PER_INTERVAL, 1000);
+    g_assert_cmpuint(red_stream_get_bandwidth(stream), ==, 100000000);
+
+    // the long interval reset the baseline
+    sample(INTERVAL_NS, BYTES_PER_INTERVAL / 2, 1000);
+    g_assert_cmpuint(red_stream_get_bandwidth(stream), ==, (100000000 * 7 + 50000000) / 8);
+
+    teardown();
+}
+
+static void test_stream_net_roundtrip(void)
+{
+    setup();
+
+    g_assert_cmpint(red_stream_get_roundtrip_ms(stream), ==, -1);
+
+    info.rtt_us = 25000;
+    sample(0, 0, 0);
+    g_assert_cmpint(red_stream_get_roundtrip_ms(stream), ==, 25);
+
+    // not known by the kernel, the previous value is kept
+    info.rtt_us = 0;
+    sample(INTERVAL_NS, 0, 0);
+    g_assert_cmpint(red_stream_get_roundtrip_ms(stream), ==, 25);
+
+    teardown();
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/stream-net/backlogged", test_stream_net_backlogged);
+    g_test_add_func("/server/stream-net/not-backlogged", test_stream_net_not_backlogged);
+    g_test_add_func("/server/stream-net/idle", test_stream_net_idle);
+    g_test_add_func("/server/stream-net/roundtrip", test_stream_net_roundtrip);
+
+    return g_test_run();
+}
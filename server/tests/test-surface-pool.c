@@ -0,0 +1,169 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2019 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test allocation, reuse and release of the surface buffers pool
+ */
+#include <config.h>
+#include <spice.h>
+
+#include "test-glib-compat.h"
+#include "basic-event-loop.h"
+#include "reds.h"
+#include "surface-pool.h"
+
+#define KB 1024
+#define MB (1024 * KB)
+
+typedef struct {
+    SpiceCoreInterface *core;
+    SpiceServer *server;
+    SurfacePool *pool;
+} TestFixture;
+
+static void test_pool_setup(TestFixture *fixture, gconstpointer user_data)
+{
+    fixture->core = basic_event_loop_init();
+    g_assert_nonnull(fixture->core);
+    fixture->server = spice_server_new();
+    g_assert_nonnull(fixture->server);
+    g_assert_cmpint(spice_server_init(fixture->server, fixture->core), ==, 0);
+
+    fixture->pool = surface_pool_new(reds_get_core_interface(fixture->server),
+                                     fixture->server, NULL);
+    g_assert_nonnull(fixture->pool);
+    g_assert_cmpuint(surface_pool_get_pooled_bytes(fixture->pool), ==, 0);
+}
+
+static void test_pool_teardown(TestFixture *fixture, gconstpointer user_data)
+{
+    surface_pool_free(fixture->pool);
+    spice_server_destroy(fixture->server);
+    basic_event_loop_destroy();
+}
+
+static void *alloc_and_fill(SurfacePool *pool, size_t size)
+{
+    uint8_t *data = surface_pool_alloc(pool, size);
+
+    g_assert_nonnull(data);
+    memset(data, 0x5a, size);
+    return data;
+}
+
+// released buffers are reused for sizes of the same bucket, most recent first
+static void test_pool_reuse(TestFixture *fixture, gconstpointer user_data)
+{
+    SurfacePool *pool = fixture->pool;
+
+    void *a = alloc_and_fill(pool, 100 * KB);
+    void *b = alloc_and_fill(pool, 100 * KB);
+    void *c = alloc_and_fill(pool, 300 * KB);
+    g_assert_true(a != b);
+    g_assert_cmpuint(GPOINTER_TO_SIZE(a) % 64, ==, 0);
+    g_assert_cmpuint(GPOINTER_TO_SIZE(c) % 64, ==, 0);
+    g_assert_cmpuint(surface_pool_get_pooled_bytes(pool), ==, 0);
+
+    surface_pool_release(pool, a);
+    surface_pool_release(pool, b);
+    surface_pool_release(pool, c);
+    g_assert_cmpuint(surface_pool_get_pooled_bytes(pool), >=, 2 * 128 * KB + 512 * KB);
+
+    g_assert_true(alloc_and_fill(pool, 260 * KB) == c);
+    g_assert_true(alloc_and_fill(pool, 128 * KB) == b);
+    g_assert_true(alloc_and_fill(pool, 70 * KB) == a);
+    g_assert_cmpuint(surface_pool_get_pooled_bytes(pool), ==, 0);
+
+    surface_pool_release(pool, a);
+    surface_pool_release(pool, b);
+    surface_pool_release(pool, c);
+    // NULL is ignored
+    surface_pool_release(pool, NULL);
+}
+
+// small and huge buffers are not kept
+static void test_pool_not_pooled(TestFixture *fixture, gconstpointer user_data)
+{
+    SurfacePool *pool = fixture->pool;
+
+    surface_pool_release(pool, alloc_and_fill(pool, 1000));
+    g_assert_cmpuint(surface_pool_get_pooled_bytes(pool), ==, 0);
+
+    surface_pool_release(pool, alloc_and_fill(pool, 16 * KB));
+    g_assert_cmpuint(surface_pool_get_pooled_bytes(pool), ==, 0);
+
+    // not written, the pages are never resident
+    surface_pool_release(pool, surface_pool_alloc(pool, 65 * MB));
+    g_assert_cmpuint(surface_pool_get_pooled_bytes(pool), ==, 0);
+}
+
+// the unused buffers kept are limited
+static void test_pool_max_pooled(TestFixture *fixture, gconstpointer user_data)
+{
+    SurfacePool *pool = fixture->pool;
+    void *data[4];
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(data); i++) {
+        data[i] = surface_pool_alloc(pool, 60 * MB);
+        g_assert_nonnull(data[i]);
+    }
+    for (i = 0; i < G_N_ELEMENTS(data); i++) {
+        surface_pool_release(pool, data[i]);
+    }
+    g_assert_cmpuint(surface_pool_get_pooled_bytes(pool), >, 0);
+    g_assert_cmpuint(surface_pool_get_pooled_bytes(pool), <=, 128 * MB);
+}
+
+// trimming frees the buffers not used for the given time
+static void test_pool_trim(TestFixture *fixture, gconstpointer user_data)
+{
+    SurfacePool *pool = fixture->pool;
+
+    surface_pool_release(pool, alloc_and_fill(pool, 100 * KB));
+    g_usleep(100 * 1000);
+    void *recent = alloc_and_fill(pool, 300 * KB);
+    surface_pool_release(pool, recent);
+    uint64_t pooled = surface_pool_get_pooled_bytes(pool);
+
+    surface_pool_trim(pool, 50 * NSEC_PER_MILLISEC);
+    g_assert_cmpuint(surface_pool_get_pooled_bytes(pool), >, 0);
+    g_assert_cmpuint(surface_pool_get_pooled_bytes(pool), <, pooled);
+    // the recent one is still there
+    g_assert_true(alloc_and_fill(pool, 300 * KB) == recent);
+    surface_pool_release(pool, recent);
+
+    surface_pool_trim(pool, 0);
+    g_assert_cmpuint(surface_pool_get_pooled_bytes(pool), ==, 0);
+}
+
+static void test_add(const char *name, void (*func)(TestFixture *, gconstpointer))
+{
+    g_test_add(name, TestFixture, NULL, test_pool_setup, func, test_pool_teardown);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    test_add("/server/surface-pool/reuse", test_pool_reuse);
+    test_add("/server/surface-pool/not-pooled", test_pool_not_pooled);
+    test_add("/server/surface-pool/max-pooled", test_pool_max_pooled);
+    test_add("/server/surface-pool/trim", test_pool_trim);
+
+    return g_test_run();
+}
@@ -167,6 +167,14 @@ typedef struct VideoEncoderRateControlCbs {
      *              frames to reach the client.
      */
     void (*update_client_playback_delay)(void *opaque, uint32_t delay_ms);
+
+    /* Returns the share of the network bandwidth available to the stream
+     * in bits per second, or 0 if unknown.
+     *
+     * This is continuously estimated from the network traffic so the bit
+     * rate should not be increased above it.
+     */
+    uint64_t (*get_bit_rate_estimate)(void *opaque);
 } VideoEncoderRateControlCbs;
 
 typedef void (*bitmap_ref_t)(gpointer data);
@@ -584,6 +584,15 @@ static void dcc_update_streams_max_latency(DisplayChannelClient *dcc,
     dcc_set_max_stream_latency(dcc, new_max_latency);
 }
 
+/* dividing the available bandwidth among the active streams, and saving
+ * (1-RED_STREAM_CHANNEL_CAPACITY) of it for other messages */
+static uint64_t get_stream_bit_rate_share(DisplayChannelClient *dcc, VideoStream *stream,
+                                          uint64_t bit_rate)
+{
+    return (RED_STREAM_CHANNEL_CAPACITY * bit_rate *
+            stream->width * stream->height) / DCC_TO_DC(dcc)->priv->streams_size_total;
+}
+
 static uint64_t get_initial_bit_rate(DisplayChannelClient *dcc, VideoStream *stream)
 {
     char *env_bit_rate_str;
@@ -605,11 +614,16 @@ static uint64_t get_initial_bit_rate(DisplayChannelClient *dcc, VideoStream *str
     if (!bit_rate) {
         MainChannelClient *mcc;
         uint64_t net_test_bit_rate;
-
-        mcc = red_client_get_main(red_channel_client_get_client(RED_CHANNEL_CLIENT(dcc)));
-        net_test_bit_rate = main_channel_client_is_network_info_initialized(mcc) ?
-                                main_channel_client_get_bitrate_per_sec(mcc) :
-                                0;
+        RedStream *red_stream = red_channel_client_get_stream(RED_CHANNEL_CLIENT(dcc));
+
+        /* the estimation of the stream is more recent than the net test */
+        net_test_bit_rate = red_stream_get_bandwidth(red_stream);
+        if (net_test_bit_rate == 0) {
+            mcc = red_client_get_main(red_channel_client_get_client(RED_CHANNEL_CLIENT(dcc)));
+            net_test_bit_rate = main_channel_client_is_network_info_initialized(mcc) ?
+                                    main_channel_client_get_bitrate_per_sec(mcc) :
+                                    0;
+        }
         bit_rate = MAX(dcc_get_max_stream_bit_rate(dcc), net_test_bit_rate);
         if (bit_rate == 0) {
             /*
@@ -625,10 +639,7 @@ static uint64_t get_initial_bit_rate(DisplayChannelClient *dcc, VideoStream *str
     }
 
     spice_debug("base-bit-rate %.2f (Mbps)", bit_rate / 1024.0 / 1024.0);
-    /* dividing the available bandwidth among the active streams, and saving
-     * (1-RED_STREAM_CHANNEL_CAPACITY) of it for other messages */
-    return (RED_STREAM_CHANNEL_CAPACITY * bit_rate *
-            stream->width * stream->height) / DCC_TO_DC(dcc)->priv->streams_size_total;
+    return get_stream_bit_rate_share(dcc, stream, bit_rate);
 }
 
 static uint32_t get_roundtrip_ms(void *opaque)
@@ -638,6 +649,9 @@ static uint32_t get_roundtrip_ms(void *opaque)
     RedChannelClient *rcc = RED_CHANNEL_CLIENT(agent->dcc);
 
     roundtrip = red_channel_client_get_roundtrip_ms(rcc);
+    if (roundtrip < 0) {
+        roundtrip = red_stream_get_roundtrip_ms(red_channel_client_get_stream(rcc));
+    }
     if (roundtrip < 0) {
         MainChannelClient *mcc = red_client_get_main(red_channel_client_get_client(rcc));
 
@@ -652,6 +666,19 @@ static uint32_t get_roundtrip_ms(void *opaque)
     return roundtrip;
 }
 
+static uint64_t get_bit_rate_estimate(void *opaque)
+{
+    VideoStreamAgent *agent = opaque;
+    RedChannelClient *rcc = RED_CHANNEL_CLIENT(agent->dcc);
+    uint64_t bit_rate;
+
+    bit_rate = red_stream_get_bandwidth(red_channel_client_get_stream(rcc));
+    if (bit_rate == 0) {
+        return 0;
+    }
+    return get_stream_bit_rate_share(agent->dcc, agent->stream, bit_rate);
+}
+
 static uint32_t get_source_fps(void *opaque)
 {
     VideoStreamAgent *agent = opaque;
@@ -748,6 +775,7 @@ void dcc_create_stream(DisplayChannelClient *dcc, VideoStream *stream)
     video_cbs.get_roundtrip_ms = get_roundtrip_ms;
     video_cbs.get_source_fps = get_source_fps;
     video_cbs.update_client_playback_delay = update_client_playback_delay;
+    video_cbs.get_bit_rate_estimate = get_bit_rate_estimate;
 
     uint64_t initial_bit_rate = get_initial_bit_rate(dcc, stream);
     agent->video_encoder = dcc_create_video_encoder(dcc, initial_bit_rate, &video_cbs);